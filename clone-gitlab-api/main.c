@@ -1,9 +1,10 @@
+#include "../pg/pg.h"
+
 #include <assert.h>
 #include <curl/curl.h>
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -12,11 +13,12 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include "../pg/pg.h"
 #define JSMN_STATIC
 #include "vendor/jsmn/jsmn.h"
 
 #define MAX_URL_LEN 4096
+// Each git process uses 3 file descriptors: stdout, stderr and its exit.
+#define MAX_CONCURRENT_PROCESSES 128
 
 typedef enum {
   COL_RESET,
@@ -34,9 +36,9 @@ static const char pg_colors[2][COL_COUNT][14] = {
 static struct timeval start;
 
 typedef struct {
+  pg_exec_cmd_t cmd; // First member: the group hands back a pointer to it.
   pg_string_t path_with_namespace;
-  int stderr_fd;
-  pid_t pid;
+  char *argv[7];
 } process_t;
 
 typedef enum {
@@ -53,6 +55,15 @@ typedef struct {
 } options_t;
 static bool verbose = false;
 
+// Everything is small and bounded by the page size and
+// MAX_CONCURRENT_PROCESSES: going above means a leak.
+static pg_alloc_stats_t memory_stats = {0};
+#define MEMORY_BUDGET (4 * 1024 * 1024ULL)
+
+static pg_allocator_t allocator(void) {
+  return pg_alloc_stats_allocator(&memory_stats);
+}
+
 typedef struct {
   CURL *http_handle;
   pg_string_t response_body;
@@ -64,12 +75,9 @@ typedef struct {
   PG_PAD(7);
 } api_t;
 
-static bool atomic_child_spawner_finished = false;
-static pthread_mutex_t child_processes_mtx = PTHREAD_MUTEX_INITIALIZER;
-// Use child_processes_mtx to access
-static pg_array_t(process_t) concurrent_child_processes = {0};
-// Use child_processes_mtx to access
-static uint64_t concurrent_children_spawned_count = 0;
+static pg_exec_group_t processes = {0};
+static uint64_t processes_spawned_count = 0;
+static uint64_t processes_finished_count = 0;
 
 static void print_usage(int argc, char *argv[]) {
   (void)argc;
@@ -193,15 +201,15 @@ static void api_init(api_t *api, options_t *options) {
 
   api->gitlab_domain = pg_span_make(options->gitlab_domain);
   api->response_body = pg_string_make_reserve(
-      pg_heap_allocator(),
+      allocator(),
       /* Empirically observed response size is ~86KiB at most */ 100 * 1000);
 
-  pg_array_init_reserve(api->tokens, 8 * 1000, pg_heap_allocator());
+  pg_array_init_reserve(api->tokens, 8 * 1000, allocator());
 
   api->http_handle = curl_easy_init();
   assert(api->http_handle != NULL);
 
-  api->url = pg_string_make_reserve(pg_heap_allocator(), MAX_URL_LEN);
+  api->url = pg_string_make_reserve(allocator(), MAX_URL_LEN);
   api_set_url(api, pg_span_make_c("1")); // Page 1
 
   assert(curl_easy_setopt(api->http_handle, CURLOPT_SOCKOPTFUNCTION,
@@ -299,7 +307,7 @@ static void options_parse_from_cli(int argc, char *argv[], options_t *options) {
       }
 
       options->gitlab_domain =
-          pg_string_make_reserve(pg_heap_allocator(), MAX_URL_LEN);
+          pg_string_make_reserve(allocator(), MAX_URL_LEN);
       if (!pg_str_has_prefix(optarg, "https://")) {
         options->gitlab_domain =
             pg_string_appendc(options->gitlab_domain, "https://");
@@ -425,10 +433,10 @@ static int api_parse_and_upsert_projects(api_t *api, const options_t *options) {
     if (pg_span_eq(key, key_path_with_namespace)) {
       field_count++;
       path_with_namespace =
-          pg_string_make_length(pg_heap_allocator(), value.data, value.len);
+          pg_string_make_length(allocator(), value.data, value.len);
 
       sanitize_and_flatten_path(value, '.');
-      // `execvp(2)` expects null terminated strings
+      // `posix_spawn(3)` expects null terminated strings
       // This is safe to do because we override the terminating double
       // quote which no one cares about
       fs_path = value.data;
@@ -441,7 +449,7 @@ static int api_parse_and_upsert_projects(api_t *api, const options_t *options) {
     if (pg_span_eq(key, key_git_url)) {
       field_count++;
       git_url = value.data;
-      // `execvp(2)` expects null terminated strings
+      // `posix_spawn(3)` expects null terminated strings
       // This is safe to do because we override the terminating double
       // quote which no one cares about
       git_url[value.len] = 0;
@@ -463,139 +471,47 @@ static int api_parse_and_upsert_projects(api_t *api, const options_t *options) {
   return res;
 }
 
-static void *watch_workers(void *varg) {
-  (void)varg;
-
-  static char child_proc_stderr[256] = {0};
+static void process_report(process_t *process) {
+  assert(process != NULL);
 
   const bool is_tty = isatty(STDOUT_FILENO);
-
-  uint64_t children_waited_count = 0, children_spawned_count = 0;
-
-  while (1) {
-    int stat_loc = 0;
-    const pid_t child_pid = wait(&stat_loc);
-    if (child_pid < 0) {
-      if (errno == ECHILD) {
-        bool children_spawner_finished = false;
-        __atomic_load(&atomic_child_spawner_finished,
-                      &children_spawner_finished, __ATOMIC_SEQ_CST);
-
-        if (children_spawner_finished) // Done
-          break;
-
-        // Might happen temporarily. Could use pthread_cond_wait instead but
-        // that should be fine, only reporting would be delayed
-        sleep(1);
-        continue;
-      }
-
-      fprintf(stderr, "Failed to wait(): %s\n", strerror(errno));
-      exit(errno);
-    }
-
-    children_waited_count += 1;
-
-    process_t process = {0};
-    {
-      pthread_mutex_lock(&child_processes_mtx);
-      for (uint64_t i = 0; i < pg_array_len(concurrent_child_processes); i++) {
-        if (concurrent_child_processes[i].pid == child_pid) {
-          process = concurrent_child_processes[i];
-          concurrent_child_processes[i] = concurrent_child_processes
-              [pg_array_len(concurrent_child_processes) - 1];
-          pg_array_resize(concurrent_child_processes,
-                          pg_array_len(concurrent_child_processes) - 1);
-
-          break;
-        }
-      }
-
-      children_spawned_count = concurrent_children_spawned_count;
-      pthread_mutex_unlock(&child_processes_mtx);
-    }
-
-    assert(process.pid == child_pid);
-
-    const int exit_status = WEXITSTATUS(stat_loc);
-    if (exit_status == 0) {
-      printf("%s[%" PRIu64 "/%" PRIu64 "] ✓ "
-             "%s%s\n",
-             pg_colors[is_tty][COL_GREEN], children_waited_count,
-             children_spawned_count, process.path_with_namespace,
-             pg_colors[is_tty][COL_RESET]);
-    } else {
-      // Best effort to get the stderr from the child
-      ssize_t stderr_read = 0;
-      {
-        stderr_read = read(process.stderr_fd, child_proc_stderr,
-                           sizeof(child_proc_stderr) - 1);
-        if (stderr_read > 0) {
-          child_proc_stderr[stderr_read] = 0;
-        }
-      }
-
-      printf("%s[%" PRIu64 "/%" PRIu64 "] ❌ "
-             "%s (%d): %s%s\n",
-             pg_colors[is_tty][COL_RED], children_waited_count,
-             children_spawned_count, process.path_with_namespace, exit_status,
-             stderr_read > 0 ? child_proc_stderr : "(unknown)",
-             pg_colors[is_tty][COL_RESET]);
-    }
-
-    // Rm
-    {
-      pg_string_free(process.path_with_namespace);
-      close(process.stderr_fd);
-    }
-  }
-
-  struct timeval end = {0};
-  gettimeofday(&end, NULL);
-  printf("Finished in %lds\n", end.tv_sec - start.tv_sec);
-
-  return NULL;
-}
-
-static int worker_update_project(const char *fs_path, const pg_string_t git_url,
-                                 const options_t *options) {
-  assert(fs_path != NULL);
-  assert(git_url != NULL);
-  assert(options != NULL);
-
-  if (chdir(fs_path) == -1) {
-    fprintf(stderr, "Failed to chdir(2): fs_path=%s err=%s\n", fs_path,
-            strerror(errno));
-    exit(errno);
+  processes_finished_count += 1;
+
+  const int exit_status = WEXITSTATUS(process->cmd.exit_status);
+  if (process->cmd.spawn_error == 0 && WIFEXITED(process->cmd.exit_status) &&
+      exit_status == 0) {
+    printf("%s[%" PRIu64 "/%" PRIu64 "] ✓ "
+           "%s%s\n",
+           pg_colors[is_tty][COL_GREEN], processes_finished_count,
+           processes_spawned_count, process->path_with_namespace,
+           pg_colors[is_tty][COL_RESET]);
+  } else {
+    process->cmd.err = pg_string_trim(process->cmd.err, "\n");
+    const char *reason = "(unknown)";
+    if (process->cmd.spawn_error != 0)
+      reason = strerror(process->cmd.spawn_error);
+    else if (pg_string_len(process->cmd.err) > 0)
+      reason = process->cmd.err;
+
+    printf("%s[%" PRIu64 "/%" PRIu64 "] ❌ "
+           "%s (%d): %s%s\n",
+           pg_colors[is_tty][COL_RED], processes_finished_count,
+           processes_spawned_count, process->path_with_namespace, exit_status,
+           reason, pg_colors[is_tty][COL_RESET]);
   }
 
-  char *const argv[] = {"git", "pull", "--quiet", "--no-tags", 0};
-
-  if (execvp("git", argv) == -1) {
-    fprintf(stderr,
-            "Failed to spawn %s as child process to pull: git_url=%s err=%s\n",
-            argv[0], git_url, strerror(errno));
-    exit(errno);
-  }
-  __builtin_unreachable();
+  pg_string_free(process->path_with_namespace);
+  pg_string_free(process->cmd.out);
+  pg_string_free(process->cmd.err);
+  pg_free(allocator(), process);
 }
 
-static int worker_clone_project(char *fs_path,  pg_string_t git_url,
-                                const options_t *options) {
-  assert(fs_path != NULL);
-  assert(git_url != NULL);
-  assert(options != NULL);
-
-  char *const argv[] = {"git",   "clone", "--quiet", "--no-tags",
-                        git_url, fs_path, 0};
-
-  if (execvp("git", argv) == -1) {
-    fprintf(stderr,
-            "Failed to spawn %s as child process to clone: git_url=%s err=%s\n",
-            argv[0], git_url, strerror(errno));
-    exit(errno);
-  }
-  __builtin_unreachable();
+// Report the processes which finished in the meantime, waiting at most
+// `timeout_ms` for each one (-1: until all are finished).
+static void processes_report_finished(int timeout_ms) {
+  pg_exec_cmd_t *cmd = NULL;
+  while ((cmd = pg_exec_group_wait(&processes, timeout_ms)) != NULL)
+    process_report((process_t *)(void *)cmd);
 }
 
 static int change_directory(const char *path) {
@@ -629,49 +545,30 @@ static int upsert_project(pg_string_t path, char *git_url, char *fs_path,
   assert(git_url != NULL);
   assert(options != NULL);
 
-  int stderr_pipe[2] = {0};
-  if (pipe(stderr_pipe) != 0) {
-    fprintf(stderr, "Failed to pipe(2): err=%s\n", strerror(errno));
-    return errno;
-  }
-
-  const pid_t pid = fork();
-  if (pid == -1) {
-    fprintf(stderr, "Failed to fork(2): err=%s\n", strerror(errno));
-    return errno;
-  }
-
-  if (pid == 0) {
-    close(stderr_pipe[0]); // Child does not read
-    close(0);              // Close stdin
-    close(1);              // Close stdout
-    if (dup2(stderr_pipe[1], 2) ==
-        -1) { // Direct stderr to the pipe for the parent to read
-      fprintf(stderr, "Failed to dup2(2): err=%s\n", strerror(errno));
-    }
-    close(stderr_pipe[1]); // Not needed anymore
-
-    if (pg_path_is_directory(fs_path)) {
-      worker_update_project(fs_path, git_url, options);
-    } else {
-      worker_clone_project(fs_path, git_url, options);
-    }
-    __builtin_unreachable();
+  while (processes.running >= MAX_CONCURRENT_PROCESSES)
+    processes_report_finished(-1);
+
+  process_t *const process = pg_alloc(allocator(), sizeof(process_t));
+  process->path_with_namespace = path;
+  process->cmd.out = pg_string_make_reserve(allocator(), 0);
+  process->cmd.err = pg_string_make_reserve(allocator(), 256);
+  process->cmd.argv = process->argv;
+
+  // The arguments are copied by `posix_spawn(3)` so they can point to the
+  // response body.
+  if (pg_path_is_directory(fs_path)) {
+    char *const argv[] = {"git",     "-C",        fs_path, "pull",
+                          "--quiet", "--no-tags", 0};
+    memcpy(process->argv, argv, sizeof(argv));
   } else {
-    close(stderr_pipe[1]); // Parent does not write
-
-    const process_t process = {
-        .pid = pid,
-        .stderr_fd = stderr_pipe[0],
-        .path_with_namespace = path,
-    };
-    {
-      pthread_mutex_lock(&child_processes_mtx);
-      pg_array_append(concurrent_child_processes, process);
-      concurrent_children_spawned_count += 1;
-      pthread_mutex_unlock(&child_processes_mtx);
-    }
+    char *const argv[] = {"git",   "clone", "--quiet", "--no-tags",
+                          git_url, fs_path, 0};
+    memcpy(process->argv, argv, sizeof(argv));
   }
+
+  // On failure, the process is reported as failed like the others.
+  pg_exec_group_spawn(&processes, &process->cmd);
+  processes_spawned_count += 1;
   return 0;
 }
 
@@ -690,10 +587,18 @@ static int api_fetch_and_upsert_projects(api_t *api, const options_t *options) {
 
 int main(int argc, char *argv[]) {
   gettimeofday(&start, NULL);
+  pg_alloc_stats_init(&memory_stats, "clone-gitlab-api", pg_heap_allocator(),
+                      MEMORY_BUDGET);
   options_t options = {0};
   options_parse_from_cli(argc, argv, &options);
+  if (verbose)
+    pg_alloc_stats_report_at_exit(SIGUSR1);
 
-  pg_array_init_reserve(concurrent_child_processes, 200, pg_heap_allocator());
+  if (!pg_exec_group_init(&processes)) {
+    fprintf(stderr, "Failed to watch child processes: err=%s\n",
+            strerror(errno));
+    return errno;
+  }
 
   api_t api = {0};
   api_init(&api, &options);
@@ -710,26 +615,21 @@ int main(int argc, char *argv[]) {
 
   printf("Changed directory to: %s\n", options.root_directory.data);
 
-  pthread_t process_exit_watcher = {0};
-  if (pthread_create(&process_exit_watcher, NULL, watch_workers, NULL) != 0) {
-    fprintf(stderr, "Failed to watch projects cloning: err=%s\n",
-            strerror(errno));
-    goto end;
-  }
-
   while (!api.finished &&
          (res = api_fetch_and_upsert_projects(&api, &options)) == 0) {
+    processes_report_finished(0);
   }
   if (res != 0) {
     fprintf(stderr, "Failed to handle all projects: err=%s\n", strerror(errno));
   }
 
-  bool btrue = true;
-  __atomic_store(&atomic_child_spawner_finished, &btrue, __ATOMIC_SEQ_CST);
+  processes_report_finished(-1);
+  pg_exec_group_destroy(&processes);
+
+  struct timeval end = {0};
+  gettimeofday(&end, NULL);
+  printf("Finished in %lds\n", end.tv_sec - start.tv_sec);
 
-end:
   if ((res = change_directory(cwd)) != 0)
     return res;
-
-  pthread_join(process_exit_watcher, NULL);
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "../pg/pg.h"
+
 #include <assert.h>
 #include <libproc.h>
 #include <mach-o/loader.h>
@@ -8,8 +10,6 @@
 #include <sys/errno.h>
 #include <unistd.h>
 
-#include "../pg/pg.h"
-
 static pg_logger_t logger = {.level = PG_LOG_INFO};
 
 static void read_data(uint8_t *data, uint64_t data_size, uint64_t *offset,
@@ -1740,13 +1740,13 @@ __attribute__((unused)) static void stacktrace_print(void) {
     const char *exe_name = pg_path_base_name(exe_path);
     snprintf(path, sizeof(path), "%s.dSYM/Contents/Resources/DWARF/%s",
              exe_name, exe_name);
-    pg_array_t(uint8_t) contents = {0};
-    pg_array_init_reserve(contents, 0, pg_heap_allocator());
-    if (!pg_read_file(path, &contents)) {
+    // Kept mapped for the lifetime of the process: `dd` points into it.
+    pg_mapped_file_t dsym = {0};
+    if (!pg_mmap_file(path, PG_MMAP_FLAGS_RANDOM, &dsym)) {
       pg_log_fatal(&logger, errno, "Failed to read file: %s %s\n", path,
                    strerror(errno));
     }
-    read_macho_dsym(allocator, contents, pg_array_len(contents), &dd);
+    read_macho_dsym(allocator, (uint8_t *)dsym.span.data, dsym.span.len, &dd);
   }
 
   uintptr_t *rbp = __builtin_frame_address(0);
@@ -1,10 +1,10 @@
+#include "../pg/pg.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-#include "../pg/pg.h"
-
 static pg_logger_t logger = {.level = PG_LOG_INFO};
 
 typedef enum {
@@ -40,97 +40,10 @@ struct event_t {
   } v;
 };
 
-typedef struct {
-  pg_array_t(uint64_t) keys;
-  pg_array_t(uint64_t) values;
-  pg_array_t(uint32_t) hashes;
-} hashtable_u64_u64_t;
-
-#define PG_HASHTABLE_LOAD_FACTOR 0.75
-
-static void pg_hashtable_init(hashtable_u64_u64_t *hashtable, uint64_t cap,
-                              pg_allocator_t allocator) {
-  pg_array_init_reserve(hashtable->keys, cap, allocator);
-  pg_array_init_reserve(hashtable->values, cap, allocator);
-  pg_array_init_reserve(hashtable->hashes, cap, allocator);
-}
-
-static bool pg_hashtable_find(hashtable_u64_u64_t *hashtable, uint64_t key,
-                              uint64_t *index) {
-
-  assert(pg_array_capacity(hashtable->keys) ==
-         pg_array_capacity(hashtable->values));
-  assert(pg_array_capacity(hashtable->keys) ==
-         pg_array_capacity(hashtable->hashes));
-  assert(pg_array_len(hashtable->keys) == pg_array_len(hashtable->values));
-  assert(pg_array_len(hashtable->keys) == pg_array_len(hashtable->hashes));
-
-  const uint32_t hash = pg_hash((uint8_t *)&key, sizeof(uint64_t));
-  *index = hash % pg_array_capacity(hashtable->keys);
-
-  for (;;) {
-    const uint32_t index_hash = hashtable->hashes[*index];
-    if (index_hash == 0)
-      return false; /* Not found but suitable empty slot */
-    if (index_hash == hash &&
-        memcmp(&key, &hashtable->keys[*index], sizeof(uint64_t)) == 0) {
-      /* Found after checking for collision */
-
-      return true;
-    }
-    /* Keep going to find either an empty slot or a matching hash */
-    *index = (*index + 1) % pg_array_capacity(hashtable->keys);
-  }
-
-  __builtin_unreachable();
-}
-
-static void pg_hashtable_upsert(hashtable_u64_u64_t *hashtable, uint64_t key,
-                                uint64_t val) {
-  assert(pg_array_capacity(hashtable->keys) ==
-         pg_array_capacity(hashtable->values));
-  assert(pg_array_capacity(hashtable->keys) ==
-         pg_array_capacity(hashtable->hashes));
-  assert(pg_array_len(hashtable->keys) == pg_array_len(hashtable->values));
-  assert(pg_array_len(hashtable->keys) == pg_array_len(hashtable->hashes));
-
-  const uint64_t cap = pg_array_capacity(hashtable->keys);
-  assert(cap > 0);
-  const uint64_t len = pg_array_len(hashtable->keys);
-  if (((double)len / (double)cap) >= PG_HASHTABLE_LOAD_FACTOR) {
-    const uint64_t new_cap = (uint64_t)(1.5 * (double)cap + 8);
-    pg_array_grow(hashtable->keys, new_cap);
-    pg_array_grow(hashtable->values, new_cap);
-    pg_array_grow(hashtable->hashes, new_cap);
-    assert(pg_array_capacity(hashtable->keys) ==
-           pg_array_capacity(hashtable->values));
-    assert(pg_array_capacity(hashtable->keys) ==
-           pg_array_capacity(hashtable->hashes));
-    assert(pg_array_capacity(hashtable->keys) > cap);
-    assert(pg_array_capacity(hashtable->values) > cap);
-    assert(pg_array_capacity(hashtable->hashes) > cap);
-  }
-  uint64_t index = -1ULL;
-  if (pg_hashtable_find((hashtable), key, &index)) {
-    /* Update */
-    hashtable->values[index] = val;
-    hashtable->hashes[index] = pg_hash((uint8_t *)&key, sizeof(uint64_t));
-  } else {
-    hashtable->keys[index] = key;
-    hashtable->hashes[index] = pg_hash((uint8_t *)&key, sizeof(uint64_t));
-    hashtable->values[index] = val;
-    const uint64_t new_len = pg_array_len((hashtable)->keys) + 1;
-    pg_array_resize(hashtable->keys, new_len);
-    pg_array_resize(hashtable->values, new_len);
-    pg_array_resize(hashtable->hashes, new_len);
-  }
-}
-
-static uint64_t pg_hashtable_at(const hashtable_u64_u64_t *hashtable,
-                                uint64_t index) {
-  assert(index < pg_array_capacity(hashtable->values));
-  return hashtable->values[index];
-}
+PG_HASHMAP_DEFINE(hashmap_u64_u64, uint64_t, uint64_t, pg_hash_u64, pg_eq_u64)
+// Function name to its index in `fn_names`.
+PG_HASHMAP_DEFINE(hashmap_span_u64, pg_span_t, uint64_t, pg_hash_span,
+                  pg_span_eq)
 
 static char *power_of_two_string(uint64_t n) {
   static char res[50];
@@ -151,23 +64,13 @@ static char *power_of_two_string(uint64_t n) {
     return res;
 }
 
-static uint64_t fn_name_find(pg_array_t(pg_span_t) fn_names, pg_span_t name,
-                             bool *found) {
-  for (uint64_t i = 0; i < pg_array_len(fn_names); i++) {
-    if (pg_span_eq(fn_names[i], name)) {
-      *found = true;
-      return i;
-    }
-  }
-  return false;
-}
-
 // name is of the form:
 // foo`bar+0xab
 // foo`bar
 // foo`+[objc_weirdness]+0xab
 static stacktrace_entry_t
-fn_name_to_stacktrace_entry(pg_array_t(pg_span_t) * fn_names, pg_span_t name) {
+fn_name_to_stacktrace_entry(pg_array_t(pg_span_t) * fn_names,
+                            hashmap_span_u64_t *fn_indices, pg_span_t name) {
   pg_span_t left = {0}, right = {0};
   int64_t offset = 0;
   if (pg_span_split_at_last(name, '+', &left,
@@ -180,26 +83,29 @@ fn_name_to_stacktrace_entry(pg_array_t(pg_span_t) * fn_names, pg_span_t name) {
                    (int)name.len, name.data, (int)right.len, right.data);
   }
 
-  bool found = false;
-  uint64_t fn_i = fn_name_find(*fn_names, left, &found);
-  if (!found) {
+  const uint64_t *const found = hashmap_span_u64_find(fn_indices, left);
+  uint64_t fn_i = 0;
+  if (found != NULL) {
+    fn_i = *found;
+  } else {
     pg_array_append(*fn_names, left);
     fn_i = pg_array_len(*fn_names) - 1;
+    hashmap_span_u64_upsert(fn_indices, left, fn_i);
   }
 
   return (stacktrace_entry_t){.fn_i = fn_i, .offset = (uint64_t)offset};
 }
 
 static void find_allocation_event_by_allocation_ptr(
-    pg_array_t(event_t) events, hashtable_u64_u64_t *last_allocation_by_ptr,
+    pg_array_t(event_t) events, hashmap_u64_u64_t *last_allocation_by_ptr,
     uint64_t i, uint64_t ptr) {
 
-  uint64_t found_index = -1ULL;
-  if (!pg_hashtable_find(last_allocation_by_ptr, ptr, &found_index))
+  const uint64_t *const found =
+      hashmap_u64_u64_find(last_allocation_by_ptr, ptr);
+  if (found == NULL)
     return;
 
-  const uint64_t other_index =
-      pg_hashtable_at(last_allocation_by_ptr, found_index);
+  const uint64_t other_index = *found;
   assert(i < pg_array_len(events));
   assert(other_index < pg_array_len(events));
 
@@ -212,10 +118,14 @@ static void find_allocation_event_by_allocation_ptr(
 }
 
 static void parse_input(pg_span_t input, pg_array_t(event_t) * events,
-                        pg_array_t(pg_span_t) * fn_names) {
-  hashtable_u64_u64_t last_allocation_by_ptr = {0};
-  pg_hashtable_init(&last_allocation_by_ptr, pg_array_capacity(*events) / 2,
-                    pg_heap_allocator());
+                        pg_array_t(pg_span_t) * fn_names,
+                        pg_allocator_t stacktrace_allocator) {
+  hashmap_u64_u64_t last_allocation_by_ptr = {0};
+  hashmap_u64_u64_init(&last_allocation_by_ptr, pg_array_capacity(*events) / 2,
+                       pg_heap_allocator());
+  hashmap_span_u64_t fn_indices = {0};
+  hashmap_span_u64_init(&fn_indices, pg_array_capacity(*fn_names),
+                        pg_heap_allocator());
 
   const pg_span_t malloc_span = pg_span_make_c("malloc");
   const pg_span_t realloc_span = pg_span_make_c("realloc");
@@ -224,7 +134,7 @@ static void parse_input(pg_span_t input, pg_array_t(event_t) * events,
 
   while (input.len > 0) {
     event_t event = {.kind = EK_NONE, .related_event = -1};
-    pg_array_init_reserve(event.stacktrace, 20, pg_heap_allocator());
+    pg_array_init_reserve(event.stacktrace, 20, stacktrace_allocator);
 
     pg_span_trim_left(&input);
     {
@@ -313,16 +223,17 @@ static void parse_input(pg_span_t input, pg_array_t(event_t) * events,
           event.size = (uint64_t)arg0;
           event.v.alloc.ptr = (uint64_t)arg1;
           pg_array_append(*events, event);
-          pg_hashtable_upsert(&last_allocation_by_ptr, event.v.alloc.ptr,
-                              pg_array_len(*events) - 1);
+          hashmap_u64_u64_upsert(&last_allocation_by_ptr, event.v.alloc.ptr,
+                                 pg_array_len(*events) - 1);
         } else if (event.kind == EK_REALLOC) {
           event.size = (uint64_t)arg0;
           event.v.realloc.new_ptr = (uint64_t)arg1;
           event.v.realloc.old_ptr = (uint64_t)arg2;
           pg_array_append(*events, event);
 
-          pg_hashtable_upsert(&last_allocation_by_ptr, event.v.realloc.new_ptr,
-                              pg_array_len(*events) - 1);
+          hashmap_u64_u64_upsert(&last_allocation_by_ptr,
+                                 event.v.realloc.new_ptr,
+                                 pg_array_len(*events) - 1);
         } else if (event.kind == EK_FREE) {
           const uint64_t ptr = (uint64_t)arg0;
           if (ptr == 0)
@@ -346,10 +257,13 @@ static void parse_input(pg_span_t input, pg_array_t(event_t) * events,
       pg_span_trim(&fn);
 
       const stacktrace_entry_t stacktrace_entry =
-          fn_name_to_stacktrace_entry(fn_names, fn);
+          fn_name_to_stacktrace_entry(fn_names, &fn_indices, fn);
       pg_array_append(event.stacktrace, stacktrace_entry);
     }
   }
+
+  hashmap_u64_u64_destroy(&last_allocation_by_ptr);
+  hashmap_span_u64_destroy(&fn_indices);
 }
 
 static uint64_t event_ptr(const pg_array_t(event_t) events,
@@ -456,6 +370,13 @@ static void print_html(const pg_array_t(event_t) events,
            50ULL, y, power_of_two_string(i), chart_margin_left, y, chart_w, y);
   }
 
+  // One circle per event: format them without printf and write them out in
+  // big chunks. What was printed so far must be written out first.
+  fflush(stdout);
+  static char out_buf[256 * 1024];
+  pg_builder_t out = {0};
+  pg_builder_init_fd(&out, out_buf, sizeof(out_buf), STDOUT_FILENO);
+
   const uint64_t circle_r = 3ULL;
   for (uint64_t i = 0; i < pg_array_len(events); i++) {
     const event_t event = events[i];
@@ -480,23 +401,42 @@ static void print_html(const pg_array_t(event_t) events,
     assert(y <= chart_padding_top + (chart_h - circle_r));
 
     const uint64_t ptr = event_ptr(events, &event);
-    printf("<g class=\"datapoint\"><circle fill=\"%s\" cx=\"%llu\" cy=\"%llu\" "
-           "r=\"%llu\" data-kind=\"%s\" data-id=\"%llu\" "
-           "data-refid=\"%lld\" "
-           "data-size=\"%llu\" data-ptr=\"%#llx\" data-timestamp=\"%llu\" "
-           "data-stacktrace=\"",
-           event.kind == EK_FREE ? "goldenrod"
-                                 : (ptr == 0 ? "crimson" : "steelblue"),
-           x, y, circle_r, event.kind == EK_FREE ? "free" : "alloc", i,
-           event.related_event, event.size, ptr, event.timestamp);
+    pg_builder_append_cstr(&out, "<g class=\"datapoint\"><circle fill=\"");
+    pg_builder_append_cstr(&out, event.kind == EK_FREE ? "goldenrod"
+                                 : ptr == 0            ? "crimson"
+                                                       : "steelblue");
+    pg_builder_append_cstr(&out, "\" cx=\"");
+    pg_builder_append_u64(&out, x);
+    pg_builder_append_cstr(&out, "\" cy=\"");
+    pg_builder_append_u64(&out, y);
+    pg_builder_append_cstr(&out, "\" r=\"");
+    pg_builder_append_u64(&out, circle_r);
+    pg_builder_append_cstr(&out, "\" data-kind=\"");
+    pg_builder_append_cstr(&out, event.kind == EK_FREE ? "free" : "alloc");
+    pg_builder_append_cstr(&out, "\" data-id=\"");
+    pg_builder_append_u64(&out, i);
+    pg_builder_append_cstr(&out, "\" data-refid=\"");
+    pg_builder_append_i64(&out, event.related_event);
+    pg_builder_append_cstr(&out, "\" data-size=\"");
+    pg_builder_append_u64(&out, event.size);
+    // Like `%#llx`: no prefix for 0, which the page relies on.
+    pg_builder_append_cstr(&out, ptr == 0 ? "\" data-ptr=\""
+                                          : "\" data-ptr=\"0x");
+    pg_builder_append_hex(&out, ptr);
+    pg_builder_append_cstr(&out, "\" data-timestamp=\"");
+    pg_builder_append_u64(&out, event.timestamp);
+    pg_builder_append_cstr(&out, "\" data-stacktrace=\"");
 
     for (uint64_t j = 0; j < pg_array_len(event.stacktrace); j++) {
       const uint64_t fn_i = event.stacktrace[j].fn_i;
-      const pg_span_t fn_name = fn_names[fn_i];
-      printf("%.*s%c", (int)fn_name.len, fn_name.data, 0x0a);
+      pg_builder_append_span(&out, fn_names[fn_i]);
+      pg_builder_append_char(&out, 0x0a);
     }
-    printf("\"></circle></g>\n");
+    pg_builder_append_cstr(&out, "\"></circle></g>\n");
   }
+  if (!pg_builder_flush(&out))
+    pg_log_fatal(&logger, out.err, "Failed to write output: %s",
+                 strerror(out.err));
 
   printf(
       // clang-format off
@@ -577,35 +517,46 @@ static void print_html(const pg_array_t(event_t) events,
 }
 
 int main(int argc, char *argv[]) {
-  pg_array_t(uint8_t) file_data = {0};
-  pg_array_init_reserve(file_data, 0, pg_heap_allocator());
+  // Traces can be multiple GiBs: map them instead of copying them.
+  pg_mapped_file_t file = {0};
   if (argc == 1) {
-    pg_log_fatal(&logger, EINVAL, "TODO read from stdin");
-  } else if (argc == 2) {
-    int fd = open(argv[1], O_RDONLY);
-    if (fd == -1) {
-      pg_log_fatal(&logger, errno, "Failed to open file %s: %s", argv[1],
+    if (!pg_mmap_file_fd(STDIN_FILENO, PG_MMAP_FLAGS_SEQUENTIAL, &file)) {
+      pg_log_fatal(&logger, errno, "Failed to read stdin: %s",
                    strerror(errno));
     }
-    if ((!pg_read_file(argv[1], &file_data)) != 0) {
+  } else if (argc == 2) {
+    if (!pg_mmap_file(argv[1], PG_MMAP_FLAGS_SEQUENTIAL, &file)) {
       pg_log_fatal(&logger, errno, "Failed to read file %s: %s", argv[1],
                    strerror(errno));
     }
   } else {
     return EINVAL;
   }
-  assert(file_data != NULL);
 
-  pg_span_t input = {.data = (char *)file_data, .len = pg_array_len(file_data)};
+  const pg_span_t input = file.span;
 
+  // Events take most of the memory: grow them in place in address space
+  // reserved up front, instead of copying them each time. An event takes
+  // more than 8 bytes of input.
+  pg_vm_t events_vm = {0};
+  if (!pg_vm_init(&events_vm, sizeof(pg_array_header_t) +
+                                  (input.len / 8 + 1) * sizeof(event_t))) {
+    pg_log_fatal(&logger, errno, "Failed to reserve memory: %s",
+                 strerror(errno));
+  }
   pg_array_t(event_t) events = {0};
-  pg_array_init_reserve(events, input.len / 400, pg_heap_allocator());
+  pg_array_init_reserve(events, input.len / 400, pg_vm_allocator(&events_vm));
 
   pg_array_t(pg_span_t) fn_names = {0};
   pg_array_init_reserve(fn_names, pg_array_capacity(events) / 10,
                         pg_heap_allocator());
 
-  parse_input(input, &events, &fn_names);
+  // Stacktraces live as long as the program and are only appended to while
+  // parsing their event so they can grow in place in an arena
+  pg_arena_t stacktrace_arena = {0};
+  pg_arena_init(&stacktrace_arena, 0);
+
+  parse_input(input, &events, &fn_names, pg_arena_allocator(&stacktrace_arena));
 
   print_html(events, fn_names);
   return 0;
@@ -1,3 +1,5 @@
+#include "../pg/pg.h"
+
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
@@ -11,8 +13,6 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include "../pg/pg.h"
-
 typedef struct {
   uint64_t max_retries, max_duration_seconds;
   uint32_t wait_milliseconds;
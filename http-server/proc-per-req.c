@@ -1,3 +1,5 @@
+#include "../pg/pg.h"
+
 #include <assert.h>
 #include <errno.h>
 #include <netinet/in.h>
@@ -11,7 +13,6 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#include "../pg/pg.h"
 #include "../vendor/picohttpparser/picohttpparser.h"
 
 static const uint64_t KiB = 1024;
@@ -106,6 +107,11 @@ static int http_parse_request(http_req_t *req, pg_string_t buf,
     LOG("Invalid path, too long: path=%.*s", (int)path.len, path.data);
     return EINVAL;
   }
+  if (!pg_span_url_decode(&path)) {
+    LOG("Invalid path, malformed escape: path=%.*s", (int)path.len,
+        path.data);
+    return EINVAL;
+  }
   req->path = path;
 
   if (req->headers_len >= UINT8_MAX ||
@@ -136,17 +142,19 @@ static int http_parse_request(http_req_t *req, pg_string_t buf,
   return 0;
 }
 
-static pg_string_t app_handle(const http_req_t *http_req, const char *req_body,
-                              uint64_t req_body_len) {
+static void app_handle(pg_builder_t *res, const http_req_t *http_req,
+                       const char *req_body, uint64_t req_body_len) {
   (void)http_req;
   (void)req_body;
   (void)req_body_len;
 
-  return pg_string_make(pg_heap_allocator(),
-                        "HTTP/1.1 200 OK\r\n"
-                        "Content-Type: text/plain; charset=utf8\r\n"
-                        "Content-Length: 0\r\n"
-                        "\r\n");
+  const pg_span_t body = {0};
+  pg_builder_append_cstr(res, "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/plain; charset=utf8\r\n"
+                              "Content-Length: ");
+  pg_builder_append_u64(res, body.len);
+  pg_builder_append_cstr(res, "\r\n\r\n");
+  pg_builder_append_span(res, body);
 }
 
 static void *timeout_background_worker_run(void *arg) {
@@ -212,18 +220,15 @@ static void handle_connection(int conn_fd) {
     req_body_len = 0;
   }
 
-  pg_string_t res = app_handle(&http_req, req_body, req_body_len);
-  LOG("res=%s\n", res);
+  static char res_buf[16 * 1024];
+  pg_builder_t res = {0};
+  pg_builder_init_fd(&res, res_buf, sizeof(res_buf), conn_fd);
+  app_handle(&res, &http_req, req_body, req_body_len);
+  LOG("res=%.*s\n", (int)res.len, res.data);
 
-  uint64_t written = 0;
-  const uint64_t total = pg_string_len(res);
-  while (written < total) {
-    const ssize_t sent = send(conn_fd, &res[written], total - written, 0);
-    if (sent == -1) {
-      fprintf(stderr, "Failed to send(2): err=%s\n", strerror(errno));
-      return;
-    }
-    written += total;
+  if (!pg_builder_flush(&res)) {
+    fprintf(stderr, "Failed to write(2): err=%s\n", strerror(res.err));
+    return;
   }
   // Nothing to cleanup, since this process is going to exit right after
 }
@@ -1,11 +1,11 @@
+#include "../pg/pg.h"
+
 #include <assert.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 
-#include "../pg/pg.h"
-
 static void print_usage(int argc, char *argv[]) {
   assert(argc > 0);
   printf("%s <port> <delay_ms> <batch_size_max> <payload_length>\nGot:", argv[0]);
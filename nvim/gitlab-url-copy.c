@@ -1,3 +1,5 @@
+#include "../pg/pg.h"
+
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -6,8 +8,6 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "../pg/pg.h"
-
 #define MAX_URL_LEN 2048
 
 static void open_url_in_browser(pg_string_t url) {
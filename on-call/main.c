@@ -1,9 +1,9 @@
+#include "../pg/pg.h"
+
 #include <assert.h>
 #include <stdio.h>
 #include <time.h>
 
-#include "../pg/pg.h"
-
 static const uint64_t hourly_week_end_rate = 15;
 static const uint64_t hourly_week_rate = 10;
 
@@ -1,21 +1,49 @@
 #pragma once
 
+// Expose `MAP_ANONYMOUS`, `memfd_create` and friends on Linux even when
+// building with -std=c99. This only works if pg.h is included before any
+// system header.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#else
+#include <sys/event.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
@@ -51,45 +79,267 @@ typedef struct {
 
 typedef struct pg_allocator_t pg_allocator_t;
 struct pg_allocator_t {
-  //  void *backing_memory;
-  //  uint64_t backing_memory_cap;
-  void *(*realloc)(void *old_memory, uint64_t new_size, uint64_t old_size);
-  void (*free)(void *memory);
+  // Memory returned by `realloc` is zeroed from `old_size` to `new_size`.
+  void *(*realloc)(void *ctx, void *old_memory, uint64_t new_size,
+                   uint64_t old_size);
+  void (*free)(void *ctx, void *memory);
+  void *ctx; // Allocator specific state e.g. the arena, NULL for the heap
 };
 
-__attribute__((unused)) static void *
-pg_heap_realloc(void *old_memory, uint64_t new_size, uint64_t old_size) {
+#define pg_alloc(allocator, size)                                              \
+  ((allocator).realloc((allocator).ctx, NULL, (size), 0))
+#define pg_realloc(allocator, old_memory, new_size, old_size)                  \
+  ((allocator).realloc((allocator).ctx, (old_memory), (new_size), (old_size)))
+#define pg_free(allocator, memory) ((allocator).free((allocator).ctx, (memory)))
+
+__attribute__((unused)) static void *pg_heap_realloc(void *ctx,
+                                                     void *old_memory,
+                                                     uint64_t new_size,
+                                                     uint64_t old_size) {
+  (void)ctx;
   void *res = realloc(old_memory, new_size);
-  memset((uint8_t *)res + old_size, 0, new_size - old_size);
+  if (res != NULL && new_size > old_size)
+    memset((uint8_t *)res + old_size, 0, new_size - old_size);
   return res;
 }
 
-__attribute__((unused)) static void pg_heap_free(void *memory) { free(memory); }
+__attribute__((unused)) static void pg_heap_free(void *ctx, void *memory) {
+  (void)ctx;
+  free(memory);
+}
 
 __attribute__((unused)) static pg_allocator_t pg_heap_allocator(void) {
   return (pg_allocator_t){.realloc = pg_heap_realloc, .free = pg_heap_free};
 }
 
-// memmem
+// -------------------------- Byte search
+
+// Thin layer over SSE2/AVX2 so that each search is written once. Without
+// either, the scalar paths are used (and libc's memchr/memcmp, which are
+// vectorized on their own).
+#if defined(__AVX2__)
+#define PG_SIMD_WIDTH 32
+#define PG_SIMD_MASK_ALL 0xffffffffU
+typedef __m256i pg_simd_t;
+#define pg_simd_load(p) _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define pg_simd_splat(c) _mm256_set1_epi8((char)(c))
+#define pg_simd_eq(a, b) _mm256_cmpeq_epi8((a), (b))
+#define pg_simd_and(a, b) _mm256_and_si256((a), (b))
+#define pg_simd_or(a, b) _mm256_or_si256((a), (b))
+#define pg_simd_gt(a, b) _mm256_cmpgt_epi8((a), (b)) // Signed.
+#define pg_simd_store(p, a) _mm256_storeu_si256((__m256i *)(void *)(p), (a))
+#define pg_simd_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#define PG_SIMD_WIDTH 16
+#define PG_SIMD_MASK_ALL 0xffffU
+typedef __m128i pg_simd_t;
+#define pg_simd_load(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define pg_simd_splat(c) _mm_set1_epi8((char)(c))
+#define pg_simd_eq(a, b) _mm_cmpeq_epi8((a), (b))
+#define pg_simd_and(a, b) _mm_and_si128((a), (b))
+#define pg_simd_or(a, b) _mm_or_si128((a), (b))
+#define pg_simd_gt(a, b) _mm_cmpgt_epi8((a), (b)) // Signed.
+#define pg_simd_store(p, a) _mm_storeu_si128((__m128i *)(void *)(p), (a))
+#define pg_simd_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+// Like libc's memchr: the search functions return a non-const pointer into
+// the (const) input.
+__attribute__((unused)) static void *pg_unconst(const void *p) {
+  return (void *)(uintptr_t)p;
+}
+
+// Find the first occurence of `little` in `big`.
+// For each block, the positions where both the first and the last byte of
+// `little` match are found at once, and only those are compared in full.
 __attribute__((unused)) static void *pg_memmem(const void *big,
                                                uint64_t big_len,
                                                const void *little,
                                                uint64_t little_len) {
-  const char *sbig = (const char *)big;
-  const char *slittle = (const char *)little;
-  char *s = memchr(big, slittle[0], big_len);
-  if (!s)
-    return NULL;
+  const uint8_t *b = big;
+  const uint8_t *l = little;
 
-  uint64_t rem_len = big_len + (uint64_t)(s - sbig);
-  if (rem_len < little_len)
+  if (little_len == 0)
+    return pg_unconst(b);
+  if (little_len > big_len)
     return NULL;
+  if (little_len == 1)
+    return memchr(big, l[0], big_len);
+
+  const uint64_t last = little_len - 1;
+  // Number of candidate positions.
+  const uint64_t end = big_len - little_len + 1;
+  uint64_t i = 0;
+
+#ifdef PG_SIMD_WIDTH
+  const pg_simd_t first_c = pg_simd_splat(l[0]);
+  const pg_simd_t last_c = pg_simd_splat(l[last]);
+
+  for (; i + PG_SIMD_WIDTH <= end; i += PG_SIMD_WIDTH) {
+    uint32_t mask = pg_simd_mask(
+        pg_simd_and(pg_simd_eq(first_c, pg_simd_load(b + i)),
+                    pg_simd_eq(last_c, pg_simd_load(b + i + last))));
+    while (mask != 0) {
+      const uint64_t pos = i + (uint64_t)__builtin_ctz(mask);
+      if (memcmp(b + pos + 1, l + 1, little_len - 2) == 0)
+        return pg_unconst(b + pos);
+      mask &= mask - 1;
+    }
+  }
+#endif
 
-  for (uint64_t i = 0; i < little_len; i++) {
-    if (s[i] != slittle[i])
+  while (i < end) {
+    const uint8_t *s = memchr(b + i, l[0], end - i);
+    if (s == NULL)
       return NULL;
+
+    i = (uint64_t)(s - b);
+    if (b[i + last] == l[last] && memcmp(b + i, l, last) == 0)
+      return pg_unconst(s);
+    i += 1;
   }
-  return s;
+  return NULL;
+}
+
+// Find the last occurence of `c`.
+__attribute__((unused)) static void *pg_memrchr(const void *big,
+                                                uint64_t big_len, uint8_t c) {
+  const uint8_t *b = big;
+  uint64_t i = big_len;
+
+#ifdef PG_SIMD_WIDTH
+  const pg_simd_t needle = pg_simd_splat(c);
+  for (; i >= PG_SIMD_WIDTH; i -= PG_SIMD_WIDTH) {
+    const uint32_t mask =
+        pg_simd_mask(pg_simd_eq(needle, pg_simd_load(b + i - PG_SIMD_WIDTH)));
+    if (mask != 0) {
+      const uint64_t last = 31 - (uint64_t)__builtin_clz(mask);
+      return pg_unconst(b + i - PG_SIMD_WIDTH + last);
+    }
+  }
+#endif
+
+  while (i > 0) {
+    i -= 1;
+    if (b[i] == c)
+      return pg_unconst(b + i);
+  }
+  return NULL;
+}
+
+// Find the first byte which is any of `needles`.
+__attribute__((unused)) static void *pg_memchr_any(const void *big,
+                                                   uint64_t big_len,
+                                                   const uint8_t *needles,
+                                                   uint64_t needles_len) {
+  const uint8_t *b = big;
+  uint64_t i = 0;
+
+  if (needles_len == 0 || big_len == 0)
+    return NULL;
+  if (needles_len == 1)
+    return memchr(big, needles[0], big_len);
+
+#ifdef PG_SIMD_WIDTH
+  // One comparison per needle and per block: past a handful of needles the
+  // lookup table below wins.
+  if (needles_len <= 8) {
+    pg_simd_t splats[8];
+    for (uint64_t j = 0; j < needles_len; j++)
+      splats[j] = pg_simd_splat(needles[j]);
+
+    for (; i + PG_SIMD_WIDTH <= big_len; i += PG_SIMD_WIDTH) {
+      const pg_simd_t block = pg_simd_load(b + i);
+      pg_simd_t match = pg_simd_eq(block, splats[0]);
+      for (uint64_t j = 1; j < needles_len; j++)
+        match = pg_simd_or(match, pg_simd_eq(block, splats[j]));
+
+      const uint32_t mask = pg_simd_mask(match);
+      if (mask != 0)
+        return pg_unconst(b + i + (uint64_t)__builtin_ctz(mask));
+    }
+  }
+#endif
+
+  bool table[256] = {0};
+  for (uint64_t j = 0; j < needles_len; j++)
+    table[needles[j]] = true;
+
+  for (; i < big_len; i++) {
+    if (table[b[i]])
+      return pg_unconst(b + i);
+  }
+  return NULL;
+}
+
+// Equality of two buffers of the same length. Inlined, unlike memcmp, which
+// matters for the short spans compared in parsers.
+__attribute__((unused)) static bool pg_mem_eq(const void *a, const void *b,
+                                              uint64_t len) {
+  const uint8_t *x = a;
+  const uint8_t *y = b;
+
+#ifdef PG_SIMD_WIDTH
+  if (len >= PG_SIMD_WIDTH) {
+    for (uint64_t i = 0; i + PG_SIMD_WIDTH <= len; i += PG_SIMD_WIDTH) {
+      if (pg_simd_mask(pg_simd_eq(pg_simd_load(x + i), pg_simd_load(y + i))) !=
+          PG_SIMD_MASK_ALL)
+        return false;
+    }
+    // The last block may overlap the previous one.
+    const uint64_t i = len - PG_SIMD_WIDTH;
+    return pg_simd_mask(pg_simd_eq(pg_simd_load(x + i),
+                                   pg_simd_load(y + i))) == PG_SIMD_MASK_ALL;
+  }
+#endif
+
+  if (len >= 8) {
+    uint64_t u = 0, v = 0;
+    for (uint64_t i = 0; i + 8 <= len; i += 8) {
+      memcpy(&u, x + i, 8);
+      memcpy(&v, y + i, 8);
+      if (u != v)
+        return false;
+    }
+    memcpy(&u, x + len - 8, 8);
+    memcpy(&v, y + len - 8, 8);
+    return u == v;
+  }
+  if (len >= 4) {
+    uint32_t u = 0, v = 0, s = 0, t = 0;
+    memcpy(&u, x, 4);
+    memcpy(&v, y, 4);
+    memcpy(&s, x + len - 4, 4);
+    memcpy(&t, y + len - 4, 4);
+    return u == v && s == t;
+  }
+  for (uint64_t i = 0; i < len; i++) {
+    if (x[i] != y[i])
+      return false;
+  }
+  return true;
+}
+
+#if defined(MAP_ANONYMOUS)
+#define PG_MAP_ANONYMOUS MAP_ANONYMOUS
+#elif defined(MAP_ANON)
+#define PG_MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Zeroed, lazily committed pages.
+__attribute__((unused)) static void *pg_mmap_anonymous(uint64_t size) {
+#ifdef PG_MAP_ANONYMOUS
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | PG_MAP_ANONYMOUS, -1, 0);
+#else
+  // Strict C99 on Linux hides MAP_ANONYMOUS: map /dev/zero instead
+  const int fd = open("/dev/zero", O_RDWR);
+  if (fd == -1)
+    return NULL;
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+#endif
+  return ptr == MAP_FAILED ? NULL : ptr;
 }
 
 // -------------------------- Pool
@@ -123,62 +373,687 @@ typedef struct pg_pool_free_node_t {
   struct pg_pool_free_node_t *next;
 } pg_pool_free_node_t;
 
-typedef struct {
-  uint8_t *buf;
-  uint64_t buf_len;
-  uint64_t chunk_size;
+typedef enum {
+  PG_POOL_FLAGS_NONE = 0,
+  // Add slabs on demand instead of returning NULL, and give empty slabs back
+  // to the OS.
+  PG_POOL_FLAGS_GROW = 1 << 0,
+  // Do not memset chunks on alloc, for callers which overwrite them anyway.
+  PG_POOL_FLAGS_NO_ZERO = 1 << 1,
+  // The pool is accessed from multiple threads, typically through
+  // `pg_pool_cache_t`.
+  PG_POOL_FLAGS_SHARED = 1 << 2,
+} pg_pool_flags_t;
+
+// A slab is a header followed by `chunks_per_slab` chunks. Growable pools
+// align slabs on their (power of two) size so that the slab owning a chunk is
+// found by masking the chunk address.
+typedef struct pg_pool_slab_t pg_pool_slab_t;
+struct pg_pool_slab_t {
+  pg_pool_slab_t *next, *prev;
   pg_pool_free_node_t *head;
+  uint64_t used;
+};
+
+typedef struct {
+  pg_pool_slab_t *partial; // Slabs with at least one free chunk
+  pg_pool_slab_t *full;    // Slabs with no free chunk
+  uint64_t chunk_size, chunks_per_slab, slab_size, slabs_count;
+  uint64_t empty_slabs_count;
+  uint32_t flags;
+  bool lock;
+  PG_PAD(3);
 } pg_pool_t;
 
+#define PG_POOL_SLAB_HEADER_SIZE                                               \
+  (pg_align_forward(sizeof(pg_pool_slab_t), PG_DEFAULT_ALIGNEMENT))
+
+__attribute__((unused)) static void pg_pool_lock(pg_pool_t *pool) {
+  if (!(pool->flags & PG_POOL_FLAGS_SHARED))
+    return;
+  while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&pool->lock, __ATOMIC_RELAXED))
+      ;
+  }
+}
+
+__attribute__((unused)) static void pg_pool_unlock(pg_pool_t *pool) {
+  if (!(pool->flags & PG_POOL_FLAGS_SHARED))
+    return;
+  __atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+__attribute__((unused)) static void pg_pool_slab_unlink(pg_pool_slab_t **list,
+                                                       pg_pool_slab_t *slab) {
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+__attribute__((unused)) static void pg_pool_slab_link(pg_pool_slab_t **list,
+                                                     pg_pool_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+__attribute__((unused)) static void pg_pool_slab_reset(pg_pool_t *pool,
+                                                      pg_pool_slab_t *slab) {
+  uint8_t *const data = (uint8_t *)slab + PG_POOL_SLAB_HEADER_SIZE;
+  slab->head = NULL;
+  slab->used = 0;
+  // Push in reverse so that chunks are handed out in address order
+  for (uint64_t i = pool->chunks_per_slab; i > 0; i--) {
+    pg_pool_free_node_t *node =
+        (pg_pool_free_node_t *)(void *)&data[(i - 1) * pool->chunk_size];
+    node->next = slab->head;
+    slab->head = node;
+  }
+}
+
+__attribute__((unused)) static pg_pool_slab_t *
+pg_pool_slab_make(pg_pool_t *pool) {
+  uint8_t *ptr = NULL;
+  if (pool->flags & PG_POOL_FLAGS_GROW) {
+    // Over-map then trim to get a slab aligned on its size
+    uint8_t *raw = pg_mmap_anonymous(2 * pool->slab_size);
+    if (raw == NULL)
+      return NULL;
+
+    ptr = (uint8_t *)pg_align_forward((uint64_t)raw, pool->slab_size);
+    if (ptr > raw)
+      munmap(raw, (uint64_t)(ptr - raw));
+    const uint64_t tail = (uint64_t)(raw + 2 * pool->slab_size -
+                                     (ptr + pool->slab_size));
+    if (tail > 0)
+      munmap(ptr + pool->slab_size, tail);
+  } else {
+    ptr = calloc(1, pool->slab_size);
+    if (ptr == NULL)
+      return NULL;
+  }
+
+  pg_pool_slab_t *slab = (pg_pool_slab_t *)(void *)ptr;
+  pg_pool_slab_reset(pool, slab);
+  pg_pool_slab_link(&pool->partial, slab);
+  pool->slabs_count += 1;
+  pool->empty_slabs_count += 1;
+  return slab;
+}
+
+__attribute__((unused)) static void pg_pool_slab_release(pg_pool_t *pool,
+                                                        pg_pool_slab_t *slab) {
+  if (pool->flags & PG_POOL_FLAGS_GROW)
+    munmap(slab, pool->slab_size);
+  else
+    free(slab);
+}
+
+__attribute__((unused)) static pg_pool_slab_t *
+pg_pool_slab_of(const pg_pool_t *pool, void *ptr) {
+  if (pool->flags & PG_POOL_FLAGS_GROW)
+    return (pg_pool_slab_t *)((uintptr_t)ptr & ~(pool->slab_size - 1));
+
+  // A fixed pool only ever has one slab
+  return pool->partial != NULL ? pool->partial : pool->full;
+}
+
+// Does not zero the chunk nor lock the pool.
+__attribute__((unused)) static void *pg_pool_alloc_raw(pg_pool_t *pool) {
+  pg_pool_slab_t *slab = pool->partial;
+  if (slab == NULL) {
+    if (!(pool->flags & PG_POOL_FLAGS_GROW))
+      return NULL; // No more space
+    if ((slab = pg_pool_slab_make(pool)) == NULL)
+      return NULL;
+  }
+
+  pg_pool_free_node_t *node = slab->head;
+  assert(node != NULL);
+  slab->head = node->next;
+  if (slab->used == 0)
+    pool->empty_slabs_count -= 1;
+  slab->used += 1;
+
+  if (slab->head == NULL) {
+    pg_pool_slab_unlink(&pool->partial, slab);
+    pg_pool_slab_link(&pool->full, slab);
+  }
+
+  return node;
+}
+
+// Does not lock the pool.
+__attribute__((unused)) static void pg_pool_free_raw(pg_pool_t *pool,
+                                                    void *ptr) {
+  pg_pool_slab_t *slab = pg_pool_slab_of(pool, ptr);
+  assert(slab != NULL);
+  assert((uint8_t *)ptr >= (uint8_t *)slab + PG_POOL_SLAB_HEADER_SIZE);
+  assert((uint8_t *)ptr < (uint8_t *)slab + PG_POOL_SLAB_HEADER_SIZE +
+                              pool->chunks_per_slab * pool->chunk_size);
+  assert(slab->used > 0);
+
+  if (slab->head == NULL) {
+    pg_pool_slab_unlink(&pool->full, slab);
+    pg_pool_slab_link(&pool->partial, slab);
+  }
+
+  pg_pool_free_node_t *node = (pg_pool_free_node_t *)ptr;
+  node->next = slab->head;
+  slab->head = node;
+  slab->used -= 1;
+
+  if (slab->used > 0)
+    return;
+
+  // Give the slab back, but keep one empty slab around so that alternating
+  // alloc/free across a slab boundary does not mmap/munmap every time
+  if ((pool->flags & PG_POOL_FLAGS_GROW) && pool->empty_slabs_count > 0) {
+    pg_pool_slab_unlink(&pool->partial, slab);
+    pool->slabs_count -= 1;
+    pg_pool_slab_release(pool, slab);
+  } else {
+    pool->empty_slabs_count += 1;
+  }
+}
+
 __attribute__((unused)) static void pg_pool_free_all(pg_pool_t *pool) {
-  for (uint64_t i = 0; i < pool->buf_len / pool->chunk_size; i++) {
-    void *ptr = &pool->buf[i * pool->chunk_size];
-    pg_pool_free_node_t *node = (pg_pool_free_node_t *)ptr;
-    node->next = pool->head;
-    pool->head = node;
+  pg_pool_lock(pool);
+
+  // Growable pools release all slabs but one
+  pg_pool_slab_t *keep = pool->partial != NULL ? pool->partial : pool->full;
+  pg_pool_slab_t *lists[] = {pool->partial, pool->full};
+  for (uint64_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+    pg_pool_slab_t *slab = lists[i];
+    while (slab != NULL) {
+      pg_pool_slab_t *next = slab->next;
+      if (slab != keep)
+        pg_pool_slab_release(pool, slab);
+      slab = next;
+    }
   }
+  pool->partial = pool->full = NULL;
+  pool->slabs_count = 0;
+  pool->empty_slabs_count = 0;
+
+  if (keep != NULL) {
+    pg_pool_slab_reset(pool, keep);
+    pg_pool_slab_link(&pool->partial, keep);
+    pool->slabs_count = 1;
+    pool->empty_slabs_count = 1;
+  }
+
+  pg_pool_unlock(pool);
 }
 
 __attribute__((unused)) static void *pg_pool_alloc(pg_pool_t *pool) {
-  pg_pool_free_node_t *node = pool->head;
-  if (node == NULL)
-    return NULL; // No more space
+  pg_pool_lock(pool);
+  void *res = pg_pool_alloc_raw(pool);
+  pg_pool_unlock(pool);
 
-  pool->head = pool->head->next;
-
-  return memset(node, 0, pool->chunk_size);
+  if (res != NULL && !(pool->flags & PG_POOL_FLAGS_NO_ZERO))
+    memset(res, 0, pool->chunk_size);
+  return res;
 }
 
 __attribute__((unused)) static void pg_pool_free(pg_pool_t *pool, void *ptr) {
   assert(ptr != NULL);
-  assert(ptr >= (void *)pool->buf);
-  assert((uint8_t *)ptr <
-         (uint8_t *)pool->buf + pool->buf_len - sizeof(pg_pool_free_node_t *));
 
-  pg_pool_free_node_t *node = (pg_pool_free_node_t *)ptr;
-  node->next = pool->head;
-  pool->head = node;
+  pg_pool_lock(pool);
+  pg_pool_free_raw(pool, ptr);
+  pg_pool_unlock(pool);
 }
 
-__attribute__((unused)) static void
-pg_pool_init(pg_pool_t *pool, uint64_t chunk_size, uint64_t max_items_count) {
+// `items_count` is the total number of chunks for a fixed pool, and the
+// (minimum) number of chunks per slab for a growable pool. With 0 items, a
+// fixed pool is always empty and a growable pool maps its first slab on the
+// first alloc.
+__attribute__((unused)) static void pg_pool_init_flags(pg_pool_t *pool,
+                                                      uint64_t chunk_size,
+                                                      uint64_t items_count,
+                                                      uint32_t flags) {
   // TODO: allow using existing chunk of mem
   // TODO: alignement
 
   chunk_size = pg_align_forward(chunk_size, PG_DEFAULT_ALIGNEMENT);
   assert(chunk_size >= sizeof(pg_pool_free_node_t));
 
-  pool->chunk_size = chunk_size;
-  pool->buf_len = max_items_count * chunk_size;
-  pool->buf = calloc(max_items_count, chunk_size);
-  assert(pool->buf);
-  pool->head = NULL;
+  *pool = (pg_pool_t){.chunk_size = chunk_size, .flags = flags};
+
+  if (flags & PG_POOL_FLAGS_GROW) {
+    const uint64_t size =
+        PG_POOL_SLAB_HEADER_SIZE + MAX(items_count, 1) * chunk_size;
+    // Round up to a power of two (for masking) and fill the slack with chunks
+    pool->slab_size = 4 * Ki;
+    while (pool->slab_size < size)
+      pool->slab_size *= 2;
+    pool->chunks_per_slab =
+        (pool->slab_size - PG_POOL_SLAB_HEADER_SIZE) / chunk_size;
+  } else {
+    pool->slab_size = PG_POOL_SLAB_HEADER_SIZE + items_count * chunk_size;
+    pool->chunks_per_slab = items_count;
+  }
+
+  // A slab without chunks would sit in `partial` with an empty free list
+  if (items_count == 0)
+    return;
+
+  pg_pool_slab_t *slab = pg_pool_slab_make(pool);
+  assert(slab != NULL);
+}
 
-  pg_pool_free_all(pool);
+__attribute__((unused)) static void
+pg_pool_init(pg_pool_t *pool, uint64_t chunk_size, uint64_t max_items_count) {
+  pg_pool_init_flags(pool, chunk_size, max_items_count, PG_POOL_FLAGS_NONE);
 }
 
 __attribute__((unused)) static void pg_pool_destroy(pg_pool_t *pool) {
-  free(pool->buf);
+  pg_pool_slab_t *lists[] = {pool->partial, pool->full};
+  for (uint64_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+    pg_pool_slab_t *slab = lists[i];
+    while (slab != NULL) {
+      pg_pool_slab_t *next = slab->next;
+      pg_pool_slab_release(pool, slab);
+      slab = next;
+    }
+  }
+  pool->partial = pool->full = NULL;
+  pool->slabs_count = 0;
+}
+
+// Per-thread cache in front of a shared pool: each thread owns one, allocates
+// and frees without any synchronization, and only takes the pool lock to
+// move a batch of chunks in or out.
+
+#ifndef PG_POOL_CACHE_CAP
+#define PG_POOL_CACHE_CAP 64
+#endif
+
+typedef struct {
+  pg_pool_t *pool;
+  pg_pool_free_node_t *head;
+  uint64_t len;
+} pg_pool_cache_t;
+
+__attribute__((unused)) static void pg_pool_cache_init(pg_pool_cache_t *cache,
+                                                      pg_pool_t *pool) {
+  *cache = (pg_pool_cache_t){.pool = pool};
+}
+
+// Give back `count` chunks to the pool.
+__attribute__((unused)) static void pg_pool_cache_drain(pg_pool_cache_t *cache,
+                                                       uint64_t count) {
+  pg_pool_lock(cache->pool);
+  for (uint64_t i = 0; i < count && cache->head != NULL; i++) {
+    pg_pool_free_node_t *node = cache->head;
+    cache->head = node->next;
+    cache->len -= 1;
+    pg_pool_free_raw(cache->pool, node);
+  }
+  pg_pool_unlock(cache->pool);
+}
+
+__attribute__((unused)) static void *
+pg_pool_cache_alloc(pg_pool_cache_t *cache) {
+  if (cache->head == NULL) { // Refill half of the cache at once
+    pg_pool_lock(cache->pool);
+    for (uint64_t i = 0; i < PG_POOL_CACHE_CAP / 2; i++) {
+      pg_pool_free_node_t *node = pg_pool_alloc_raw(cache->pool);
+      if (node == NULL)
+        break;
+      node->next = cache->head;
+      cache->head = node;
+      cache->len += 1;
+    }
+    pg_pool_unlock(cache->pool);
+
+    if (cache->head == NULL)
+      return NULL;
+  }
+
+  pg_pool_free_node_t *node = cache->head;
+  cache->head = node->next;
+  cache->len -= 1;
+
+  if (!(cache->pool->flags & PG_POOL_FLAGS_NO_ZERO))
+    memset(node, 0, cache->pool->chunk_size);
+  return node;
+}
+
+__attribute__((unused)) static void pg_pool_cache_free(pg_pool_cache_t *cache,
+                                                      void *ptr) {
+  assert(ptr != NULL);
+
+  pg_pool_free_node_t *node = ptr;
+  node->next = cache->head;
+  cache->head = node;
+  cache->len += 1;
+
+  if (cache->len > PG_POOL_CACHE_CAP)
+    pg_pool_cache_drain(cache, PG_POOL_CACHE_CAP / 2);
+}
+
+// Must be called before the owning thread exits.
+__attribute__((unused)) static void
+pg_pool_cache_flush(pg_pool_cache_t *cache) {
+  pg_pool_cache_drain(cache, cache->len);
+}
+
+// -------------------------- Arena
+
+// Bump allocator: memory is carved out of large chunks reserved with mmap(2)
+// and all of it is released at once with `pg_arena_reset` or when a scratch
+// scope ends. Chunks are kept around after a reset to be reused.
+
+#ifndef PG_ARENA_DEFAULT_CHUNK_SIZE
+#define PG_ARENA_DEFAULT_CHUNK_SIZE (64 * Mi)
+#endif
+
+typedef struct pg_arena_chunk_t pg_arena_chunk_t;
+struct pg_arena_chunk_t {
+  pg_arena_chunk_t *next;
+  uint64_t cap, offset;
+  // Bytes past `dirty` have never been handed out and are still zero (fresh
+  // pages from mmap(2)), so they do not need to be memset.
+  uint64_t dirty;
+};
+
+typedef struct {
+  pg_arena_chunk_t *first, *current;
+  uint64_t chunk_size;
+  void *last_alloc; // Only the last allocation can grow/shrink in place
+} pg_arena_t;
+
+typedef struct {
+  pg_arena_t *arena;
+  pg_arena_chunk_t *chunk;
+  uint64_t offset;
+} pg_arena_scope_t;
+
+__attribute__((unused)) static void pg_arena_init(pg_arena_t *arena,
+                                                  uint64_t chunk_size) {
+  *arena = (pg_arena_t){
+      .chunk_size = chunk_size == 0 ? PG_ARENA_DEFAULT_CHUNK_SIZE : chunk_size,
+  };
+}
+
+__attribute__((unused)) static uint8_t *
+pg_arena_chunk_data(pg_arena_chunk_t *chunk) {
+  return (uint8_t *)chunk +
+         pg_align_forward(sizeof(pg_arena_chunk_t), PG_DEFAULT_ALIGNEMENT);
+}
+
+__attribute__((unused)) static pg_arena_chunk_t *
+pg_arena_chunk_make(uint64_t cap) {
+  const uint64_t header_size =
+      pg_align_forward(sizeof(pg_arena_chunk_t), PG_DEFAULT_ALIGNEMENT);
+  void *ptr = pg_mmap_anonymous(header_size + cap);
+  if (ptr == NULL)
+    return NULL;
+
+  pg_arena_chunk_t *chunk = ptr;
+  chunk->cap = cap;
+  return chunk;
+}
+
+// Zero the part of [start, end) that may have been used before.
+__attribute__((unused)) static void
+pg_arena_chunk_zero(pg_arena_chunk_t *chunk, uint64_t start, uint64_t end) {
+  if (start < chunk->dirty)
+    memset(pg_arena_chunk_data(chunk) + start, 0,
+           MIN(end, chunk->dirty) - start);
+  chunk->dirty = MAX(chunk->dirty, end);
+}
+
+__attribute__((unused)) static void *pg_arena_alloc(pg_arena_t *arena,
+                                                    uint64_t size) {
+  pg_arena_chunk_t *chunk = arena->current;
+  uint64_t start = chunk == NULL
+                       ? 0
+                       : pg_align_forward(chunk->offset, PG_DEFAULT_ALIGNEMENT);
+
+  if (chunk == NULL || start + size > chunk->cap) {
+    // Reuse the next chunk if it was kept around after a reset, otherwise
+    // insert a fresh one after the current one.
+    pg_arena_chunk_t *next = chunk == NULL ? arena->first : chunk->next;
+    if (next == NULL || next->cap < size) {
+      pg_arena_chunk_t *fresh =
+          pg_arena_chunk_make(MAX(arena->chunk_size, size));
+      if (fresh == NULL)
+        return NULL;
+
+      fresh->next = next;
+      if (chunk == NULL)
+        arena->first = fresh;
+      else
+        chunk->next = fresh;
+      next = fresh;
+    }
+    chunk = arena->current = next;
+    chunk->offset = start = 0;
+  }
+
+  pg_arena_chunk_zero(chunk, start, start + size);
+  chunk->offset = start + size;
+  arena->last_alloc = pg_arena_chunk_data(chunk) + start;
+  return arena->last_alloc;
+}
+
+__attribute__((unused)) static void *pg_arena_realloc(void *ctx,
+                                                      void *old_memory,
+                                                      uint64_t new_size,
+                                                      uint64_t old_size) {
+  pg_arena_t *arena = ctx;
+  assert(arena != NULL);
+
+  if (old_memory != NULL && old_memory == arena->last_alloc) {
+    pg_arena_chunk_t *chunk = arena->current;
+    const uint64_t start =
+        (uint64_t)((uint8_t *)old_memory - pg_arena_chunk_data(chunk));
+    if (start + new_size <= chunk->cap) { // Grow or shrink in place
+      pg_arena_chunk_zero(chunk, start + MIN(old_size, new_size),
+                          start + new_size);
+      chunk->offset = start + new_size;
+      return old_memory;
+    }
+  } else if (old_memory != NULL && new_size <= old_size) {
+    return old_memory;
+  }
+
+  void *res = pg_arena_alloc(arena, new_size);
+  if (res != NULL && old_memory != NULL)
+    memcpy(res, old_memory, MIN(old_size, new_size));
+  return res;
+}
+
+// Only the last allocation is actually given back, everything else is
+// reclaimed by `pg_arena_reset` or `pg_arena_scope_end`.
+__attribute__((unused)) static void pg_arena_free(void *ctx, void *memory) {
+  pg_arena_t *arena = ctx;
+  assert(arena != NULL);
+
+  if (memory == NULL || memory != arena->last_alloc)
+    return;
+
+  arena->current->offset =
+      (uint64_t)((uint8_t *)memory - pg_arena_chunk_data(arena->current));
+  arena->last_alloc = NULL;
+}
+
+__attribute__((unused)) static pg_allocator_t
+pg_arena_allocator(pg_arena_t *arena) {
+  return (pg_allocator_t){
+      .realloc = pg_arena_realloc, .free = pg_arena_free, .ctx = arena};
+}
+
+// O(1): chunks are kept to be reused by the next allocations.
+__attribute__((unused)) static void pg_arena_reset(pg_arena_t *arena) {
+  arena->current = arena->first;
+  if (arena->current != NULL)
+    arena->current->offset = 0;
+  arena->last_alloc = NULL;
+}
+
+__attribute__((unused)) static pg_arena_scope_t
+pg_arena_scope_begin(pg_arena_t *arena) {
+  return (pg_arena_scope_t){
+      .arena = arena,
+      .chunk = arena->current,
+      .offset = arena->current == NULL ? 0 : arena->current->offset,
+  };
+}
+
+// Release everything allocated since the matching `pg_arena_scope_begin`.
+// Scopes nest and must be ended in reverse order.
+__attribute__((unused)) static void pg_arena_scope_end(pg_arena_scope_t scope) {
+  pg_arena_t *arena = scope.arena;
+  if (scope.chunk == NULL) {
+    pg_arena_reset(arena);
+    return;
+  }
+
+  arena->current = scope.chunk;
+  arena->current->offset = scope.offset;
+  arena->last_alloc = NULL;
+}
+
+__attribute__((unused)) static uint64_t
+pg_arena_used(const pg_arena_t *arena) {
+  uint64_t res = 0;
+  for (pg_arena_chunk_t *chunk = arena->first; chunk != NULL;
+       chunk = chunk->next) {
+    res += chunk->offset;
+    if (chunk == arena->current)
+      break;
+  }
+  return res;
+}
+
+__attribute__((unused)) static void pg_arena_destroy(pg_arena_t *arena) {
+  const uint64_t header_size =
+      pg_align_forward(sizeof(pg_arena_chunk_t), PG_DEFAULT_ALIGNEMENT);
+
+  pg_arena_chunk_t *chunk = arena->first;
+  while (chunk != NULL) {
+    pg_arena_chunk_t *next = chunk->next;
+    munmap(chunk, header_size + chunk->cap);
+    chunk = next;
+  }
+  *arena = (pg_arena_t){0};
+}
+
+// -------------------------- Reserved memory
+
+// One block growing in place at the start of a range of address space
+// reserved up front: pages are only committed as it grows, so growing never
+// copies, never needs twice the memory, and the address stays the same.
+// Meant for a single huge array e.g.:
+//
+//   pg_vm_t vm = {0};
+//   pg_vm_init(&vm, 64 * Gi);
+//   pg_array_init(events, pg_vm_allocator(&vm));
+
+#ifndef PG_VM_COMMIT_GRANULARITY
+#define PG_VM_COMMIT_GRANULARITY (2 * Mi)
+#endif
+
+typedef struct {
+  uint8_t *base;
+  uint64_t reserved, committed;
+  uint64_t len;
+  uint64_t dirty; // Like for arena chunks.
+} pg_vm_t;
+
+// Address space only: no memory is used until committed.
+__attribute__((unused)) static void *pg_mmap_reserve(uint64_t size) {
+#if defined(MAP_NORESERVE)
+  const int flags = MAP_PRIVATE | MAP_NORESERVE;
+#else
+  const int flags = MAP_PRIVATE;
+#endif
+
+#ifdef PG_MAP_ANONYMOUS
+  void *ptr = mmap(NULL, size, PROT_NONE, flags | PG_MAP_ANONYMOUS, -1, 0);
+#else
+  const int fd = open("/dev/zero", O_RDWR);
+  if (fd == -1)
+    return NULL;
+  void *ptr = mmap(NULL, size, PROT_NONE, flags, fd, 0);
+  close(fd);
+#endif
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+__attribute__((unused)) static bool pg_vm_init(pg_vm_t *vm, uint64_t reserve) {
+  *vm = (pg_vm_t){
+      .reserved = pg_align_forward(reserve, PG_VM_COMMIT_GRANULARITY)};
+  vm->base = pg_mmap_reserve(vm->reserved);
+  return vm->base != NULL;
+}
+
+__attribute__((unused)) static bool pg_vm_commit(pg_vm_t *vm, uint64_t len) {
+  if (len <= vm->committed)
+    return true;
+  if (len > vm->reserved) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  const uint64_t committed =
+      MIN(pg_align_forward(len, PG_VM_COMMIT_GRANULARITY), vm->reserved);
+  if (mprotect(vm->base + vm->committed, committed - vm->committed,
+               PROT_READ | PROT_WRITE) == -1)
+    return false;
+
+  vm->committed = committed;
+  return true;
+}
+
+__attribute__((unused)) static void *pg_vm_realloc(void *ctx, void *old_memory,
+                                                   uint64_t new_size,
+                                                   uint64_t old_size) {
+  pg_vm_t *const vm = ctx;
+  // Only one block.
+  assert(old_memory == NULL ? vm->len == 0 : old_memory == vm->base);
+  (void)old_size;
+
+  if (!pg_vm_commit(vm, new_size))
+    return NULL;
+
+  // Zero what was used before and is handed out again.
+  const uint64_t start = old_memory == NULL ? 0 : MIN(vm->len, new_size);
+  if (start < vm->dirty)
+    memset(vm->base + start, 0, MIN(new_size, vm->dirty) - start);
+  vm->dirty = MAX(vm->dirty, new_size);
+  vm->len = new_size;
+  return vm->base;
+}
+
+// Pages stay committed for the next block.
+__attribute__((unused)) static void pg_vm_free(void *ctx, void *memory) {
+  pg_vm_t *const vm = ctx;
+  if (memory == NULL)
+    return;
+  assert(memory == vm->base);
+
+  vm->len = 0;
+}
+
+__attribute__((unused)) static pg_allocator_t pg_vm_allocator(pg_vm_t *vm) {
+  return (pg_allocator_t){
+      .realloc = pg_vm_realloc, .free = pg_vm_free, .ctx = vm};
+}
+
+__attribute__((unused)) static void pg_vm_destroy(pg_vm_t *vm) {
+  if (vm->base != NULL)
+    munmap(vm->base, vm->reserved);
+  *vm = (pg_vm_t){0};
 }
 
 // --------------------------- Array
@@ -206,11 +1081,9 @@ typedef struct pg_array_header_t {
   do {                                                                         \
     void **pg__array_ = (void **)&(x);                                         \
     pg_array_header_t *pg__ah =                                                \
-        (pg_array_header_t *)(my_allocator)                                    \
-            .realloc(NULL,                                                     \
-                     sizeof(pg_array_header_t) +                               \
-                         sizeof(*(x)) * ((uint64_t)cap),                       \
-                     0);                                                       \
+        (pg_array_header_t *)pg_alloc((my_allocator),                          \
+                                      sizeof(pg_array_header_t) +              \
+                                          sizeof(*(x)) * ((uint64_t)cap));     \
     pg__ah->len = 0;                                                           \
     pg__ah->capacity = (uint64_t)cap;                                          \
     pg__ah->allocator = my_allocator;                                          \
@@ -222,21 +1095,30 @@ typedef struct pg_array_header_t {
 #define pg_array_free(x)                                                       \
   do {                                                                         \
     pg_array_header_t *pg__ah = PG_ARRAY_HEADER(x);                            \
-    pg__ah->allocator.free(pg__ah);                                            \
+    pg_free(pg__ah->allocator, pg__ah);                                        \
     x = NULL;                                                                  \
   } while (0)
 
+// When the allocator has a hard limit (e.g. `pg_vm_t`), the growth formula
+// may overshoot it while what is needed still fits: retry with just that.
 #define pg_array_grow(x, min_capacity)                                         \
   do {                                                                         \
-    uint64_t new_capacity = PG_ARRAY_GROW_FORMULA(pg_array_capacity(x));       \
-    if (new_capacity < (min_capacity))                                         \
-      new_capacity = (min_capacity);                                           \
+    const uint64_t pg__needed =                                                \
+        MAX((uint64_t)(min_capacity), pg_array_capacity(x) + 1);               \
+    uint64_t new_capacity =                                                    \
+        MAX(PG_ARRAY_GROW_FORMULA(pg_array_capacity(x)), pg__needed);          \
     const uint64_t old_size =                                                  \
         sizeof(pg_array_header_t) + pg_array_capacity(x) * sizeof(*x);         \
-    const uint64_t new_size =                                                  \
-        sizeof(pg_array_header_t) + new_capacity * sizeof(*x);                 \
-    pg_array_header_t *pg__new_header = PG_ARRAY_HEADER(x)->allocator.realloc( \
-        PG_ARRAY_HEADER(x), new_size, old_size);                               \
+    pg_array_header_t *pg__new_header = pg_realloc(                            \
+        PG_ARRAY_HEADER(x)->allocator, PG_ARRAY_HEADER(x),                     \
+        sizeof(pg_array_header_t) + new_capacity * sizeof(*x), old_size);      \
+    if (pg__new_header == NULL && new_capacity > pg__needed) {                 \
+      new_capacity = pg__needed;                                               \
+      pg__new_header = pg_realloc(                                             \
+          PG_ARRAY_HEADER(x)->allocator, PG_ARRAY_HEADER(x),                   \
+          sizeof(pg_array_header_t) + new_capacity * sizeof(*x), old_size);    \
+    }                                                                          \
+    assert(pg__new_header != NULL);                                            \
     pg__new_header->capacity = new_capacity;                                   \
     x = (void *)(pg__new_header + 1);                                          \
   } while (0)
@@ -265,6 +1147,28 @@ typedef struct pg_array_header_t {
     PG_ARRAY_HEADER(x)->len = (uint64_t)(new_count);                           \
   } while (0)
 
+// Grow at most once so that `count` more items fit.
+#define pg_array_reserve_more(x, count)                                        \
+  do {                                                                         \
+    if (pg_array_available_space(x) < (uint64_t)(count))                       \
+      pg_array_grow(x, pg_array_len(x) + (uint64_t)(count));                   \
+  } while (0)
+
+// Add `count` items to fill in at `x + pg_array_len(x) - count`. They are
+// zero only if the memory was never used before.
+#define pg_array_append_uninitialized(x, count)                                \
+  do {                                                                         \
+    pg_array_reserve_more(x, count);                                           \
+    PG_ARRAY_HEADER(x)->len += (uint64_t)(count);                              \
+  } while (0)
+
+#define pg_array_append_many(x, items, count)                                  \
+  do {                                                                         \
+    pg_array_reserve_more(x, count);                                           \
+    memcpy((x) + pg_array_len(x), (items), (uint64_t)(count) * sizeof(*(x)));  \
+    PG_ARRAY_HEADER(x)->len += (uint64_t)(count);                              \
+  } while (0)
+
 __attribute__((unused)) static char const *pg_char_last_occurence(char const *s,
                                                                   char c) {
   char const *result = NULL;
@@ -343,7 +1247,7 @@ __attribute__((unused)) static void pg__set_string_capacity(pg_string_t str,
 __attribute__((unused)) static pg_string_t
 pg_string_make_reserve(pg_allocator_t a, uint64_t capacity) {
   uint64_t header_size = sizeof(pg_string_header_t);
-  void *ptr = a.realloc(NULL, header_size + capacity + 1, 0);
+  void *ptr = pg_alloc(a, header_size + capacity + 1);
 
   pg_string_t str;
   pg_string_header_t *header;
@@ -366,7 +1270,7 @@ __attribute__((unused)) static pg_string_t
 pg_string_make_length(pg_allocator_t a, void const *init_str,
                       uint64_t num_bytes) {
   uint64_t header_size = sizeof(pg_string_header_t);
-  void *ptr = a.realloc(NULL, header_size + num_bytes + 1, 0);
+  void *ptr = pg_alloc(a, header_size + num_bytes + 1);
 
   pg_string_t str;
   pg_string_header_t *header;
@@ -398,7 +1302,7 @@ __attribute__((unused)) static pg_string_t pg_string_make(pg_allocator_t a,
 __attribute__((unused)) static void pg_string_free(pg_string_t str) {
   if (str) {
     pg_string_header_t *header = PG_STRING_HEADER(str);
-    header->allocator.free(header);
+    pg_free(header->allocator, header);
   }
 }
 
@@ -471,7 +1375,7 @@ pg_string_make_space_for(pg_string_t str, uint64_t add_len) {
     old_size = sizeof(pg_string_header_t) + pg_string_len(str) + 1;
     new_size = sizeof(pg_string_header_t) + new_len + 1;
 
-    new_ptr = PG_STRING_HEADER(str)->allocator.realloc(ptr, new_size, old_size);
+    new_ptr = pg_realloc(a, ptr, new_size, old_size);
     if (new_ptr == NULL)
       return NULL;
 
@@ -549,7 +1453,7 @@ __attribute__((unused)) static pg_string_t pg_string_trim(pg_string_t str,
 
 // ---------------- Hashtable
 
-// FNV-1a
+// FNV-1a, one byte at a time: prefer `pg_hash_bytes`.
 __attribute__((unused)) static uint32_t pg_hash(uint8_t *n, uint64_t len) {
   uint32_t hash = 2166136261u;
   for (uint64_t i = 0; i < len; i++) {
@@ -558,6 +1462,356 @@ __attribute__((unused)) static uint32_t pg_hash(uint8_t *n, uint64_t len) {
   }
   return hash;
 }
+
+// 64-bit hash of bytes, reading 8 bytes at a time through three independent
+// lanes for long inputs (wyhash). Much faster than `pg_hash` past a few
+// bytes, and with better distribution.
+#define PG_HASH_P0 0xa0761d6478bd642fULL
+#define PG_HASH_P1 0xe7037ed1a0b428dbULL
+#define PG_HASH_P2 0x8ebc6af09c88c6e3ULL
+#define PG_HASH_P3 0x589965cc75374cc3ULL
+
+// Full 64x64->128 multiplication, folded.
+__attribute__((unused)) static uint64_t pg_hash_mix(uint64_t a, uint64_t b) {
+  const __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+__attribute__((unused)) static uint64_t pg_hash_read64(const uint8_t *p) {
+  uint64_t v = 0;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+__attribute__((unused)) static uint64_t pg_hash_read32(const uint8_t *p) {
+  uint32_t v = 0;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// With a secret seed, e.g. from `pg_hash_random_seed`, inputs colliding on
+// purpose cannot be crafted without knowing it.
+__attribute__((unused)) static uint64_t
+pg_hash_bytes_seeded(const void *data, uint64_t len, uint64_t seed) {
+  const uint8_t *p = data;
+  seed ^= pg_hash_mix(seed ^ PG_HASH_P0, PG_HASH_P1);
+
+  uint64_t a = 0, b = 0;
+  if (len <= 16) {
+    if (len >= 4) {
+      // Overlapping reads cover 4 to 16 bytes without branching on the length.
+      const uint64_t mid = (len >> 3) << 2;
+      a = (pg_hash_read32(p) << 32) | pg_hash_read32(p + mid);
+      b = (pg_hash_read32(p + len - 4) << 32) |
+          pg_hash_read32(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+    }
+  } else {
+    uint64_t remaining = len;
+    if (remaining > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = pg_hash_mix(pg_hash_read64(p) ^ PG_HASH_P1,
+                           pg_hash_read64(p + 8) ^ seed);
+        seed1 = pg_hash_mix(pg_hash_read64(p + 16) ^ PG_HASH_P2,
+                            pg_hash_read64(p + 24) ^ seed1);
+        seed2 = pg_hash_mix(pg_hash_read64(p + 32) ^ PG_HASH_P3,
+                            pg_hash_read64(p + 40) ^ seed2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (remaining > 16) {
+      seed = pg_hash_mix(pg_hash_read64(p) ^ PG_HASH_P1,
+                         pg_hash_read64(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+    // The last 16 bytes, overlapping what was already hashed if need be.
+    a = pg_hash_read64(p + remaining - 16);
+    b = pg_hash_read64(p + remaining - 8);
+  }
+
+  const __uint128_t r = (__uint128_t)(a ^ PG_HASH_P1) * (b ^ seed);
+  return pg_hash_mix((uint64_t)r ^ PG_HASH_P0 ^ len,
+                     (uint64_t)(r >> 64) ^ PG_HASH_P1);
+}
+
+__attribute__((unused)) static uint64_t pg_hash_bytes(const void *data,
+                                                      uint64_t len) {
+  return pg_hash_bytes_seeded(data, len, 0);
+}
+
+// For hash tables filled from untrusted input.
+__attribute__((unused)) static uint64_t pg_hash_random_seed(void) {
+  uint64_t seed = 0;
+  const int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    const ssize_t ret = read(fd, &seed, sizeof(seed));
+    close(fd);
+    if (ret == (ssize_t)sizeof(seed))
+      return seed;
+  }
+
+  // Still different per process and run.
+  struct timespec ts = {0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return pg_hash_mix((uint64_t)ts.tv_nsec ^ PG_HASH_P2,
+                     (uint64_t)getpid() ^ (uintptr_t)&seed);
+}
+// ---------------- Hashmap
+
+// Typed open-addressing hash map, generated with `PG_HASHMAP_DEFINE`.
+//
+// Each slot has a control byte: `PG_HASHMAP_CTRL_EMPTY`, or 0x80 | the top 7
+// bits of the hash. Slots are probed linearly, a whole group of control bytes
+// at a time (Swiss table style): the group is compared against the hash in
+// one go and the probe stops at the first group with an empty slot.
+// The control bytes of the first group are mirrored after the last slot so
+// that a group can be loaded at any position without wrapping around.
+// Deletion shifts the following entries back instead of leaving a tombstone,
+// so lookups never have to skip over deleted slots.
+// The capacity is a power of two and all entries are rehashed on growth.
+
+#define PG_HASHMAP_GROUP_WIDTH 16
+#define PG_HASHMAP_CTRL_EMPTY 0
+
+// Max load factor: 3/4.
+#define PG_HASHMAP_NEEDS_GROW(len, cap) (((len) + 1) * 4 > (cap) * 3)
+
+// Bit `i` of the result is set if `ctrl[i] == c`.
+__attribute__((unused)) static uint32_t
+pg_hashmap_group_match(const uint8_t *ctrl, uint8_t c) {
+#if defined(__SSE2__)
+  const __m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < PG_HASHMAP_GROUP_WIDTH; i++)
+    mask |= (uint32_t)(ctrl[i] == c) << i;
+  return mask;
+#endif
+}
+
+__attribute__((unused)) static uint8_t pg_hashmap_h2(uint64_t hash) {
+  return (uint8_t)(0x80 | (hash >> 57));
+}
+
+__attribute__((unused)) static void
+pg_hashmap_set_ctrl(uint8_t *ctrl, uint64_t cap, uint64_t i, uint8_t c) {
+  ctrl[i] = c;
+  if (i < PG_HASHMAP_GROUP_WIDTH)
+    ctrl[cap + i] = c;
+}
+
+// Smallest power of two capacity holding `count` entries under the max load
+// factor.
+__attribute__((unused)) static uint64_t pg_hashmap_cap_for(uint64_t count) {
+  uint64_t cap = PG_HASHMAP_GROUP_WIDTH;
+  while (PG_HASHMAP_NEEDS_GROW(count, cap))
+    cap *= 2;
+  return cap;
+}
+
+// murmur3 finalizer.
+__attribute__((unused)) static uint64_t pg_hash_u64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+__attribute__((unused)) static bool pg_eq_u64(uint64_t a, uint64_t b) {
+  return a == b;
+}
+
+// Defines `name##_t` mapping `key_type` to `value_type`.
+// `hash_fn(key_type) -> uint64_t` and `eq_fn(key_type, key_type) -> bool`
+// can be functions or macros.
+#define PG_HASHMAP_DEFINE(name, key_type, value_type, hash_fn, eq_fn)          \
+  typedef struct {                                                             \
+    key_type key;                                                              \
+    value_type value;                                                          \
+  } name##_slot_t;                                                             \
+                                                                               \
+  typedef struct {                                                             \
+    uint8_t *ctrl;                                                             \
+    name##_slot_t *slots;                                                      \
+    uint64_t len, cap;                                                         \
+    pg_allocator_t allocator;                                                  \
+  } name##_t;                                                                  \
+                                                                               \
+  __attribute__((unused)) static void name##_alloc_table(name##_t *map,        \
+                                                         uint64_t cap) {       \
+    assert(pg_is_power_of_two(cap));                                           \
+    assert(cap >= PG_HASHMAP_GROUP_WIDTH);                                     \
+                                                                               \
+    map->cap = cap;                                                            \
+    /* Zeroed: all empty. */                                                   \
+    map->ctrl = pg_alloc(map->allocator, cap + PG_HASHMAP_GROUP_WIDTH);        \
+    map->slots = pg_alloc(map->allocator, cap * sizeof(name##_slot_t));        \
+  }                                                                            \
+                                                                               \
+  /* `count`: expected number of entries. */                                   \
+  __attribute__((unused)) static void name##_init(                             \
+      name##_t *map, uint64_t count, pg_allocator_t allocator) {               \
+    *map = (name##_t){.allocator = allocator};                                 \
+    name##_alloc_table(map, pg_hashmap_cap_for(count));                        \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static void name##_destroy(name##_t *map) {          \
+    pg_free(map->allocator, map->ctrl);                                        \
+    pg_free(map->allocator, map->slots);                                       \
+    *map = (name##_t){0};                                                      \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static void name##_clear(name##_t *map) {            \
+    memset(map->ctrl, PG_HASHMAP_CTRL_EMPTY,                                   \
+           map->cap + PG_HASHMAP_GROUP_WIDTH);                                 \
+    map->len = 0;                                                              \
+  }                                                                            \
+                                                                               \
+  /* On success, `index` is the slot of `key`, otherwise the first empty slot  \
+   * of the probe sequence. */                                                 \
+  __attribute__((unused)) static bool name##_find_index(                       \
+      const name##_t *map, key_type key, uint64_t hash, uint64_t *index) {     \
+    assert(map->cap > 0);                                                      \
+                                                                               \
+    const uint64_t mask = map->cap - 1;                                        \
+    const uint8_t h2 = pg_hashmap_h2(hash);                                    \
+    uint64_t pos = hash & mask;                                                \
+                                                                               \
+    for (;;) {                                                                 \
+      const uint8_t *group = map->ctrl + pos;                                  \
+      const uint32_t empty =                                                   \
+          pg_hashmap_group_match(group, PG_HASHMAP_CTRL_EMPTY);                \
+      uint32_t match = pg_hashmap_group_match(group, h2);                      \
+      /* Slots past the first empty one are not part of the probe sequence. */ \
+      if (empty != 0)                                                          \
+        match &= (1U << __builtin_ctz(empty)) - 1;                             \
+                                                                               \
+      while (match != 0) {                                                     \
+        const uint64_t i = (pos + (uint64_t)__builtin_ctz(match)) & mask;      \
+        if (eq_fn(map->slots[i].key, key)) {                                   \
+          *index = i;                                                          \
+          return true;                                                         \
+        }                                                                      \
+        match &= match - 1;                                                    \
+      }                                                                        \
+                                                                               \
+      if (empty != 0) {                                                        \
+        *index = (pos + (uint64_t)__builtin_ctz(empty)) & mask;                \
+        return false;                                                          \
+      }                                                                        \
+      pos = (pos + PG_HASHMAP_GROUP_WIDTH) & mask;                             \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static value_type *name##_find(const name##_t *map,  \
+                                                          key_type key) {      \
+    uint64_t i = 0;                                                            \
+    if (!name##_find_index(map, key, hash_fn(key), &i))                        \
+      return NULL;                                                             \
+    return &map->slots[i].value;                                               \
+  }                                                                            \
+                                                                               \
+  /* Insert a key known to be absent, without growing. */                      \
+  __attribute__((unused)) static void name##_insert_unique(                    \
+      name##_t *map, uint64_t hash, name##_slot_t slot) {                      \
+    uint64_t i = 0;                                                            \
+    name##_find_index(map, slot.key, hash, &i);                                \
+    assert(map->ctrl[i] == PG_HASHMAP_CTRL_EMPTY);                             \
+                                                                               \
+    pg_hashmap_set_ctrl(map->ctrl, map->cap, i, pg_hashmap_h2(hash));          \
+    map->slots[i] = slot;                                                      \
+    map->len += 1;                                                             \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static void name##_grow(name##_t *map) {             \
+    name##_t old = *map;                                                       \
+    name##_alloc_table(map, old.cap * 2);                                      \
+    map->len = 0;                                                              \
+                                                                               \
+    for (uint64_t i = 0; i < old.cap; i++) {                                   \
+      if (old.ctrl[i] == PG_HASHMAP_CTRL_EMPTY)                                \
+        continue;                                                              \
+      name##_insert_unique(map, hash_fn(old.slots[i].key), old.slots[i]);      \
+    }                                                                          \
+    assert(map->len == old.len);                                               \
+                                                                               \
+    pg_free(old.allocator, old.ctrl);                                          \
+    pg_free(old.allocator, old.slots);                                         \
+  }                                                                            \
+                                                                               \
+  /* Returns true if the key was inserted, false if it was updated. */         \
+  __attribute__((unused)) static bool name##_upsert(                           \
+      name##_t *map, key_type key, value_type value) {                         \
+    const uint64_t hash = hash_fn(key);                                        \
+    uint64_t i = 0;                                                            \
+    if (name##_find_index(map, key, hash, &i)) {                               \
+      map->slots[i].value = value;                                             \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    if (PG_HASHMAP_NEEDS_GROW(map->len, map->cap)) {                           \
+      name##_grow(map);                                                        \
+      name##_find_index(map, key, hash, &i);                                   \
+    }                                                                          \
+    assert(map->ctrl[i] == PG_HASHMAP_CTRL_EMPTY);                             \
+                                                                               \
+    pg_hashmap_set_ctrl(map->ctrl, map->cap, i, pg_hashmap_h2(hash));          \
+    map->slots[i].key = key;                                                   \
+    map->slots[i].value = value;                                               \
+    map->len += 1;                                                             \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static bool name##_remove(name##_t *map,             \
+                                                    key_type key) {            \
+    uint64_t i = 0;                                                            \
+    if (!name##_find_index(map, key, hash_fn(key), &i))                        \
+      return false;                                                            \
+                                                                               \
+    /* Backward shift: move back each following entry of the cluster which     \
+     * is allowed to occupy the hole, i.e. whose home is not in (hole, j]. */  \
+    const uint64_t mask = map->cap - 1;                                        \
+    uint64_t j = i;                                                            \
+    for (;;) {                                                                 \
+      j = (j + 1) & mask;                                                      \
+      if (map->ctrl[j] == PG_HASHMAP_CTRL_EMPTY)                               \
+        break;                                                                 \
+                                                                               \
+      const uint64_t home = hash_fn(map->slots[j].key) & mask;                 \
+      if (((j - home) & mask) < ((j - i) & mask))                              \
+        continue;                                                              \
+                                                                               \
+      map->slots[i] = map->slots[j];                                           \
+      pg_hashmap_set_ctrl(map->ctrl, map->cap, i, map->ctrl[j]);               \
+      i = j;                                                                   \
+    }                                                                          \
+    pg_hashmap_set_ctrl(map->ctrl, map->cap, i, PG_HASHMAP_CTRL_EMPTY);        \
+    map->len -= 1;                                                             \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  /* Iterate over the entries, starting with `*it = 0`. */                     \
+  __attribute__((unused)) static bool name##_next(                             \
+      const name##_t *map, uint64_t *it, name##_slot_t **slot) {               \
+    for (; *it < map->cap; *it += 1) {                                         \
+      if (map->ctrl[*it] != PG_HASHMAP_CTRL_EMPTY) {                           \
+        *slot = &map->slots[*it];                                              \
+        *it += 1;                                                              \
+        return true;                                                           \
+      }                                                                        \
+    }                                                                          \
+    return false;                                                              \
+  }
+
 // ------------------ Span
 
 __attribute__((unused)) static char pg_span_peek_left(pg_span_t span,
@@ -613,6 +1867,20 @@ __attribute__((unused)) static void pg_span_consume_right(pg_span_t *span,
   span->len -= n;
 }
 
+__attribute__((unused)) static void pg_span_split_at(pg_span_t span,
+                                                     const char *at,
+                                                     pg_span_t *left,
+                                                     pg_span_t *right) {
+  assert(at >= span.data);
+  assert(at < span.data + span.len);
+
+  const uint64_t i = (uint64_t)(at - span.data);
+  left->data = span.data;
+  left->len = i;
+  right->data = span.data + i;
+  right->len = span.len - i;
+}
+
 __attribute__((unused)) static bool pg_span_split_at_first(pg_span_t span,
                                                            char needle,
                                                            pg_span_t *left,
@@ -620,20 +1888,33 @@ __attribute__((unused)) static bool pg_span_split_at_first(pg_span_t span,
   *left = (pg_span_t){0};
   *right = (pg_span_t){0};
 
-  for (uint64_t i = 0; i < span.len; i++) {
-    if (span.data[i] == needle) {
-      left->data = span.data;
-      left->len = i;
-      right->data = span.data + i;
-      right->len = span.len - i;
-      assert(right->data[0] == needle);
+  const char *at = span.len > 0 ? memchr(span.data, needle, span.len) : NULL;
+  if (at == NULL) {
+    *left = span;
+    return false;
+  }
 
-      return true;
-    }
+  pg_span_split_at(span, at, left, right);
+  assert(right->data[0] == needle);
+  return true;
+}
+
+// Split at the first byte which is any of `needles`.
+__attribute__((unused)) static bool
+pg_span_split_at_first_any(pg_span_t span, pg_span_t needles, pg_span_t *left,
+                           pg_span_t *right) {
+  *left = (pg_span_t){0};
+  *right = (pg_span_t){0};
+
+  const char *at = pg_memchr_any(span.data, span.len, (uint8_t *)needles.data,
+                                 needles.len);
+  if (at == NULL) {
+    *left = span;
+    return false;
   }
 
-  *left = span;
-  return false;
+  pg_span_split_at(span, at, left, right);
+  return true;
 }
 
 __attribute__((unused)) static bool pg_span_split_at_last(pg_span_t span,
@@ -642,20 +1923,16 @@ __attribute__((unused)) static bool pg_span_split_at_last(pg_span_t span,
                                                           pg_span_t *right) {
   *left = (pg_span_t){0};
   *right = (pg_span_t){0};
-  for (int64_t i = (int64_t)(span.len - 1); i >= 0; i--) {
-    if (span.data[i] == needle) {
-      left->data = span.data;
-      left->len = (uint64_t)i;
 
-      right->data = &span.data[i];
-      right->len = span.len - (uint64_t)i;
-      assert(right->data[0] == needle);
-
-      return true;
-    }
+  const char *at = pg_memrchr(span.data, span.len, (uint8_t)needle);
+  if (at == NULL) {
+    *left = span;
+    return false;
   }
-  *left = span;
-  return false;
+
+  pg_span_split_at(span, at, left, right);
+  assert(right->data[0] == needle);
+  return true;
 }
 
 __attribute__((unused)) static bool
@@ -715,22 +1992,139 @@ __attribute__((unused)) static bool pg_span_ends_with(pg_span_t haystack,
                                                       pg_span_t needle) {
   if (needle.len > haystack.len)
     return false;
-  return pg_memmem(haystack.data + haystack.len - needle.len, needle.len,
-                   needle.data, needle.len) != NULL;
+  return pg_mem_eq(haystack.data + haystack.len - needle.len, needle.data,
+                   needle.len);
+}
+
+// RFC 3986 unreserved characters, which URL encoding leaves as is: one bit
+// per byte value.
+__attribute__((unused)) static const uint64_t pg_url_unreserved[4] = {
+    0x03ff600000000000ULL, // '-', '.', '0'..'9'
+    0x47fffffe87fffffeULL, // 'A'..'Z', '_', 'a'..'z', '~'
+    0,
+    0,
+};
+
+__attribute__((unused)) static bool pg_url_is_unreserved(uint8_t c) {
+  return (pg_url_unreserved[c >> 6] >> (c & 63)) & 1;
+}
+
+#ifdef PG_SIMD_WIDTH
+// Bytes in `lo..hi`. Those above 0x7f are negative and never are.
+__attribute__((unused)) static pg_simd_t pg__simd_in_range(pg_simd_t block,
+                                                           char lo, char hi) {
+  return pg_simd_and(pg_simd_gt(block, pg_simd_splat(lo - 1)),
+                     pg_simd_gt(pg_simd_splat(hi + 1), block));
+}
+#endif
+
+// Percent-encode all but unreserved characters into `dst`, which has room
+// for `3 * len` bytes. Returns the encoded length. Blocks of unreserved
+// characters are copied as is; the others are classified a block at a time
+// too, and only encoded one by one.
+__attribute__((unused)) static uint64_t pg_url_encode(char *dst,
+                                                      const void *src,
+                                                      uint64_t len) {
+  static const char hex[] = "0123456789ABCDEF";
+  const uint8_t *const s = src;
+  uint64_t i = 0, written = 0;
+
+#ifdef PG_SIMD_WIDTH
+  for (; i + PG_SIMD_WIDTH <= len; i += PG_SIMD_WIDTH) {
+    const pg_simd_t block = pg_simd_load(s + i);
+    const pg_simd_t unreserved = pg_simd_or(
+        pg_simd_or(pg__simd_in_range(block, '0', '9'),
+                   // 'A'..'Z' and only them end up in 'a'..'z'.
+                   pg__simd_in_range(pg_simd_or(block, pg_simd_splat(0x20)),
+                                     'a', 'z')),
+        pg_simd_or(pg_simd_or(pg_simd_eq(block, pg_simd_splat('-')),
+                              pg_simd_eq(block, pg_simd_splat('.'))),
+                   pg_simd_or(pg_simd_eq(block, pg_simd_splat('_')),
+                              pg_simd_eq(block, pg_simd_splat('~')))));
+    const uint32_t mask = pg_simd_mask(unreserved);
+
+    if (mask == PG_SIMD_MASK_ALL) {
+      pg_simd_store(dst + written, block);
+      written += PG_SIMD_WIDTH;
+      continue;
+    }
+
+    for (uint64_t j = 0; j < PG_SIMD_WIDTH; j++) {
+      const uint8_t c = s[i + j];
+      if ((mask >> j) & 1) {
+        dst[written++] = (char)c;
+      } else {
+        dst[written] = '%';
+        dst[written + 1] = hex[c >> 4];
+        dst[written + 2] = hex[c & 0xf];
+        written += 3;
+      }
+    }
+  }
+#endif
+
+  for (; i < len; i++) {
+    const uint8_t c = s[i];
+    if (pg_url_is_unreserved(c)) {
+      dst[written++] = (char)c;
+    } else {
+      dst[written] = '%';
+      dst[written + 1] = hex[c >> 4];
+      dst[written + 2] = hex[c & 0xf];
+      written += 3;
+    }
+  }
+  return written;
 }
 
 __attribute__((unused)) static pg_string_t
 pg_span_url_encode(pg_allocator_t allocator, pg_span_t src) {
   pg_string_t res = pg_string_make_reserve(allocator, 3 * src.len);
+  const uint64_t len = pg_url_encode(res, src.data, src.len);
+  pg__set_string_len(res, len);
+  res[len] = 0;
+  return res;
+}
+
+// Decode `%XX` escapes in place, shrinking `span`. Runs without escapes are
+// found with `memchr` and moved at once. '+' is left as is: it only means a
+// space in form data. Returns false on a malformed escape.
+__attribute__((unused)) static bool pg_span_url_decode(pg_span_t *span) {
+  char *const data = span->data;
+  uint64_t read = 0, written = 0;
+
+  while (read < span->len) {
+    const char *const percent = memchr(data + read, '%', span->len - read);
+    const uint64_t run =
+        (percent == NULL ? span->len : (uint64_t)(percent - data)) - read;
+    if (written != read)
+      memmove(data + written, data + read, run);
+    written += run;
+    read += run;
+    if (percent == NULL)
+      break;
 
-  for (uint64_t i = 0; i < src.len; i++) {
-    char buf[4] = {0};
-    const uint64_t len =
-        (uint64_t)(snprintf(buf, sizeof(buf), "%%%02X", (uint8_t)src.data[i]));
-    res = pg_string_append_length(res, buf, len);
+    if (read + 2 >= span->len)
+      return false;
+    uint8_t c = 0;
+    for (uint64_t i = 1; i <= 2; i++) {
+      const uint8_t h = (uint8_t)data[read + i];
+      uint8_t n = (uint8_t)(h - '0');
+      if (n > 9) {
+        // Checked before adding 10, which would wrap '@' and '`' back to 9
+        const uint8_t letter = (uint8_t)((h | 0x20) - 'a');
+        if (letter > 5)
+          return false;
+        n = (uint8_t)(letter + 10);
+      }
+      c = (uint8_t)((c << 4) | n);
+    }
+    data[written++] = (char)c;
+    read += 3;
   }
 
-  return res;
+  span->len = written;
+  return true;
 }
 
 __attribute__((unused)) static pg_span_t pg_span_make(pg_string_t s) {
@@ -745,11 +2139,16 @@ __attribute__((unused)) static bool pg_span_starts_with(pg_span_t haystack,
                                                         pg_span_t needle) {
   if (needle.len > haystack.len)
     return false;
-  return pg_memmem(haystack.data, needle.len, needle.data, needle.len) != NULL;
+  return pg_mem_eq(haystack.data, needle.data, needle.len);
 }
 
 __attribute__((unused)) static bool pg_span_eq(pg_span_t a, pg_span_t b) {
-  return a.len == b.len && memcmp(a.data, b.data, a.len) == 0;
+  return a.len == b.len && pg_mem_eq(a.data, b.data, a.len);
+}
+
+// To key a `PG_HASHMAP_DEFINE` map by span, with `pg_span_eq`.
+__attribute__((unused)) static uint64_t pg_hash_span(pg_span_t span) {
+  return pg_hash_bytes(span.data, span.len);
 }
 
 __attribute__((unused)) static bool pg_span_ieq(pg_span_t a, pg_span_t b) {
@@ -765,11 +2164,107 @@ __attribute__((unused)) static bool pg_span_ieq(pg_span_t a, pg_span_t b) {
   return true;
 }
 
+// The digits are parsed 8 at a time (SWAR), the first one being the most
+// significant: a chunk is validated and converted with a few 64 bits
+// operations instead of a branch and a multiplication per digit. When the
+// length is not a multiple of 8, the first chunk is padded on the left with
+// '0'. Like digit by digit parsing, values too big wrap around.
+
+__attribute__((unused)) static bool pg__parse_8_decimal(uint64_t chunk,
+                                                        uint64_t *res) {
+  // Each byte is in '0'..'9': its high nibble is 3, and still is after
+  // adding 6 to it.
+  if (((chunk & 0xf0f0f0f0f0f0f0f0ULL) |
+       (((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) !=
+      0x3333333333333333ULL)
+    return false;
+
+  // Combine pairs of digits, then pairs of pairs, then of quadruples.
+  chunk -= 0x3030303030303030ULL;
+  chunk = (chunk * 10) + (chunk >> 8);
+  chunk = (((chunk & 0x000000ff000000ffULL) * (100 + (1000000ULL << 32))) +
+           (((chunk >> 16) & 0x000000ff000000ffULL) * (1 + (10000ULL << 32)))) >>
+          32;
+  *res = *res * 100000000 + chunk;
+  return true;
+}
+
+__attribute__((unused)) static bool pg__parse_8_hex(uint64_t chunk,
+                                                    uint64_t *res) {
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  if ((chunk & highs) != 0)
+    return false;
+
+  // With all bytes below 0x80, `byte + 0x80 - lo` has its high bit set iff
+  // `byte >= lo`, without carrying into the next byte.
+  const uint64_t lower = chunk | (0x20 * ones);
+  const uint64_t digits = (chunk + (0x80 - '0') * ones) &
+                          ~(chunk + (0x7f - '9') * ones) & highs;
+  const uint64_t letters = (lower + (0x80 - 'a') * ones) &
+                           ~(lower + (0x7f - 'f') * ones) & highs;
+  if ((digits | letters) != highs)
+    return false;
+
+  // '0' is 0x30, 'a' and 'A' are 0x?1.
+  uint64_t nibbles = (chunk & (0x0f * ones)) + (letters >> 7) * 9;
+  nibbles = __builtin_bswap64(nibbles);
+  nibbles = (nibbles | (nibbles >> 4)) & 0x00ff00ff00ff00ffULL;
+  nibbles = (nibbles | (nibbles >> 8)) & 0x0000ffff0000ffffULL;
+  nibbles = (nibbles | (nibbles >> 16)) & 0x00000000ffffffffULL;
+  *res = (*res << 32) | nibbles;
+  return true;
+}
+
+// Only digits, no sign or prefix.
+__attribute__((unused)) static uint64_t
+pg__span_parse_digits(pg_span_t span, bool hex, bool *valid) {
+  uint64_t res = 0;
+  *valid = false;
+
+  // Short numbers (sizes, offsets) are not worth a chunk.
+  if (span.len < 8) {
+    for (uint64_t i = 0; i < span.len; i++) {
+      const uint8_t c = (uint8_t)span.data[i];
+      uint64_t n = (uint8_t)(c - '0');
+      if (n > 9 && hex)
+        n = (uint8_t)((c | 0x20) - 'a') + 10ULL;
+      if (n > (hex ? 15 : 9))
+        return 0;
+      res = (hex ? res << 4 : res * 10) + n;
+    }
+    *valid = true;
+    return res;
+  }
+
+  // The bytes before the first full chunk are shifted in, after '0's.
+  uint64_t i = span.len % 8;
+  uint64_t chunk = 0;
+  memcpy(&chunk, span.data, 8);
+  if (i == 0)
+    i = 8;
+  else
+    chunk = (chunk << (8 * (8 - i))) | (0x3030303030303030ULL >> (8 * i));
+
+  for (;;) {
+    if (!(hex ? pg__parse_8_hex(chunk, &res)
+              : pg__parse_8_decimal(chunk, &res)))
+      return 0;
+    if (i == span.len)
+      break;
+
+    memcpy(&chunk, span.data + i, 8);
+    i += 8;
+  }
+
+  *valid = true;
+  return res;
+}
+
 __attribute__((unused)) static int64_t pg_span_parse_i64_hex(pg_span_t span,
                                                              bool *valid) {
   pg_span_trim(&span);
 
-  uint64_t res = 0;
   int64_t sign = 1;
   if (pg_span_peek_left(span, NULL) == '-') {
     sign = -1;
@@ -781,46 +2276,13 @@ __attribute__((unused)) static int64_t pg_span_parse_i64_hex(pg_span_t span,
   if (pg_span_starts_with(span, pg_span_make_c("0x")))
     pg_span_consume_left(&span, 2);
 
-  for (uint64_t i = 0; i < span.len; i++) {
-    if (!pg_char_is_alphanumeric(span.data[i])) {
-      *valid = false;
-      return 0;
-    }
-
-    res *= 16;
-    uint64_t n = 0;
-    char c = pg_char_to_lower(span.data[i]);
-
-    if (c == 'a')
-      n = 10;
-    else if (c == 'b')
-      n = 11;
-    else if (c == 'c')
-      n = 12;
-    else if (c == 'd')
-      n = 13;
-    else if (c == 'e')
-      n = 14;
-    else if (c == 'f')
-      n = 15;
-    else if (pg_char_is_digit(c))
-      n = ((uint8_t)c) - '0';
-    else {
-      *valid = false;
-      return 0;
-    }
-    res += n;
-  }
-
-  *valid = true;
-  return sign * (int64_t)res;
+  return sign * (int64_t)pg__span_parse_digits(span, true, valid);
 }
 
 __attribute__((unused)) static uint64_t pg_span_parse_u64_hex(pg_span_t span,
                                                               bool *valid) {
   pg_span_trim(&span);
 
-  uint64_t res = 0;
   if (pg_span_peek_left(span, NULL) == '-') {
     *valid = false;
     return 0;
@@ -831,48 +2293,14 @@ __attribute__((unused)) static uint64_t pg_span_parse_u64_hex(pg_span_t span,
   if (pg_span_starts_with(span, pg_span_make_c("0x")))
     pg_span_consume_left(&span, 2);
 
-  for (uint64_t i = 0; i < span.len; i++) {
-    if (!pg_char_is_alphanumeric(span.data[i])) {
-      *valid = false;
-      return 0;
-    }
-
-    res *= 16;
-    uint64_t n = 0;
-    char c = pg_char_to_lower(span.data[i]);
-
-    if (c == 'a')
-      n = 10;
-    else if (c == 'b')
-      n = 11;
-    else if (c == 'c')
-      n = 12;
-    else if (c == 'd')
-      n = 13;
-    else if (c == 'e')
-      n = 14;
-    else if (c == 'f')
-      n = 15;
-    else if (pg_char_is_digit(c))
-      n = ((uint8_t)c) - '0';
-    else {
-      *valid = false;
-      return 0;
-    }
-    res += n;
-  }
-
-  *valid = true;
-  return res;
+  return pg__span_parse_digits(span, true, valid);
 }
 
 __attribute__((unused)) static int64_t pg_span_parse_i64_decimal(pg_span_t span,
                                                                  bool *valid) {
   pg_span_trim(&span);
 
-  int64_t res = 0;
   int64_t sign = 1;
-
   if (pg_span_peek_left(span, NULL) == '-') {
     sign = -1;
     pg_span_consume_left(&span, 1);
@@ -880,25 +2308,13 @@ __attribute__((unused)) static int64_t pg_span_parse_i64_decimal(pg_span_t span,
     pg_span_consume_left(&span, 1);
   }
 
-  for (uint64_t i = 0; i < span.len; i++) {
-    if (!pg_char_is_digit(span.data[i])) {
-      *valid = false;
-      return 0;
-    }
-
-    res *= 10;
-    res += (uint8_t)span.data[i] - '0';
-  }
-  *valid = true;
-  return sign * res;
+  return sign * (int64_t)pg__span_parse_digits(span, false, valid);
 }
 
 __attribute__((unused)) static uint64_t
 pg_span_parse_u64_decimal(pg_span_t span, bool *valid) {
   pg_span_trim(&span);
 
-  uint64_t res = 0;
-
   if (pg_span_peek_left(span, NULL) == '-') {
     *valid = false;
     return 0;
@@ -906,501 +2322,3393 @@ pg_span_parse_u64_decimal(pg_span_t span, bool *valid) {
     pg_span_consume_left(&span, 1);
   }
 
-  for (uint64_t i = 0; i < span.len; i++) {
-    if (!pg_char_is_digit(span.data[i])) {
-      *valid = false;
-      return 0;
-    }
-
-    res *= 10;
-    res += (uint8_t)span.data[i] - '0';
-  }
-  *valid = true;
-  return res;
+  return pg__span_parse_digits(span, false, valid);
 }
 
-// -------------------------- Log
-
-typedef enum {
-  PG_LOG_DEBUG,
-  PG_LOG_INFO,
-  PG_LOG_ERROR,
-  PG_LOG_FATAL,
-} pg_log_level_t;
-
-typedef struct {
-  pg_log_level_t level;
-} pg_logger_t;
-
-#define pg_log_debug(logger, fmt, ...)                                         \
-  do {                                                                         \
-    if ((logger) != NULL && (logger)->level <= PG_LOG_DEBUG)                   \
-      fprintf(stderr, "%s[DEBUG] " fmt "%s\n",                                 \
-              (isatty(2) ? "\x1b[38:5:240m" : ""), ##__VA_ARGS__,              \
-              (isatty(2) ? "\x1b[0m" : ""));                                   \
-  } while (0)
-
-#define pg_log_info(logger, fmt, ...)                                          \
-  do {                                                                         \
-    if ((logger) != NULL && (logger)->level <= PG_LOG_INFO)                    \
-      fprintf(stderr, "%s[INFO] " fmt "%s\n", (isatty(2) ? "\x1b[32m" : ""),   \
-              ##__VA_ARGS__, (isatty(2) ? "\x1b[0m" : ""));                    \
-  } while (0)
-
-#define pg_log_error(logger, fmt, ...)                                         \
-  do {                                                                         \
-    if ((logger) != NULL && (logger)->level <= PG_LOG_ERROR)                   \
-      fprintf(stderr, "%s[ERROR] " fmt "%s\n", (isatty(2) ? "\x1b[31m" : ""),  \
-              ##__VA_ARGS__, (isatty(2) ? "\x1b[0m" : ""));                    \
-  } while (0)
-
-#define pg_log_fatal(logger, exit_code, fmt, ...)                              \
-  do {                                                                         \
-    if ((logger) != NULL && (logger)->level <= PG_LOG_FATAL) {                 \
-      fprintf(stderr, "%s[FATAL] " fmt "%s\n",                                 \
-              (isatty(2) ? "\x1b[38:5:124m" : ""), ##__VA_ARGS__,              \
-              (isatty(2) ? "\x1b[0m" : ""));                                   \
-      exit((int)exit_code);                                                    \
-    }                                                                          \
-  } while (0)
-
-// -------------------------- Ring buffer of bytes
+// -------------------------- Builder
 
+// Appends formatted output to a buffer without allocating per call. Once the
+// buffer is full, depending on how it was initialized, the builder either:
+// - writes it out to `fd` and starts over (`pg_builder_init_fd`),
+// - grows it with `allocator`, e.g. an arena (`pg_builder_init_alloc`),
+// - drops the rest and sets `truncated` (`pg_builder_init_buf`).
 typedef struct {
-  uint8_t *data;
-  uint64_t len, offset, cap;
-  pg_allocator_t allocator;
-} pg_ring_t;
+  char *data;
+  uint64_t len;
+  uint64_t cap;
+  pg_allocator_t allocator; // Only set when growing.
+  int fd;                   // -1 when not flushing.
+  int err;                  // errno of the first failed write.
+  bool truncated;
+  PG_PAD(7);
+} pg_builder_t;
 
 __attribute__((unused)) static void
-pg_ring_init(pg_allocator_t allocator, pg_ring_t *ring, uint64_t cap) {
-  assert(cap > 0);
+pg_builder_init_buf(pg_builder_t *b, char *buf, uint64_t cap) {
+  *b = (pg_builder_t){.data = buf, .cap = cap, .fd = -1};
+}
 
-  ring->len = ring->offset = 0;
-  ring->data = allocator.realloc(NULL, cap, 0);
-  ring->cap = cap;
-  ring->allocator = allocator;
+// Flush to `fd` with large writes. The buffer should be a few KiBs at least.
+__attribute__((unused)) static void
+pg_builder_init_fd(pg_builder_t *b, char *buf, uint64_t cap, int fd) {
+  *b = (pg_builder_t){.data = buf, .cap = cap, .fd = fd};
 }
 
-__attribute__((unused)) static uint64_t pg_ring_len(pg_ring_t *ring) {
-  return ring->len;
+__attribute__((unused)) static void
+pg_builder_init_alloc(pg_builder_t *b, pg_allocator_t allocator, uint64_t cap) {
+  *b = (pg_builder_t){
+      .cap = MAX(cap, 16ULL), .allocator = allocator, .fd = -1};
+  b->data = pg_alloc(allocator, b->cap);
+  if (b->data == NULL)
+    b->cap = 0;
 }
 
-__attribute__((unused)) static uint64_t pg_ring_cap(pg_ring_t *ring) {
-  return ring->cap;
+__attribute__((unused)) static pg_span_t
+pg_builder_span(const pg_builder_t *b) {
+  return (pg_span_t){.data = b->data, .len = b->len};
 }
 
-__attribute__((unused)) static void pg_ring_destroy(pg_ring_t *ring) {
-  ring->allocator.free(ring->data);
+// Returns false on error, see `b->err`. The content is dropped either way.
+__attribute__((unused)) static bool pg_builder_flush(pg_builder_t *b) {
+  uint64_t written = 0;
+  while (b->fd != -1 && b->err == 0 && written < b->len) {
+    const ssize_t ret = write(b->fd, b->data + written, b->len - written);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1)
+      b->err = errno;
+    else
+      written += (uint64_t)ret;
+  }
+  b->len = 0;
+  return b->err == 0;
 }
 
-__attribute__((unused)) static uint8_t *pg_ring_get_ptr(pg_ring_t *ring,
-                                                        uint64_t i) {
-  if (ring->cap == 0)
-    return NULL;
+// Make room for `len` more bytes if possible.
+__attribute__((unused)) static bool pg_builder_reserve(pg_builder_t *b,
+                                                       uint64_t len) {
+  if (b->len + len <= b->cap)
+    return true;
 
-  assert(i < ring->cap);
-  const uint64_t index = (i + ring->offset) % ring->cap;
-  return &ring->data[index];
-}
+  if (b->fd != -1) {
+    pg_builder_flush(b);
+    return len <= b->cap;
+  }
 
-__attribute__((unused)) static uint8_t pg_ring_get(pg_ring_t *ring,
-                                                   uint64_t i) {
-  return *pg_ring_get_ptr(ring, i);
+  if (b->allocator.realloc != NULL) {
+    const uint64_t new_cap = MAX(b->cap * 2, b->len + len);
+    char *const data = pg_realloc(b->allocator, b->data, new_cap, b->cap);
+    if (data != NULL) {
+      b->data = data;
+      b->cap = new_cap;
+      return true;
+    }
+  }
+  return false;
 }
 
-__attribute__((unused)) static uint8_t *pg_ring_front_ptr(pg_ring_t *ring) {
-  assert(ring->offset < ring->cap);
-  return &ring->data[ring->offset];
+__attribute__((unused)) static void
+pg_builder_append(pg_builder_t *b, const void *data, uint64_t len) {
+  if (!pg_builder_reserve(b, len)) {
+    if (b->fd != -1) { // Bigger than the buffer: write it directly.
+      pg_builder_t direct = {
+          .data = pg_unconst(data), .len = len, .cap = len, .fd = b->fd};
+      if (b->err == 0 && !pg_builder_flush(&direct))
+        b->err = direct.err;
+      return;
+    }
+    len = b->cap - b->len;
+    b->truncated = true;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
 }
 
-__attribute__((unused)) static uint8_t pg_ring_front(pg_ring_t *ring) {
-  return *pg_ring_front_ptr(ring);
+__attribute__((unused)) static void pg_builder_append_span(pg_builder_t *b,
+                                                           pg_span_t span) {
+  pg_builder_append(b, span.data, span.len);
 }
 
-__attribute__((unused)) static uint8_t *pg_ring_back_ptr(pg_ring_t *ring) {
-  if (ring->cap == 0)
-    return NULL;
+__attribute__((unused)) static void pg_builder_append_cstr(pg_builder_t *b,
+                                                           const char *s) {
+  pg_builder_append(b, s, strlen(s));
+}
 
-  const uint64_t index = (ring->offset + ring->len - 1) % ring->cap;
-  return &ring->data[index];
+__attribute__((unused)) static void pg_builder_append_char(pg_builder_t *b,
+                                                           char c) {
+  if (b->len < b->cap || pg_builder_reserve(b, 1))
+    b->data[b->len++] = c;
+  else
+    b->truncated = true;
 }
 
-__attribute__((unused)) static uint8_t pg_ring_back(pg_ring_t *ring) {
+// Like `pg_url_encode`, in pieces when the buffer cannot hold it all.
+__attribute__((unused)) static void
+pg_builder_append_url_encoded(pg_builder_t *b, pg_span_t src) {
+  uint64_t i = 0;
+  while (i < src.len) {
+    uint64_t n = MIN(src.len - i, (b->cap - b->len) / 3);
+    if (n == 0 && !pg_builder_reserve(b, 3 * (src.len - i))) {
+      // The next byte may still fit if it is not encoded.
+      if (b->len == b->cap || !pg_url_is_unreserved((uint8_t)src.data[i])) {
+        b->truncated = true;
+        return;
+      }
+      n = 1;
+    }
+    b->len += pg_url_encode(b->data + b->len, src.data + i, n);
+    i += n;
+  }
+}
+
+// Two digits at a time, as in most integer formatting routines.
+__attribute__((unused)) static const char pg_builder_digits[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+__attribute__((unused)) static void pg_builder_append_u64(pg_builder_t *b,
+                                                          uint64_t n) {
+  char tmp[20];
+  uint64_t i = sizeof(tmp);
+  while (n >= 100) {
+    const uint64_t pair = (n % 100) * 2;
+    n /= 100;
+    tmp[--i] = pg_builder_digits[pair + 1];
+    tmp[--i] = pg_builder_digits[pair];
+  }
+  if (n >= 10) {
+    tmp[--i] = pg_builder_digits[n * 2 + 1];
+    tmp[--i] = pg_builder_digits[n * 2];
+  } else {
+    tmp[--i] = (char)('0' + n);
+  }
+  pg_builder_append(b, tmp + i, sizeof(tmp) - i);
+}
+
+__attribute__((unused)) static void pg_builder_append_i64(pg_builder_t *b,
+                                                          int64_t n) {
+  if (n < 0) {
+    pg_builder_append_char(b, '-');
+    pg_builder_append_u64(b, -(uint64_t)n); // Also fine for INT64_MIN.
+  } else {
+    pg_builder_append_u64(b, (uint64_t)n);
+  }
+}
+
+// Lowercase, without the `0x` prefix.
+__attribute__((unused)) static void pg_builder_append_hex(pg_builder_t *b,
+                                                          uint64_t n) {
+  char tmp[16];
+  uint64_t i = sizeof(tmp);
+  do {
+    tmp[--i] = "0123456789abcdef"[n & 0xf];
+    n >>= 4;
+  } while (n != 0);
+  pg_builder_append(b, tmp + i, sizeof(tmp) - i);
+}
+
+// Like `%.*f` with at most 9 decimals. Ties may round differently than
+// printf.
+__attribute__((unused)) static void
+pg_builder_append_f64(pg_builder_t *b, double x, uint32_t decimals) {
+  assert(decimals <= 9);
+
+  uint64_t scale = 1;
+  for (uint32_t i = 0; i < decimals; i++)
+    scale *= 10;
+
+  const double scaled = fabs(x) * (double)scale + 0.5;
+  if (isnan(x) || isinf(x) || scaled >= 18446744073709551616.0) {
+    char tmp[330];
+    const int len = snprintf(tmp, sizeof(tmp), "%.*f", (int)decimals, x);
+    pg_builder_append(b, tmp, (uint64_t)MAX(len, 0));
+    return;
+  }
+
+  if (signbit(x))
+    pg_builder_append_char(b, '-');
+
+  const uint64_t n = (uint64_t)scaled;
+  pg_builder_append_u64(b, n / scale);
+  if (decimals == 0)
+    return;
+
+  pg_builder_append_char(b, '.');
+  char tmp[9];
+  uint64_t frac = n % scale;
+  for (uint32_t i = decimals; i > 0; i--) {
+    tmp[i - 1] = (char)('0' + frac % 10);
+    frac /= 10;
+  }
+  pg_builder_append(b, tmp, decimals);
+}
+
+// -------------------------- Allocation stats
+
+// Size classes by power of two: [0], [1], [2, 3], [4, 7], ... the last one
+// holds everything from 1 GiB.
+#define PG_ALLOC_STATS_SIZE_CLASSES 32
+
+// Counts what goes through `backing` under a tag. All counters are updated
+// with relaxed atomics so that it can stay on in production and be shared
+// by threads. Each allocation carries a 16 bytes header holding its size.
+typedef struct pg_alloc_stats_t pg_alloc_stats_t;
+struct pg_alloc_stats_t {
+  const char *tag;
+  pg_allocator_t backing;
+  uint64_t budget_bytes; // Flagged in the report when the peak is above.
+  pg_alloc_stats_t *next;
+  uint64_t allocs_count, reallocs_count, frees_count;
+  uint64_t live_bytes, peak_bytes, total_bytes;
+  uint64_t size_classes[PG_ALLOC_STATS_SIZE_CLASSES];
+};
+
+// All the initialized stats, for reports.
+__attribute__((unused)) static struct {
+  pthread_mutex_t lock;
+  pg_alloc_stats_t *head;
+} pg_alloc_stats_registry = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define PG_ALLOC_STATS_HEADER_SIZE 16ULL
+
+__attribute__((unused)) static uint64_t
+pg_alloc_stats_size_class(uint64_t size) {
+  if (size == 0)
+    return 0;
+  const uint64_t class = 64 - (uint64_t)__builtin_clzll(size);
+  return MIN(class, PG_ALLOC_STATS_SIZE_CLASSES - 1ULL);
+}
+
+__attribute__((unused)) static void
+pg_alloc_stats_update(pg_alloc_stats_t *stats, uint64_t old_size,
+                      uint64_t new_size) {
+  if (new_size > old_size) {
+    const uint64_t grown = new_size - old_size;
+    const uint64_t live =
+        __atomic_add_fetch(&stats->live_bytes, grown, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->total_bytes, grown, __ATOMIC_RELAXED);
+
+    uint64_t peak = __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&stats->peak_bytes, &peak, live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  } else {
+    __atomic_fetch_sub(&stats->live_bytes, old_size - new_size,
+                       __ATOMIC_RELAXED);
+  }
+}
+
+__attribute__((unused)) static void *pg_alloc_stats_realloc(void *ctx,
+                                                            void *old_memory,
+                                                            uint64_t new_size,
+                                                            uint64_t old_size) {
+  pg_alloc_stats_t *const stats = ctx;
+  uint8_t *old_header = NULL;
+  if (old_memory != NULL) {
+    old_header = (uint8_t *)old_memory - PG_ALLOC_STATS_HEADER_SIZE;
+    memcpy(&old_size, old_header, sizeof(old_size));
+  }
+
+  const uint64_t old_total =
+      old_header == NULL ? 0 : PG_ALLOC_STATS_HEADER_SIZE + old_size;
+  uint8_t *const header = pg_realloc(stats->backing, old_header,
+                                     PG_ALLOC_STATS_HEADER_SIZE + new_size,
+                                     old_total);
+  if (header == NULL)
+    return NULL;
+  memcpy(header, &new_size, sizeof(new_size));
+
+  __atomic_fetch_add(old_memory == NULL ? &stats->allocs_count
+                                        : &stats->reallocs_count,
+                     1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->size_classes[pg_alloc_stats_size_class(new_size)],
+                     1, __ATOMIC_RELAXED);
+  pg_alloc_stats_update(stats, old_memory == NULL ? 0 : old_size, new_size);
+
+  return header + PG_ALLOC_STATS_HEADER_SIZE;
+}
+
+__attribute__((unused)) static void pg_alloc_stats_free(void *ctx,
+                                                        void *memory) {
+  if (memory == NULL)
+    return;
+
+  pg_alloc_stats_t *const stats = ctx;
+  uint8_t *const header = (uint8_t *)memory - PG_ALLOC_STATS_HEADER_SIZE;
+  uint64_t size = 0;
+  memcpy(&size, header, sizeof(size));
+
+  __atomic_fetch_add(&stats->frees_count, 1, __ATOMIC_RELAXED);
+  pg_alloc_stats_update(stats, size, 0);
+  pg_free(stats->backing, header);
+}
+
+__attribute__((unused)) static void pg_alloc_stats_init(pg_alloc_stats_t *stats,
+                                                        const char *tag,
+                                                        pg_allocator_t backing,
+                                                        uint64_t budget_bytes) {
+  *stats = (pg_alloc_stats_t){
+      .tag = tag, .backing = backing, .budget_bytes = budget_bytes};
+
+  pthread_mutex_lock(&pg_alloc_stats_registry.lock);
+  stats->next = pg_alloc_stats_registry.head;
+  pg_alloc_stats_registry.head = stats;
+  pthread_mutex_unlock(&pg_alloc_stats_registry.lock);
+}
+
+// Stop reporting `stats`, e.g. before the memory holding it is reused.
+__attribute__((unused)) static void
+pg_alloc_stats_destroy(pg_alloc_stats_t *stats) {
+  pthread_mutex_lock(&pg_alloc_stats_registry.lock);
+  pg_alloc_stats_t **it = &pg_alloc_stats_registry.head;
+  while (*it != NULL && *it != stats)
+    it = &(*it)->next;
+  if (*it != NULL)
+    *it = stats->next;
+  pthread_mutex_unlock(&pg_alloc_stats_registry.lock);
+}
+
+__attribute__((unused)) static pg_allocator_t
+pg_alloc_stats_allocator(pg_alloc_stats_t *stats) {
+  return (pg_allocator_t){.realloc = pg_alloc_stats_realloc,
+                          .free = pg_alloc_stats_free,
+                          .ctx = stats};
+}
+
+__attribute__((unused)) static bool
+pg_alloc_stats_over_budget(const pg_alloc_stats_t *stats) {
+  return stats->budget_bytes > 0 &&
+         __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED) >
+             stats->budget_bytes;
+}
+
+__attribute__((unused)) static void
+pg_alloc_stats_format(pg_builder_t *b, const pg_alloc_stats_t *stats) {
+  pg_builder_append_cstr(b, stats->tag);
+  pg_builder_append_cstr(b, ": allocs=");
+  pg_builder_append_u64(
+      b, __atomic_load_n(&stats->allocs_count, __ATOMIC_RELAXED));
+  pg_builder_append_cstr(b, " reallocs=");
+  pg_builder_append_u64(
+      b, __atomic_load_n(&stats->reallocs_count, __ATOMIC_RELAXED));
+  pg_builder_append_cstr(b, " frees=");
+  pg_builder_append_u64(
+      b, __atomic_load_n(&stats->frees_count, __ATOMIC_RELAXED));
+  pg_builder_append_cstr(b, " live=");
+  pg_builder_append_u64(
+      b, __atomic_load_n(&stats->live_bytes, __ATOMIC_RELAXED));
+  pg_builder_append_cstr(b, " peak=");
+  pg_builder_append_u64(
+      b, __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED));
+  pg_builder_append_cstr(b, " total=");
+  pg_builder_append_u64(
+      b, __atomic_load_n(&stats->total_bytes, __ATOMIC_RELAXED));
+  if (stats->budget_bytes > 0) {
+    pg_builder_append_cstr(b, " budget=");
+    pg_builder_append_u64(b, stats->budget_bytes);
+    if (pg_alloc_stats_over_budget(stats))
+      pg_builder_append_cstr(b, " OVER BUDGET");
+  }
+  pg_builder_append_char(b, '\n');
+
+  for (uint64_t i = 0; i < PG_ALLOC_STATS_SIZE_CLASSES; i++) {
+    const uint64_t count =
+        __atomic_load_n(&stats->size_classes[i], __ATOMIC_RELAXED);
+    if (count == 0)
+      continue;
+
+    pg_builder_append_cstr(b, "  <");
+    if (i == PG_ALLOC_STATS_SIZE_CLASSES - 1)
+      pg_builder_append_cstr(b, "inf");
+    else
+      pg_builder_append_u64(b, 1ULL << i);
+    pg_builder_append_cstr(b, ": ");
+    pg_builder_append_u64(b, count);
+    pg_builder_append_char(b, '\n');
+  }
+}
+
+// Only uses write(2): can be called from a signal handler.
+__attribute__((unused)) static void pg_alloc_stats_report(int fd) {
+  char buf[4096];
+  pg_builder_t b = {0};
+  pg_builder_init_fd(&b, buf, sizeof(buf), fd);
+
+  // Not locking in a signal handler: at worst a stats being added is missed.
+  for (const pg_alloc_stats_t *it = pg_alloc_stats_registry.head; it != NULL;
+       it = it->next)
+    pg_alloc_stats_format(&b, it);
+  pg_builder_flush(&b);
+}
+
+__attribute__((unused)) static void pg_alloc_stats_report_stderr(void) {
+  pg_alloc_stats_report(STDERR_FILENO);
+}
+
+__attribute__((unused)) static void pg_alloc_stats_on_signal(int sig) {
+  (void)sig;
+  pg_alloc_stats_report(STDERR_FILENO);
+}
+
+// Print the report to stderr at exit and, if `sig` is not 0, on that signal.
+__attribute__((unused)) static void pg_alloc_stats_report_at_exit(int sig) {
+  atexit(pg_alloc_stats_report_stderr);
+  if (sig != 0)
+    signal(sig, pg_alloc_stats_on_signal);
+}
+
+// -------------------------- Queues
+
+// Bounded lock-free queues of pointers. Producers never wait for the
+// consumer: a full queue is reported and the caller decides what to do.
+
+// One producer thread, one consumer thread.
+typedef struct {
+  // Consumer side.
+  uint64_t head;
+  uint64_t tail_cached; // Last `tail` seen, to not touch the other line.
+  PG_PAD(48);
+  // Producer side.
+  uint64_t tail;
+  uint64_t head_cached;
+  PG_PAD(48);
+  void **items;
+  uint64_t cap; // Power of two.
+  pg_allocator_t allocator;
+} pg_spsc_t;
+
+__attribute__((unused)) static void pg_spsc_init(pg_spsc_t *queue,
+                                                 pg_allocator_t allocator,
+                                                 uint64_t cap) {
+  assert(cap > 0 && (cap & (cap - 1)) == 0);
+
+  *queue = (pg_spsc_t){.cap = cap, .allocator = allocator};
+  queue->items = pg_alloc(allocator, cap * sizeof(void *));
+}
+
+__attribute__((unused)) static void pg_spsc_destroy(pg_spsc_t *queue) {
+  pg_free(queue->allocator, queue->items);
+}
+
+__attribute__((unused)) static bool pg_spsc_push(pg_spsc_t *queue,
+                                                 void *item) {
+  const uint64_t tail = queue->tail;
+  if (tail - queue->head_cached == queue->cap) {
+    queue->head_cached = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - queue->head_cached == queue->cap)
+      return false;
+  }
+
+  queue->items[tail & (queue->cap - 1)] = item;
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Pop up to `max` items at once, publishing the freed slots once.
+__attribute__((unused)) static uint64_t
+pg_spsc_pop_batch(pg_spsc_t *queue, void **items, uint64_t max) {
+  const uint64_t head = queue->head;
+  if (queue->tail_cached - head < max)
+    queue->tail_cached = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+  const uint64_t count = MIN(queue->tail_cached - head, max);
+  for (uint64_t i = 0; i < count; i++)
+    items[i] = queue->items[(head + i) & (queue->cap - 1)];
+
+  __atomic_store_n(&queue->head, head + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+// Consumer only.
+__attribute__((unused)) static bool pg_spsc_is_empty(pg_spsc_t *queue) {
+  return __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == queue->head;
+}
+
+// Many producer threads, one consumer thread. Each slot has a sequence
+// number telling whether it is free for the lap of a producer or full for
+// the consumer, so producers only contend on `tail`.
+typedef struct {
+  uint64_t seq;
+  void *item;
+} pg_mpsc_slot_t;
+
+typedef struct {
+  uint64_t tail; // Producers.
+  PG_PAD(56);
+  uint64_t head; // Consumer.
+  PG_PAD(56);
+  pg_mpsc_slot_t *slots;
+  uint64_t cap; // Power of two.
+  pg_allocator_t allocator;
+} pg_mpsc_t;
+
+__attribute__((unused)) static void pg_mpsc_init(pg_mpsc_t *queue,
+                                                 pg_allocator_t allocator,
+                                                 uint64_t cap) {
+  assert(cap > 0 && (cap & (cap - 1)) == 0);
+
+  *queue = (pg_mpsc_t){.cap = cap, .allocator = allocator};
+  queue->slots = pg_alloc(allocator, cap * sizeof(pg_mpsc_slot_t));
+  for (uint64_t i = 0; i < cap; i++)
+    queue->slots[i].seq = i;
+}
+
+__attribute__((unused)) static void pg_mpsc_destroy(pg_mpsc_t *queue) {
+  pg_free(queue->allocator, queue->slots);
+}
+
+__attribute__((unused)) static bool pg_mpsc_push(pg_mpsc_t *queue,
+                                                 void *item) {
+  uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    pg_mpsc_slot_t *const slot = &queue->slots[tail & (queue->cap - 1)];
+    const uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    const int64_t diff = (int64_t)(seq - tail);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slot->item = item;
+        __atomic_store_n(&slot->seq, tail + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+    } else if (diff < 0) { // Not consumed yet since the last lap: full.
+      return false;
+    } else { // Taken by another producer.
+      tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Pop up to `max` items at once. Stops at a slot claimed by a producer
+// which has not written it yet.
+__attribute__((unused)) static uint64_t
+pg_mpsc_pop_batch(pg_mpsc_t *queue, void **items, uint64_t max) {
+  uint64_t head = queue->head;
+  uint64_t count = 0;
+  for (; count < max; count++, head++) {
+    pg_mpsc_slot_t *const slot = &queue->slots[head & (queue->cap - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1)
+      break;
+
+    items[count] = slot->item;
+    __atomic_store_n(&slot->seq, head + queue->cap, __ATOMIC_RELEASE);
+  }
+  queue->head = head;
+  return count;
+}
+
+// Consumer only.
+__attribute__((unused)) static bool pg_mpsc_is_empty(pg_mpsc_t *queue) {
+  const pg_mpsc_slot_t *const slot =
+      &queue->slots[queue->head & (queue->cap - 1)];
+  return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != queue->head + 1;
+}
+
+// Lets a consumer sleep until a producer pushes, and only then costs a
+// syscall to the producer. The file descriptor can be watched with
+// poll(2) or an event loop. Consumer side:
+//
+//   for (;;) {
+//     if (pg_mpsc_pop_batch(...) > 0) { ...; continue; }
+//     pg_wakeup_prepare(&wakeup);
+//     if (!pg_mpsc_is_empty(&queue)) { pg_wakeup_cancel(&wakeup); continue; }
+//     pg_wakeup_wait(&wakeup, -1);
+//   }
+typedef struct {
+  int read_fd;
+  int write_fd; // Same as `read_fd` with eventfd.
+  uint32_t sleeping;
+  PG_PAD(4);
+} pg_wakeup_t;
+
+__attribute__((unused)) static bool pg_wakeup_init(pg_wakeup_t *wakeup) {
+  *wakeup = (pg_wakeup_t){0};
+#if defined(__linux__)
+  wakeup->read_fd = wakeup->write_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return wakeup->read_fd != -1;
+#else
+  int fds[2] = {0};
+  if (pipe(fds) != 0)
+    return false;
+  for (uint64_t i = 0; i < 2; i++) {
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[i], F_SETFL, O_NONBLOCK);
+  }
+  wakeup->read_fd = fds[0];
+  wakeup->write_fd = fds[1];
+  return true;
+#endif
+}
+
+__attribute__((unused)) static void pg_wakeup_destroy(pg_wakeup_t *wakeup) {
+  close(wakeup->read_fd);
+  if (wakeup->write_fd != wakeup->read_fd)
+    close(wakeup->write_fd);
+}
+
+// After this, the consumer must check the queue again before waiting.
+__attribute__((unused)) static void pg_wakeup_prepare(pg_wakeup_t *wakeup) {
+  __atomic_store_n(&wakeup->sleeping, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+__attribute__((unused)) static void pg_wakeup_cancel(pg_wakeup_t *wakeup) {
+  __atomic_store_n(&wakeup->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+// Producer side, after pushing.
+__attribute__((unused)) static void pg_wakeup_signal(pg_wakeup_t *wakeup) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&wakeup->sleeping, 0, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  const uint64_t one = 1;
+  while (write(wakeup->write_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+    ;
+}
+
+// Returns false on timeout or error. May return spuriously.
+__attribute__((unused)) static bool pg_wakeup_wait(pg_wakeup_t *wakeup,
+                                                   int timeout_ms) {
+  struct pollfd pfd = {.fd = wakeup->read_fd, .events = POLLIN};
+  const int ret = poll(&pfd, 1, timeout_ms);
+  pg_wakeup_cancel(wakeup);
+  if (ret <= 0)
+    return false;
+
+  uint64_t drain[8] = {0};
+  while (read(wakeup->read_fd, drain, sizeof(drain)) > 0)
+    ;
+  return true;
+}
+
+// -------------------------- Log
+
+typedef enum {
+  PG_LOG_DEBUG,
+  PG_LOG_INFO,
+  PG_LOG_ERROR,
+  PG_LOG_FATAL,
+} pg_log_level_t;
+
+typedef enum {
+  PG_LOG_FLAGS_NONE = 0,
+  // Keep messages in a per-thread buffer, written out when it is full, on
+  // errors, on `pg_log_flush()` and at exit.
+  PG_LOG_FLAGS_BUFFERED = 1,
+  // Only record the format string pointer and the raw arguments, and format
+  // them when the buffer is written out. Implies buffered.
+  // The format string must outlive the flush, e.g. be a literal.
+  PG_LOG_FLAGS_BINARY = 2,
+} pg_log_flags_t;
+
+typedef struct {
+  pg_log_level_t level;
+  uint32_t flags;
+  // Max messages per second and per call site, 0 for no limit. The number of
+  // dropped messages is reported once the limit resets.
+  uint32_t max_per_second;
+  PG_PAD(4);
+} pg_logger_t;
+
+// Rate limiting state of one `pg_log_*` call site.
+typedef struct {
+  uint64_t window_start_ns;
+  uint32_t count, suppressed;
+} pg_log_site_t;
+
+#define PG_LOG_BUFFER_SIZE (16 * Ki)
+
+typedef struct {
+  uint64_t len;
+  bool binary;
+  PG_PAD(7);
+  uint8_t data[PG_LOG_BUFFER_SIZE];
+} pg_log_buffer_t;
+
+__attribute__((unused)) static __thread pg_log_buffer_t pg_log_buffer;
+
+// A binary record in the buffer, followed by `args_len` bytes of arguments.
+typedef struct {
+  const char *fmt;
+  uint32_t level;
+  uint32_t args_len;
+} pg_log_record_t;
+
+__attribute__((unused)) static uint64_t pg_now_ns(void) {
+  struct timespec ts = {0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 + (uint64_t)ts.tv_nsec;
+}
+
+__attribute__((unused)) static bool pg_log_is_tty(void) {
+  // -1: unknown.
+  static int is_tty = -1;
+  int res = __atomic_load_n(&is_tty, __ATOMIC_RELAXED);
+  if (res == -1) {
+    res = isatty(2);
+    __atomic_store_n(&is_tty, res, __ATOMIC_RELAXED);
+  }
+  return res == 1;
+}
+
+__attribute__((unused)) static const char *
+pg_log_level_prefix(pg_log_level_t level, bool tty) {
+  switch (level) {
+  case PG_LOG_DEBUG:
+    return tty ? "\x1b[38:5:240m[DEBUG] " : "[DEBUG] ";
+  case PG_LOG_INFO:
+    return tty ? "\x1b[32m[INFO] " : "[INFO] ";
+  case PG_LOG_ERROR:
+    return tty ? "\x1b[31m[ERROR] " : "[ERROR] ";
+  case PG_LOG_FATAL:
+    return tty ? "\x1b[38:5:124m[FATAL] " : "[FATAL] ";
+  }
+  __builtin_unreachable();
+}
+
+__attribute__((unused)) static const char *pg_log_suffix(bool tty) {
+  return tty ? "\x1b[0m\n" : "\n";
+}
+
+__attribute__((unused)) static void pg_log_write_fd(const uint8_t *data,
+                                                    uint64_t len) {
+  while (len > 0) {
+    const ssize_t res = write(2, data, len);
+    if (res == -1 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return; // Nothing sensible to do.
+
+    data += res;
+    len -= (uint64_t)res;
+  }
+}
+
+// One conversion specification of a printf format string.
+typedef enum {
+  PG_LOG_ARG_NONE, // `%%`
+  PG_LOG_ARG_SIGNED,
+  PG_LOG_ARG_UNSIGNED,
+  PG_LOG_ARG_CHAR,
+  PG_LOG_ARG_DOUBLE,
+  PG_LOG_ARG_STRING,
+  PG_LOG_ARG_POINTER,
+} pg_log_arg_kind_t;
+
+typedef struct {
+  const char *flags;
+  uint64_t flags_len;
+  const char *width; // NULL if absent or `*`.
+  uint64_t width_len;
+  const char *precision; // Digits after the `.`, NULL if absent or `*`.
+  uint64_t precision_len;
+  bool width_star, has_precision, precision_star;
+  char length[2]; // Length modifier, e.g. "ll" or "z".
+  char conversion;
+  PG_PAD(2);
+  pg_log_arg_kind_t kind;
+  PG_PAD(4);
+} pg_log_spec_t;
+
+// Parse the specification starting after the `%` at `*fmt`, and advance it.
+__attribute__((unused)) static pg_log_spec_t
+pg_log_spec_parse(const char **fmt) {
+  pg_log_spec_t spec = {0};
+  const char *s = *fmt;
+
+  spec.flags = s;
+  while (*s != 0 && strchr("-+ #0'", *s) != NULL)
+    s++;
+  spec.flags_len = (uint64_t)(s - spec.flags);
+
+  if (*s == '*') {
+    spec.width_star = true;
+    s++;
+  } else {
+    spec.width = s;
+    while (pg_char_is_digit(*s))
+      s++;
+    spec.width_len = (uint64_t)(s - spec.width);
+  }
+
+  if (*s == '.') {
+    spec.has_precision = true;
+    s++;
+    if (*s == '*') {
+      spec.precision_star = true;
+      s++;
+    } else {
+      spec.precision = s;
+      while (pg_char_is_digit(*s))
+        s++;
+      spec.precision_len = (uint64_t)(s - spec.precision);
+    }
+  }
+
+  for (uint64_t i = 0; i < 2 && *s != 0 && strchr("hljztL", *s) != NULL; i++)
+    spec.length[i] = *s++;
+
+  spec.conversion = *s;
+  if (*s != 0)
+    s++;
+  *fmt = s;
+
+  switch (spec.conversion) {
+  case '%':
+    spec.kind = PG_LOG_ARG_NONE;
+    break;
+  case 'd':
+  case 'i':
+    spec.kind = PG_LOG_ARG_SIGNED;
+    break;
+  case 'o':
+  case 'u':
+  case 'x':
+  case 'X':
+    spec.kind = PG_LOG_ARG_UNSIGNED;
+    break;
+  case 'c':
+    spec.kind = PG_LOG_ARG_CHAR;
+    break;
+  case 'f':
+  case 'F':
+  case 'e':
+  case 'E':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+    spec.kind = PG_LOG_ARG_DOUBLE;
+    break;
+  case 's':
+    assert(spec.length[0] == 0 && "wide strings are not supported");
+    spec.kind = PG_LOG_ARG_STRING;
+    break;
+  case 'p':
+    spec.kind = PG_LOG_ARG_POINTER;
+    break;
+  default:
+    assert(0 && "unsupported conversion");
+  }
+  return spec;
+}
+
+// Append `len` bytes if they fit.
+__attribute__((unused)) static bool
+pg_log_args_push(uint8_t *dst, uint64_t cap, uint64_t *len, const void *src,
+                 uint64_t src_len) {
+  if (*len + src_len > cap)
+    return false;
+  memcpy(dst + *len, src, src_len);
+  *len += src_len;
+  return true;
+}
+
+// Copy the arguments described by `fmt` in `dst`. Integers are widened to 64
+// bits, floating point numbers to double, and strings are copied inline with
+// their terminating 0. Returns false if `cap` is too small.
+__attribute__((unused)) static bool pg_log_args_encode(uint8_t *dst,
+                                                       uint64_t cap,
+                                                       uint64_t *len,
+                                                       const char *fmt,
+                                                       va_list args) {
+  *len = 0;
+  while (*fmt != 0) {
+    if (*fmt++ != '%')
+      continue;
+
+    const pg_log_spec_t spec = pg_log_spec_parse(&fmt);
+    int32_t precision = -1;
+    if (spec.width_star) {
+      const int32_t width = va_arg(args, int);
+      if (!pg_log_args_push(dst, cap, len, &width, sizeof(width)))
+        return false;
+    }
+    if (spec.precision_star) {
+      precision = va_arg(args, int);
+      if (!pg_log_args_push(dst, cap, len, &precision, sizeof(precision)))
+        return false;
+    } else if (spec.has_precision) {
+      precision = 0;
+      for (uint64_t i = 0; i < spec.precision_len; i++)
+        precision = precision * 10 + (spec.precision[i] - '0');
+    }
+
+    const char l0 = spec.length[0], l1 = spec.length[1];
+    switch (spec.kind) {
+    case PG_LOG_ARG_NONE:
+      break;
+    case PG_LOG_ARG_SIGNED: {
+      int64_t v = 0;
+      if (l0 == 'l' && l1 == 'l')
+        v = va_arg(args, long long);
+      else if (l0 == 'l')
+        v = va_arg(args, long);
+      else if (l0 == 'j')
+        v = va_arg(args, intmax_t);
+      else if (l0 == 'z')
+        v = (int64_t)va_arg(args, size_t);
+      else if (l0 == 't')
+        v = va_arg(args, ptrdiff_t);
+      else
+        v = va_arg(args, int);
+      if (l0 == 'h' && l1 == 'h')
+        v = (signed char)v;
+      else if (l0 == 'h')
+        v = (short)v;
+      if (!pg_log_args_push(dst, cap, len, &v, sizeof(v)))
+        return false;
+    } break;
+    case PG_LOG_ARG_UNSIGNED: {
+      uint64_t v = 0;
+      if (l0 == 'l' && l1 == 'l')
+        v = va_arg(args, unsigned long long);
+      else if (l0 == 'l')
+        v = va_arg(args, unsigned long);
+      else if (l0 == 'j')
+        v = va_arg(args, uintmax_t);
+      else if (l0 == 'z')
+        v = va_arg(args, size_t);
+      else if (l0 == 't')
+        v = (uint64_t)va_arg(args, ptrdiff_t);
+      else
+        v = va_arg(args, unsigned int);
+      if (l0 == 'h' && l1 == 'h')
+        v = (unsigned char)v;
+      else if (l0 == 'h')
+        v = (unsigned short)v;
+      if (!pg_log_args_push(dst, cap, len, &v, sizeof(v)))
+        return false;
+    } break;
+    case PG_LOG_ARG_CHAR: {
+      const int32_t v = va_arg(args, int);
+      if (!pg_log_args_push(dst, cap, len, &v, sizeof(v)))
+        return false;
+    } break;
+    case PG_LOG_ARG_DOUBLE: {
+      const double v = l0 == 'L' ? (double)va_arg(args, long double)
+                                 : va_arg(args, double);
+      if (!pg_log_args_push(dst, cap, len, &v, sizeof(v)))
+        return false;
+    } break;
+    case PG_LOG_ARG_STRING: {
+      const char *s = va_arg(args, const char *);
+      if (s == NULL)
+        s = "(null)";
+      // Spans are logged with `%.*s` and are not 0 terminated.
+      uint32_t s_len = 0;
+      while ((precision < 0 || s_len < (uint32_t)precision) && s[s_len] != 0)
+        s_len++;
+      const uint8_t zero = 0;
+      if (!pg_log_args_push(dst, cap, len, s, s_len) ||
+          !pg_log_args_push(dst, cap, len, &zero, 1))
+        return false;
+    } break;
+    case PG_LOG_ARG_POINTER: {
+      const uint64_t v = (uint64_t)(uintptr_t)va_arg(args, void *);
+      if (!pg_log_args_push(dst, cap, len, &v, sizeof(v)))
+        return false;
+    } break;
+    }
+  }
+  return true;
+}
+
+// Text output accumulated before being written to stderr.
+typedef struct {
+  uint64_t len;
+  char data[4 * Ki];
+} pg_log_out_t;
+
+__attribute__((unused)) static void pg_log_out_flush(pg_log_out_t *out) {
+  pg_log_write_fd((uint8_t *)out->data, out->len);
+  out->len = 0;
+}
+
+__attribute__((unused)) static void
+pg_log_out_append(pg_log_out_t *out, const char *s, uint64_t len) {
+  if (out->len + len > sizeof(out->data))
+    pg_log_out_flush(out);
+  if (len > sizeof(out->data)) {
+    pg_log_write_fd((const uint8_t *)s, len);
+    return;
+  }
+  memcpy(out->data + out->len, s, len);
+  out->len += len;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+__attribute__((unused)) static void
+pg_log_out_printf(pg_log_out_t *out, const char *spec, ...) {
+  va_list args;
+  va_start(args, spec);
+  const uint64_t rem = sizeof(out->data) - out->len;
+  const int n = vsnprintf(out->data + out->len, rem, spec, args);
+  va_end(args);
+  if (n < 0)
+    return;
+
+  if ((uint64_t)n < rem) {
+    out->len += (uint64_t)n;
+    return;
+  }
+
+  char *tmp = malloc((uint64_t)n + 1);
+  if (tmp == NULL)
+    return;
+  va_start(args, spec);
+  vsnprintf(tmp, (uint64_t)n + 1, spec, args);
+  va_end(args);
+  pg_log_out_append(out, tmp, (uint64_t)n);
+  free(tmp);
+}
+#pragma GCC diagnostic pop
+
+// Read the next `size` bytes of the arguments.
+__attribute__((unused)) static void
+pg_log_args_pop(const uint8_t **args, void *dst, uint64_t size) {
+  memcpy(dst, *args, size);
+  *args += size;
+}
+
+// Format a binary record the same way printf would have.
+__attribute__((unused)) static void
+pg_log_record_format(pg_log_out_t *out, const char *fmt, const uint8_t *args) {
+  while (*fmt != 0) {
+    const char *percent = strchr(fmt, '%');
+    if (percent == NULL) {
+      pg_log_out_append(out, fmt, strlen(fmt));
+      return;
+    }
+    pg_log_out_append(out, fmt, (uint64_t)(percent - fmt));
+    fmt = percent + 1;
+
+    const pg_log_spec_t spec = pg_log_spec_parse(&fmt);
+    if (spec.kind == PG_LOG_ARG_NONE) {
+      pg_log_out_append(out, "%", 1);
+      continue;
+    }
+
+    // Rebuild the specification with the `*` resolved and the length
+    // modifier matching the stored argument.
+    char s[64] = "%";
+    uint64_t s_len = 1;
+    assert(spec.flags_len + spec.width_len + spec.precision_len + 8 <
+           sizeof(s));
+    memcpy(s + s_len, spec.flags, spec.flags_len);
+    s_len += spec.flags_len;
+
+    if (spec.width_star) {
+      int32_t width = 0;
+      pg_log_args_pop(&args, &width, sizeof(width));
+      s_len += (uint64_t)snprintf(s + s_len, sizeof(s) - s_len, "%s%d",
+                                  width < 0 ? "-" : "",
+                                  width < 0 ? -width : width);
+    } else {
+      memcpy(s + s_len, spec.width, spec.width_len);
+      s_len += spec.width_len;
+    }
+
+    int32_t precision = -1;
+    if (spec.precision_star) {
+      pg_log_args_pop(&args, &precision, sizeof(precision));
+    } else if (spec.has_precision) {
+      precision = 0;
+      for (uint64_t i = 0; i < spec.precision_len; i++)
+        precision = precision * 10 + (spec.precision[i] - '0');
+    }
+    // Strings were already truncated to the precision.
+    if (precision >= 0 && spec.kind != PG_LOG_ARG_STRING)
+      s_len += (uint64_t)snprintf(s + s_len, sizeof(s) - s_len, ".%d",
+                                  precision);
+
+    if (spec.kind == PG_LOG_ARG_SIGNED || spec.kind == PG_LOG_ARG_UNSIGNED) {
+      s[s_len++] = 'l';
+      s[s_len++] = 'l';
+    }
+    s[s_len++] = spec.conversion;
+    s[s_len] = 0;
+
+    switch (spec.kind) {
+    case PG_LOG_ARG_NONE:
+      break;
+    case PG_LOG_ARG_SIGNED: {
+      int64_t v = 0;
+      pg_log_args_pop(&args, &v, sizeof(v));
+      pg_log_out_printf(out, s, (long long)v);
+    } break;
+    case PG_LOG_ARG_UNSIGNED: {
+      uint64_t v = 0;
+      pg_log_args_pop(&args, &v, sizeof(v));
+      pg_log_out_printf(out, s, (unsigned long long)v);
+    } break;
+    case PG_LOG_ARG_CHAR: {
+      int32_t v = 0;
+      pg_log_args_pop(&args, &v, sizeof(v));
+      pg_log_out_printf(out, s, (int)v);
+    } break;
+    case PG_LOG_ARG_DOUBLE: {
+      double v = 0;
+      pg_log_args_pop(&args, &v, sizeof(v));
+      pg_log_out_printf(out, s, v);
+    } break;
+    case PG_LOG_ARG_STRING: {
+      const char *v = (const char *)args;
+      args += strlen(v) + 1;
+      pg_log_out_printf(out, s, v);
+    } break;
+    case PG_LOG_ARG_POINTER: {
+      uint64_t v = 0;
+      pg_log_args_pop(&args, &v, sizeof(v));
+      pg_log_out_printf(out, s, (void *)(uintptr_t)v);
+    } break;
+    }
+  }
+}
+
+// Format binary records and write them out.
+__attribute__((unused)) static void pg_log_format_records(const uint8_t *data,
+                                                          uint64_t len) {
+  const bool tty = pg_log_is_tty();
+  pg_log_out_t out = {0};
+  for (uint64_t i = 0; i < len;) {
+    pg_log_record_t record = {0};
+    memcpy(&record, data + i, sizeof(record));
+    i += sizeof(record);
+
+    const char *prefix =
+        pg_log_level_prefix((pg_log_level_t)record.level, tty);
+    pg_log_out_append(&out, prefix, strlen(prefix));
+    pg_log_record_format(&out, record.fmt, data + i);
+    const char *suffix = pg_log_suffix(tty);
+    pg_log_out_append(&out, suffix, strlen(suffix));
+
+    i += record.args_len;
+  }
+  pg_log_out_flush(&out);
+}
+
+// Optional thread formatting the binary records of all threads, so that
+// logging only costs copying the arguments.
+typedef struct {
+  uint64_t len;
+  uint8_t data[];
+} pg_log_chunk_t;
+
+#define PG_LOG_BACKGROUND_QUEUE_CAP 1024
+
+__attribute__((unused)) static struct {
+  pg_mpsc_t queue;
+  pg_wakeup_t wakeup;
+  pthread_t thread;
+  uint64_t pushers_count; // Threads in `pg_log_background_push`.
+  bool running, stop;
+  PG_PAD(6);
+} pg_log_background;
+
+__attribute__((unused)) static void *pg_log_background_run(void *arg) {
+  (void)arg;
+
+  void *chunks[64] = {0};
+  for (;;) {
+    // Read before popping: once set, nothing is pushed anymore.
+    const bool stop =
+        __atomic_load_n(&pg_log_background.stop, __ATOMIC_ACQUIRE);
+
+    const uint64_t count = pg_mpsc_pop_batch(
+        &pg_log_background.queue, chunks, sizeof(chunks) / sizeof(chunks[0]));
+    for (uint64_t i = 0; i < count; i++) {
+      pg_log_chunk_t *const chunk = chunks[i];
+      pg_log_format_records(chunk->data, chunk->len);
+      free(chunk);
+    }
+    if (count > 0)
+      continue;
+    if (stop)
+      break;
+
+    pg_wakeup_prepare(&pg_log_background.wakeup);
+    if (!pg_mpsc_is_empty(&pg_log_background.queue) ||
+        __atomic_load_n(&pg_log_background.stop, __ATOMIC_SEQ_CST)) {
+      pg_wakeup_cancel(&pg_log_background.wakeup);
+      continue;
+    }
+    pg_wakeup_wait(&pg_log_background.wakeup, -1);
+  }
+  return NULL;
+}
+
+// Hand the buffer over to the background thread, if it runs and keeps up.
+__attribute__((unused)) static bool pg_log_background_push(const uint8_t *data,
+                                                           uint64_t len) {
+  __atomic_fetch_add(&pg_log_background.pushers_count, 1, __ATOMIC_SEQ_CST);
+
+  bool pushed = false;
+  if (__atomic_load_n(&pg_log_background.running, __ATOMIC_SEQ_CST)) {
+    pg_log_chunk_t *const chunk = malloc(sizeof(pg_log_chunk_t) + len);
+    if (chunk != NULL) {
+      chunk->len = len;
+      memcpy(chunk->data, data, len);
+      pushed = pg_mpsc_push(&pg_log_background.queue, chunk);
+    }
+
+    if (pushed)
+      pg_wakeup_signal(&pg_log_background.wakeup);
+    else
+      free(chunk);
+  }
+
+  __atomic_fetch_sub(&pg_log_background.pushers_count, 1, __ATOMIC_RELEASE);
+  return pushed;
+}
+
+// Write out the buffer of the calling thread.
+__attribute__((unused)) static void pg_log_flush(void) {
+  pg_log_buffer_t *const buf = &pg_log_buffer;
+  if (buf->len == 0)
+    return;
+
+  if (!buf->binary)
+    pg_log_write_fd(buf->data, buf->len);
+  else if (!pg_log_background_push(buf->data, buf->len))
+    pg_log_format_records(buf->data, buf->len);
+
+  buf->len = 0;
+}
+
+// Format the binary records on a background thread instead of in
+// `pg_log_flush()`. Stopped at exit.
+__attribute__((unused)) static bool pg_log_background_start(void) {
+  if (pg_log_background.running)
+    return true;
+
+  pg_log_background.stop = false;
+  if (!pg_wakeup_init(&pg_log_background.wakeup))
+    return false;
+  pg_mpsc_init(&pg_log_background.queue, pg_heap_allocator(),
+               PG_LOG_BACKGROUND_QUEUE_CAP);
+
+  if (pthread_create(&pg_log_background.thread, NULL, pg_log_background_run,
+                     NULL) != 0) {
+    pg_mpsc_destroy(&pg_log_background.queue);
+    pg_wakeup_destroy(&pg_log_background.wakeup);
+    return false;
+  }
+
+  __atomic_store_n(&pg_log_background.running, true, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Write out the calling thread's buffer and everything queued, then stop the
+// background thread.
+__attribute__((unused)) static void pg_log_background_stop(void) {
+  pg_log_flush();
+  if (!__atomic_load_n(&pg_log_background.running, __ATOMIC_ACQUIRE))
+    return;
+
+  __atomic_store_n(&pg_log_background.running, false, __ATOMIC_SEQ_CST);
+  // Pushes which saw it running must land before the thread exits.
+  while (__atomic_load_n(&pg_log_background.pushers_count, __ATOMIC_ACQUIRE) >
+         0)
+    sched_yield();
+
+  __atomic_store_n(&pg_log_background.stop, true, __ATOMIC_SEQ_CST);
+  pg_wakeup_signal(&pg_log_background.wakeup);
+  pthread_join(pg_log_background.thread, NULL);
+
+  pg_mpsc_destroy(&pg_log_background.queue);
+  pg_wakeup_destroy(&pg_log_background.wakeup);
+}
+
+__attribute__((unused)) static void pg_log_flush_at_exit(void) {
+  pg_log_background_stop();
+}
+
+// Format in the buffer of the calling thread.
+__attribute__((unused)) static void pg_log_text(pg_log_level_t level,
+                                                const char *fmt,
+                                                va_list args) {
+  pg_log_buffer_t *const buf = &pg_log_buffer;
+  const bool tty = pg_log_is_tty();
+  const char *const prefix = pg_log_level_prefix(level, tty);
+  const char *const suffix = pg_log_suffix(tty);
+  const uint64_t prefix_len = strlen(prefix), suffix_len = strlen(suffix);
+
+  for (uint64_t attempt = 0; attempt < 2; attempt++) {
+    const uint64_t start = buf->len;
+    if (start + prefix_len + suffix_len < PG_LOG_BUFFER_SIZE) {
+      memcpy(buf->data + start, prefix, prefix_len);
+      const uint64_t rem = PG_LOG_BUFFER_SIZE - start - prefix_len;
+
+      va_list args_copy;
+      va_copy(args_copy, args);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+      const int n = vsnprintf((char *)buf->data + start + prefix_len, rem, fmt,
+                              args_copy);
+#pragma GCC diagnostic pop
+      va_end(args_copy);
+      if (n < 0)
+        return;
+
+      if ((uint64_t)n + suffix_len < rem) {
+        memcpy(buf->data + start + prefix_len + (uint64_t)n, suffix,
+               suffix_len);
+        buf->len = start + prefix_len + (uint64_t)n + suffix_len;
+        return;
+      }
+    }
+
+    // Does not fit: make room and try again.
+    if (start == 0)
+      break;
+    pg_log_flush();
+  }
+
+  // Too big for the buffer.
+  pg_log_flush();
+  fputs(prefix, stderr);
+  vfprintf(stderr, fmt, args);
+  fputs(suffix, stderr);
+}
+
+__attribute__((unused)) static bool pg_log_binary(pg_log_level_t level,
+                                                  const char *fmt,
+                                                  va_list args) {
+  pg_log_buffer_t *const buf = &pg_log_buffer;
+
+  for (uint64_t attempt = 0; attempt < 2; attempt++) {
+    const uint64_t start = buf->len;
+    if (start + sizeof(pg_log_record_t) <= PG_LOG_BUFFER_SIZE) {
+      uint8_t *const args_dst = buf->data + start + sizeof(pg_log_record_t);
+      const uint64_t cap =
+          PG_LOG_BUFFER_SIZE - start - sizeof(pg_log_record_t);
+      uint64_t args_len = 0;
+
+      va_list args_copy;
+      va_copy(args_copy, args);
+      const bool ok =
+          pg_log_args_encode(args_dst, cap, &args_len, fmt, args_copy);
+      va_end(args_copy);
+
+      if (ok) {
+        const pg_log_record_t record = {.fmt = fmt,
+                                        .level = (uint32_t)level,
+                                        .args_len = (uint32_t)args_len};
+        memcpy(buf->data + start, &record, sizeof(record));
+        buf->len = start + sizeof(record) + args_len;
+        return true;
+      }
+    }
+
+    if (start == 0)
+      break;
+    pg_log_flush();
+  }
+  return false;
+}
+
+// Returns false if the message should be dropped.
+__attribute__((unused)) static bool pg_log_rate_limit(const pg_logger_t *logger,
+                                                      pg_log_site_t *site,
+                                                      uint32_t *suppressed) {
+  *suppressed = 0;
+  if (logger->max_per_second == 0 || site == NULL)
+    return true;
+
+  const uint64_t now = pg_now_ns();
+  const uint64_t window_start =
+      __atomic_load_n(&site->window_start_ns, __ATOMIC_RELAXED);
+  if (now - window_start >= 1000 * 1000 * 1000) {
+    __atomic_store_n(&site->window_start_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) >
+      logger->max_per_second) {
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  return true;
+}
+
+__attribute__((unused)) static void
+pg_log_write_va(const pg_logger_t *logger, pg_log_level_t level,
+                const char *fmt, va_list args) {
+  static bool at_exit_registered = false;
+  if (!__atomic_test_and_set(&at_exit_registered, __ATOMIC_RELAXED))
+    atexit(pg_log_flush_at_exit);
+
+  pg_log_buffer_t *const buf = &pg_log_buffer;
+  const bool binary = logger->flags & PG_LOG_FLAGS_BINARY;
+  if (buf->len > 0 && buf->binary != binary)
+    pg_log_flush();
+  buf->binary = binary;
+
+  if (binary) {
+    if (!pg_log_binary(level, fmt, args)) {
+      // Too big for the buffer: format it now instead.
+      pg_log_flush();
+      buf->binary = false;
+      pg_log_text(level, fmt, args);
+    }
+  } else {
+    pg_log_text(level, fmt, args);
+  }
+
+  if (!(logger->flags & (PG_LOG_FLAGS_BUFFERED | PG_LOG_FLAGS_BINARY)) ||
+      level >= PG_LOG_ERROR)
+    pg_log_flush();
+}
+
+__attribute__((unused)) static void pg_log_write_one(const pg_logger_t *logger,
+                                                     pg_log_level_t level,
+                                                     const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  pg_log_write_va(logger, level, fmt, args);
+  va_end(args);
+}
+
+__attribute__((unused, format(printf, 4, 5))) static void
+pg_log_write(const pg_logger_t *logger, pg_log_site_t *site,
+             pg_log_level_t level, const char *fmt, ...) {
+  uint32_t suppressed = 0;
+  const bool keep = pg_log_rate_limit(logger, site, &suppressed);
+  if (suppressed > 0)
+    pg_log_write_one(logger, level, "(suppressed %u similar messages)",
+                     suppressed);
+  if (!keep)
+    return;
+
+  va_list args;
+  va_start(args, fmt);
+  pg_log_write_va(logger, level, fmt, args);
+  va_end(args);
+}
+
+#define pg_log_debug(logger, fmt, ...)                                         \
+  do {                                                                         \
+    if ((logger) != NULL && (logger)->level <= PG_LOG_DEBUG) {                 \
+      static pg_log_site_t pg__site;                                           \
+      pg_log_write((logger), &pg__site, PG_LOG_DEBUG, fmt, ##__VA_ARGS__);     \
+    }                                                                          \
+  } while (0)
+
+#define pg_log_info(logger, fmt, ...)                                          \
+  do {                                                                         \
+    if ((logger) != NULL && (logger)->level <= PG_LOG_INFO) {                  \
+      static pg_log_site_t pg__site;                                           \
+      pg_log_write((logger), &pg__site, PG_LOG_INFO, fmt, ##__VA_ARGS__);      \
+    }                                                                          \
+  } while (0)
+
+#define pg_log_error(logger, fmt, ...)                                         \
+  do {                                                                         \
+    if ((logger) != NULL && (logger)->level <= PG_LOG_ERROR) {                 \
+      static pg_log_site_t pg__site;                                           \
+      pg_log_write((logger), &pg__site, PG_LOG_ERROR, fmt, ##__VA_ARGS__);     \
+    }                                                                          \
+  } while (0)
+
+// Never rate limited.
+#define pg_log_fatal(logger, exit_code, fmt, ...)                              \
+  do {                                                                         \
+    if ((logger) != NULL && (logger)->level <= PG_LOG_FATAL) {                 \
+      pg_log_write((logger), NULL, PG_LOG_FATAL, fmt, ##__VA_ARGS__);          \
+      pg_log_background_stop();                                                \
+      exit((int)exit_code);                                                    \
+    }                                                                          \
+  } while (0)
+
+// -------------------------- Ring buffer of bytes
+
+typedef struct {
+  uint8_t *data;
+  uint64_t len, offset, cap;
+  pg_allocator_t allocator;
+  // The same physical pages are mapped twice back to back: `data[cap + i]`
+  // aliases `data[i]`, so any region of the ring is contiguous in memory.
+  bool mirrored;
+  PG_PAD(7);
+} pg_ring_t;
+
+__attribute__((unused)) static void
+pg_ring_init(pg_allocator_t allocator, pg_ring_t *ring, uint64_t cap) {
+  assert(cap > 0);
+
+  ring->len = ring->offset = 0;
+  ring->data = pg_alloc(allocator, cap);
+  ring->cap = cap;
+  ring->allocator = allocator;
+  ring->mirrored = false;
+}
+
+// Shared memory object with no name in the filesystem.
+__attribute__((unused)) static int pg_anonymous_shm_open(void) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+  return memfd_create("pg_ring", MFD_CLOEXEC);
+#else
+  static uint32_t counter = 0;
+  char name[64] = "";
+  snprintf(name, sizeof(name), "/pg_ring_%d_%u", getpid(),
+           __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd != -1)
+    shm_unlink(name);
+  return fd;
+#endif
+}
+
+// `cap` is rounded up to the page size. Falls back to `pg_ring_init` when the
+// double mapping cannot be set up, the return value tells which one it is.
+__attribute__((unused)) static bool
+pg_ring_init_mirrored(pg_allocator_t allocator, pg_ring_t *ring,
+                      uint64_t cap) {
+  assert(cap > 0);
+
+  const uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+  cap = pg_align_forward(cap, page_size);
+
+  const int fd = pg_anonymous_shm_open();
+  if (fd == -1)
+    goto fallback;
+
+  if (ftruncate(fd, (off_t)cap) == -1) {
+    close(fd);
+    goto fallback;
+  }
+
+  // Reserve the whole range first so that the second mapping cannot collide
+  // with anything else, then map the object twice over it.
+  uint8_t *data = pg_mmap_anonymous(2 * cap);
+  if (data == NULL) {
+    close(fd);
+    goto fallback;
+  }
+  if (mmap(data, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+          MAP_FAILED ||
+      mmap(data + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    munmap(data, 2 * cap);
+    close(fd);
+    goto fallback;
+  }
+  close(fd); // The mappings keep the object alive
+
+  *ring = (pg_ring_t){
+      .data = data,
+      .cap = cap,
+      .allocator = allocator,
+      .mirrored = true,
+  };
+  return true;
+
+fallback:
+  pg_ring_init(allocator, ring, cap);
+  return false;
+}
+
+__attribute__((unused)) static uint64_t pg_ring_len(pg_ring_t *ring) {
+  return ring->len;
+}
+
+__attribute__((unused)) static uint64_t pg_ring_cap(pg_ring_t *ring) {
+  return ring->cap;
+}
+
+__attribute__((unused)) static void pg_ring_destroy(pg_ring_t *ring) {
+  if (ring->mirrored)
+    munmap(ring->data, 2 * ring->cap);
+  else
+    pg_free(ring->allocator, ring->data);
+}
+
+__attribute__((unused)) static uint8_t *pg_ring_get_ptr(pg_ring_t *ring,
+                                                        uint64_t i) {
+  if (ring->cap == 0)
+    return NULL;
+
+  assert(i < ring->cap);
+  const uint64_t index = (i + ring->offset) % ring->cap;
+  return &ring->data[index];
+}
+
+__attribute__((unused)) static uint8_t pg_ring_get(pg_ring_t *ring,
+                                                   uint64_t i) {
+  return *pg_ring_get_ptr(ring, i);
+}
+
+__attribute__((unused)) static uint8_t *pg_ring_front_ptr(pg_ring_t *ring) {
+  assert(ring->offset < ring->cap);
+  return &ring->data[ring->offset];
+}
+
+__attribute__((unused)) static uint8_t pg_ring_front(pg_ring_t *ring) {
+  return *pg_ring_front_ptr(ring);
+}
+
+__attribute__((unused)) static uint8_t *pg_ring_back_ptr(pg_ring_t *ring) {
+  if (ring->cap == 0)
+    return NULL;
+
+  const uint64_t index = (ring->offset + ring->len - 1) % ring->cap;
+  return &ring->data[index];
+}
+
+__attribute__((unused)) static uint8_t pg_ring_back(pg_ring_t *ring) {
   return *pg_ring_back_ptr(ring);
 }
 
-__attribute__((unused)) static void pg_ring_push_back(pg_ring_t *ring,
-                                                      uint8_t x) {
-  assert(ring->len < ring->cap);
+__attribute__((unused)) static void pg_ring_push_back(pg_ring_t *ring,
+                                                      uint8_t x) {
+  assert(ring->len < ring->cap);
+
+  const uint64_t index = (ring->offset + ring->len) % ring->cap;
+  assert(index < ring->cap);
+  ring->data[index] = x;
+  ring->len += 1;
+}
+
+__attribute__((unused)) static void pg_ring_push_front(pg_ring_t *ring,
+                                                       uint8_t x) {
+  assert(ring->len < ring->cap);
+
+  ring->offset = (ring->offset - 1 + ring->cap) % ring->cap;
+  assert(ring->offset < ring->cap);
+  ring->data[ring->offset] = x;
+  ring->len += 1;
+}
+
+__attribute__((unused)) static uint8_t pg_ring_pop_back(pg_ring_t *ring) {
+  assert(ring->len > 0);
+  ring->len -= 1;
+  const uint64_t index = (ring->offset + ring->len) % ring->cap;
+  assert(index < ring->cap);
+  return ring->data[index];
+}
+
+__attribute__((unused)) static uint8_t pg_ring_pop_front(pg_ring_t *ring) {
+  assert(ring->len > 0);
+  assert(ring->offset < ring->cap);
+  const uint8_t res = ring->data[ring->offset];
+
+  ring->offset = (ring->offset + 1) % ring->cap;
+  ring->len -= 1;
+
+  return res;
+}
+
+__attribute__((unused)) static void pg_ring_consume_front(pg_ring_t *ring,
+                                                          uint64_t n) {
+  assert(n <= ring->len);
+  ring->offset = (ring->offset + n) % ring->cap;
+  ring->len -= n;
+}
+
+__attribute__((unused)) static void pg_ring_consume_back(pg_ring_t *ring,
+                                                         uint64_t n) {
+  assert(n <= ring->len);
+  ring->len -= n;
+}
+
+__attribute__((unused)) static void pg_ring_clear(pg_ring_t *ring) {
+  ring->offset = 0;
+  ring->len = 0;
+}
+
+__attribute__((unused)) static uint64_t pg_ring_space(pg_ring_t *ring) {
+  return ring->cap - ring->len;
+}
+
+__attribute__((unused)) static void
+pg_ring_push_backv(pg_ring_t *ring, const uint8_t *data, uint64_t len) {
+  assert(ring->len + len <= ring->cap);
+
+  const uint64_t index = (ring->offset + ring->len) % ring->cap;
+
+  // Fill the tail
+  const uint64_t space_tail = ring->cap - index;
+  uint64_t to_write_tail_count = len;
+  if (to_write_tail_count > space_tail)
+    to_write_tail_count = space_tail;
+  assert(index + to_write_tail_count <= ring->cap);
+  memcpy(ring->data + index, data, to_write_tail_count);
+
+  // Fill the head
+  const uint64_t remain = len - to_write_tail_count;
+  memcpy(ring->data, data + to_write_tail_count, remain);
+  ring->len += len;
+}
+
+// Contiguous readable bytes at the front: all of them for a mirrored ring,
+// otherwise up to the end of the underlying buffer.
+__attribute__((unused)) static pg_span_t pg_ring_peek_span(pg_ring_t *ring) {
+  const uint64_t len =
+      ring->mirrored ? ring->len : MIN(ring->len, ring->cap - ring->offset);
+  return (pg_span_t){.data = (char *)ring->data + ring->offset, .len = len};
+}
+
+// Contiguous writable space at the back, to be filled e.g. by read(2) and
+// then published with `pg_ring_commit_write`.
+__attribute__((unused)) static pg_span_t pg_ring_write_span(pg_ring_t *ring) {
+  const uint64_t index = (ring->offset + ring->len) % ring->cap;
+  const uint64_t space = pg_ring_space(ring);
+  const uint64_t len = ring->mirrored ? space : MIN(space, ring->cap - index);
+  return (pg_span_t){.data = (char *)ring->data + index, .len = len};
+}
+
+__attribute__((unused)) static void pg_ring_commit_write(pg_ring_t *ring,
+                                                         uint64_t n) {
+  assert(ring->len + n <= ring->cap);
+  ring->len += n;
+}
+
+__attribute__((unused)) static void pg_reverse_bytes(uint8_t *data,
+                                                     uint64_t len) {
+  for (uint64_t i = 0, j = len; i + 1 < j; i++, j--) {
+    const uint8_t tmp = data[i];
+    data[i] = data[j - 1];
+    data[j - 1] = tmp;
+  }
+}
+
+// Make `pg_ring_peek_span` cover all the bytes, for a ring which is not
+// mirrored and wraps around. The buffer is rotated in place.
+__attribute__((unused)) static void pg_ring_make_contiguous(pg_ring_t *ring) {
+  if (ring->mirrored || ring->offset + ring->len <= ring->cap)
+    return;
+
+  pg_reverse_bytes(ring->data, ring->offset);
+  pg_reverse_bytes(ring->data + ring->offset, ring->cap - ring->offset);
+  pg_reverse_bytes(ring->data, ring->cap);
+  ring->offset = 0;
+}
+
+__attribute__((unused)) static void
+pg_ring_peek_frontv(pg_ring_t *ring, uint8_t *data, uint64_t len) {
+  assert(len <= ring->len);
+
+  if (ring->mirrored) {
+    memcpy(data, ring->data + ring->offset, len);
+    return;
+  }
+
+  const uint64_t head_count = MIN(len, ring->cap - ring->offset);
+  memcpy(data, ring->data + ring->offset, head_count);
+  memcpy(data + head_count, ring->data, len - head_count);
+}
+
+__attribute__((unused)) static void
+pg_ring_pop_frontv(pg_ring_t *ring, uint8_t *data, uint64_t len) {
+  pg_ring_peek_frontv(ring, data, len);
+  pg_ring_consume_front(ring, len);
+}
+
+// -------------------------- bitarray
+
+// Bits are stored LSB-first in 64 bits words so that most operations work on
+// a whole word at a time. Invariant: the bits past `max_index` in the last
+// word are always 0, so that counting and searching need no masking.
+typedef struct {
+  pg_array_t(uint64_t) data;
+  uint64_t max_index;
+} pg_bitarray_t;
+
+#define PG_BITARRAY_WORD_BITS 64ULL
+
+__attribute__((unused)) static uint64_t
+pg_bitarray_words_count(uint64_t max_index) {
+  return max_index / PG_BITARRAY_WORD_BITS + 1;
+}
+
+// Mask of the valid bits in the last word.
+__attribute__((unused)) static uint64_t
+pg_bitarray_tail_mask(const pg_bitarray_t *bitarr) {
+  const uint64_t bits = (bitarr->max_index + 1) % PG_BITARRAY_WORD_BITS;
+  return bits == 0 ? UINT64_MAX : (1ULL << bits) - 1;
+}
+
+__attribute__((unused)) static void
+pg_bitarray_clear_tail(pg_bitarray_t *bitarr) {
+  bitarr->data[pg_array_len(bitarr->data) - 1] &= pg_bitarray_tail_mask(bitarr);
+}
+
+__attribute__((unused)) static void pg_bitarray_init(pg_allocator_t allocator,
+                                                     pg_bitarray_t *bitarr,
+                                                     uint64_t max_index) {
+  bitarr->max_index = max_index;
+  const uint64_t len = pg_bitarray_words_count(max_index);
+  pg_array_init_reserve(bitarr->data, len, allocator);
+  pg_array_resize(bitarr->data, len);
+  memset(bitarr->data, 0, len * sizeof(uint64_t));
+}
+
+// `data` holds the bits LSB-first, one byte after the other. Since the words
+// are little-endian, this is a plain copy.
+__attribute__((unused)) static void
+pg_bitarray_setv(pg_bitarray_t *bitarr, uint8_t *data, uint64_t len) {
+  const uint64_t cap = pg_array_len(bitarr->data) * sizeof(uint64_t);
+  assert(len <= cap);
+
+  memcpy(bitarr->data, data, len);
+  memset((uint8_t *)bitarr->data + len, 0, cap - len);
+  pg_bitarray_clear_tail(bitarr);
+}
+
+__attribute__((unused)) static void pg_bitarray_destroy(pg_bitarray_t *bitarr) {
+  pg_array_free(bitarr->data);
+}
+
+__attribute__((unused)) static uint64_t
+pg_bitarray_len(const pg_bitarray_t *bitarr) {
+  return bitarr->max_index + 1;
+}
+
+__attribute__((unused)) static void pg_bitarray_set(pg_bitarray_t *bitarr,
+                                                    uint64_t index) {
+  assert(index <= bitarr->max_index);
+
+  bitarr->data[index / PG_BITARRAY_WORD_BITS] |=
+      1ULL << (index % PG_BITARRAY_WORD_BITS);
+}
+
+__attribute__((unused)) static bool pg_bitarray_get(const pg_bitarray_t *bitarr,
+                                                    uint64_t index) {
+  assert(index <= bitarr->max_index);
+
+  return (bitarr->data[index / PG_BITARRAY_WORD_BITS] >>
+          (index % PG_BITARRAY_WORD_BITS)) &
+         1;
+}
+
+__attribute__((unused)) static bool
+pg_bitarray_next(const pg_bitarray_t *bitarr, uint64_t *index, bool *is_set) {
+  if (*index >= pg_bitarray_len(bitarr))
+    return false;
+
+  *is_set = pg_bitarray_get(bitarr, *index);
+  *index += 1;
+  return true;
+}
+
+__attribute__((unused)) static void pg_bitarray_unset(pg_bitarray_t *bitarr,
+                                                      uint64_t index) {
+  assert(index <= bitarr->max_index);
+
+  bitarr->data[index / PG_BITARRAY_WORD_BITS] &=
+      ~(1ULL << (index % PG_BITARRAY_WORD_BITS));
+}
+
+// Find the first set bit at or after `start`.
+// Usage: `for (uint64_t i = 0; pg_bitarray_find_next_set(b, i, &i); i++)`.
+__attribute__((unused)) static bool
+pg_bitarray_find_next_set(const pg_bitarray_t *bitarr, uint64_t start,
+                          uint64_t *index) {
+  if (start > bitarr->max_index)
+    return false;
+
+  const uint64_t words_count = pg_array_len(bitarr->data);
+  uint64_t w = start / PG_BITARRAY_WORD_BITS;
+  uint64_t word =
+      bitarr->data[w] & (UINT64_MAX << (start % PG_BITARRAY_WORD_BITS));
+
+  for (;;) {
+    if (word != 0) {
+      *index = w * PG_BITARRAY_WORD_BITS + (uint64_t)__builtin_ctzll(word);
+      return true;
+    }
+    w += 1;
+    if (w >= words_count)
+      return false;
+    word = bitarr->data[w];
+  }
+}
+
+__attribute__((unused)) static bool
+pg_bitarray_find_first_set(const pg_bitarray_t *bitarr, uint64_t *index) {
+  return pg_bitarray_find_next_set(bitarr, 0, index);
+}
+
+// Find the first bit at or after `start` which is set in both `a` and `b`,
+// without materializing the intersection.
+__attribute__((unused)) static bool
+pg_bitarray_find_next_set_and(const pg_bitarray_t *a, const pg_bitarray_t *b,
+                              uint64_t start, uint64_t *index) {
+  assert(a->max_index == b->max_index);
+  if (start > a->max_index)
+    return false;
+
+  const uint64_t words_count = pg_array_len(a->data);
+  uint64_t w = start / PG_BITARRAY_WORD_BITS;
+  uint64_t word = a->data[w] & b->data[w] &
+                  (UINT64_MAX << (start % PG_BITARRAY_WORD_BITS));
+
+  for (;;) {
+    if (word != 0) {
+      *index = w * PG_BITARRAY_WORD_BITS + (uint64_t)__builtin_ctzll(word);
+      return true;
+    }
+    w += 1;
+    if (w >= words_count)
+      return false;
+    word = a->data[w] & b->data[w];
+  }
+}
+
+__attribute__((unused)) static uint64_t
+pg_bitarray_count_set(const pg_bitarray_t *bitarr) {
+  uint64_t res = 0;
+  for (uint64_t i = 0; i < pg_array_len(bitarr->data); i++) {
+    res += (uint64_t)__builtin_popcountll(bitarr->data[i]);
+  }
+  return res;
+}
+
+__attribute__((unused)) static uint64_t
+pg_bitarray_count_unset(const pg_bitarray_t *bitarr) {
+  return pg_bitarray_len(bitarr) - pg_bitarray_count_set(bitarr);
+}
+
+// Whether any bit in [start, end) is equal to `value`. The full words in the
+// middle are OR-reduced in fixed-size blocks without branches so that the
+// compiler can vectorize them, with an early exit after each block.
+__attribute__((unused)) static bool
+pg_bitarray_range_has(const pg_bitarray_t *bitarr, uint64_t start,
+                      uint64_t end, bool value) {
+  assert(start <= end);
+  assert(end <= pg_bitarray_len(bitarr));
+  if (start == end)
+    return false;
+
+  const uint64_t flip = value ? 0 : UINT64_MAX;
+  const uint64_t first = start / PG_BITARRAY_WORD_BITS;
+  const uint64_t last = (end - 1) / PG_BITARRAY_WORD_BITS;
+  const uint64_t first_mask = UINT64_MAX << (start % PG_BITARRAY_WORD_BITS);
+  const uint64_t last_mask =
+      UINT64_MAX >>
+      (PG_BITARRAY_WORD_BITS - 1 - (end - 1) % PG_BITARRAY_WORD_BITS);
+
+  if (first == last)
+    return ((bitarr->data[first] ^ flip) & first_mask & last_mask) != 0;
+
+  if ((bitarr->data[first] ^ flip) & first_mask)
+    return true;
+  if ((bitarr->data[last] ^ flip) & last_mask)
+    return true;
+
+  uint64_t i = first + 1;
+  for (; i + 8 <= last; i += 8) {
+    uint64_t acc = 0;
+    for (uint64_t j = 0; j < 8; j++)
+      acc |= bitarr->data[i + j] ^ flip;
+    if (acc)
+      return true;
+  }
+  for (; i < last; i++) {
+    if (bitarr->data[i] ^ flip)
+      return true;
+  }
+  return false;
+}
+
+__attribute__((unused)) static bool
+pg_bitarray_any_set_in_range(const pg_bitarray_t *bitarr, uint64_t start,
+                             uint64_t end) {
+  return pg_bitarray_range_has(bitarr, start, end, true);
+}
 
-  const uint64_t index = (ring->offset + ring->len) % ring->cap;
-  assert(index < ring->cap);
-  ring->data[index] = x;
-  ring->len += 1;
+__attribute__((unused)) static bool
+pg_bitarray_none_set_in_range(const pg_bitarray_t *bitarr, uint64_t start,
+                              uint64_t end) {
+  return !pg_bitarray_range_has(bitarr, start, end, true);
 }
 
-__attribute__((unused)) static void pg_ring_push_front(pg_ring_t *ring,
-                                                       uint8_t x) {
-  assert(ring->len < ring->cap);
+__attribute__((unused)) static bool
+pg_bitarray_all_set_in_range(const pg_bitarray_t *bitarr, uint64_t start,
+                             uint64_t end) {
+  return !pg_bitarray_range_has(bitarr, start, end, false);
+}
 
-  ring->offset = (ring->offset - 1 + ring->cap) % ring->cap;
-  assert(ring->offset < ring->cap);
-  ring->data[ring->offset] = x;
-  ring->len += 1;
+__attribute__((unused)) static bool
+pg_bitarray_is_all_set(const pg_bitarray_t *bitarr) {
+  return pg_bitarray_all_set_in_range(bitarr, 0, pg_bitarray_len(bitarr));
 }
 
-__attribute__((unused)) static uint8_t pg_ring_pop_back(pg_ring_t *ring) {
-  assert(ring->len > 0);
-  ring->len -= 1;
-  const uint64_t index = (ring->offset + ring->len) % ring->cap;
-  assert(index < ring->cap);
-  return ring->data[index];
+__attribute__((unused)) static bool
+pg_bitarray_is_all_unset(const pg_bitarray_t *bitarr) {
+  return pg_bitarray_none_set_in_range(bitarr, 0, pg_bitarray_len(bitarr));
 }
 
-__attribute__((unused)) static uint8_t pg_ring_pop_front(pg_ring_t *ring) {
-  assert(ring->len > 0);
-  assert(ring->offset < ring->cap);
-  const uint8_t res = ring->data[ring->offset];
+__attribute__((unused)) static void pg_bitarray_set_all(pg_bitarray_t *bitarr) {
+  memset(bitarr->data, 0xff, pg_array_len(bitarr->data) * sizeof(uint64_t));
+  pg_bitarray_clear_tail(bitarr);
+}
 
-  ring->offset = (ring->offset + 1) % ring->cap;
-  ring->len -= 1;
+__attribute__((unused)) static void
+pg_bitarray_unset_all(pg_bitarray_t *bitarr) {
+  memset(bitarr->data, 0, pg_array_len(bitarr->data) * sizeof(uint64_t));
+}
 
-  return res;
+// Bulk word-wise operations: `dst` and `src` must have the same length.
+// The loops are simple enough to be auto-vectorized.
+
+__attribute__((unused)) static void pg_bitarray_and(pg_bitarray_t *dst,
+                                                    const pg_bitarray_t *src) {
+  assert(dst->max_index == src->max_index);
+
+  uint64_t *restrict d = dst->data;
+  const uint64_t *restrict s = src->data;
+  const uint64_t len = pg_array_len(dst->data);
+  for (uint64_t i = 0; i < len; i++)
+    d[i] &= s[i];
+}
+
+// dst &= ~src
+__attribute__((unused)) static void
+pg_bitarray_andnot(pg_bitarray_t *dst, const pg_bitarray_t *src) {
+  assert(dst->max_index == src->max_index);
+
+  uint64_t *restrict d = dst->data;
+  const uint64_t *restrict s = src->data;
+  const uint64_t len = pg_array_len(dst->data);
+  for (uint64_t i = 0; i < len; i++)
+    d[i] &= ~s[i];
+}
+
+__attribute__((unused)) static void pg_bitarray_or(pg_bitarray_t *dst,
+                                                   const pg_bitarray_t *src) {
+  assert(dst->max_index == src->max_index);
+
+  uint64_t *restrict d = dst->data;
+  const uint64_t *restrict s = src->data;
+  const uint64_t len = pg_array_len(dst->data);
+  for (uint64_t i = 0; i < len; i++)
+    d[i] |= s[i];
+}
+
+__attribute__((unused)) static void pg_bitarray_resize(pg_bitarray_t *bitarr,
+                                                       uint64_t max_index) {
+  const uint64_t old_len = pg_array_len(bitarr->data);
+  const uint64_t len = pg_bitarray_words_count(max_index);
+
+  if (max_index < bitarr->max_index) {
+    bitarr->max_index = max_index;
+    pg_array_resize(bitarr->data, len);
+    pg_bitarray_clear_tail(bitarr);
+    return;
+  }
+
+  bitarr->max_index = max_index;
+  pg_array_resize(bitarr->data, len);
+  // Bits past the old `max_index` are already 0 in the old last word.
+  if (len > old_len)
+    memset(bitarr->data + old_len, 0, (len - old_len) * sizeof(uint64_t));
+}
+
+// ------------- File utils
+
+__attribute__((unused)) static bool
+pg_array_read_file_fd(int fd, pg_array_t(uint8_t) * buf) {
+  struct stat st = {0};
+  if (fstat(fd, &st) == -1) {
+    return false;
+  }
+  // Pipes and the like have no known size: read until EOF.
+  const bool is_regular = S_ISREG(st.st_mode);
+  const uint64_t size = is_regular ? (uint64_t)st.st_size : 0;
+  const uint64_t end = pg_array_len(*buf) + size;
+  const uint64_t read_buffer_size =
+      is_regular ? MIN((uint64_t)INT32_MAX, size) : 64 * 1024;
+  pg_array_grow(*buf, end);
+  while (!is_regular || pg_array_len(*buf) < end) {
+    if (!is_regular && pg_array_available_space(*buf) < read_buffer_size)
+      pg_array_grow(*buf, pg_array_len(*buf) + read_buffer_size);
+
+    int64_t ret =
+        read(fd, *buf + pg_array_len(*buf),
+             MIN(read_buffer_size, pg_array_available_space(*buf)));
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1) {
+      return false;
+    }
+    if (ret == 0)
+      return true;
+    pg_array_resize(*buf, pg_array_len(*buf) + (uint64_t)ret);
+  }
+  return true;
+}
+
+__attribute__((unused)) static bool pg_string_read_file_fd(int fd,
+                                                           pg_string_t *str) {
+  struct stat st = {0};
+  if (fstat(fd, &st) == -1) {
+    return false;
+  }
+  const uint64_t read_buffer_size =
+      MIN((uint64_t)INT32_MAX, (uint64_t)st.st_size);
+  *str = pg_string_make_space_for(*str, (uint64_t)st.st_size);
+
+  while (pg_string_len(*str) < (uint64_t)st.st_size) {
+    int64_t ret = read(fd, *str + pg_string_len(*str), read_buffer_size);
+    if (ret == -1) {
+      return false;
+    }
+    if (ret == 0)
+      return true;
+    const uint64_t new_len = pg_string_len(*str) + (uint64_t)ret;
+    *str = pg_string_make_space_for(*str, new_len);
+    pg__set_string_len(*str, new_len);
+  }
+  return true;
+}
+
+__attribute__((unused)) static bool pg_read_file(char *path,
+                                                 pg_array_t(uint8_t) * buf) {
+  const int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  const bool ok = pg_array_read_file_fd(fd, buf);
+  close(fd);
+  return ok;
+}
+
+typedef enum {
+  PG_MMAP_FLAGS_NONE = 0,
+  PG_MMAP_FLAGS_SEQUENTIAL = 1 << 0,
+  PG_MMAP_FLAGS_RANDOM = 1 << 1,
+  PG_MMAP_FLAGS_POPULATE = 1 << 2, // Fault in all pages up front.
+} pg_mmap_flags_t;
+
+// The read-only content of a file, mapped in memory if possible or read
+// otherwise (pipes, stdin, etc).
+typedef struct {
+  pg_span_t span;
+  pg_array_t(uint8_t) read_data; // Only set when the file was read.
+} pg_mapped_file_t;
+
+__attribute__((unused)) static bool pg_mmap_file_fd(int fd, uint32_t flags,
+                                                    pg_mapped_file_t *file) {
+  *file = (pg_mapped_file_t){0};
+
+  struct stat st = {0};
+  if (fstat(fd, &st) == -1)
+    return false;
+
+  if (S_ISREG(st.st_mode) && st.st_size == 0)
+    return true;
+
+  if (S_ISREG(st.st_mode)) {
+    const uint64_t size = (uint64_t)st.st_size;
+    int mmap_flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+    if (flags & PG_MMAP_FLAGS_POPULATE)
+      mmap_flags |= MAP_POPULATE;
+#endif
+    void *const data = mmap(NULL, size, PROT_READ, mmap_flags, fd, 0);
+    if (data != MAP_FAILED) {
+      if (flags & PG_MMAP_FLAGS_SEQUENTIAL)
+        madvise(data, size, MADV_SEQUENTIAL);
+      if (flags & PG_MMAP_FLAGS_RANDOM)
+        madvise(data, size, MADV_RANDOM);
+#if !defined(MAP_POPULATE)
+      if (flags & PG_MMAP_FLAGS_POPULATE)
+        madvise(data, size, MADV_WILLNEED);
+#endif
+      file->span = (pg_span_t){.data = data, .len = size};
+      return true;
+    }
+  }
+
+  pg_array_init_reserve(file->read_data, 0, pg_heap_allocator());
+  if (!pg_array_read_file_fd(fd, &file->read_data)) {
+    pg_array_free(file->read_data);
+    return false;
+  }
+  file->span = (pg_span_t){.data = (char *)file->read_data,
+                           .len = pg_array_len(file->read_data)};
+  return true;
+}
+
+// The file descriptor is not needed once mapped, so it is closed.
+__attribute__((unused)) static bool pg_mmap_file(const char *path,
+                                                 uint32_t flags,
+                                                 pg_mapped_file_t *file) {
+  const int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  const bool ok = pg_mmap_file_fd(fd, flags, file);
+  const int err = errno;
+  close(fd);
+  errno = err;
+  return ok;
+}
+
+__attribute__((unused)) static void pg_munmap_file(pg_mapped_file_t *file) {
+  if (file->read_data != NULL)
+    pg_array_free(file->read_data);
+  else if (file->span.len > 0)
+    munmap(file->span.data, file->span.len);
+
+  *file = (pg_mapped_file_t){0};
+}
+
+__attribute__((unused)) static char const *pg_path_base_name(char const *path) {
+  char const *ls;
+  assert(path != NULL);
+  ls = pg_char_last_occurence(path, '/');
+  return (ls == NULL) ? path : ls + 1;
+}
+__attribute__((unused)) static bool
+pg_string_read_from_stream_once(int fd, pg_string_t *str) {
+  const uint64_t read_batch_size = 4096;
+  if (pg_string_available_space(*str) < read_batch_size)
+    *str =
+        pg_string_make_space_for(*str, pg_string_len(*str) + read_batch_size);
+
+  const int64_t ret = read(fd, *str + pg_string_len(*str), read_batch_size);
+  if (ret == -1)
+    return false;
+  if (ret == 0)
+    return true;
+
+  const uint64_t new_len = pg_string_len(*str) + (uint64_t)ret;
+  pg__set_string_len(*str, new_len);
+
+  return true;
+}
+
+__attribute__((unused)) static bool
+pg_string_read_from_stream(int fd, pg_string_t *str) {
+  while (true) {
+    if (!pg_string_read_from_stream_once(fd, str))
+      return false;
+  }
+  __builtin_unreachable();
+}
+
+// -------------------------- Executor
+
+// Work-stealing thread pool. Each worker owns a Chase-Lev deque: it pushes
+// and pops at the bottom without contention while idle workers steal from
+// the top. Threads which are not workers submit through a shared deque.
+
+// Runs on [begin, end).
+typedef void (*pg_task_fn_t)(void *ctx, uint64_t begin, uint64_t end);
+
+typedef struct {
+  uint64_t pending;
+} pg_wait_group_t;
+
+typedef struct {
+  pg_task_fn_t fn;
+  void *ctx;
+  pg_wait_group_t *wait_group;
+  uint64_t begin, end;
+  uint64_t grain; // Ranges are not split below this length.
+} pg_task_t;
+
+// Ranges are split in halves so a few slots go a long way. When full, the
+// task is run right away by the pusher instead.
+#define PG_DEQUE_CAP ((int64_t)256)
+
+typedef struct {
+  // Each on its own cache line: thieves write `top`, the owner `bottom`.
+  int64_t top;
+  PG_PAD(56);
+  int64_t bottom;
+  PG_PAD(56);
+  pg_task_t tasks[PG_DEQUE_CAP];
+} pg_deque_t;
+
+// Slots can be read by a thief while the owner writes them: the CAS on
+// `top` decides whether the read is used.
+__attribute__((unused)) static void pg_task_load(const pg_task_t *src,
+                                                 pg_task_t *dst) {
+  dst->fn = __atomic_load_n(&src->fn, __ATOMIC_RELAXED);
+  dst->ctx = __atomic_load_n(&src->ctx, __ATOMIC_RELAXED);
+  dst->wait_group = __atomic_load_n(&src->wait_group, __ATOMIC_RELAXED);
+  dst->begin = __atomic_load_n(&src->begin, __ATOMIC_RELAXED);
+  dst->end = __atomic_load_n(&src->end, __ATOMIC_RELAXED);
+  dst->grain = __atomic_load_n(&src->grain, __ATOMIC_RELAXED);
+}
+
+__attribute__((unused)) static void pg_task_store(pg_task_t *dst,
+                                                  const pg_task_t *src) {
+  __atomic_store_n(&dst->fn, src->fn, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->ctx, src->ctx, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->wait_group, src->wait_group, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->begin, src->begin, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->end, src->end, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->grain, src->grain, __ATOMIC_RELAXED);
+}
+
+__attribute__((unused)) static int64_t pg_deque_len(const pg_deque_t *deque) {
+  const int64_t len = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) -
+                      __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  return MAX(len, (int64_t)0);
 }
 
-__attribute__((unused)) static void pg_ring_consume_front(pg_ring_t *ring,
-                                                          uint64_t n) {
-  assert(n <= ring->len);
-  ring->offset = (ring->offset + n) % ring->cap;
-  ring->len -= n;
+// Owner only.
+__attribute__((unused)) static bool pg_deque_push(pg_deque_t *deque,
+                                                  const pg_task_t *task) {
+  const int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  const int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (b - t >= PG_DEQUE_CAP)
+    return false;
+
+  pg_task_store(&deque->tasks[b & (PG_DEQUE_CAP - 1)], task);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+// Owner only.
+__attribute__((unused)) static bool pg_deque_pop(pg_deque_t *deque,
+                                                 pg_task_t *task) {
+  const int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (t > b) { // Empty.
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  pg_task_load(&deque->tasks[b & (PG_DEQUE_CAP - 1)], task);
+  if (t < b)
+    return true;
+
+  // Last one: race against thieves for it.
+  const bool won = __atomic_compare_exchange_n(
+      &deque->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+  return won;
+}
+
+// Any thread.
+__attribute__((unused)) static bool pg_deque_steal(pg_deque_t *deque,
+                                                   pg_task_t *task) {
+  int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  const int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b)
+    return false;
+
+  pg_task_load(&deque->tasks[t & (PG_DEQUE_CAP - 1)], task);
+  return __atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+typedef struct pg_executor_t pg_executor_t;
+
+typedef struct {
+  pg_deque_t deque;
+  pg_executor_t *executor;
+  pthread_t thread;
+  uint64_t rng;
+} pg_executor_worker_t;
+
+struct pg_executor_t {
+  pg_allocator_t allocator;
+  pg_executor_worker_t *workers;
+  uint64_t workers_count;
+
+  // Pushes from threads which are not workers, serialized by the lock.
+  pg_deque_t *injected;
+  pthread_mutex_t injected_lock;
+
+  // Bumped on each push, to not miss one while going to sleep.
+  uint64_t tasks_epoch;
+  uint64_t sleepers_count;
+  pthread_mutex_t sleep_lock;
+  pthread_cond_t sleep_cond;
+  bool stop;
+  PG_PAD(7);
+};
+
+// NULL when the current thread is not a worker.
+__attribute__((unused)) static __thread pg_executor_worker_t
+    *pg_executor_worker;
+
+__attribute__((unused)) static uint64_t pg_cpu_count(void) {
+  const long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (uint64_t)count : 1;
+}
+
+__attribute__((unused)) static void
+pg_executor_notify(pg_executor_t *executor) {
+  __atomic_fetch_add(&executor->tasks_epoch, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&executor->sleepers_count, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  pthread_mutex_lock(&executor->sleep_lock);
+  pthread_cond_signal(&executor->sleep_cond);
+  pthread_mutex_unlock(&executor->sleep_lock);
+}
+
+// The deque tasks of the current thread go to.
+__attribute__((unused)) static pg_deque_t *
+pg_executor_local_deque(pg_executor_t *executor) {
+  pg_executor_worker_t *const worker = pg_executor_worker;
+  return (worker != NULL && worker->executor == executor) ? &worker->deque
+                                                          : executor->injected;
+}
+
+__attribute__((unused)) static bool pg_executor_push(pg_executor_t *executor,
+                                                     const pg_task_t *task) {
+  pg_deque_t *const deque = pg_executor_local_deque(executor);
+  bool pushed = false;
+  if (deque == executor->injected) {
+    pthread_mutex_lock(&executor->injected_lock);
+    pushed = pg_deque_push(deque, task);
+    pthread_mutex_unlock(&executor->injected_lock);
+  } else {
+    pushed = pg_deque_push(deque, task);
+  }
+
+  if (pushed)
+    pg_executor_notify(executor);
+  return pushed;
+}
+
+__attribute__((unused)) static bool
+pg_executor_find_task(pg_executor_t *executor, pg_task_t *task) {
+  pg_executor_worker_t *const worker = pg_executor_worker;
+  uint64_t start = 0;
+  if (worker != NULL && worker->executor == executor) {
+    if (pg_deque_pop(&worker->deque, task))
+      return true;
+
+    // Random victim so that thieves do not all hit the same one.
+    worker->rng ^= worker->rng << 13;
+    worker->rng ^= worker->rng >> 7;
+    worker->rng ^= worker->rng << 17;
+    start = worker->rng;
+  }
+
+  for (uint64_t i = 0; i < executor->workers_count; i++) {
+    pg_executor_worker_t *const victim =
+        &executor->workers[(start + i) % executor->workers_count];
+    if (victim != worker && pg_deque_steal(&victim->deque, task))
+      return true;
+  }
+  return pg_deque_steal(executor->injected, task);
+}
+
+__attribute__((unused)) static void pg_executor_run(pg_executor_t *executor,
+                                                    pg_task_t task) {
+  const pg_deque_t *const deque = pg_executor_local_deque(executor);
+
+  while (task.begin < task.end) {
+    const uint64_t len = task.end - task.begin;
+
+    // Only split when the previous halves were stolen: this adapts the
+    // chunk size to how many workers are idle.
+    if (len > task.grain && pg_deque_len(deque) == 0) {
+      pg_task_t upper = task;
+      upper.begin = task.begin + len / 2;
+      __atomic_fetch_add(&task.wait_group->pending, 1, __ATOMIC_RELAXED);
+      if (pg_executor_push(executor, &upper)) {
+        task.end = upper.begin;
+        continue;
+      }
+      __atomic_fetch_sub(&task.wait_group->pending, 1, __ATOMIC_RELAXED);
+    }
+
+    const uint64_t end = task.begin + MIN(len, task.grain);
+    task.fn(task.ctx, task.begin, end);
+    task.begin = end;
+  }
+
+  __atomic_fetch_sub(&task.wait_group->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+__attribute__((unused)) static void *pg_executor_worker_run(void *arg) {
+  pg_executor_worker_t *const worker = arg;
+  pg_executor_t *const executor = worker->executor;
+  pg_executor_worker = worker;
+
+  uint64_t idle_rounds = 0;
+  for (;;) {
+    const uint64_t epoch =
+        __atomic_load_n(&executor->tasks_epoch, __ATOMIC_SEQ_CST);
+    pg_task_t task = {0};
+    if (pg_executor_find_task(executor, &task)) {
+      pg_executor_run(executor, task);
+      idle_rounds = 0;
+      continue;
+    }
+
+    // Stay around a bit since parallel loops tend to come in series.
+    if (idle_rounds++ < 64) {
+      sched_yield();
+      continue;
+    }
+
+    pthread_mutex_lock(&executor->sleep_lock);
+    if (executor->stop) {
+      pthread_mutex_unlock(&executor->sleep_lock);
+      break;
+    }
+    __atomic_fetch_add(&executor->sleepers_count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&executor->tasks_epoch, __ATOMIC_SEQ_CST) == epoch)
+      pthread_cond_wait(&executor->sleep_cond, &executor->sleep_lock);
+    __atomic_fetch_sub(&executor->sleepers_count, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&executor->sleep_lock);
+    idle_rounds = 0;
+  }
+
+  return NULL;
 }
 
-__attribute__((unused)) static void pg_ring_consume_back(pg_ring_t *ring,
-                                                         uint64_t n) {
-  assert(n <= ring->len);
-  ring->len -= n;
+// With `workers_count` 0, one worker per CPU besides the calling thread,
+// which also runs tasks while waiting. The executor must not move after.
+__attribute__((unused)) static bool pg_executor_init(pg_executor_t *executor,
+                                                     pg_allocator_t allocator,
+                                                     uint64_t workers_count) {
+  if (workers_count == 0)
+    workers_count = MAX(pg_cpu_count() - 1, 1ULL);
+
+  *executor = (pg_executor_t){
+      .allocator = allocator,
+      .workers_count = workers_count,
+      .injected_lock = PTHREAD_MUTEX_INITIALIZER,
+      .sleep_lock = PTHREAD_MUTEX_INITIALIZER,
+      .sleep_cond = PTHREAD_COND_INITIALIZER,
+  };
+  executor->injected = pg_alloc(allocator, sizeof(pg_deque_t));
+  executor->workers =
+      pg_alloc(allocator, workers_count * sizeof(pg_executor_worker_t));
+
+  for (uint64_t i = 0; i < workers_count; i++) {
+    pg_executor_worker_t *const worker = &executor->workers[i];
+    worker->executor = executor;
+    worker->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+
+    int ret = 0;
+    if ((ret = pthread_create(&worker->thread, NULL, pg_executor_worker_run,
+                              worker)) != 0) {
+      executor->workers_count = i;
+      errno = ret;
+      return false;
+    }
+  }
+  return true;
 }
 
-__attribute__((unused)) static void pg_ring_clear(pg_ring_t *ring) {
-  ring->offset = 0;
-  ring->len = 0;
+// All tasks must have been waited on.
+__attribute__((unused)) static void
+pg_executor_destroy(pg_executor_t *executor) {
+  pthread_mutex_lock(&executor->sleep_lock);
+  executor->stop = true;
+  pthread_cond_broadcast(&executor->sleep_cond);
+  pthread_mutex_unlock(&executor->sleep_lock);
+
+  for (uint64_t i = 0; i < executor->workers_count; i++)
+    pthread_join(executor->workers[i].thread, NULL);
+
+  pg_free(executor->allocator, executor->workers);
+  pg_free(executor->allocator, executor->injected);
+  pthread_mutex_destroy(&executor->injected_lock);
+  pthread_mutex_destroy(&executor->sleep_lock);
+  pthread_cond_destroy(&executor->sleep_cond);
 }
 
-__attribute__((unused)) static uint64_t pg_ring_space(pg_ring_t *ring) {
-  return ring->cap - ring->len;
+// Runs tasks, including unrelated ones, until those of `wait_group` are done.
+__attribute__((unused)) static void
+pg_wait_group_wait(pg_executor_t *executor, pg_wait_group_t *wait_group) {
+  while (__atomic_load_n(&wait_group->pending, __ATOMIC_ACQUIRE) > 0) {
+    pg_task_t task = {0};
+    if (pg_executor_find_task(executor, &task))
+      pg_executor_run(executor, task);
+    else
+      sched_yield();
+  }
 }
 
+// Calls `fn(ctx, 0, 1)` on some thread. Wait with `pg_wait_group_wait`.
 __attribute__((unused)) static void
-pg_ring_push_backv(pg_ring_t *ring, const uint8_t *data, uint64_t len) {
-  assert(ring->len + len <= ring->cap);
-
-  const uint64_t index = (ring->offset + ring->len) % ring->cap;
+pg_executor_submit(pg_executor_t *executor, pg_wait_group_t *wait_group,
+                   pg_task_fn_t fn, void *ctx) {
+  const pg_task_t task = {.fn = fn,
+                          .ctx = ctx,
+                          .wait_group = wait_group,
+                          .begin = 0,
+                          .end = 1,
+                          .grain = 1};
+  __atomic_fetch_add(&wait_group->pending, 1, __ATOMIC_RELAXED);
+  if (!pg_executor_push(executor, &task))
+    pg_executor_run(executor, task);
+}
 
-  // Fill the tail
-  const uint64_t space_tail = ring->cap - index;
-  uint64_t to_write_tail_count = len;
-  if (to_write_tail_count > space_tail)
-    to_write_tail_count = space_tail;
-  assert(index + to_write_tail_count <= ring->cap);
-  memcpy(ring->data + index, data, to_write_tail_count);
+// Calls `fn` on sub-ranges covering [begin, end) in parallel and waits for
+// them. They are `grain` long at most, or picked from the range length and
+// the number of workers when `grain` is 0.
+__attribute__((unused)) static void
+pg_executor_parallel_for(pg_executor_t *executor, uint64_t begin,
+                         uint64_t end, uint64_t grain, pg_task_fn_t fn,
+                         void *ctx) {
+  if (begin >= end)
+    return;
 
-  // Fill the head
-  const uint64_t remain = len - to_write_tail_count;
-  memcpy(ring->data, data + to_write_tail_count, remain);
-  ring->len += len;
+  if (grain == 0)
+    grain = MAX((end - begin) / ((executor->workers_count + 1) * 32), 1ULL);
+
+  pg_wait_group_t wait_group = {0};
+  const pg_task_t task = {.fn = fn,
+                          .ctx = ctx,
+                          .wait_group = &wait_group,
+                          .begin = begin,
+                          .end = end,
+                          .grain = grain};
+  __atomic_fetch_add(&wait_group.pending, 1, __ATOMIC_RELAXED);
+  pg_executor_run(executor, task);
+  pg_wait_group_wait(executor, &wait_group);
 }
 
-// -------------------------- bitarray
+// -------------------------- Radix sort
+
+// Stable LSD radix sort, one byte per pass. Each key can carry a value of
+// the same width, e.g. its index to sort other arrays with. Histograms of
+// all bytes are computed in one read, and passes where all keys have the
+// same byte are skipped: keys sharing high bytes (addresses, timestamps)
+// sort in fewer passes. Scratch space for a copy of the arrays comes from
+// `allocator`.
+//
+// The `_parallel` variant splits the arrays in one block per thread. Each
+// pass counts the digits of each block then scatters the blocks at once:
+// the offsets of a block for a digit come after those of all lower digits
+// and of the same digit in previous blocks, which keeps it stable.
+
+#define PG_RADIX_BUCKETS 256
+// Below this, splitting between threads costs more than it brings.
+#define PG_RADIX_PARALLEL_MIN_BLOCK_LEN (64 * 1024ULL)
+
+#define PG_RADIX_SORT_DEFINE(name, key_type)                                   \
+  typedef struct {                                                             \
+    key_type *src_keys, *dst_keys, *src_values, *dst_values;                   \
+    uint64_t len, block_len, shift;                                            \
+    uint64_t (*counts)[PG_RADIX_BUCKETS]; /* Per block. */                     \
+  } name##_pass_t;                                                             \
+                                                                               \
+  __attribute__((unused)) static void name##_scatter(                          \
+      name##_pass_t *pass, uint64_t begin, uint64_t end,                       \
+      uint64_t *offsets) {                                                     \
+    for (uint64_t i = begin; i < end; i++) {                                   \
+      const key_type key = pass->src_keys[i];                                  \
+      const uint64_t dst = offsets[(key >> pass->shift) & 0xff]++;             \
+      pass->dst_keys[dst] = key;                                               \
+      if (pass->src_values != NULL)                                            \
+        pass->dst_values[dst] = pass->src_values[i];                           \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* Returns the sorted arrays, `keys`/`values` or the scratch ones. */        \
+  __attribute__((unused)) static void name##_finish(                           \
+      name##_pass_t *pass, key_type *keys, key_type *values,                   \
+      pg_allocator_t allocator) {                                              \
+    if (pass->src_keys != keys) {                                              \
+      memcpy(keys, pass->src_keys, pass->len * sizeof(key_type));              \
+      if (values != NULL)                                                      \
+        memcpy(values, pass->src_values, pass->len * sizeof(key_type));        \
+    }                                                                          \
+    pg_free(allocator, keys == pass->src_keys ? pass->dst_keys                 \
+                                              : pass->src_keys);               \
+    if (values != NULL)                                                        \
+      pg_free(allocator, values == pass->src_values ? pass->dst_values         \
+                                                    : pass->src_values);       \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static void name##_swap(name##_pass_t *pass) {       \
+    key_type *const keys = pass->src_keys;                                     \
+    pass->src_keys = pass->dst_keys;                                           \
+    pass->dst_keys = keys;                                                     \
+    key_type *const values = pass->src_values;                                 \
+    pass->src_values = pass->dst_values;                                       \
+    pass->dst_values = values;                                                 \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static name##_pass_t name##_begin(                   \
+      key_type *keys, key_type *values, uint64_t len,                          \
+      pg_allocator_t allocator) {                                              \
+    return (name##_pass_t){                                                    \
+        .src_keys = keys,                                                      \
+        .dst_keys = pg_alloc(allocator, len * sizeof(key_type)),               \
+        .src_values = values,                                                  \
+        .dst_values = values == NULL                                           \
+                          ? NULL                                               \
+                          : pg_alloc(allocator, len * sizeof(key_type)),       \
+        .len = len,                                                            \
+    };                                                                         \
+  }                                                                            \
+                                                                               \
+  /* `values` can be NULL. */                                                  \
+  __attribute__((unused)) static void name(key_type *keys, key_type *values,   \
+                                           uint64_t len,                       \
+                                           pg_allocator_t allocator) {         \
+    if (len < 2)                                                               \
+      return;                                                                  \
+                                                                               \
+    uint64_t counts[sizeof(key_type)][PG_RADIX_BUCKETS] = {{0}};               \
+    for (uint64_t i = 0; i < len; i++) {                                       \
+      const key_type key = keys[i];                                            \
+      for (uint64_t d = 0; d < sizeof(key_type); d++)                          \
+        counts[d][(key >> (d * 8)) & 0xff] += 1;                               \
+    }                                                                          \
+                                                                               \
+    name##_pass_t pass = name##_begin(keys, values, len, allocator);           \
+    for (uint64_t d = 0; d < sizeof(key_type); d++) {                          \
+      pass.shift = d * 8;                                                      \
+      if (counts[d][(keys[0] >> pass.shift) & 0xff] == len)                    \
+        continue;                                                              \
+                                                                               \
+      uint64_t offsets[PG_RADIX_BUCKETS] = {0};                                \
+      for (uint64_t b = 1; b < PG_RADIX_BUCKETS; b++)                          \
+        offsets[b] = offsets[b - 1] + counts[d][b - 1];                        \
+                                                                               \
+      name##_scatter(&pass, 0, len, offsets);                                  \
+      name##_swap(&pass);                                                      \
+    }                                                                          \
+    name##_finish(&pass, keys, values, allocator);                             \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static void name##_count_blocks(                     \
+      void *ctx, uint64_t begin, uint64_t end) {                               \
+    name##_pass_t *const pass = ctx;                                           \
+    for (uint64_t block = begin; block < end; block++) {                       \
+      uint64_t *const counts = pass->counts[block];                            \
+      memset(counts, 0, PG_RADIX_BUCKETS * sizeof(uint64_t));                  \
+      const uint64_t start = block * pass->block_len;                          \
+      const uint64_t stop = MIN(start + pass->block_len, pass->len);           \
+      for (uint64_t i = start; i < stop; i++)                                  \
+        counts[(pass->src_keys[i] >> pass->shift) & 0xff] += 1;                \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* The counts have been turned into offsets. */                              \
+  __attribute__((unused)) static void name##_scatter_blocks(                   \
+      void *ctx, uint64_t begin, uint64_t end) {                               \
+    name##_pass_t *const pass = ctx;                                           \
+    for (uint64_t block = begin; block < end; block++) {                       \
+      const uint64_t start = block * pass->block_len;                          \
+      name##_scatter(pass, start, MIN(start + pass->block_len, pass->len),     \
+                     pass->counts[block]);                                     \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  __attribute__((unused)) static void name##_parallel(                         \
+      pg_executor_t *executor, key_type *keys, key_type *values, uint64_t len, \
+      pg_allocator_t allocator) {                                              \
+    const uint64_t blocks_count =                                              \
+        MIN(executor->workers_count + 1,                                       \
+            len / PG_RADIX_PARALLEL_MIN_BLOCK_LEN);                            \
+    if (blocks_count <= 1) {                                                   \
+      name(keys, values, len, allocator);                                      \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    name##_pass_t pass = name##_begin(keys, values, len, allocator);           \
+    pass.block_len = (len + blocks_count - 1) / blocks_count;                  \
+    pass.counts = pg_alloc(allocator, blocks_count * sizeof(*pass.counts));    \
+                                                                               \
+    for (uint64_t d = 0; d < sizeof(key_type); d++) {                          \
+      pass.shift = d * 8;                                                      \
+      pg_executor_parallel_for(executor, 0, blocks_count, 1,                   \
+                               name##_count_blocks, &pass);                    \
+                                                                               \
+      uint64_t offset = 0;                                                     \
+      bool skip = false;                                                       \
+      for (uint64_t digit = 0; digit < PG_RADIX_BUCKETS; digit++) {            \
+        const uint64_t digit_start = offset;                                   \
+        for (uint64_t block = 0; block < blocks_count; block++) {              \
+          const uint64_t count = pass.counts[block][digit];                    \
+          pass.counts[block][digit] = offset;                                  \
+          offset += count;                                                     \
+        }                                                                      \
+        skip |= offset - digit_start == len;                                   \
+      }                                                                        \
+      if (skip)                                                                \
+        continue;                                                              \
+                                                                               \
+      pg_executor_parallel_for(executor, 0, blocks_count, 1,                   \
+                               name##_scatter_blocks, &pass);                  \
+      name##_swap(&pass);                                                      \
+    }                                                                          \
+                                                                               \
+    pg_free(allocator, pass.counts);                                           \
+    name##_finish(&pass, keys, values, allocator);                             \
+  }
 
-typedef struct {
-  pg_array_t(uint8_t) data;
-  uint64_t max_index;
-} pg_bitarray_t;
+PG_RADIX_SORT_DEFINE(pg_radix_sort_u32, uint32_t)
+PG_RADIX_SORT_DEFINE(pg_radix_sort_u64, uint64_t)
+
+// -------------------------- Timer wheel
+
+// Hierarchical timer wheel: level `l` has 64 slots of 64^l ticks each, so
+// adding and cancelling a timer is O(1) whatever the number of timers.
+// A timer sits at the level of the highest 6-bit group where its deadline
+// differs from the current tick; when the wheel reaches the start of its
+// slot, it is moved down, until it fires from level 0. What a tick is (a
+// millisecond, a second) is up to the caller, who advances the wheel from
+// its event loop and sleeps at most `pg_timer_wheel_next_expiry` ticks in
+// `epoll_wait` & co.
+//
+// Timers are embedded in the caller's structures: the wheel never
+// allocates.
+
+#define PG_TIMER_WHEEL_BITS 6
+#define PG_TIMER_WHEEL_SLOTS (1ULL << PG_TIMER_WHEEL_BITS)
+// Enough for any 64 bits deadline.
+#define PG_TIMER_WHEEL_LEVELS 11
+
+typedef struct pg_timer_t pg_timer_t;
+struct pg_timer_t {
+  pg_timer_t *next;
+  pg_timer_t **pprev; // NULL when not scheduled.
+  uint64_t deadline;  // In ticks.
+  void (*fn)(pg_timer_t *timer);
+  void *ctx; // For `fn`.
+  uint32_t slot;
+  PG_PAD(4);
+};
 
-__attribute__((unused)) static void pg_bitarray_init(pg_allocator_t allocator,
-                                                     pg_bitarray_t *bitarr,
-                                                     uint64_t max_index) {
-  bitarr->max_index = max_index;
-  const uint64_t len = 1 + (uint64_t)(ceil(((double)max_index) / 8.0));
-  pg_array_init_reserve(bitarr->data, len, allocator);
-  pg_array_resize(bitarr->data, len);
+typedef struct {
+  uint64_t now; // Last tick processed.
+  uint64_t count;
+  uint64_t occupied[PG_TIMER_WHEEL_LEVELS]; // One bit per non empty slot.
+  pg_timer_t *slots[PG_TIMER_WHEEL_LEVELS * PG_TIMER_WHEEL_SLOTS];
+} pg_timer_wheel_t;
+
+__attribute__((unused)) static void pg_timer_wheel_init(pg_timer_wheel_t *wheel,
+                                                        uint64_t now) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->now = now;
 }
 
-__attribute__((unused)) static void
-pg_bitarray_setv(pg_bitarray_t *bitarr, uint8_t *data, uint64_t len) {
-  assert(len <= 1 + bitarr->max_index);
-
-  memcpy(bitarr->data, data, len);
+__attribute__((unused)) static bool pg_timer_is_scheduled(pg_timer_t *timer) {
+  return timer->pprev != NULL;
 }
 
-__attribute__((unused)) static void pg_bitarray_destroy(pg_bitarray_t *bitarr) {
-  pg_array_free(bitarr->data);
+// `timer->deadline >= wheel->now`.
+__attribute__((unused)) static void pg__timer_wheel_link(pg_timer_wheel_t *wheel,
+                                                         pg_timer_t *timer) {
+  const uint64_t diff = timer->deadline ^ wheel->now;
+  const uint64_t level =
+      diff == 0 ? 0
+                : (63 - (uint64_t)__builtin_clzll(diff)) / PG_TIMER_WHEEL_BITS;
+  const uint64_t index = (timer->deadline >> (level * PG_TIMER_WHEEL_BITS)) &
+                         (PG_TIMER_WHEEL_SLOTS - 1);
+  timer->slot = (uint32_t)(level * PG_TIMER_WHEEL_SLOTS + index);
+
+  pg_timer_t **const head = &wheel->slots[timer->slot];
+  timer->next = *head;
+  if (timer->next != NULL)
+    timer->next->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+  wheel->occupied[level] |= 1ULL << index;
 }
 
-__attribute__((unused)) static uint64_t
-pg_bitarray_len(const pg_bitarray_t *bitarr) {
-  return bitarr->max_index + 1;
+__attribute__((unused)) static void
+pg__timer_wheel_unlink(pg_timer_wheel_t *wheel, pg_timer_t *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL)
+    timer->next->pprev = timer->pprev;
+  if (wheel->slots[timer->slot] == NULL)
+    wheel->occupied[timer->slot / PG_TIMER_WHEEL_SLOTS] &=
+        ~(1ULL << (timer->slot % PG_TIMER_WHEEL_SLOTS));
+  timer->next = NULL;
+  timer->pprev = NULL;
 }
 
-__attribute__((unused)) static void pg_bitarray_set(pg_bitarray_t *bitarr,
-                                                    uint64_t index) {
-  const uint64_t i = (uint64_t)((double)(index) / 8.0);
-  assert(i < pg_array_len(bitarr->data));
+// Returns false if the timer was not scheduled.
+__attribute__((unused)) static bool pg_timer_wheel_cancel(pg_timer_wheel_t *wheel,
+                                                          pg_timer_t *timer) {
+  if (!pg_timer_is_scheduled(timer))
+    return false;
 
-  bitarr->data[i] |= 1 << (index % 8);
+  pg__timer_wheel_unlink(wheel, timer);
+  wheel->count -= 1;
+  return true;
 }
 
-__attribute__((unused)) static bool pg_bitarray_get(const pg_bitarray_t *bitarr,
-                                                    uint64_t index) {
-  const uint64_t i = (uint64_t)((double)(index) / 8.0);
-  assert(i < pg_array_len(bitarr->data));
-
-  return bitarr->data[i] & (1 << (index % 8));
+// Schedule `timer->fn` to be called when the wheel reaches `deadline`, or
+// on the next tick if it is not in the future. A scheduled timer is
+// rescheduled, e.g. to push back an idle timeout when data comes in.
+__attribute__((unused)) static void pg_timer_wheel_add(pg_timer_wheel_t *wheel,
+                                                       pg_timer_t *timer,
+                                                       uint64_t deadline) {
+  assert(timer->fn != NULL);
+
+  pg_timer_wheel_cancel(wheel, timer);
+  timer->deadline = MAX(deadline, wheel->now + 1);
+  pg__timer_wheel_link(wheel, timer);
+  wheel->count += 1;
 }
 
-__attribute__((unused)) static bool
-pg_bitarray_next(const pg_bitarray_t *bitarr, uint64_t *index, bool *is_set) {
-  if (*index >= pg_bitarray_len(bitarr))
-    return false;
+// Returns the number of timers fired.
+__attribute__((unused)) static uint64_t
+pg__timer_wheel_tick(pg_timer_wheel_t *wheel) {
+  const uint64_t now = wheel->now;
+
+  // Move timers down from the slots starting now, higher levels first
+  // since they can land in a lower level slot starting now as well.
+  for (uint64_t level = PG_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+    const uint64_t shift = level * PG_TIMER_WHEEL_BITS;
+    if ((now & ((1ULL << shift) - 1)) != 0)
+      continue;
 
-  *is_set = pg_bitarray_get(bitarr, *index);
-  *index += 1;
-  return true;
+    const uint64_t index = (now >> shift) & (PG_TIMER_WHEEL_SLOTS - 1);
+    pg_timer_t *timer = wheel->slots[level * PG_TIMER_WHEEL_SLOTS + index];
+    wheel->slots[level * PG_TIMER_WHEEL_SLOTS + index] = NULL;
+    wheel->occupied[level] &= ~(1ULL << index);
+    while (timer != NULL) {
+      pg_timer_t *const next = timer->next;
+      pg__timer_wheel_link(wheel, timer);
+      timer = next;
+    }
+  }
+
+  // One at a time: `fn` may add or cancel other timers.
+  uint64_t fired = 0;
+  pg_timer_t **const head =
+      &wheel->slots[now & (PG_TIMER_WHEEL_SLOTS - 1)];
+  while (*head != NULL) {
+    pg_timer_t *const timer = *head;
+    pg__timer_wheel_unlink(wheel, timer);
+    wheel->count -= 1;
+    fired += 1;
+    timer->fn(timer);
+  }
+  return fired;
 }
 
-__attribute__((unused)) static void pg_bitarray_unset(pg_bitarray_t *bitarr,
-                                                      uint64_t index) {
-  const uint64_t i = (uint64_t)((double)(index) / 8.0);
-  assert(i < pg_array_len(bitarr->data));
+// First tick after the current one where there is something to do: the
+// start of the next occupied slot, in the lowest level that has one.
+// UINT64_MAX when no timer is scheduled.
+__attribute__((unused)) static uint64_t
+pg__timer_wheel_next_tick(const pg_timer_wheel_t *wheel) {
+  for (uint64_t level = 0; level < PG_TIMER_WHEEL_LEVELS; level++) {
+    const uint64_t shift = level * PG_TIMER_WHEEL_BITS;
+    const uint64_t index = (wheel->now >> shift) & (PG_TIMER_WHEEL_SLOTS - 1);
+    // Slots up to the current one are empty, they have been moved down.
+    const uint64_t pending =
+        wheel->occupied[level] & ~((2ULL << index) - 1);
+    if (pending == 0)
+      continue;
 
-  bitarr->data[i] &= ~(1 << (index % 8));
+    const uint64_t block_shift = shift + PG_TIMER_WHEEL_BITS;
+    const uint64_t block_start =
+        block_shift >= 64 ? 0 : wheel->now >> block_shift << block_shift;
+    return block_start + ((uint64_t)__builtin_ctzll(pending) << shift);
+  }
+  return UINT64_MAX;
 }
 
+// Process all ticks up to `now` included, firing the expired timers.
+// Ticks with nothing to do are skipped. Returns the number of timers
+// fired.
 __attribute__((unused)) static uint64_t
-pg_bitarray_count_set(pg_bitarray_t *bitarr) {
-  uint64_t res = 0;
-  for (uint64_t i = 0; i < pg_bitarray_len(bitarr); i++) {
-    res += pg_bitarray_get(bitarr, i);
+pg_timer_wheel_advance(pg_timer_wheel_t *wheel, uint64_t now) {
+  uint64_t fired = 0;
+  for (;;) {
+    const uint64_t tick = pg__timer_wheel_next_tick(wheel);
+    if (tick > now)
+      break;
+
+    wheel->now = tick;
+    fired += pg__timer_wheel_tick(wheel);
   }
-  return res;
+  wheel->now = MAX(wheel->now, now);
+  return fired;
 }
 
+// Number of ticks after which `pg_timer_wheel_advance` has something to
+// do, to use as a timeout for `epoll_wait` & co. It can be earlier than
+// the next deadline when timers have to move down a level. UINT64_MAX
+// when no timer is scheduled.
 __attribute__((unused)) static uint64_t
-pg_bitarray_count_unset(pg_bitarray_t *bitarr) {
-  uint64_t res = 0;
-  for (uint64_t i = 0; i < pg_bitarray_len(bitarr); i++) {
-    res += !pg_bitarray_get(bitarr, i);
-  }
-  return res;
+pg_timer_wheel_next_expiry(const pg_timer_wheel_t *wheel) {
+  const uint64_t tick = pg__timer_wheel_next_tick(wheel);
+  return tick == UINT64_MAX ? UINT64_MAX : tick - wheel->now;
 }
 
-__attribute__((unused)) static bool
-pg_bitarray_is_all_set(pg_bitarray_t *bitarr) {
-  for (uint64_t i = 0; i < pg_bitarray_len(bitarr); i++) {
-    if (!pg_bitarray_get(bitarr, i))
-      return false;
-  }
-  return true;
+// ------------------------------------- Child process
+
+// A command run by `pg_exec_group_spawn`. Its stdout and stderr are captured
+// in `out` and `err`, which must be made by the caller.
+typedef struct pg_exec_cmd_t pg_exec_cmd_t;
+struct pg_exec_cmd_t {
+  char **argv; // NULL terminated, `argv[0]` is looked up in PATH.
+  pg_string_t out;
+  pg_string_t err;
+  int exit_status; // As returned by waitpid(2).
+  int spawn_error; // errno if the command could not be spawned.
+
+  // Private.
+  pg_exec_cmd_t *next_done;
+  pid_t pid;
+  int out_fd, err_fd;
+  int pidfd; // -1 if unsupported: the exit is noticed when both pipes close.
+  bool finished;
+  PG_PAD(7);
+};
+
+// Commands running concurrently, all watched with one epoll/kqueue set.
+typedef struct {
+  int poll_fd;
+  PG_PAD(4);
+  uint64_t running;
+  pg_exec_cmd_t *done; // Finished but not returned by `pg_exec_group_wait`.
+} pg_exec_group_t;
+
+// The event data is the command pointer tagged with the source of the event.
+typedef enum {
+  PG_EXEC_EVENT_OUT = 0,
+  PG_EXEC_EVENT_ERR = 1,
+  PG_EXEC_EVENT_EXIT = 2,
+} pg_exec_event_t;
+
+extern char **environ;
+
+__attribute__((unused)) static void *pg_exec_event_tag(pg_exec_cmd_t *cmd,
+                                                       pg_exec_event_t event) {
+  assert(((uintptr_t)cmd & 3) == 0);
+  return (void *)((uintptr_t)cmd | (uintptr_t)event);
 }
 
-__attribute__((unused)) static bool
-pg_bitarray_is_all_unset(pg_bitarray_t *bitarr) {
-  for (uint64_t i = 0; i < pg_bitarray_len(bitarr); i++) {
-    if (pg_bitarray_get(bitarr, i))
-      return false;
-  }
-  return true;
+__attribute__((unused)) static pg_exec_cmd_t *
+pg_exec_event_untag(void *data, pg_exec_event_t *event) {
+  *event = (pg_exec_event_t)((uintptr_t)data & 3);
+  return (pg_exec_cmd_t *)((uintptr_t)data & ~(uintptr_t)3);
 }
 
-__attribute__((unused)) static void pg_bitarray_set_all(pg_bitarray_t *bitarr) {
-  memset(bitarr->data, 0xff, pg_array_len(bitarr->data));
+__attribute__((unused)) static bool pg_exec_group_init(pg_exec_group_t *group) {
+  *group = (pg_exec_group_t){0};
+#if defined(__linux__)
+  group->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+  group->poll_fd = kqueue();
+#endif
+  return group->poll_fd != -1;
 }
 
 __attribute__((unused)) static void
-pg_bitarray_unset_all(pg_bitarray_t *bitarr) {
-  memset(bitarr->data, 0, pg_array_len(bitarr->data));
+pg_exec_group_destroy(pg_exec_group_t *group) {
+  close(group->poll_fd);
 }
 
-__attribute__((unused)) static void pg_bitarray_resize(pg_bitarray_t *bitarr,
-                                                       uint64_t max_index) {
-  bitarr->max_index = max_index;
-  const uint64_t len = (uint64_t)(ceil(((double)max_index) / 8.0));
-  pg_array_resize(bitarr->data, len);
+__attribute__((unused)) static bool pg_exec_watch_fd(pg_exec_group_t *group,
+                                                     int fd, void *data) {
+#if defined(__linux__)
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = data};
+  return epoll_ctl(group->poll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+#else
+  struct kevent event = {0};
+  EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, data);
+  return kevent(group->poll_fd, &event, 1, NULL, 0, NULL) == 0;
+#endif
 }
 
-// ------------- File utils
+// Watch for the exit of the child. Sets `cmd->pidfd` to -1 if that is not
+// possible on this system.
+__attribute__((unused)) static bool pg_exec_watch_exit(pg_exec_group_t *group,
+                                                       pg_exec_cmd_t *cmd) {
+  void *const data = pg_exec_event_tag(cmd, PG_EXEC_EVENT_EXIT);
+#if defined(__linux__)
+#if defined(SYS_pidfd_open)
+  cmd->pidfd = (int)syscall(SYS_pidfd_open, cmd->pid, 0);
+#else
+  cmd->pidfd = -1;
+#endif
+  if (cmd->pidfd == -1)
+    return true; // Old kernel: fall back to the pipes closing.
 
-__attribute__((unused)) static bool
-pg_array_read_file_fd(int fd, pg_array_t(uint8_t) * buf) {
-  struct stat st = {0};
-  if (fstat(fd, &st) == -1) {
-    return false;
-  }
-  const uint64_t read_buffer_size =
-      MIN((uint64_t)INT32_MAX, (uint64_t)st.st_size);
-  pg_array_grow(*buf, (uint64_t)st.st_size);
-  while (pg_array_len(*buf) < (uint64_t)st.st_size) {
-    int64_t ret = read(fd, *buf + pg_array_len(*buf), read_buffer_size);
-    if (ret == -1) {
-      return false;
-    }
-    if (ret == 0)
-      return true;
-    pg_array_resize(*buf, pg_array_len(*buf) + (uint64_t)ret);
+  return pg_exec_watch_fd(group, cmd->pidfd, data);
+#else
+  cmd->pidfd = -1;
+  struct kevent event = {0};
+  EV_SET(&event, cmd->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0,
+         data);
+  if (kevent(group->poll_fd, &event, 1, NULL, 0, NULL) == 0) {
+    cmd->pidfd = cmd->pid; // Only used as a flag with kqueue.
+    return true;
   }
-  return true;
+  // Already exited.
+  return errno == ESRCH;
+#endif
 }
 
-__attribute__((unused)) static bool pg_string_read_file_fd(int fd,
-                                                           pg_string_t *str) {
-  struct stat st = {0};
-  if (fstat(fd, &st) == -1) {
+// Not pipe2(2): it is only declared with `_GNU_SOURCE`, which cannot be
+// relied upon when a system header is included before pg.h.
+__attribute__((unused)) static bool pg_exec_pipe(int fds[2]) {
+  if (pipe(fds) != 0)
+    return false;
+  if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+      fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    fds[0] = fds[1] = -1;
     return false;
   }
-  const uint64_t read_buffer_size =
-      MIN((uint64_t)INT32_MAX, (uint64_t)st.st_size);
-  *str = pg_string_make_space_for(*str, (uint64_t)st.st_size);
+  return true;
+}
 
-  while (pg_string_len(*str) < (uint64_t)st.st_size) {
-    int64_t ret = read(fd, *str + pg_string_len(*str), read_buffer_size);
-    if (ret == -1) {
-      return false;
+// Read what is available. Returns false on EOF or error, after which the
+// file descriptor is closed.
+__attribute__((unused)) static bool pg_exec_read_available(int *fd,
+                                                           pg_string_t *str) {
+  const uint64_t read_batch_size = 4096;
+  for (;;) {
+    *str = pg_string_make_space_for(*str, read_batch_size);
+    const uint64_t len = pg_string_len(*str);
+    const ssize_t ret = read(*fd, *str + len, read_batch_size);
+    if (ret > 0) {
+      pg__set_string_len(*str, len + (uint64_t)ret);
+      (*str)[len + (uint64_t)ret] = 0;
+      continue;
     }
-    if (ret == 0)
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
       return true;
-    const uint64_t new_len = pg_string_len(*str) + (uint64_t)ret;
-    *str = pg_string_make_space_for(*str, new_len);
-    pg__set_string_len(*str, new_len);
-  }
-  return true;
-}
 
-__attribute__((unused)) static bool pg_read_file(char *path,
-                                                 pg_array_t(uint8_t) * buf) {
-  const int fd = open(path, O_RDONLY);
-  if (fd == -1) {
-    return errno;
+    close(*fd); // Also removes it from the epoll/kqueue set.
+    *fd = -1;
+    return false;
   }
-  const bool ok = pg_array_read_file_fd(fd, buf);
-  close(fd);
-  return ok;
 }
 
-__attribute__((unused)) static char const *pg_path_base_name(char const *path) {
-  char const *ls;
-  assert(path != NULL);
-  ls = pg_char_last_occurence(path, '/');
-  return (ls == NULL) ? path : ls + 1;
+// Collect the exit status and the remaining output.
+__attribute__((unused)) static void pg_exec_finish(pg_exec_group_t *group,
+                                                   pg_exec_cmd_t *cmd) {
+  while (waitpid(cmd->pid, &cmd->exit_status, 0) == -1 && errno == EINTR)
+    ;
+
+  // The child is gone so whatever it wrote is in the pipes. Do not wait for
+  // EOF: a grandchild could keep them open.
+  if (cmd->out_fd != -1)
+    pg_exec_read_available(&cmd->out_fd, &cmd->out);
+  if (cmd->err_fd != -1)
+    pg_exec_read_available(&cmd->err_fd, &cmd->err);
+  if (cmd->out_fd != -1)
+    close(cmd->out_fd);
+  if (cmd->err_fd != -1)
+    close(cmd->err_fd);
+#if defined(__linux__)
+  if (cmd->pidfd != -1)
+    close(cmd->pidfd);
+#endif
+  cmd->out_fd = cmd->err_fd = cmd->pidfd = -1;
+  cmd->finished = true;
+
+  assert(group->running > 0);
+  group->running -= 1;
+  cmd->next_done = group->done;
+  group->done = cmd;
 }
-__attribute__((unused)) static bool
-pg_string_read_from_stream_once(int fd, pg_string_t *str) {
-  const uint64_t read_batch_size = 4096;
-  if (pg_string_available_space(*str) < read_batch_size)
-    *str =
-        pg_string_make_space_for(*str, pg_string_len(*str) + read_batch_size);
 
-  const int64_t ret = read(fd, *str + pg_string_len(*str), read_batch_size);
-  if (ret == -1)
+// Start `cmd`, which must stay at the same address until it is returned by
+// `pg_exec_group_wait`. That is also the case on failure, with
+// `cmd->spawn_error` set.
+__attribute__((unused)) static bool pg_exec_group_spawn(pg_exec_group_t *group,
+                                                        pg_exec_cmd_t *cmd) {
+  cmd->spawn_error = 0;
+  cmd->exit_status = 0;
+  cmd->next_done = NULL;
+  cmd->finished = false;
+  cmd->pid = 0;
+  cmd->out_fd = cmd->err_fd = cmd->pidfd = -1;
+
+  int out_pipe[2] = {-1, -1};
+  int err_pipe[2] = {-1, -1};
+  posix_spawn_file_actions_t actions;
+  bool actions_init = false;
+
+  if (!pg_exec_pipe(out_pipe) || !pg_exec_pipe(err_pipe))
+    goto fail;
+
+  if ((errno = posix_spawn_file_actions_init(&actions)) != 0)
+    goto fail;
+  actions_init = true;
+
+  // The pipe ends are close-on-exec, dup2 clears the flag on the copies.
+  if ((errno = posix_spawn_file_actions_addclose(&actions, 0)) != 0 ||
+      (errno = posix_spawn_file_actions_adddup2(&actions, out_pipe[1], 1)) !=
+          0 ||
+      (errno = posix_spawn_file_actions_adddup2(&actions, err_pipe[1], 2)) !=
+          0)
+    goto fail;
+
+  if ((errno = posix_spawnp(&cmd->pid, cmd->argv[0], &actions, NULL,
+                            cmd->argv, environ)) != 0)
+    goto fail;
+
+  posix_spawn_file_actions_destroy(&actions);
+  close(out_pipe[1]);
+  close(err_pipe[1]);
+  cmd->out_fd = out_pipe[0];
+  cmd->err_fd = err_pipe[0];
+  fcntl(cmd->out_fd, F_SETFL, O_NONBLOCK);
+  fcntl(cmd->err_fd, F_SETFL, O_NONBLOCK);
+  group->running += 1;
+
+  if (!pg_exec_watch_fd(group, cmd->out_fd,
+                        pg_exec_event_tag(cmd, PG_EXEC_EVENT_OUT)) ||
+      !pg_exec_watch_fd(group, cmd->err_fd,
+                        pg_exec_event_tag(cmd, PG_EXEC_EVENT_ERR)) ||
+      !pg_exec_watch_exit(group, cmd)) {
+    cmd->spawn_error = errno;
+    kill(cmd->pid, SIGKILL);
+    pg_exec_finish(group, cmd);
     return false;
-  if (ret == 0)
-    return true;
-
-  const uint64_t new_len = pg_string_len(*str) + (uint64_t)ret;
-  pg__set_string_len(*str, new_len);
-
+  }
   return true;
-}
 
-__attribute__((unused)) static bool
-pg_string_read_from_stream(int fd, pg_string_t *str) {
-  while (true) {
-    if (!pg_string_read_from_stream_once(fd, str))
-      return false;
+fail:
+  cmd->spawn_error = errno;
+  if (actions_init)
+    posix_spawn_file_actions_destroy(&actions);
+  for (uint64_t i = 0; i < 2; i++) {
+    if (out_pipe[i] != -1)
+      close(out_pipe[i]);
+    if (err_pipe[i] != -1)
+      close(err_pipe[i]);
   }
-  __builtin_unreachable();
+  cmd->finished = true;
+  cmd->next_done = group->done;
+  group->done = cmd;
+  errno = cmd->spawn_error;
+  return false;
 }
 
-// ------------------------------------- Child process
-__attribute__((unused)) static bool pg_exec(char **argv, pg_string_t *cmd_stdio,
-                                            pg_string_t *cmd_stderr,
-                                            int *exit_status) {
-  int stdio_pipe[2] = {0};
-  if (pipe(stdio_pipe) != 0) {
-    return false;
-  }
+__attribute__((unused)) static void pg_exec_handle_event(pg_exec_group_t *group,
+                                                         void *data) {
+  pg_exec_event_t event = PG_EXEC_EVENT_OUT;
+  pg_exec_cmd_t *const cmd = pg_exec_event_untag(data, &event);
+  if (cmd->finished) // Stale event from the same batch.
+    return;
 
-  int stderr_pipe[2] = {0};
-  if (pipe(stderr_pipe) != 0) {
-    return false;
+  switch (event) {
+  case PG_EXEC_EVENT_OUT:
+    if (cmd->out_fd != -1)
+      pg_exec_read_available(&cmd->out_fd, &cmd->out);
+    break;
+  case PG_EXEC_EVENT_ERR:
+    if (cmd->err_fd != -1)
+      pg_exec_read_available(&cmd->err_fd, &cmd->err);
+    break;
+  case PG_EXEC_EVENT_EXIT:
+    pg_exec_finish(group, cmd);
+    return;
   }
 
-  const pid_t pid = fork();
-  if (pid == -1)
-    return false;
-
-  if (pid == 0) {          // Child
-    close(stdio_pipe[0]);  // Child does not read from parent
-    close(stderr_pipe[0]); // Child does not read from parent
-    close(0);              // Close child's stdin
-
-    if (dup2(stdio_pipe[1], 1) ==
-        -1) // Direct child's stdout to the pipe for the parent to read
-      exit(errno);
+  // No way to watch the exit: assume it happens when both pipes close.
+  if (cmd->pidfd == -1 && cmd->out_fd == -1 && cmd->err_fd == -1)
+    pg_exec_finish(group, cmd);
+}
 
-    if (dup2(stderr_pipe[1], 2) ==
-        -1) // Direct child's stderr to the pipe for the parent to read
-      exit(errno);
+// Return the next finished command, waiting at most `timeout_ms` (-1:
+// forever). Returns NULL on timeout, on error and when nothing runs anymore.
+__attribute__((unused)) static pg_exec_cmd_t *
+pg_exec_group_wait(pg_exec_group_t *group, int timeout_ms) {
+  for (;;) {
+    if (group->done != NULL) {
+      pg_exec_cmd_t *const cmd = group->done;
+      group->done = cmd->next_done;
+      cmd->next_done = NULL;
+      return cmd;
+    }
+    if (group->running == 0)
+      return NULL;
 
-    close(stdio_pipe[1]);  // Not needed anymore
-    close(stderr_pipe[1]); // Not needed anymore
+#if defined(__linux__)
+    struct epoll_event events[16];
+    const int events_len =
+        epoll_wait(group->poll_fd, events,
+                   (int)(sizeof(events) / sizeof(events[0])), timeout_ms);
+#else
+    struct kevent events[16];
+    struct timespec timeout = {.tv_sec = timeout_ms / 1000,
+                               .tv_nsec = (timeout_ms % 1000) * 1000 * 1000};
+    const int events_len =
+        kevent(group->poll_fd, NULL, 0, events,
+               (int)(sizeof(events) / sizeof(events[0])),
+               timeout_ms >= 0 ? &timeout : NULL);
+#endif
+    if (events_len == -1 && errno == EINTR)
+      continue;
+    if (events_len == -1)
+      return NULL;
 
-    if (execvp(argv[0], argv) == -1)
-      exit(errno);
+    for (int i = 0; i < events_len; i++) {
+#if defined(__linux__)
+      pg_exec_handle_event(group, events[i].data.ptr);
+#else
+      pg_exec_handle_event(group, events[i].udata);
+#endif
+    }
 
-    __builtin_unreachable();
+    if (events_len == 0 && group->done == NULL)
+      return NULL; // Timeout.
   }
+}
 
-  struct pollfd fds[] = {{.fd = stdio_pipe[0], .events = POLLIN},
-                         {.fd = stderr_pipe[0], .events = POLLIN}};
-  pid_t ret_pid = 0;
-  while (1) {
-    const int ret = poll(fds, 2, 200);
-    if (ret == -1)
-      break;
+// Run all `cmds`, at most `max_concurrent` at a time (0: no limit), and
+// collect their outputs. Returns false if the commands could not be watched;
+// commands which failed to spawn have `spawn_error` set.
+__attribute__((unused)) static bool
+pg_exec_batch(pg_exec_cmd_t *cmds, uint64_t cmds_len, uint64_t max_concurrent) {
+  pg_exec_group_t group = {0};
+  if (!pg_exec_group_init(&group))
+    return false;
 
-    for (uint64_t i = 0; i < (uint64_t)ret; i++) {
-      if (i == 0 && (fds[i].revents & POLLIN)) {
-        if (!pg_string_read_from_stream_once(fds[i].fd, cmd_stdio))
-          break;
-      }
-      if (i == 1 && (fds[i].revents & POLLIN)) {
-        if (!pg_string_read_from_stream_once(fds[i].fd, cmd_stderr))
-          break;
-      }
+  bool ok = true;
+  uint64_t next = 0;
+  for (;;) {
+    while (next < cmds_len &&
+           (max_concurrent == 0 || group.running < max_concurrent)) {
+      pg_exec_group_spawn(&group, &cmds[next]);
+      next += 1;
     }
 
-    ret_pid = waitpid(pid, exit_status, 0);
-    if (ret_pid == -1)
+    if (pg_exec_group_wait(&group, -1) != NULL)
       continue;
-
-    if (WIFEXITED(*exit_status)) {
-      goto end;
-    }
-  }
-
-  ret_pid = waitpid(pid, exit_status, 0);
-  if (ret_pid == -1) {
-    fprintf(stderr, "Failed to wait(2): %d %s\n", errno, strerror(errno));
-    exit(errno);
+    if (group.running > 0) // Polling failed.
+      ok = false;
+    if (group.running > 0 || next == cmds_len)
+      break;
   }
 
-end:
-  close(stdio_pipe[0]);
-  close(stderr_pipe[0]);
+  pg_exec_group_destroy(&group);
+  return ok;
+}
 
-  return true;
+__attribute__((unused)) static bool pg_exec(char **argv, pg_string_t *cmd_stdio,
+                                            pg_string_t *cmd_stderr,
+                                            int *exit_status) {
+  pg_exec_cmd_t cmd = {.argv = argv, .out = *cmd_stdio, .err = *cmd_stderr};
+  const bool ok = pg_exec_batch(&cmd, 1, 1) && cmd.spawn_error == 0;
+
+  *cmd_stdio = cmd.out;
+  *cmd_stderr = cmd.err;
+  *exit_status = cmd.exit_status;
+  if (cmd.spawn_error != 0)
+    errno = cmd.spawn_error;
+  return ok;
 }
+
 // --------------------- Path
 
 __attribute__((unused)) static bool pg_path_is_directory(const char *path) {
@@ -0,0 +1,1355 @@
+#include "pg.h"
+
+#include <time.h>
+
+// Usage: pg_bench [-w warmup] [-r repetitions] [-f filter] [-n keys_count]
+//                 [-s sort_max_count] [-o results.tsv] [-b baseline.tsv]
+//                 [-t threshold_percent]
+//
+// Each benchmark runs `warmup` untimed then `repetitions` timed iterations
+// and reports the median and p99 of the iterations. With `-o`, the results
+// are written as `name\tmedian_ns_per_op\tp99_ns_per_op\tbytes_per_s`
+// lines. With `-b`, they are compared to such a file and changes of the
+// median above the threshold are flagged. Regressions make the exit status
+// non-zero.
+
+static uint64_t bench_now_ns(void) {
+  struct timespec ts = {0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, keys look like random pointers.
+static uint64_t bench_rand(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+// -------------------------- Harness
+
+typedef struct {
+  char name[64];
+  double median_ns_per_op;
+  double p99_ns_per_op;
+  double bytes_per_s;
+} bench_result_t;
+
+static struct {
+  uint64_t warmup;
+  uint64_t repetitions;
+  double threshold; // Relative change of the median flagged against baseline.
+  const char *filter;
+  FILE *results_file;
+  pg_array_t(bench_result_t) baseline;
+  uint64_t regressions_count;
+  uint64_t checksum; // Keeps the compiler from removing the benchmarked code.
+} bench = {.warmup = 2, .repetitions = 15, .threshold = 0.1};
+
+typedef struct {
+  const char *name;
+  uint64_t ops;   // Per iteration.
+  uint64_t bytes; // Per iteration, 0 when not meaningful.
+  uint64_t iteration;
+  uint64_t start_ns;
+  uint64_t paused_ns;
+  uint64_t pause_start_ns;
+  uint64_t *samples_ns;
+} bench_run_t;
+
+// Run the body `warmup + repetitions` times, timing each iteration.
+#define BENCH_LOOP(run, name, ops, bytes)                                      \
+  for (bench_run_t run = bench_begin(name, ops, bytes); bench_next(&run);)
+
+static bench_run_t bench_begin(const char *name, uint64_t ops,
+                               uint64_t bytes) {
+  assert(ops > 0);
+  bench_run_t run = {.name = name, .ops = ops, .bytes = bytes};
+  if (bench.filter != NULL && strstr(name, bench.filter) == NULL)
+    return run;
+
+  run.samples_ns =
+      pg_alloc(pg_heap_allocator(), bench.repetitions * sizeof(uint64_t));
+  return run;
+}
+
+// Exclude setup work from the current iteration.
+static void bench_pause(bench_run_t *run) {
+  run->pause_start_ns = bench_now_ns();
+}
+
+static void bench_resume(bench_run_t *run) {
+  run->paused_ns += bench_now_ns() - run->pause_start_ns;
+}
+
+static int bench_compare_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static const bench_result_t *bench_baseline_find(const char *name) {
+  if (bench.baseline == NULL)
+    return NULL;
+
+  for (uint64_t i = 0; i < pg_array_len(bench.baseline); i++) {
+    if (strcmp(bench.baseline[i].name, name) == 0)
+      return &bench.baseline[i];
+  }
+  return NULL;
+}
+
+static void bench_finish(bench_run_t *run) {
+  const uint64_t n = bench.repetitions;
+  qsort(run->samples_ns, n, sizeof(uint64_t), bench_compare_u64);
+
+  bench_result_t result = {
+      .median_ns_per_op = (double)run->samples_ns[n / 2] / (double)run->ops,
+      .p99_ns_per_op =
+          (double)run->samples_ns[(n * 99 + 99) / 100 - 1] / (double)run->ops,
+  };
+  snprintf(result.name, sizeof(result.name), "%s", run->name);
+  if (run->bytes > 0)
+    result.bytes_per_s = (double)run->bytes * 1e9 /
+                         (double)MAX(run->samples_ns[n / 2], 1ULL);
+
+  printf("%-36s %14.2f ns/op %14.2f p99", result.name,
+         result.median_ns_per_op, result.p99_ns_per_op);
+  if (run->bytes > 0)
+    printf(" %8.2f GB/s", result.bytes_per_s / 1e9);
+
+  const bench_result_t *const baseline = bench_baseline_find(result.name);
+  if (baseline != NULL && baseline->median_ns_per_op > 0) {
+    const double change =
+        result.median_ns_per_op / baseline->median_ns_per_op - 1;
+    if (change > bench.threshold) {
+      printf("  REGRESSION %+.1f%%", change * 100);
+      bench.regressions_count += 1;
+    } else if (change < -bench.threshold) {
+      printf("  improvement %+.1f%%", change * 100);
+    }
+  }
+  printf("\n");
+
+  if (bench.results_file != NULL)
+    fprintf(bench.results_file, "%s\t%.3f\t%.3f\t%.0f\n", result.name,
+            result.median_ns_per_op, result.p99_ns_per_op, result.bytes_per_s);
+
+  pg_free(pg_heap_allocator(), run->samples_ns);
+  run->samples_ns = NULL;
+}
+
+static bool bench_next(bench_run_t *run) {
+  if (run->samples_ns == NULL) // Filtered out.
+    return false;
+
+  const uint64_t now = bench_now_ns();
+  if (run->iteration > bench.warmup)
+    run->samples_ns[run->iteration - bench.warmup - 1] =
+        now - run->start_ns - run->paused_ns;
+
+  if (run->iteration == bench.warmup + bench.repetitions) {
+    bench_finish(run);
+    return false;
+  }
+
+  run->iteration += 1;
+  run->paused_ns = 0;
+  run->start_ns = bench_now_ns();
+  return true;
+}
+
+static bool bench_baseline_load(const char *path) {
+  FILE *const file = fopen(path, "r");
+  if (file == NULL)
+    return false;
+
+  pg_array_init_reserve(bench.baseline, 64, pg_heap_allocator());
+  bench_result_t result = {0};
+  while (fscanf(file, "%63[^\t]\t%lf\t%lf\t%lf\n", result.name,
+                &result.median_ns_per_op, &result.p99_ns_per_op,
+                &result.bytes_per_s) == 4)
+    pg_array_append(bench.baseline, result);
+
+  fclose(file);
+  return true;
+}
+
+// -------------------------- Containers
+
+static void bench_array(void) {
+  const uint64_t count = 1000 * 1000;
+
+  BENCH_LOOP(run, "pg_array_append u64", count, count * sizeof(uint64_t)) {
+    pg_array_t(uint64_t) array = {0};
+    pg_array_init_reserve(array, 0, pg_heap_allocator());
+    for (uint64_t i = 0; i < count; i++)
+      pg_array_append(array, i);
+    bench.checksum += array[count / 2];
+    pg_array_free(array);
+  }
+
+  // Big enough for copying on growth to show.
+  const uint64_t big_count = 64 * 1000 * 1000;
+  BENCH_LOOP(run, "pg_array_append u64 64M heap", big_count,
+             big_count * sizeof(uint64_t)) {
+    pg_array_t(uint64_t) array = {0};
+    pg_array_init_reserve(array, 0, pg_heap_allocator());
+    for (uint64_t i = 0; i < big_count; i++)
+      pg_array_append(array, i);
+    bench.checksum += array[big_count / 2];
+    pg_array_free(array);
+  }
+
+  BENCH_LOOP(run, "pg_array_append u64 64M pg_vm", big_count,
+             big_count * sizeof(uint64_t)) {
+    bench_pause(&run);
+    pg_vm_t vm = {0};
+    pg_vm_init(&vm, 1 * Gi);
+    bench_resume(&run);
+
+    pg_array_t(uint64_t) array = {0};
+    pg_array_init_reserve(array, 0, pg_vm_allocator(&vm));
+    for (uint64_t i = 0; i < big_count; i++)
+      pg_array_append(array, i);
+    bench.checksum += array[big_count / 2];
+
+    bench_pause(&run);
+    pg_vm_destroy(&vm);
+    bench_resume(&run);
+  }
+
+  uint64_t items[16] = {0};
+  BENCH_LOOP(run, "pg_array_append_many 16 u64", count,
+             count * sizeof(uint64_t)) {
+    pg_array_t(uint64_t) array = {0};
+    pg_array_init_reserve(array, 0, pg_heap_allocator());
+    for (uint64_t i = 0; i < count; i += 16) {
+      items[0] = i;
+      pg_array_append_many(array, items, 16);
+    }
+    bench.checksum += array[count / 2];
+    pg_array_free(array);
+  }
+
+  // Strings grow by exactly what is appended: keep them small.
+  const uint64_t pieces_count = 64 * 1000;
+  const char piece[] = "0123456789abcdef";
+  BENCH_LOOP(run, "pg_string_append_length 16B", pieces_count,
+             pieces_count * 16) {
+    pg_string_t str = pg_string_make_reserve(pg_heap_allocator(), 0);
+    for (uint64_t i = 0; i < pieces_count; i++)
+      str = pg_string_append_length(str, piece, 16);
+    bench.checksum += pg_string_len(str);
+    pg_string_free(str);
+  }
+}
+
+static void bench_ring(void) {
+  const uint64_t count = 1000 * 1000;
+  pg_ring_t ring = {0};
+  pg_ring_init(pg_heap_allocator(), &ring, 64 * Ki);
+
+  uint8_t chunk[64] = {1};
+  BENCH_LOOP(run, "pg_ring push_backv+pop_frontv 64B", count,
+             count * sizeof(chunk)) {
+    for (uint64_t i = 0; i < count; i++) {
+      // Keep the ring half full so that copies wrap around.
+      if (pg_ring_space(&ring) < sizeof(chunk) * 512)
+        pg_ring_pop_frontv(&ring, chunk, sizeof(chunk));
+      pg_ring_push_backv(&ring, chunk, sizeof(chunk));
+    }
+    bench.checksum += pg_ring_len(&ring);
+  }
+
+  pg_ring_clear(&ring);
+  BENCH_LOOP(run, "pg_ring push_back+pop_front 1B", count, count) {
+    for (uint64_t i = 0; i < count; i++) {
+      pg_ring_push_back(&ring, (uint8_t)i);
+      if (pg_ring_len(&ring) > 1000)
+        bench.checksum += pg_ring_pop_front(&ring);
+    }
+  }
+
+  pg_ring_destroy(&ring);
+}
+
+static void bench_bitarray(void) {
+  const uint64_t bits = 1000 * 1000;
+  pg_bitarray_t a = {0}, b = {0};
+  pg_bitarray_init(pg_heap_allocator(), &a, bits - 1);
+  pg_bitarray_init(pg_heap_allocator(), &b, bits - 1);
+
+  uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+  BENCH_LOOP(run, "pg_bitarray_set random", bits, 0) {
+    for (uint64_t i = 0; i < bits; i++)
+      pg_bitarray_set(&a, bench_rand(&rand_state) % bits);
+  }
+
+  // Sparse: 1% of bits set.
+  memset(a.data, 0, pg_array_len(a.data) * sizeof(uint64_t));
+  for (uint64_t i = 0; i < bits / 100; i++) {
+    pg_bitarray_set(&a, bench_rand(&rand_state) % bits);
+    pg_bitarray_set(&b, bench_rand(&rand_state) % bits);
+  }
+
+  const uint64_t set_count = pg_bitarray_count_set(&a);
+  BENCH_LOOP(run, "pg_bitarray_find_next_set sparse", set_count, bits / 8) {
+    for (uint64_t i = 0; pg_bitarray_find_next_set(&a, i, &i); i++)
+      bench.checksum += i;
+  }
+
+  BENCH_LOOP(run, "pg_bitarray_count_set", 1, bits / 8) {
+    bench.checksum += pg_bitarray_count_set(&a);
+  }
+
+  BENCH_LOOP(run, "pg_bitarray_and", 1, bits / 8) {
+    pg_bitarray_and(&b, &a);
+  }
+
+  pg_bitarray_destroy(&a);
+  pg_bitarray_destroy(&b);
+}
+
+// -------------------------- Hashing & parsing
+
+static void bench_hash(void) {
+  const uint64_t count = 1000 * 1000;
+  uint8_t keys[16 * 64] = {0};
+  uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+  for (uint64_t i = 0; i < sizeof(keys); i++)
+    keys[i] = (uint8_t)bench_rand(&rand_state);
+
+  BENCH_LOOP(run, "pg_hash 16B", count, count * 16) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_hash(keys + (i % 64) * 16, 16);
+  }
+
+  BENCH_LOOP(run, "pg_hash_bytes 16B", count, count * 16) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_hash_bytes(keys + (i % 64) * 16, 16);
+  }
+
+  // Variable lengths, as for names and paths.
+  BENCH_LOOP(run, "pg_hash 1-64B", count, 0) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_hash(keys + i % 64, 1 + i % 64);
+  }
+
+  BENCH_LOOP(run, "pg_hash_bytes 1-64B", count, 0) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_hash_bytes(keys + i % 64, 1 + i % 64);
+  }
+
+  const uint64_t big_len = 4 * Mi;
+  uint8_t *big = pg_alloc(pg_heap_allocator(), big_len);
+  BENCH_LOOP(run, "pg_hash 4MiB", 1, big_len) {
+    bench.checksum += pg_hash(big, big_len);
+  }
+
+  BENCH_LOOP(run, "pg_hash_bytes 4MiB", 1, big_len) {
+    bench.checksum += pg_hash_bytes(big, big_len);
+  }
+  pg_free(pg_heap_allocator(), big);
+
+  BENCH_LOOP(run, "pg_hash_u64", count, count * sizeof(uint64_t)) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_hash_u64(i);
+  }
+
+  BENCH_LOOP(run, "pg_hash (u64 key)", count, count * sizeof(uint64_t)) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_hash((uint8_t *)&i, sizeof(i));
+  }
+}
+
+typedef uint64_t (*bench_hash_fn_t)(const uint8_t *data, uint64_t len);
+
+static uint64_t bench_hash_fnv(const uint8_t *data, uint64_t len) {
+  return pg_hash((uint8_t *)data, len);
+}
+
+static uint64_t bench_hash_bytes(const uint8_t *data, uint64_t len) {
+  return pg_hash_bytes(data, len);
+}
+
+// Only for 8 bytes keys.
+static uint64_t bench_hash_u64(const uint8_t *data, uint64_t len) {
+  assert(len == sizeof(uint64_t));
+  uint64_t x = 0;
+  memcpy(&x, data, sizeof(x));
+  return pg_hash_u64(x);
+}
+
+static uint64_t bench_count_duplicates(uint64_t *hashes, uint64_t count) {
+  qsort(hashes, count, sizeof(uint64_t), bench_compare_u64);
+  uint64_t res = 0;
+  for (uint64_t i = 1; i < count; i++)
+    res += hashes[i] == hashes[i - 1];
+  return res;
+}
+
+// Not timed: collisions of sequential integer keys (the worst case for
+// weak hashes) on the low 32 bits, spread of the low 16 bits in buckets
+// (chi-square over its expected value, ~1 is uniform), and the worst
+// deviation from 50% of an output bit flipping when one input bit does.
+static void bench_hash_quality(const char *name, bench_hash_fn_t fn,
+                               uint64_t output_bits) {
+  if (bench.filter != NULL && strstr(name, bench.filter) == NULL)
+    return;
+
+  const uint64_t count = 1000 * 1000;
+  uint64_t *hashes = pg_alloc(pg_heap_allocator(), count * sizeof(uint64_t));
+  for (uint64_t i = 0; i < count; i++)
+    hashes[i] = fn((const uint8_t *)&i, sizeof(i)) & UINT32_MAX;
+
+  const uint64_t buckets_count = 1 << 16;
+  uint64_t *buckets =
+      pg_alloc(pg_heap_allocator(), buckets_count * sizeof(uint64_t));
+  for (uint64_t i = 0; i < count; i++)
+    buckets[hashes[i] & (buckets_count - 1)] += 1;
+  const double expected = (double)count / (double)buckets_count;
+  double chi2 = 0;
+  for (uint64_t i = 0; i < buckets_count; i++)
+    chi2 += ((double)buckets[i] - expected) * ((double)buckets[i] - expected) /
+            expected;
+  chi2 /= (double)(buckets_count - 1);
+
+  const uint64_t collisions = bench_count_duplicates(hashes, count);
+
+  const uint64_t keys_count = 10 * 1000;
+  uint64_t flips[64] = {0};
+  uint64_t rand_state = 0x2545f4914f6cdd1dULL;
+  for (uint64_t k = 0; k < keys_count; k++) {
+    uint64_t key = bench_rand(&rand_state);
+    const uint64_t hash = fn((const uint8_t *)&key, sizeof(key));
+    for (uint64_t bit = 0; bit < 64; bit++) {
+      key ^= 1ULL << bit;
+      const uint64_t diff = hash ^ fn((const uint8_t *)&key, sizeof(key));
+      key ^= 1ULL << bit;
+      for (uint64_t out = 0; out < output_bits; out++)
+        flips[out] += (diff >> out) & 1;
+    }
+  }
+  double worst_bias = 0;
+  for (uint64_t out = 0; out < output_bits; out++) {
+    const double p = (double)flips[out] / (double)(keys_count * 64);
+    worst_bias = MAX(worst_bias, p > 0.5 ? p - 0.5 : 0.5 - p);
+  }
+
+  printf("%-36s %8llu collisions %10.2f chi2 %8.3f avalanche bias\n", name,
+         collisions, chi2, worst_bias);
+
+  pg_free(pg_heap_allocator(), buckets);
+  pg_free(pg_heap_allocator(), hashes);
+}
+
+static void bench_parse(void) {
+  const uint64_t count = 1000 * 1000;
+  const pg_span_t decimals[] = {
+      pg_span_make_c("0"),
+      pg_span_make_c("1234"),
+      pg_span_make_c("4294967296"),
+      pg_span_make_c("18446744073709551615"),
+  };
+  const pg_span_t signed_decimals[] = {
+      pg_span_make_c("0"),
+      pg_span_make_c("-1234"),
+      pg_span_make_c("4294967296"),
+      pg_span_make_c("-9223372036854775807"),
+  };
+  const pg_span_t hexes[] = {
+      pg_span_make_c("0x0"),
+      pg_span_make_c("0x7ff8"),
+      pg_span_make_c("0x10a3f2c40"),
+      pg_span_make_c("0x7ffee3b1c2d8a9f0"),
+  };
+  uint64_t decimals_bytes = 0, signed_decimals_bytes = 0, hexes_bytes = 0;
+  for (uint64_t i = 0; i < 4; i++) {
+    decimals_bytes += decimals[i].len;
+    signed_decimals_bytes += signed_decimals[i].len;
+    hexes_bytes += hexes[i].len;
+  }
+
+  BENCH_LOOP(run, "pg_span_parse_u64_decimal", count,
+             count / 4 * decimals_bytes) {
+    for (uint64_t i = 0; i < count; i++) {
+      bool valid = false;
+      bench.checksum += pg_span_parse_u64_decimal(decimals[i % 4], &valid);
+    }
+  }
+
+  BENCH_LOOP(run, "pg_span_parse_i64_decimal", count,
+             count / 4 * signed_decimals_bytes) {
+    for (uint64_t i = 0; i < count; i++) {
+      bool valid = false;
+      bench.checksum +=
+          (uint64_t)pg_span_parse_i64_decimal(signed_decimals[i % 4], &valid);
+    }
+  }
+
+  BENCH_LOOP(run, "pg_span_parse_u64_hex", count, count / 4 * hexes_bytes) {
+    for (uint64_t i = 0; i < count; i++) {
+      bool valid = false;
+      bench.checksum += pg_span_parse_u64_hex(hexes[i % 4], &valid);
+    }
+  }
+}
+
+// What the parsers did before, one character at a time.
+static uint64_t bench_parse_scalar(pg_span_t span, bool hex, bool *valid) {
+  uint64_t res = 0;
+  for (uint64_t i = 0; i < span.len; i++) {
+    const char c = pg_char_to_lower(span.data[i]);
+    uint64_t n = 0;
+    if (pg_char_is_digit(c))
+      n = (uint8_t)c - '0';
+    else if (hex && c >= 'a' && c <= 'f')
+      n = (uint8_t)c - 'a' + 10;
+    else {
+      *valid = false;
+      return 0;
+    }
+    res = res * (hex ? 16 : 10) + n;
+  }
+  *valid = true;
+  return res;
+}
+
+// The fields of dtrace-alloc-postprocess input: per event a timestamp in
+// ns, a size, a pointer in decimal, and the offsets of ~10 stack frames.
+static void bench_parse_trace(void) {
+  const uint64_t events_count = 100 * 1000;
+  const uint64_t frames_count = 10;
+  const uint64_t fields_count = events_count * (3 + frames_count);
+  pg_span_t *const fields =
+      pg_alloc(pg_heap_allocator(), fields_count * sizeof(pg_span_t));
+  bool *const hexes = pg_alloc(pg_heap_allocator(), fields_count);
+  char *const text = pg_alloc(pg_heap_allocator(), fields_count * 24);
+
+  uint64_t state = 7, text_len = 0, bytes = 0;
+  uint64_t timestamp = 1676543210123456789ULL;
+  for (uint64_t i = 0, f = 0; i < events_count; i++) {
+    timestamp += bench_rand(&state) % 100000;
+    const uint64_t size = 1ULL << (bench_rand(&state) % 16);
+    const uint64_t ptr = 0x600000000000ULL + (bench_rand(&state) >> 28);
+    const uint64_t values[] = {timestamp, size, ptr};
+    for (uint64_t j = 0; j < 3 + frames_count; j++, f++) {
+      char *const s = text + text_len;
+      const int len =
+          j < 3 ? snprintf(s, 24, "%llu", values[j])
+                : snprintf(s, 24, "0x%llx", bench_rand(&state) % 0x4000);
+      fields[f] = (pg_span_t){.data = s, .len = (uint64_t)len};
+      hexes[f] = j >= 3;
+      text_len += (uint64_t)len;
+      bytes += (uint64_t)len;
+    }
+  }
+
+  BENCH_LOOP(run, "parse dtrace fields scalar", fields_count, bytes) {
+    for (uint64_t i = 0; i < fields_count; i++) {
+      bool valid = false;
+      pg_span_t span = fields[i];
+      if (hexes[i])
+        pg_span_consume_left(&span, 2);
+      bench.checksum += bench_parse_scalar(span, hexes[i], &valid) + valid;
+    }
+  }
+
+  BENCH_LOOP(run, "parse dtrace fields pg_span_parse", fields_count, bytes) {
+    for (uint64_t i = 0; i < fields_count; i++) {
+      bool valid = false;
+      bench.checksum +=
+          (hexes[i] ? (uint64_t)pg_span_parse_i64_hex(fields[i], &valid)
+                    : pg_span_parse_u64_decimal(fields[i], &valid)) +
+          valid;
+    }
+  }
+
+  pg_free(pg_heap_allocator(), text);
+  pg_free(pg_heap_allocator(), hexes);
+  pg_free(pg_heap_allocator(), fields);
+}
+
+// What `pg_span_url_encode` did: encoding all bytes, one `snprintf` each.
+static uint64_t bench_url_encode_snprintf(char *dst, const uint8_t *src,
+                                          uint64_t len) {
+  for (uint64_t i = 0; i < len; i++)
+    snprintf(dst + i * 3, 4, "%%%02X", src[i]);
+  return len * 3;
+}
+
+static void bench_url(void) {
+  const uint64_t count = 100 * 1000;
+  // Tracker announces: random bytes.
+  uint8_t info_hash[20] = {0};
+  uint64_t state = 11;
+  for (uint64_t i = 0; i < sizeof(info_hash); i++)
+    info_hash[i] = (uint8_t)bench_rand(&state);
+  // HTTP paths: mostly unreserved.
+  char path[] = "/api/v4/projects/gitlab-org%2Fgitlab/repository/files/"
+                "doc%2Fapi%2Fmerge_requests.md/raw?ref=master&private=true";
+  char dst[3 * sizeof(path)] = {0};
+
+  BENCH_LOOP(run, "url encode 20B snprintf", count, count * 20) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += bench_url_encode_snprintf(dst, info_hash, 20);
+  }
+
+  BENCH_LOOP(run, "pg_url_encode 20B", count, count * 20) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_url_encode(dst, info_hash, 20);
+  }
+
+  BENCH_LOOP(run, "url encode path snprintf", count,
+             count * (sizeof(path) - 1)) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += bench_url_encode_snprintf(dst, (uint8_t *)path,
+                                                  sizeof(path) - 1);
+  }
+
+  BENCH_LOOP(run, "pg_url_encode path", count, count * (sizeof(path) - 1)) {
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += pg_url_encode(dst, path, sizeof(path) - 1);
+  }
+
+  char decoded[sizeof(path)] = {0};
+  BENCH_LOOP(run, "pg_span_url_decode path", count,
+             count * (sizeof(path) - 1)) {
+    for (uint64_t i = 0; i < count; i++) {
+      memcpy(decoded, path, sizeof(path));
+      pg_span_t span = {.data = decoded, .len = sizeof(path) - 1};
+      bench.checksum += pg_span_url_decode(&span) + span.len;
+    }
+  }
+}
+
+static void bench_format(void) {
+  const uint64_t count = 1000 * 1000;
+  static char buf[64 * 1024];
+  uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+
+  BENCH_LOOP(run, "snprintf u64+hex", count, 0) {
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < count; i++) {
+      const uint64_t n = bench_rand(&rand_state) >> (i % 64);
+      if (len > sizeof(buf) - 64)
+        len = 0;
+      len += (uint64_t)snprintf(buf + len, sizeof(buf) - len, "%llu %#llx ",
+                                n, n);
+    }
+    bench.checksum += len;
+  }
+
+  BENCH_LOOP(run, "pg_builder u64+hex", count, 0) {
+    pg_builder_t b = {0};
+    pg_builder_init_buf(&b, buf, sizeof(buf));
+    for (uint64_t i = 0; i < count; i++) {
+      const uint64_t n = bench_rand(&rand_state) >> (i % 64);
+      if (b.len > sizeof(buf) - 64)
+        b.len = 0;
+      pg_builder_append_u64(&b, n);
+      pg_builder_append_cstr(&b, " 0x");
+      pg_builder_append_hex(&b, n);
+      pg_builder_append_char(&b, ' ');
+    }
+    bench.checksum += b.len;
+  }
+}
+
+// -------------------------- Pool
+
+static void bench_pool(void) {
+  const uint64_t count = 1000 * 1000;
+  void **ptrs = pg_alloc(pg_heap_allocator(), count * sizeof(void *));
+
+  BENCH_LOOP(run, "malloc+free 64B", count, 0) {
+    for (uint64_t i = 0; i < count; i++)
+      ptrs[i] = malloc(64);
+    for (uint64_t i = 0; i < count; i++)
+      free(ptrs[i]);
+  }
+
+  pg_pool_t pool = {0};
+  pg_pool_init_flags(&pool, 64, 4096, PG_POOL_FLAGS_GROW);
+  BENCH_LOOP(run, "pg_pool alloc+free 64B", count, 0) {
+    for (uint64_t i = 0; i < count; i++)
+      ptrs[i] = pg_pool_alloc(&pool);
+    for (uint64_t i = 0; i < count; i++)
+      pg_pool_free(&pool, ptrs[i]);
+  }
+  pg_pool_destroy(&pool);
+
+  pg_free(pg_heap_allocator(), ptrs);
+}
+
+// -------------------------- Legacy hashtable
+
+// The hashtable previously used in dtrace-alloc-postprocess, kept as a
+// baseline. It does not rehash on growth so it is pre-sized to never grow.
+typedef struct {
+  pg_array_t(uint64_t) keys;
+  pg_array_t(uint64_t) values;
+  pg_array_t(uint32_t) hashes;
+} legacy_hashtable_t;
+
+static void legacy_hashtable_init(legacy_hashtable_t *hashtable, uint64_t cap,
+                                  pg_allocator_t allocator) {
+  pg_array_init_reserve(hashtable->keys, cap, allocator);
+  pg_array_init_reserve(hashtable->values, cap, allocator);
+  pg_array_init_reserve(hashtable->hashes, cap, allocator);
+}
+
+static void legacy_hashtable_destroy(legacy_hashtable_t *hashtable) {
+  pg_array_free(hashtable->keys);
+  pg_array_free(hashtable->values);
+  pg_array_free(hashtable->hashes);
+}
+
+static bool legacy_hashtable_find(const legacy_hashtable_t *hashtable,
+                                  uint64_t key, uint64_t *index) {
+  const uint32_t hash = pg_hash((uint8_t *)&key, sizeof(uint64_t));
+  *index = hash % pg_array_capacity(hashtable->keys);
+
+  for (;;) {
+    const uint32_t index_hash = hashtable->hashes[*index];
+    if (index_hash == 0)
+      return false;
+    if (index_hash == hash &&
+        memcmp(&key, &hashtable->keys[*index], sizeof(uint64_t)) == 0)
+      return true;
+    *index = (*index + 1) % pg_array_capacity(hashtable->keys);
+  }
+}
+
+static void legacy_hashtable_upsert(legacy_hashtable_t *hashtable,
+                                    uint64_t key, uint64_t val) {
+  assert(pg_array_len(hashtable->keys) < pg_array_capacity(hashtable->keys));
+
+  uint64_t index = -1ULL;
+  if (legacy_hashtable_find(hashtable, key, &index)) {
+    hashtable->values[index] = val;
+  } else {
+    hashtable->keys[index] = key;
+    hashtable->hashes[index] = pg_hash((uint8_t *)&key, sizeof(uint64_t));
+    hashtable->values[index] = val;
+    const uint64_t new_len = pg_array_len(hashtable->keys) + 1;
+    pg_array_resize(hashtable->keys, new_len);
+    pg_array_resize(hashtable->values, new_len);
+    pg_array_resize(hashtable->hashes, new_len);
+  }
+}
+
+// -------------------------- Hashmap
+
+PG_HASHMAP_DEFINE(bench_map, uint64_t, uint64_t, pg_hash_u64, pg_eq_u64)
+
+static void bench_hashmap(uint64_t keys_count) {
+  uint64_t *keys = pg_alloc(pg_heap_allocator(), keys_count * sizeof(uint64_t));
+  uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+  for (uint64_t i = 0; i < keys_count; i++)
+    keys[i] = bench_rand(&rand_state);
+
+  {
+    legacy_hashtable_t table = {0};
+    BENCH_LOOP(run, "legacy insert (pre-sized)", keys_count, 0) {
+      bench_pause(&run);
+      legacy_hashtable_init(&table, keys_count * 4 / 3 + 1,
+                            pg_heap_allocator());
+      bench_resume(&run);
+
+      for (uint64_t i = 0; i < keys_count; i++)
+        legacy_hashtable_upsert(&table, keys[i], i);
+
+      bench_pause(&run);
+      legacy_hashtable_destroy(&table);
+      bench_resume(&run);
+    }
+
+    legacy_hashtable_init(&table, keys_count * 4 / 3 + 1, pg_heap_allocator());
+    for (uint64_t i = 0; i < keys_count; i++)
+      legacy_hashtable_upsert(&table, keys[i], i);
+
+    BENCH_LOOP(run, "legacy find hit", keys_count, 0) {
+      for (uint64_t i = 0; i < keys_count; i++) {
+        uint64_t index = 0;
+        if (legacy_hashtable_find(&table, keys[i], &index))
+          bench.checksum += table.values[index];
+      }
+    }
+
+    BENCH_LOOP(run, "legacy find miss", keys_count, 0) {
+      for (uint64_t i = 0; i < keys_count; i++) {
+        uint64_t index = 0;
+        bench.checksum += legacy_hashtable_find(&table, keys[i] + 1, &index);
+      }
+    }
+
+    legacy_hashtable_destroy(&table);
+  }
+  {
+    bench_map_t map = {0};
+    BENCH_LOOP(run, "hashmap insert (growing)", keys_count, 0) {
+      bench_pause(&run);
+      bench_map_init(&map, 0, pg_heap_allocator());
+      bench_resume(&run);
+
+      for (uint64_t i = 0; i < keys_count; i++)
+        bench_map_upsert(&map, keys[i], i);
+
+      bench_pause(&run);
+      bench_map_destroy(&map);
+      bench_resume(&run);
+    }
+
+    bench_map_init(&map, 0, pg_heap_allocator());
+    for (uint64_t i = 0; i < keys_count; i++)
+      bench_map_upsert(&map, keys[i], i);
+
+    BENCH_LOOP(run, "hashmap find hit", keys_count, 0) {
+      for (uint64_t i = 0; i < keys_count; i++) {
+        const uint64_t *value = bench_map_find(&map, keys[i]);
+        if (value != NULL)
+          bench.checksum += *value;
+      }
+    }
+
+    BENCH_LOOP(run, "hashmap find miss", keys_count, 0) {
+      for (uint64_t i = 0; i < keys_count; i++)
+        bench.checksum += bench_map_find(&map, keys[i] + 1) != NULL;
+    }
+
+    BENCH_LOOP(run, "hashmap remove", keys_count, 0) {
+      for (uint64_t i = 0; i < keys_count; i++)
+        bench_map_remove(&map, keys[i]);
+      assert(map.len == 0);
+
+      bench_pause(&run);
+      for (uint64_t i = 0; i < keys_count; i++)
+        bench_map_upsert(&map, keys[i], i);
+      bench_resume(&run);
+    }
+
+    bench_map_destroy(&map);
+  }
+
+  pg_free(pg_heap_allocator(), keys);
+}
+
+// -------------------------- Byte search
+
+// What `pg_span_split_at_first` used to do.
+static const char *bench_byte_loop(const char *s, uint64_t len, char c) {
+  for (uint64_t i = 0; i < len; i++) {
+    if (s[i] == c)
+      return s + i;
+  }
+  return NULL;
+}
+
+// Scalar substring search, checking every `memchr` candidate.
+static const char *bench_memmem_scalar(const char *big, uint64_t big_len,
+                                       const char *little,
+                                       uint64_t little_len) {
+  uint64_t i = 0;
+  while (i + little_len <= big_len) {
+    const char *s = memchr(big + i, little[0], big_len - little_len + 1 - i);
+    if (s == NULL)
+      return NULL;
+    if (memcmp(s, little, little_len) == 0)
+      return s;
+    i = (uint64_t)(s - big) + 1;
+  }
+  return NULL;
+}
+
+// Each search scans the whole input: the needle is only at the very end.
+static void bench_search(void) {
+  const uint64_t len = 32 * Mi;
+  char *big = pg_alloc(pg_heap_allocator(), len);
+  // HTTP-ish text with lots of partial matches of the needle.
+  const char pattern[] = "Header: value\r\n";
+  for (uint64_t i = 0; i < len; i++)
+    big[i] = pattern[i % (sizeof(pattern) - 1)];
+  memcpy(big + len - 4, "\r\n\r\n", 4);
+  big[len - 5] = '|';
+
+  BENCH_LOOP(run, "memmem scalar", 1, len) {
+    bench.checksum +=
+        (uint64_t)(bench_memmem_scalar(big, len, "\r\n\r\n", 4) - big);
+  }
+
+  BENCH_LOOP(run, "pg_memmem", 1, len) {
+    bench.checksum +=
+        (uint64_t)((char *)pg_memmem(big, len, "\r\n\r\n", 4) - big);
+  }
+
+  BENCH_LOOP(run, "byte loop", 1, len) {
+    bench.checksum += (uint64_t)(bench_byte_loop(big, len, '|') - big);
+  }
+
+  BENCH_LOOP(run, "pg_span_split_at_first", 1, len) {
+    pg_span_t left = {0}, right = {0};
+    pg_span_split_at_first((pg_span_t){big, len}, '|', &left, &right);
+    bench.checksum += left.len;
+  }
+
+  BENCH_LOOP(run, "pg_span_split_at_last (absent)", 1, len) {
+    pg_span_t left = {0}, right = {0};
+    pg_span_split_at_last((pg_span_t){big, len}, 'Z', &left, &right);
+    bench.checksum += left.len;
+  }
+
+  const uint8_t needles[] = {'|', '{', '}'};
+  BENCH_LOOP(run, "pg_memchr_any (3 needles)", 1, len) {
+    bench.checksum += (uint64_t)((char *)pg_memchr_any(big, len, needles,
+                                                       sizeof(needles)) -
+                                 big);
+  }
+
+  char *copy = pg_alloc(pg_heap_allocator(), len);
+  memcpy(copy, big, len);
+
+  BENCH_LOOP(run, "memcmp", 1, len) {
+    bench.checksum += memcmp(big, copy, len) == 0;
+  }
+
+  BENCH_LOOP(run, "pg_span_eq", 1, len) {
+    bench.checksum +=
+        pg_span_eq((pg_span_t){big, len}, (pg_span_t){copy, len});
+  }
+
+  // Short spans, as compared by parsers.
+  const uint64_t short_count = 1000 * 1000;
+  BENCH_LOOP(run, "memcmp short", short_count, 0) {
+    for (uint64_t i = 0; i < short_count; i++) {
+      const uint64_t n = 6 + i % 8;
+      bench.checksum += memcmp(big + i % 1024, copy + i % 1024, n) == 0;
+    }
+  }
+
+  BENCH_LOOP(run, "pg_span_eq short", short_count, 0) {
+    for (uint64_t i = 0; i < short_count; i++) {
+      const uint64_t n = 6 + i % 8;
+      bench.checksum += pg_span_eq((pg_span_t){big + i % 1024, n},
+                                   (pg_span_t){copy + i % 1024, n});
+    }
+  }
+
+  pg_free(pg_heap_allocator(), copy);
+  pg_free(pg_heap_allocator(), big);
+}
+
+// -------------------------- Queues
+
+#define BENCH_QUEUE_CAP 1024
+
+// What the lock-free queues replace: a ring behind a mutex.
+typedef struct {
+  pthread_mutex_t lock;
+  void *items[BENCH_QUEUE_CAP];
+  uint64_t head, tail;
+} bench_locked_queue_t;
+
+static bool bench_locked_queue_push(bench_locked_queue_t *queue, void *item) {
+  pthread_mutex_lock(&queue->lock);
+  const bool full = queue->tail - queue->head == BENCH_QUEUE_CAP;
+  if (!full)
+    queue->items[queue->tail++ % BENCH_QUEUE_CAP] = item;
+  pthread_mutex_unlock(&queue->lock);
+  return !full;
+}
+
+static uint64_t bench_locked_queue_pop_batch(bench_locked_queue_t *queue,
+                                             void **items, uint64_t max) {
+  pthread_mutex_lock(&queue->lock);
+  const uint64_t count = MIN(queue->tail - queue->head, max);
+  for (uint64_t i = 0; i < count; i++)
+    items[i] = queue->items[queue->head++ % BENCH_QUEUE_CAP];
+  pthread_mutex_unlock(&queue->lock);
+  return count;
+}
+
+typedef enum {
+  BENCH_QUEUE_LOCKED,
+  BENCH_QUEUE_SPSC,
+  BENCH_QUEUE_MPSC,
+} bench_queue_kind_t;
+
+typedef struct {
+  bench_queue_kind_t kind;
+  PG_PAD(4);
+  uint64_t items_count; // Per producer.
+  bench_locked_queue_t locked;
+  pg_spsc_t spsc;
+  pg_mpsc_t mpsc;
+} bench_queue_t;
+
+static void *bench_queue_produce(void *arg) {
+  bench_queue_t *const queue = arg;
+  for (uint64_t i = 1; i <= queue->items_count; i++) {
+    for (;;) {
+      bool pushed = false;
+      switch (queue->kind) {
+      case BENCH_QUEUE_LOCKED:
+        pushed = bench_locked_queue_push(&queue->locked, (void *)i);
+        break;
+      case BENCH_QUEUE_SPSC:
+        pushed = pg_spsc_push(&queue->spsc, (void *)i);
+        break;
+      case BENCH_QUEUE_MPSC:
+        pushed = pg_mpsc_push(&queue->mpsc, (void *)i);
+        break;
+      }
+      if (pushed)
+        break;
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+// Items per second from `producers_count` threads to the calling one.
+static void bench_queue_run(bench_run_t *run, bench_queue_t *queue,
+                            uint64_t producers_count) {
+  bench_pause(run);
+  pthread_t threads[8] = {0};
+  assert(producers_count <= sizeof(threads) / sizeof(threads[0]));
+  for (uint64_t i = 0; i < producers_count; i++)
+    pthread_create(&threads[i], NULL, bench_queue_produce, queue);
+  bench_resume(run);
+
+  void *items[64] = {0};
+  const uint64_t max = sizeof(items) / sizeof(items[0]);
+  const uint64_t total = producers_count * queue->items_count;
+  for (uint64_t received = 0; received < total;) {
+    uint64_t count = 0;
+    switch (queue->kind) {
+    case BENCH_QUEUE_LOCKED:
+      count = bench_locked_queue_pop_batch(&queue->locked, items, max);
+      break;
+    case BENCH_QUEUE_SPSC:
+      count = pg_spsc_pop_batch(&queue->spsc, items, max);
+      break;
+    case BENCH_QUEUE_MPSC:
+      count = pg_mpsc_pop_batch(&queue->mpsc, items, max);
+      break;
+    }
+    for (uint64_t i = 0; i < count; i++)
+      bench.checksum += (uint64_t)items[i];
+    received += count;
+    if (count == 0)
+      sched_yield();
+  }
+
+  for (uint64_t i = 0; i < producers_count; i++)
+    pthread_join(threads[i], NULL);
+}
+
+static void bench_queue(void) {
+  const uint64_t items_count = 1000 * 1000;
+  const uint64_t producers_count = 4;
+  bench_queue_t queue = {.items_count = items_count,
+                         .locked = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+  pg_spsc_init(&queue.spsc, pg_heap_allocator(), BENCH_QUEUE_CAP);
+  pg_mpsc_init(&queue.mpsc, pg_heap_allocator(), BENCH_QUEUE_CAP);
+
+  queue.kind = BENCH_QUEUE_LOCKED;
+  BENCH_LOOP(run, "mutex queue 1 producer", items_count, 0) {
+    bench_queue_run(&run, &queue, 1);
+  }
+  queue.kind = BENCH_QUEUE_SPSC;
+  BENCH_LOOP(run, "pg_spsc 1 producer", items_count, 0) {
+    bench_queue_run(&run, &queue, 1);
+  }
+
+  queue.kind = BENCH_QUEUE_LOCKED;
+  BENCH_LOOP(run, "mutex queue 4 producers", producers_count * items_count,
+             0) {
+    bench_queue_run(&run, &queue, producers_count);
+  }
+  queue.kind = BENCH_QUEUE_MPSC;
+  BENCH_LOOP(run, "pg_mpsc 4 producers", producers_count * items_count, 0) {
+    bench_queue_run(&run, &queue, producers_count);
+  }
+
+  pg_mpsc_destroy(&queue.mpsc);
+  pg_spsc_destroy(&queue.spsc);
+}
+
+// -------------------------- Executor
+
+#define BENCH_EXECUTOR_BLOCK (64 * 1024)
+
+typedef struct {
+  uint8_t *data;
+  uint32_t *hashes;
+} bench_executor_ctx_t;
+
+static void bench_executor_hash(void *ctx, uint64_t begin, uint64_t end) {
+  bench_executor_ctx_t *const c = ctx;
+  for (uint64_t i = begin; i < end; i++)
+    c->hashes[i] =
+        pg_hash(c->data + i * BENCH_EXECUTOR_BLOCK, BENCH_EXECUTOR_BLOCK);
+}
+
+static void bench_executor_nop(void *ctx, uint64_t begin, uint64_t end) {
+  (void)ctx;
+  (void)begin;
+  (void)end;
+}
+
+// Same work as checksumming pieces: the speed-up over the serial loop
+// should be close to the number of cores.
+static void bench_executor(void) {
+  pg_executor_t executor = {0};
+  if (!pg_executor_init(&executor, pg_heap_allocator(), 0)) {
+    fprintf(stderr, "Failed to start executor: %s\n", strerror(errno));
+    return;
+  }
+
+  const uint64_t blocks_count = 1024;
+  const uint64_t len = blocks_count * BENCH_EXECUTOR_BLOCK;
+  bench_executor_ctx_t ctx = {
+      .data = pg_alloc(pg_heap_allocator(), len),
+      .hashes = pg_alloc(pg_heap_allocator(), blocks_count * sizeof(uint32_t)),
+  };
+  for (uint64_t i = 0; i < len; i++)
+    ctx.data[i] = (uint8_t)i;
+
+  BENCH_LOOP(run, "serial pg_hash 64KiB blocks", blocks_count, len) {
+    bench_executor_hash(&ctx, 0, blocks_count);
+    bench.checksum += ctx.hashes[blocks_count - 1];
+  }
+
+  BENCH_LOOP(run, "parallel_for pg_hash 64KiB blocks", blocks_count, len) {
+    pg_executor_parallel_for(&executor, 0, blocks_count, 1,
+                             bench_executor_hash, &ctx);
+    bench.checksum += ctx.hashes[blocks_count - 1];
+  }
+
+  // Scheduling overhead.
+  const uint64_t count = 1000 * 1000;
+  BENCH_LOOP(run, "parallel_for empty, grain 1", count, 0) {
+    pg_executor_parallel_for(&executor, 0, count, 1, bench_executor_nop,
+                             NULL);
+  }
+
+  pg_free(pg_heap_allocator(), ctx.hashes);
+  pg_free(pg_heap_allocator(), ctx.data);
+  pg_executor_destroy(&executor);
+}
+
+// -------------------------- Timers
+
+static void bench_timer_fire(pg_timer_t *timer) {
+  bench.checksum += timer->deadline;
+}
+
+// An event loop with 100k connections, each with an idle timeout pushed
+// back on every read and firing ~30s later with 1ms ticks.
+static void bench_timer(void) {
+  const uint64_t count = 100 * 1000;
+  const uint64_t timeout = 30 * 1000;
+  pg_timer_t *const timers =
+      pg_alloc(pg_heap_allocator(), count * sizeof(pg_timer_t));
+  for (uint64_t i = 0; i < count; i++)
+    timers[i] = (pg_timer_t){.fn = bench_timer_fire};
+  pg_timer_wheel_t *const wheel =
+      pg_alloc(pg_heap_allocator(), sizeof(pg_timer_wheel_t));
+
+  BENCH_LOOP(run, "pg_timer_wheel add+cancel 100k", count, 0) {
+    pg_timer_wheel_init(wheel, 0);
+    for (uint64_t i = 0; i < count; i++)
+      pg_timer_wheel_add(wheel, &timers[i], timeout + i % 1000);
+    for (uint64_t i = 0; i < count; i++)
+      pg_timer_wheel_cancel(wheel, &timers[i]);
+  }
+
+  BENCH_LOOP(run, "pg_timer_wheel reschedule 100k", count, 0) {
+    bench_pause(&run);
+    pg_timer_wheel_init(wheel, 0);
+    for (uint64_t i = 0; i < count; i++)
+      pg_timer_wheel_add(wheel, &timers[i], timeout);
+    bench_resume(&run);
+
+    for (uint64_t i = 0; i < count; i++) {
+      pg_timer_wheel_advance(wheel, i / 100);
+      pg_timer_wheel_add(wheel, &timers[i], wheel->now + timeout);
+    }
+
+    bench_pause(&run);
+    for (uint64_t i = 0; i < count; i++)
+      pg_timer_wheel_cancel(wheel, &timers[i]);
+    bench_resume(&run);
+  }
+
+  BENCH_LOOP(run, "pg_timer_wheel expire 100k over 1s", count, 0) {
+    bench_pause(&run);
+    pg_timer_wheel_init(wheel, 0);
+    for (uint64_t i = 0; i < count; i++)
+      pg_timer_wheel_add(wheel, &timers[i], timeout + i % 1000);
+    bench_resume(&run);
+
+    for (uint64_t now = 1; wheel->count > 0; now++)
+      pg_timer_wheel_advance(wheel, now);
+  }
+
+  pg_free(pg_heap_allocator(), wheel);
+  pg_free(pg_heap_allocator(), timers);
+}
+
+// -------------------------- Sort
+
+// Sizes of 1M, 10M, 100M... up to `max_count` keys. Keys share their high
+// bytes like addresses do.
+static void bench_sort(uint64_t max_count) {
+  pg_executor_t executor = {0};
+  if (!pg_executor_init(&executor, pg_heap_allocator(), 0)) {
+    fprintf(stderr, "Failed to start executor: %s\n", strerror(errno));
+    return;
+  }
+
+  for (uint64_t count = 1000 * 1000; count <= max_count; count *= 10) {
+    uint64_t *const orig =
+        pg_alloc(pg_heap_allocator(), count * sizeof(uint64_t));
+    uint64_t *const keys =
+        pg_alloc(pg_heap_allocator(), count * sizeof(uint64_t));
+    uint64_t *const values =
+        pg_alloc(pg_heap_allocator(), count * sizeof(uint64_t));
+    uint64_t state = 42;
+    for (uint64_t i = 0; i < count; i++)
+      orig[i] = 0x7f0000000000ULL | (bench_rand(&state) >> 24);
+
+    char name[64] = "";
+    snprintf(name, sizeof(name), "qsort u64 %lluM", count / (1000 * 1000));
+    BENCH_LOOP(run, name, count, count * sizeof(uint64_t)) {
+      bench_pause(&run);
+      memcpy(keys, orig, count * sizeof(uint64_t));
+      bench_resume(&run);
+      qsort(keys, count, sizeof(uint64_t), bench_compare_u64);
+      bench.checksum += keys[count / 2];
+    }
+
+    snprintf(name, sizeof(name), "pg_radix_sort_u64 %lluM",
+             count / (1000 * 1000));
+    BENCH_LOOP(run, name, count, count * sizeof(uint64_t)) {
+      bench_pause(&run);
+      memcpy(keys, orig, count * sizeof(uint64_t));
+      bench_resume(&run);
+      pg_radix_sort_u64(keys, NULL, count, pg_heap_allocator());
+      bench.checksum += keys[count / 2];
+    }
+
+    snprintf(name, sizeof(name), "pg_radix_sort_u64 kv %lluM",
+             count / (1000 * 1000));
+    BENCH_LOOP(run, name, count, 2 * count * sizeof(uint64_t)) {
+      bench_pause(&run);
+      memcpy(keys, orig, count * sizeof(uint64_t));
+      for (uint64_t i = 0; i < count; i++)
+        values[i] = i;
+      bench_resume(&run);
+      pg_radix_sort_u64(keys, values, count, pg_heap_allocator());
+      bench.checksum += values[count / 2];
+    }
+
+    snprintf(name, sizeof(name), "pg_radix_sort_u64_parallel %lluM",
+             count / (1000 * 1000));
+    BENCH_LOOP(run, name, count, count * sizeof(uint64_t)) {
+      bench_pause(&run);
+      memcpy(keys, orig, count * sizeof(uint64_t));
+      bench_resume(&run);
+      pg_radix_sort_u64_parallel(&executor, keys, NULL, count,
+                                 pg_heap_allocator());
+      bench.checksum += keys[count / 2];
+    }
+
+    pg_free(pg_heap_allocator(), values);
+    pg_free(pg_heap_allocator(), keys);
+    pg_free(pg_heap_allocator(), orig);
+  }
+
+  pg_executor_destroy(&executor);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t keys_count = 1000 * 1000;
+  uint64_t sort_max_count = 10 * 1000 * 1000;
+  const char *results_path = NULL, *baseline_path = NULL;
+
+  int ch = 0;
+  while ((ch = getopt(argc, argv, "w:r:f:n:s:o:b:t:")) != -1) {
+    switch (ch) {
+    case 'w':
+      bench.warmup = strtoull(optarg, NULL, 10);
+      break;
+    case 'r':
+      bench.repetitions = MAX(strtoull(optarg, NULL, 10), 1ULL);
+      break;
+    case 'f':
+      bench.filter = optarg;
+      break;
+    case 'n':
+      keys_count = MAX(strtoull(optarg, NULL, 10), 1ULL);
+      break;
+    case 's':
+      sort_max_count = strtoull(optarg, NULL, 10);
+      break;
+    case 'o':
+      results_path = optarg;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 't':
+      bench.threshold = strtod(optarg, NULL) / 100;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-w warmup] [-r repetitions] [-f filter] "
+                      "[-n keys_count] [-s sort_max_count] [-o results.tsv] "
+                      "[-b baseline.tsv] [-t threshold_percent]\n",
+              argv[0]);
+      return EINVAL;
+    }
+  }
+
+  if (baseline_path != NULL && !bench_baseline_load(baseline_path)) {
+    fprintf(stderr, "Failed to read baseline %s: %s\n", baseline_path,
+            strerror(errno));
+    return errno;
+  }
+  if (results_path != NULL &&
+      (bench.results_file = fopen(results_path, "w")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", results_path, strerror(errno));
+    return errno;
+  }
+
+  bench_array();
+  bench_ring();
+  bench_bitarray();
+  bench_hash();
+  bench_hash_quality("quality pg_hash", bench_hash_fnv, 32);
+  bench_hash_quality("quality pg_hash_bytes", bench_hash_bytes, 64);
+  bench_hash_quality("quality pg_hash_u64", bench_hash_u64, 64);
+  bench_parse();
+  bench_parse_trace();
+  bench_format();
+  bench_url();
+  bench_pool();
+  bench_hashmap(keys_count);
+  bench_search();
+  bench_queue();
+  bench_executor();
+  bench_timer();
+  bench_sort(sort_max_count);
+
+  if (bench.results_file != NULL)
+    fclose(bench.results_file);
+
+  printf("checksum=%llu\n", bench.checksum);
+  if (bench.regressions_count > 0) {
+    printf("%llu regression(s) above %.0f%%\n", bench.regressions_count,
+           bench.threshold * 100);
+    return 1;
+  }
+}
@@ -153,13 +153,158 @@ TEST test_pg_span_split_at_last(void) {
   PASS();
 }
 
+static const uint8_t *naive_memmem(const uint8_t *big, uint64_t big_len,
+                                   const uint8_t *little, uint64_t little_len) {
+  for (uint64_t i = 0; i + little_len <= big_len; i++) {
+    if (memcmp(big + i, little, little_len) == 0)
+      return big + i;
+  }
+  return NULL;
+}
+
+TEST test_pg_memmem(void) {
+  {
+    // Repeated prefix: the first candidate does not match.
+    const char s[] = "aaab";
+    ASSERT_EQ(s + 1, pg_memmem(s, 4, "aab", 3));
+    ASSERT_EQ(NULL, pg_memmem(s, 4, "aac", 3));
+    ASSERT_EQ(NULL, pg_memmem(s, 4, "aaaab", 5));
+    ASSERT_EQ(s, pg_memmem(s, 4, "", 0));
+  }
+  {
+    const char req[] = "GET / HTTP/1.1\r\nHost: x\r\n\r\nbody";
+    const char *body = pg_memmem(req, sizeof(req) - 1, "\r\n\r\n", 4);
+    ASSERT_NEQ(NULL, body);
+    ASSERT_STRN_EQ("\r\n\r\nbody", body, 8);
+  }
+
+  // Compare with the naive version on a small alphabet so that there are many
+  // partial matches, across block boundaries.
+  uint8_t big[300] = {0};
+  uint64_t state = 42;
+  for (uint64_t i = 0; i < sizeof(big); i++) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    big[i] = (uint8_t)('a' + (state >> 60) % 3);
+  }
+  for (uint64_t big_len = 0; big_len <= sizeof(big); big_len += 7) {
+    for (uint64_t little_len = 1; little_len <= 6; little_len++) {
+      for (uint64_t start = 0; start + little_len <= sizeof(big);
+           start += 13) {
+        const uint8_t *little = big + start;
+        ASSERT_EQ(naive_memmem(big, big_len, little, little_len),
+                  pg_memmem(big, big_len, little, little_len));
+      }
+    }
+
+    for (uint8_t c = 'a'; c <= 'd'; c++) {
+      const uint8_t *expected = NULL;
+      for (uint64_t i = 0; i < big_len; i++) {
+        if (big[i] == c)
+          expected = big + i;
+      }
+      ASSERT_EQ(expected, pg_memrchr(big, big_len, c));
+    }
+
+    const uint8_t needles[] = {'d', 'c'};
+    ASSERT_EQ(naive_memmem(big, big_len, (const uint8_t *)"c", 1),
+              pg_memchr_any(big, big_len, needles, sizeof(needles)));
+  }
+
+  {
+    // Lookup table path.
+    const uint8_t needles[] = "0123456789xyz";
+    const char s[] = "The quick brown fox jumps over the lazy dog";
+    ASSERT_EQ(s + 18,
+              pg_memchr_any(s, sizeof(s) - 1, needles, sizeof(needles) - 1));
+  }
+
+  PASS();
+}
+
+TEST test_pg_span_eq(void) {
+  char a[100] = {0};
+  char b[100] = {0};
+  for (uint64_t i = 0; i < sizeof(a); i++)
+    a[i] = b[i] = (char)i;
+
+  for (uint64_t len = 0; len <= sizeof(a); len++) {
+    ASSERT_EQ(true, pg_span_eq((pg_span_t){a, len}, (pg_span_t){b, len}));
+    for (uint64_t i = 0; i < len; i++) {
+      b[i] ^= 1;
+      ASSERT_EQ(false, pg_span_eq((pg_span_t){a, len}, (pg_span_t){b, len}));
+      b[i] ^= 1;
+    }
+  }
+
+  ASSERT_EQ(true, pg_span_starts_with(pg_span_make_c("malloc"),
+                                      pg_span_make_c("mall")));
+  ASSERT_EQ(true, pg_span_ends_with(pg_span_make_c("libc`malloc"),
+                                    pg_span_make_c("malloc")));
+  ASSERT_EQ(false, pg_span_ends_with(pg_span_make_c("libc`realloc"),
+                                     pg_span_make_c("malloc")));
+  ASSERT_EQ(true, pg_span_contains(pg_span_make_c("libc`malloc+0x10"),
+                                   pg_span_make_c("malloc")));
+  PASS();
+}
+
 TEST test_pg_string_url_encode(void) {
   pg_string_t src = pg_string_make(pg_heap_allocator(), "foo?_. ");
 
   pg_string_t res = pg_string_url_encode(pg_heap_allocator(), src);
-  ASSERT_EQ_FMT(21ULL, pg_string_len(res), "%llu");
-  ASSERT_STRN_EQ("%66%6F%6F%3F%5F%2E%20", res, pg_string_len(res));
+  ASSERT_EQ_FMT(11ULL, pg_string_len(res), "%llu");
+  ASSERT_STRN_EQ("foo%3F_.%20", res, pg_string_len(res));
+
+  // Long enough for the block paths, with every byte value.
+  char all[2 * 256] = {0};
+  for (uint64_t i = 0; i < sizeof(all); i++)
+    all[i] = (char)(i < 256 ? i : 'a' + i % 26);
+  char encoded[3 * sizeof(all)] = {0};
+  const uint64_t encoded_len = pg_url_encode(encoded, all, sizeof(all));
+  ASSERT_EQ(encoded_len, 256 + 66 + 3 * (256 - 66));
+  ASSERT_STRN_EQ("%00%01", encoded, 6);
+  ASSERT_STRN_EQ("%2C-.%2F0123456789%3A", encoded + 3 * 0x2c, 21);
+
+  // Round trip.
+  pg_span_t decoded = {.data = encoded, .len = encoded_len};
+  ASSERT(pg_span_url_decode(&decoded));
+  ASSERT_EQ(decoded.len, sizeof(all));
+  ASSERT_MEM_EQ(all, decoded.data, sizeof(all));
+
+  char lower[] = "a%2fb%2Fc+d%7e";
+  pg_span_t span = pg_span_make_c(lower);
+  ASSERT(pg_span_url_decode(&span));
+  ASSERT_STRN_EQ("a/b/c+d~", span.data, span.len);
+  ASSERT_EQ(span.len, 8);
+
+  char truncated[] = "abc%2";
+  span = pg_span_make_c(truncated);
+  ASSERT_FALSE(pg_span_url_decode(&span));
+  char invalid[] = "abc%g0";
+  span = pg_span_make_c(invalid);
+  ASSERT_FALSE(pg_span_url_decode(&span));
+  // Just outside of the digit and letter ranges.
+  const char *const invalid_escapes[] = {"%@1", "%`0", "%4@", "%/0",
+                                         "%:0", "%0/", "%0:", "%G1"};
+  for (uint64_t i = 0;
+       i < sizeof(invalid_escapes) / sizeof(invalid_escapes[0]); i++) {
+    char escape[4] = {0};
+    memcpy(escape, invalid_escapes[i], 3);
+    span = (pg_span_t){.data = escape, .len = 3};
+    ASSERT_FALSE(pg_span_url_decode(&span));
+  }
 
+  // In pieces into a small fixed buffer.
+  char buf[10] = {0};
+  pg_builder_t b = {0};
+  pg_builder_init_buf(&b, buf, sizeof(buf));
+  pg_builder_append_url_encoded(&b, pg_span_make_c("a b c"));
+  ASSERT_FALSE(b.truncated);
+  ASSERT_STRN_EQ("a%20b%20c", b.data, b.len);
+  pg_builder_append_url_encoded(&b, pg_span_make_c(" "));
+  ASSERT(b.truncated);
+
+  pg_string_free(res);
+  pg_string_free(src);
   PASS();
 }
 
@@ -282,6 +427,61 @@ TEST test_pg_ring(void) {
   PASS();
 }
 
+TEST test_pg_ring_mirrored(void) {
+  pg_ring_t ring = {0};
+  ASSERT_EQ(true, pg_ring_init_mirrored(pg_heap_allocator(), &ring, 100));
+  ASSERT_EQ(0ULL, ring.cap % 4096);
+
+  // Move the offset close to the end
+  const uint64_t almost_cap = ring.cap - 3;
+  pg_span_t w = pg_ring_write_span(&ring);
+  ASSERT_EQ_FMT(ring.cap, w.len, "%llu");
+  pg_ring_commit_write(&ring, almost_cap);
+  pg_ring_consume_front(&ring, almost_cap);
+  ASSERT_EQ_FMT(0ULL, pg_ring_len(&ring), "%llu");
+
+  // Write across the wrap in one go
+  w = pg_ring_write_span(&ring);
+  ASSERT_EQ_FMT(ring.cap, w.len, "%llu");
+  memcpy(w.data, "hello world!", 12);
+  pg_ring_commit_write(&ring, 12);
+
+  const pg_span_t r = pg_ring_peek_span(&ring);
+  ASSERT_EQ_FMT(12ULL, r.len, "%llu");
+  ASSERT_STRN_EQ("hello world!", r.data, r.len);
+  ASSERT_EQ_FMT('l', pg_ring_get(&ring, 3), "%c");
+  ASSERT_EQ_FMT('!', pg_ring_back(&ring), "%c");
+
+  uint8_t hello[5] = {0};
+  pg_ring_pop_frontv(&ring, hello, sizeof(hello));
+  ASSERT_STRN_EQ("hello", (char *)hello, sizeof(hello));
+  ASSERT_EQ_FMT(7ULL, pg_ring_len(&ring), "%llu");
+
+  pg_ring_destroy(&ring);
+
+  // Non mirrored ring: spans stop at the end of the buffer
+  pg_ring_init(pg_heap_allocator(), &ring, 8);
+  pg_ring_commit_write(&ring, 6);
+  pg_ring_consume_front(&ring, 6);
+  pg_ring_push_backv(&ring, (const uint8_t *)"abcd", 4);
+  ASSERT_EQ_FMT(2ULL, pg_ring_peek_span(&ring).len, "%llu");
+  ASSERT_EQ_FMT(4ULL, pg_ring_write_span(&ring).len, "%llu");
+
+  pg_ring_make_contiguous(&ring);
+  const pg_span_t all = pg_ring_peek_span(&ring);
+  ASSERT_EQ_FMT(4ULL, all.len, "%llu");
+  ASSERT_STRN_EQ("abcd", all.data, all.len);
+  ASSERT_EQ_FMT(4ULL, pg_ring_write_span(&ring).len, "%llu");
+
+  uint8_t abcd[4] = {0};
+  pg_ring_pop_frontv(&ring, abcd, sizeof(abcd));
+  ASSERT_STRN_EQ("abcd", (char *)abcd, sizeof(abcd));
+
+  pg_ring_destroy(&ring);
+
+  PASS();
+}
+
 TEST test_pg_bitarray(void) {
   pg_bitarray_t bitarr = {0};
   pg_bitarray_init(pg_heap_allocator(), &bitarr, 10);
@@ -410,6 +610,221 @@ TEST test_pg_bitarray(void) {
   PASS();
 }
 
+TEST test_pg_bitarray_words(void) {
+  // Spans 3 words, the last one partially.
+  pg_bitarray_t a = {0};
+  pg_bitarray_init(pg_heap_allocator(), &a, 149);
+  pg_bitarray_t b = {0};
+  pg_bitarray_init(pg_heap_allocator(), &b, 149);
+
+  uint64_t i = 0;
+  ASSERT_EQ(false, pg_bitarray_find_first_set(&a, &i));
+
+  pg_bitarray_set(&a, 3);
+  pg_bitarray_set(&a, 64);
+  pg_bitarray_set(&a, 149);
+  {
+    uint64_t found[3] = {0};
+    uint64_t found_count = 0;
+    for (i = 0; pg_bitarray_find_next_set(&a, i, &i); i++) {
+      ASSERT(found_count < 3);
+      found[found_count++] = i;
+    }
+    ASSERT_EQ_FMT(3ULL, found_count, "%llu");
+    ASSERT_EQ_FMT(3ULL, found[0], "%llu");
+    ASSERT_EQ_FMT(64ULL, found[1], "%llu");
+    ASSERT_EQ_FMT(149ULL, found[2], "%llu");
+  }
+
+  ASSERT_EQ(true, pg_bitarray_any_set_in_range(&a, 4, 65));
+  ASSERT_EQ(false, pg_bitarray_any_set_in_range(&a, 4, 64));
+  ASSERT_EQ(true, pg_bitarray_none_set_in_range(&a, 65, 149));
+  ASSERT_EQ(false, pg_bitarray_none_set_in_range(&a, 65, 150));
+  ASSERT_EQ(true, pg_bitarray_all_set_in_range(&a, 64, 65));
+  ASSERT_EQ(false, pg_bitarray_all_set_in_range(&a, 63, 65));
+
+  // Tail bits past the length must not be counted.
+  pg_bitarray_set_all(&b);
+  ASSERT_EQ_FMT(150ULL, pg_bitarray_count_set(&b), "%llu");
+  ASSERT_EQ(true, pg_bitarray_is_all_set(&b));
+  ASSERT_EQ(true, pg_bitarray_all_set_in_range(&b, 1, 150));
+
+  pg_bitarray_andnot(&b, &a);
+  ASSERT_EQ_FMT(147ULL, pg_bitarray_count_set(&b), "%llu");
+  ASSERT_EQ(false, pg_bitarray_get(&b, 64));
+
+  ASSERT_EQ(false, pg_bitarray_find_next_set_and(&a, &b, 0, &i));
+  pg_bitarray_set(&b, 64);
+  ASSERT_EQ(true, pg_bitarray_find_next_set_and(&a, &b, 0, &i));
+  ASSERT_EQ_FMT(64ULL, i, "%llu");
+
+  pg_bitarray_and(&b, &a);
+  ASSERT_EQ_FMT(1ULL, pg_bitarray_count_set(&b), "%llu");
+
+  pg_bitarray_or(&b, &a);
+  ASSERT_EQ_FMT(3ULL, pg_bitarray_count_set(&b), "%llu");
+
+  // Shrinking clears the bits past the new length, growing adds 0s.
+  pg_bitarray_resize(&a, 63);
+  ASSERT_EQ_FMT(1ULL, pg_bitarray_count_set(&a), "%llu");
+  pg_bitarray_resize(&a, 199);
+  ASSERT_EQ_FMT(1ULL, pg_bitarray_count_set(&a), "%llu");
+  ASSERT_EQ(true, pg_bitarray_none_set_in_range(&a, 4, 200));
+
+  pg_bitarray_destroy(&a);
+  pg_bitarray_destroy(&b);
+
+  PASS();
+}
+
+PG_HASHMAP_DEFINE(test_map, uint64_t, uint64_t, pg_hash_u64, pg_eq_u64)
+
+// Lots of collisions and long clusters to exercise the backward shift.
+#define test_hash_collide(x) ((uint64_t)(x) % 7)
+PG_HASHMAP_DEFINE(test_map_collide, uint64_t, uint64_t, test_hash_collide,
+                  pg_eq_u64)
+
+TEST test_pg_hashmap(void) {
+  test_map_t map = {0};
+  test_map_init(&map, 0, pg_heap_allocator());
+  ASSERT_EQ_FMT(16ULL, map.cap, "%llu");
+  ASSERT_EQ(NULL, test_map_find(&map, 1));
+
+  // Grows many times.
+  for (uint64_t i = 0; i < 10000; i++)
+    ASSERT_EQ(true, test_map_upsert(&map, i * 31, i));
+  ASSERT_EQ_FMT(10000ULL, map.len, "%llu");
+  ASSERT(pg_is_power_of_two(map.cap));
+
+  for (uint64_t i = 0; i < 10000; i++) {
+    const uint64_t *v = test_map_find(&map, i * 31);
+    ASSERT_NEQ(NULL, v);
+    ASSERT_EQ_FMT(i, *v, "%llu");
+  }
+  ASSERT_EQ(NULL, test_map_find(&map, 1));
+
+  ASSERT_EQ(false, test_map_upsert(&map, 31, 42));
+  ASSERT_EQ_FMT(42ULL, *test_map_find(&map, 31), "%llu");
+
+  for (uint64_t i = 0; i < 10000; i += 2)
+    ASSERT_EQ(true, test_map_remove(&map, i * 31));
+  ASSERT_EQ(false, test_map_remove(&map, 0));
+  ASSERT_EQ_FMT(5000ULL, map.len, "%llu");
+
+  for (uint64_t i = 0; i < 10000; i++)
+    ASSERT_EQ(i % 2 == 1, test_map_find(&map, i * 31) != NULL);
+
+  uint64_t count = 0;
+  uint64_t it = 0;
+  test_map_slot_t *slot = NULL;
+  while (test_map_next(&map, &it, &slot)) {
+    ASSERT_EQ_FMT(0ULL, (slot->key / 31) % 2 == 0, "%llu");
+    count += 1;
+  }
+  ASSERT_EQ_FMT(5000ULL, count, "%llu");
+
+  test_map_clear(&map);
+  ASSERT_EQ_FMT(0ULL, map.len, "%llu");
+  ASSERT_EQ(NULL, test_map_find(&map, 31));
+  test_map_destroy(&map);
+
+  test_map_collide_t collide = {0};
+  test_map_collide_init(&collide, 100, pg_heap_allocator());
+  for (uint64_t i = 0; i < 100; i++)
+    test_map_collide_upsert(&collide, i, i);
+  for (uint64_t i = 0; i < 100; i += 3)
+    ASSERT_EQ(true, test_map_collide_remove(&collide, i));
+  for (uint64_t i = 0; i < 100; i++) {
+    const uint64_t *v = test_map_collide_find(&collide, i);
+    if (i % 3 == 0) {
+      ASSERT_EQ(NULL, v);
+    } else {
+      ASSERT_NEQ(NULL, v);
+      ASSERT_EQ_FMT(i, *v, "%llu");
+    }
+  }
+  test_map_collide_destroy(&collide);
+
+  PASS();
+}
+
+// Record the arguments then format them as the binary log mode does.
+static void test_log_format(pg_log_out_t *out, const char *fmt, ...) {
+  uint8_t args[512] = {0};
+  uint64_t args_len = 0;
+  va_list ap;
+  va_start(ap, fmt);
+  const bool ok = pg_log_args_encode(args, sizeof(args), &args_len, fmt, ap);
+  va_end(ap);
+  assert(ok);
+
+  out->len = 0;
+  pg_log_record_format(out, fmt, args);
+  out->data[out->len] = 0;
+}
+
+static bool test_log_encode_fits(uint64_t cap, const char *fmt, ...) {
+  uint8_t args[512] = {0};
+  uint64_t args_len = 0;
+  assert(cap <= sizeof(args));
+  va_list ap;
+  va_start(ap, fmt);
+  const bool ok = pg_log_args_encode(args, cap, &args_len, fmt, ap);
+  va_end(ap);
+  return ok;
+}
+
+TEST test_pg_log_binary_format(void) {
+  pg_log_out_t out = {0};
+  char expected[256] = {0};
+  const char span[] = "hello world";
+
+#define CHECK_LOG_FORMAT(fmt, ...)                                             \
+  do {                                                                         \
+    snprintf(expected, sizeof(expected), fmt, __VA_ARGS__);                    \
+    test_log_format(&out, fmt, __VA_ARGS__);                                   \
+    ASSERT_STR_EQ(expected, out.data);                                         \
+  } while (0)
+
+  CHECK_LOG_FORMAT("[%s] piece=%u block=%u", "127.0.0.1:6881", 3U, 42U);
+  CHECK_LOG_FORMAT("%.*s|%-8.3s|%8s|", 5, span, span, "ab");
+  CHECK_LOG_FORMAT("%lld %llu %zd %hhd %hu %ld", -1LL, 18446744073709551615ULL,
+                   (ssize_t)-5, (signed char)-3, (unsigned short)65535, -7L);
+  CHECK_LOG_FORMAT("%#x %08X %o %c %%", 255U, 48879U, 8U, 'z');
+  CHECK_LOG_FORMAT("%.2f MiB %2.f B/s %e %g", 1.5, 1234.5, 0.001, 1e10);
+  CHECK_LOG_FORMAT("%*d|%-*d|%.*f", 6, 42, 4, 7, 3, 3.14159);
+  CHECK_LOG_FORMAT("%p %s", (void *)0x1234, (char *)NULL);
+
+#undef CHECK_LOG_FORMAT
+
+  // Arguments which do not fit.
+  ASSERT_EQ(false, test_log_encode_fits(8, "%s", span));
+  ASSERT_EQ(true, test_log_encode_fits(8, "%.*s", 3, span));
+
+  PASS();
+}
+
+TEST test_pg_log_rate_limit(void) {
+  const pg_logger_t logger = {.level = PG_LOG_INFO, .max_per_second = 2};
+  pg_log_site_t site = {.window_start_ns = pg_now_ns()};
+
+  uint32_t suppressed = 0;
+  uint64_t kept = 0;
+  for (uint64_t i = 0; i < 5; i++)
+    kept += pg_log_rate_limit(&logger, &site, &suppressed);
+  ASSERT_EQ_FMT(2ULL, kept, "%llu");
+  ASSERT_EQ_FMT(0U, suppressed, "%u");
+
+  // Next window: the dropped count is reported once.
+  site.window_start_ns -= 2ULL * 1000 * 1000 * 1000;
+  ASSERT_EQ(true, pg_log_rate_limit(&logger, &site, &suppressed));
+  ASSERT_EQ_FMT(3U, suppressed, "%u");
+  ASSERT_EQ(true, pg_log_rate_limit(&logger, &site, &suppressed));
+  ASSERT_EQ_FMT(0U, suppressed, "%u");
+
+  PASS();
+}
+
 TEST test_pg_pool(void) {
   pg_pool_t pool = {0};
 
@@ -456,6 +871,900 @@ TEST test_pg_pool(void) {
   PASS();
 }
 
+TEST test_pg_pool_grow(void) {
+  pg_pool_t pool = {0};
+  pg_pool_init_flags(&pool, 100, 4, PG_POOL_FLAGS_GROW);
+  ASSERT_EQ_FMT(1ULL, pool.slabs_count, "%llu");
+
+  const uint64_t count = 3 * pool.chunks_per_slab + 1;
+  pg_array_t(uint8_t *) items = {0};
+  pg_array_init_reserve(items, count, pg_heap_allocator());
+
+  for (uint64_t i = 0; i < count; i++) {
+    uint8_t *item = pg_pool_alloc(&pool);
+    ASSERT(item != NULL);
+    ASSERT_EQ(0, item[0]);
+    ASSERT_EQ(0, item[99]);
+    item[99] = 1;
+    pg_array_append(items, item);
+  }
+  ASSERT_EQ_FMT(4ULL, pool.slabs_count, "%llu");
+
+  // Empty slabs are given back, except the last one
+  for (uint64_t i = 0; i < count; i++)
+    pg_pool_free(&pool, items[i]);
+  ASSERT_EQ_FMT(1ULL, pool.slabs_count, "%llu");
+  ASSERT(pool.full == NULL);
+
+  // Reused chunks are zeroed
+  uint8_t *item = pg_pool_alloc(&pool);
+  ASSERT_EQ(0, item[99]);
+  pg_pool_free(&pool, item);
+
+  // Alternating across a slab boundary keeps the spare slab
+  pg_array_clear(items);
+  for (uint64_t i = 0; i < pool.chunks_per_slab; i++)
+    pg_array_append(items, pg_pool_alloc(&pool));
+  ASSERT_EQ_FMT(1ULL, pool.slabs_count, "%llu");
+  for (uint64_t i = 0; i < 10; i++) {
+    pg_pool_free(&pool, pg_pool_alloc(&pool));
+    ASSERT_EQ_FMT(2ULL, pool.slabs_count, "%llu");
+    ASSERT_EQ_FMT(1ULL, pool.empty_slabs_count, "%llu");
+  }
+  for (uint64_t i = 0; i < pool.chunks_per_slab; i++)
+    pg_pool_free(&pool, items[i]);
+  ASSERT_EQ_FMT(1ULL, pool.slabs_count, "%llu");
+
+  pg_array_free(items);
+  pg_pool_destroy(&pool);
+
+  PASS();
+}
+
+TEST test_pg_pool_empty(void) {
+  pg_pool_t pool = {0};
+  pg_pool_init(&pool, 64, 0);
+  ASSERT_EQ_FMT(0ULL, pool.slabs_count, "%llu");
+  ASSERT_EQ(NULL, pg_pool_alloc(&pool));
+  pg_pool_free_all(&pool);
+  ASSERT_EQ(NULL, pg_pool_alloc(&pool));
+  pg_pool_destroy(&pool);
+
+  // The first slab is only mapped when needed
+  pg_pool_init_flags(&pool, 64, 0, PG_POOL_FLAGS_GROW);
+  ASSERT_EQ_FMT(0ULL, pool.slabs_count, "%llu");
+  ASSERT(pool.chunks_per_slab > 0);
+  uint8_t *item = pg_pool_alloc(&pool);
+  ASSERT(item != NULL);
+  ASSERT_EQ_FMT(1ULL, pool.slabs_count, "%llu");
+  pg_pool_free(&pool, item);
+  pg_pool_destroy(&pool);
+
+  // Chunks bigger than the minimum slab size still fit
+  pg_pool_init_flags(&pool, 8 * Ki, 0, PG_POOL_FLAGS_GROW);
+  ASSERT_EQ_FMT(1ULL, pool.chunks_per_slab, "%llu");
+  item = pg_pool_alloc(&pool);
+  ASSERT(item != NULL);
+  pg_pool_free(&pool, item);
+  pg_pool_destroy(&pool);
+
+  PASS();
+}
+
+TEST test_pg_pool_cache(void) {
+  pg_pool_t pool = {0};
+  pg_pool_init_flags(&pool, 64, 16,
+                     PG_POOL_FLAGS_GROW | PG_POOL_FLAGS_SHARED |
+                         PG_POOL_FLAGS_NO_ZERO);
+
+  pg_pool_cache_t cache = {0};
+  pg_pool_cache_init(&cache, &pool);
+
+  void *items[3 * PG_POOL_CACHE_CAP] = {0};
+  for (uint64_t i = 0; i < 3 * PG_POOL_CACHE_CAP; i++) {
+    items[i] = pg_pool_cache_alloc(&cache);
+    ASSERT(items[i] != NULL);
+  }
+  for (uint64_t i = 0; i < 3 * PG_POOL_CACHE_CAP; i++)
+    pg_pool_cache_free(&cache, items[i]);
+  ASSERT_LTE(cache.len, PG_POOL_CACHE_CAP);
+
+  pg_pool_cache_flush(&cache);
+  ASSERT_EQ_FMT(0ULL, cache.len, "%llu");
+  ASSERT_EQ_FMT(1ULL, pool.slabs_count, "%llu");
+
+  pg_pool_destroy(&pool);
+
+  PASS();
+}
+
+TEST test_pg_arena(void) {
+  pg_arena_t arena = {0};
+  pg_arena_init(&arena, 4 * Ki);
+  pg_allocator_t allocator = pg_arena_allocator(&arena);
+
+  {
+    pg_array_t(uint64_t) array = {0};
+    pg_array_init_reserve(array, 2, allocator);
+    pg_array_append(array, 1);
+    pg_array_append(array, 2);
+
+    // Last allocation: grows in place
+    uint64_t *const before = array;
+    pg_array_append(array, 3);
+    ASSERT_EQ(before, array);
+    ASSERT_EQ_FMT(3ULL, pg_array_len(array), "%llu");
+    ASSERT_EQ_FMT(3ULL, array[2], "%llu");
+  }
+
+  // Bigger than a chunk
+  uint8_t *big = pg_alloc(allocator, 10 * Ki);
+  ASSERT(big != NULL);
+  big[10 * Ki - 1] = 1;
+  ASSERT(arena.first->next != NULL);
+
+  // Scratch scopes
+  {
+    const uint64_t used = pg_arena_used(&arena);
+    pg_arena_scope_t outer = pg_arena_scope_begin(&arena);
+    uint8_t *a = pg_alloc(allocator, 100);
+    memset(a, 0xff, 100);
+
+    pg_arena_scope_t inner = pg_arena_scope_begin(&arena);
+    pg_alloc(allocator, 8 * Ki);
+    pg_arena_scope_end(inner);
+    ASSERT_EQ(a + 112, pg_alloc(allocator, 1)); // 16 bytes alignment
+
+    pg_arena_scope_end(outer);
+    ASSERT_EQ_FMT(used, pg_arena_used(&arena), "%llu");
+
+    // Reused memory is zeroed
+    uint8_t *b = pg_alloc(allocator, 100);
+    ASSERT_EQ(a, b);
+    for (uint64_t i = 0; i < 100; i++)
+      ASSERT_EQ(0, b[i]);
+  }
+
+  pg_arena_reset(&arena);
+  ASSERT_EQ_FMT(0ULL, pg_arena_used(&arena), "%llu");
+  {
+    // Chunks are reused after a reset and memory comes back zeroed
+    uint8_t *c = pg_alloc(allocator, 3 * Ki);
+    ASSERT_EQ(pg_arena_chunk_data(arena.first), c);
+    for (uint64_t i = 0; i < 3 * Ki; i++)
+      ASSERT_EQ(0, c[i]);
+
+    // Freeing the last allocation gives it back
+    pg_free(allocator, c);
+    ASSERT_EQ(c, pg_alloc(allocator, 16));
+  }
+
+  pg_arena_destroy(&arena);
+  ASSERT_EQ(NULL, arena.first);
+
+  PASS();
+}
+
+TEST test_pg_exec(void) {
+  pg_string_t out = pg_string_make_reserve(pg_heap_allocator(), 0);
+  pg_string_t err = pg_string_make_reserve(pg_heap_allocator(), 0);
+  int exit_status = 0;
+  char *argv[] = {"sh", "-c", "printf hello; printf oops >&2; exit 3", 0};
+  ASSERT_EQ(true, pg_exec(argv, &out, &err, &exit_status));
+  ASSERT_STR_EQ("hello", out);
+  ASSERT_STR_EQ("oops", err);
+  ASSERT_EQ(true, WIFEXITED(exit_status));
+  ASSERT_EQ(3, WEXITSTATUS(exit_status));
+  pg_string_free(out);
+  pg_string_free(err);
+
+  // More than a pipe buffer on stderr, and more commands than the limit.
+  char *big_argv[] = {"sh", "-c", "head -c 200000 /dev/zero >&2; echo done",
+                      0};
+  char *missing_argv[] = {"pg_test_no_such_command", 0};
+  pg_exec_cmd_t cmds[5] = {0};
+  const uint64_t cmds_len = sizeof(cmds) / sizeof(cmds[0]);
+  for (uint64_t i = 0; i < cmds_len; i++) {
+    cmds[i].argv = i == 4 ? missing_argv : big_argv;
+    cmds[i].out = pg_string_make_reserve(pg_heap_allocator(), 0);
+    cmds[i].err = pg_string_make_reserve(pg_heap_allocator(), 0);
+  }
+  ASSERT_EQ(true, pg_exec_batch(cmds, cmds_len, 2));
+
+  for (uint64_t i = 0; i < 4; i++) {
+    ASSERT_EQ(0, cmds[i].spawn_error);
+    ASSERT_EQ(0, WEXITSTATUS(cmds[i].exit_status));
+    ASSERT_STR_EQ("done\n", cmds[i].out);
+    ASSERT_EQ_FMT(200000ULL, pg_string_len(cmds[i].err), "%llu");
+  }
+  ASSERT(cmds[4].spawn_error != 0 || WEXITSTATUS(cmds[4].exit_status) != 0);
+
+  for (uint64_t i = 0; i < cmds_len; i++) {
+    pg_string_free(cmds[i].out);
+    pg_string_free(cmds[i].err);
+  }
+
+  PASS();
+}
+
+TEST test_pg_mmap_file(void) {
+  char path[] = "/tmp/pg_test_mmap_XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT(fd != -1);
+  unlink(path);
+
+  // Empty.
+  pg_mapped_file_t file = {0};
+  ASSERT_EQ(true, pg_mmap_file_fd(fd, PG_MMAP_FLAGS_NONE, &file));
+  ASSERT_EQ_FMT(0ULL, file.span.len, "%llu");
+  pg_munmap_file(&file);
+
+  ASSERT_EQ(11, write(fd, "hello world", 11));
+  ASSERT_EQ(true, pg_mmap_file_fd(fd,
+                                  PG_MMAP_FLAGS_SEQUENTIAL |
+                                      PG_MMAP_FLAGS_POPULATE,
+                                  &file));
+  ASSERT_EQ(NULL, file.read_data);
+  ASSERT(pg_span_eq(file.span, pg_span_make_c("hello world")));
+  pg_munmap_file(&file);
+  ASSERT_EQ(NULL, file.span.data);
+  close(fd);
+
+  // A pipe cannot be mapped: read instead, past the pipe buffer size.
+  int fds[2] = {0};
+  ASSERT_EQ(0, pipe(fds));
+  const pid_t pid = fork();
+  ASSERT(pid != -1);
+  if (pid == 0) {
+    static uint8_t zeroes[100 * 1000] = {0};
+    _exit(write(fds[1], zeroes, sizeof(zeroes)) == sizeof(zeroes) ? 0 : 1);
+  }
+  close(fds[1]);
+  ASSERT_EQ(true, pg_mmap_file_fd(fds[0], PG_MMAP_FLAGS_RANDOM, &file));
+  ASSERT(file.read_data != NULL);
+  ASSERT_EQ_FMT(100ULL * 1000, file.span.len, "%llu");
+  pg_munmap_file(&file);
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+
+  ASSERT_EQ(false, pg_mmap_file("/tmp/pg_test_no_such_file", 0, &file));
+
+  PASS();
+}
+
+TEST test_pg_builder(void) {
+  // Numbers match printf.
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (uint64_t i = 0; i < 10 * 1000; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    const uint64_t n = state >> (i % 64);
+
+    char buf[128] = "", expected[128] = "";
+    pg_builder_t b = {0};
+    pg_builder_init_buf(&b, buf, sizeof(buf) - 1);
+    pg_builder_append_u64(&b, n);
+    pg_builder_append_char(&b, ' ');
+    pg_builder_append_i64(&b, (int64_t)n);
+    pg_builder_append_char(&b, ' ');
+    pg_builder_append_hex(&b, n);
+    pg_builder_append_char(&b, ' ');
+    pg_builder_append_f64(&b, (double)(int64_t)n / 1e15, 3);
+    snprintf(expected, sizeof(expected), "%llu %lld %llx %.3f", n,
+             (int64_t)n, n, (double)(int64_t)n / 1e15);
+    ASSERT_STR_EQ(expected, buf);
+  }
+
+  {
+    char buf[64] = "";
+    pg_builder_t b = {0};
+    pg_builder_init_buf(&b, buf, sizeof(buf) - 1);
+    pg_builder_append_i64(&b, INT64_MIN);
+    pg_builder_append_char(&b, ' ');
+    pg_builder_append_f64(&b, -0.26, 1);
+    pg_builder_append_char(&b, ' ');
+    pg_builder_append_f64(&b, 2.6, 0);
+    pg_builder_append_char(&b, ' ');
+    pg_builder_append_f64(&b, 1.0 / 0.0, 2);
+    ASSERT_STR_EQ("-9223372036854775808 -0.3 3 inf", buf);
+    ASSERT_EQ(false, b.truncated);
+  }
+
+  // Fixed buffer: truncated.
+  {
+    char buf[8] = "";
+    pg_builder_t b = {0};
+    pg_builder_init_buf(&b, buf, sizeof(buf));
+    pg_builder_append_cstr(&b, "hello ");
+    pg_builder_append_u64(&b, 1234);
+    ASSERT_EQ(true, b.truncated);
+    ASSERT(pg_span_eq(pg_builder_span(&b), pg_span_make_c("hello 12")));
+  }
+
+  // Growing in an arena.
+  {
+    pg_arena_t arena = {0};
+    pg_arena_init(&arena, 0);
+    pg_builder_t b = {0};
+    pg_builder_init_alloc(&b, pg_arena_allocator(&arena), 0);
+    for (uint64_t i = 0; i < 1000; i++)
+      pg_builder_append_cstr(&b, "0123456789");
+    ASSERT_EQ(false, b.truncated);
+    ASSERT_EQ_FMT(10000ULL, b.len, "%llu");
+    ASSERT_EQ('9', b.data[9999]);
+    pg_arena_destroy(&arena);
+  }
+
+  // Flushing to a file descriptor, with appends bigger than the buffer.
+  {
+    char path[] = "/tmp/pg_test_builder_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT(fd != -1);
+    unlink(path);
+
+    char buf[16] = "";
+    pg_builder_t b = {0};
+    pg_builder_init_fd(&b, buf, sizeof(buf), fd);
+    for (uint64_t i = 0; i < 100; i++) {
+      pg_builder_append_u64(&b, i);
+      pg_builder_append_char(&b, ',');
+    }
+    pg_builder_append_cstr(&b, "a string longer than the buffer");
+    ASSERT_EQ(true, pg_builder_flush(&b));
+
+    char expected[512] = "";
+    uint64_t expected_len = 0;
+    for (uint64_t i = 0; i < 100; i++)
+      expected_len += (uint64_t)snprintf(expected + expected_len,
+                                         sizeof(expected) - expected_len,
+                                         "%llu,", i);
+    expected_len += (uint64_t)snprintf(expected + expected_len,
+                                       sizeof(expected) - expected_len,
+                                       "a string longer than the buffer");
+
+    char got[512] = "";
+    ASSERT_EQ((ssize_t)expected_len, pread(fd, got, sizeof(got), 0));
+    ASSERT_STR_EQ(expected, got);
+    close(fd);
+  }
+
+  PASS();
+}
+
+TEST test_pg_alloc_stats(void) {
+  pg_alloc_stats_t stats = {0};
+  pg_alloc_stats_init(&stats, "test", pg_heap_allocator(), 100);
+  pg_allocator_t allocator = pg_alloc_stats_allocator(&stats);
+
+  uint8_t *a = pg_alloc(allocator, 10);
+  ASSERT_EQ(0, a[9]);
+  a = pg_realloc(allocator, a, 60, 10);
+  // Still zeroed past the old size.
+  ASSERT_EQ(0, a[59]);
+  uint8_t *b = pg_alloc(allocator, 1);
+
+  ASSERT_EQ(2, stats.allocs_count);
+  ASSERT_EQ(1, stats.reallocs_count);
+  ASSERT_EQ(61, stats.live_bytes);
+  ASSERT_EQ(61, stats.peak_bytes);
+  ASSERT_EQ(61, stats.total_bytes);
+  ASSERT_EQ(1, stats.size_classes[1]); // 1
+  ASSERT_EQ(1, stats.size_classes[4]); // 10
+  ASSERT_EQ(1, stats.size_classes[6]); // 60
+  ASSERT(!pg_alloc_stats_over_budget(&stats));
+
+  pg_free(allocator, a);
+  ASSERT_EQ(1, stats.live_bytes);
+
+  pg_array_t(uint64_t) array = NULL;
+  pg_array_init_reserve(array, 16, allocator);
+  ASSERT(pg_alloc_stats_over_budget(&stats));
+  pg_array_free(array);
+  pg_free(allocator, b);
+  ASSERT_EQ(3, stats.frees_count);
+  ASSERT_EQ(0, stats.live_bytes);
+
+  char buf[512] = "";
+  pg_builder_t builder = {0};
+  pg_builder_init_buf(&builder, buf, sizeof(buf) - 1);
+  pg_alloc_stats_format(&builder, &stats);
+  ASSERT(strstr(buf, "test: allocs=3 reallocs=1 frees=3 live=0") == buf);
+  ASSERT(strstr(buf, " OVER BUDGET\n") != NULL);
+
+  pg_alloc_stats_destroy(&stats);
+  ASSERT(pg_alloc_stats_registry.head != &stats);
+
+  PASS();
+}
+
+static void test_pg_executor_count(void *ctx, uint64_t begin, uint64_t end) {
+  uint8_t *const seen = ctx;
+  for (uint64_t i = begin; i < end; i++)
+    seen[i] += 1;
+}
+
+typedef struct {
+  pg_executor_t *executor;
+  uint8_t *seen;
+} test_pg_executor_nested_t;
+
+// Each outer index counts 1000 inner ones with a nested parallel loop.
+static void test_pg_executor_nested(void *ctx, uint64_t begin, uint64_t end) {
+  test_pg_executor_nested_t *const nested = ctx;
+  for (uint64_t i = begin; i < end; i++)
+    pg_executor_parallel_for(nested->executor, i * 1000, (i + 1) * 1000, 10,
+                             test_pg_executor_count, nested->seen);
+}
+
+static void test_pg_executor_add(void *ctx, uint64_t begin, uint64_t end) {
+  __atomic_fetch_add((uint64_t *)ctx, end - begin, __ATOMIC_RELAXED);
+}
+
+TEST test_pg_executor(void) {
+  pg_executor_t executor = {0};
+  ASSERT(pg_executor_init(&executor, pg_heap_allocator(), 4));
+
+  const uint64_t len = 1000 * 1000;
+  uint8_t *seen = pg_alloc(pg_heap_allocator(), len);
+
+  // Every index exactly once, whatever the grain.
+  const uint64_t grains[] = {0, 1, 7, len};
+  for (uint64_t g = 0; g < sizeof(grains) / sizeof(grains[0]); g++) {
+    memset(seen, 0, len);
+    pg_executor_parallel_for(&executor, 0, len, grains[g],
+                             test_pg_executor_count, seen);
+    for (uint64_t i = 0; i < len; i++)
+      ASSERT_EQ_FMT(1, seen[i], "%d");
+  }
+
+  memset(seen, 0, len);
+  test_pg_executor_nested_t nested = {.executor = &executor, .seen = seen};
+  pg_executor_parallel_for(&executor, 0, len / 1000, 1,
+                           test_pg_executor_nested, &nested);
+  for (uint64_t i = 0; i < len; i++)
+    ASSERT_EQ_FMT(1, seen[i], "%d");
+
+  // More tasks than a deque holds.
+  uint64_t count = 0;
+  pg_wait_group_t wait_group = {0};
+  for (uint64_t i = 0; i < 10 * 1000; i++)
+    pg_executor_submit(&executor, &wait_group, test_pg_executor_add, &count);
+  pg_wait_group_wait(&executor, &wait_group);
+  ASSERT_EQ(10 * 1000, count);
+
+  pg_free(pg_heap_allocator(), seen);
+  pg_executor_destroy(&executor);
+  PASS();
+}
+
+#define TEST_QUEUE_ITEMS_COUNT ((uint64_t)100 * 1000)
+#define TEST_QUEUE_PRODUCERS_COUNT ((uint64_t)4)
+
+static void *test_pg_spsc_produce(void *arg) {
+  pg_spsc_t *const queue = arg;
+  for (uint64_t i = 1; i <= TEST_QUEUE_ITEMS_COUNT; i++) {
+    while (!pg_spsc_push(queue, (void *)i))
+      sched_yield();
+  }
+  return NULL;
+}
+
+TEST test_pg_spsc(void) {
+  pg_spsc_t queue = {0};
+  pg_spsc_init(&queue, pg_heap_allocator(), 4);
+
+  void *items[8] = {0};
+  for (uint64_t i = 1; i <= 4; i++)
+    ASSERT(pg_spsc_push(&queue, (void *)i));
+  ASSERT_FALSE(pg_spsc_push(&queue, (void *)5));
+
+  ASSERT_EQ(3, pg_spsc_pop_batch(&queue, items, 3));
+  ASSERT_EQ((void *)1, items[0]);
+  ASSERT_EQ((void *)3, items[2]);
+  ASSERT(pg_spsc_push(&queue, (void *)5));
+  ASSERT_EQ(2, pg_spsc_pop_batch(&queue, items, 8));
+  ASSERT_EQ((void *)4, items[0]);
+  ASSERT_EQ((void *)5, items[1]);
+  ASSERT(pg_spsc_is_empty(&queue));
+
+  // In order across threads.
+  pthread_t producer = {0};
+  ASSERT_EQ(0, pthread_create(&producer, NULL, test_pg_spsc_produce, &queue));
+  uint64_t expected = 1;
+  while (expected <= TEST_QUEUE_ITEMS_COUNT) {
+    const uint64_t count = pg_spsc_pop_batch(&queue, items, 8);
+    for (uint64_t i = 0; i < count; i++)
+      ASSERT_EQ((void *)expected++, items[i]);
+    if (count == 0)
+      sched_yield();
+  }
+  pthread_join(producer, NULL);
+
+  pg_spsc_destroy(&queue);
+  PASS();
+}
+
+typedef struct {
+  pg_mpsc_t *queue;
+  pg_wakeup_t *wakeup;
+  uint64_t producer;
+} test_pg_mpsc_producer_t;
+
+static void *test_pg_mpsc_produce(void *arg) {
+  test_pg_mpsc_producer_t *const p = arg;
+  for (uint64_t i = 1; i <= TEST_QUEUE_ITEMS_COUNT; i++) {
+    while (!pg_mpsc_push(p->queue, (void *)(p->producer << 32 | i)))
+      sched_yield();
+    pg_wakeup_signal(p->wakeup);
+  }
+  return NULL;
+}
+
+TEST test_pg_mpsc(void) {
+  pg_mpsc_t queue = {0};
+  pg_mpsc_init(&queue, pg_heap_allocator(), 4);
+
+  void *items[64] = {0};
+  for (uint64_t i = 1; i <= 4; i++)
+    ASSERT(pg_mpsc_push(&queue, (void *)i));
+  ASSERT_FALSE(pg_mpsc_push(&queue, (void *)5));
+  ASSERT_EQ(4, pg_mpsc_pop_batch(&queue, items, 64));
+  ASSERT_EQ((void *)4, items[3]);
+  ASSERT(pg_mpsc_is_empty(&queue));
+  pg_mpsc_destroy(&queue);
+
+  // Each producer's items in order, none lost, consumer sleeping when idle.
+  pg_mpsc_init(&queue, pg_heap_allocator(), 256);
+  pg_wakeup_t wakeup = {0};
+  ASSERT(pg_wakeup_init(&wakeup));
+
+  pthread_t threads[TEST_QUEUE_PRODUCERS_COUNT] = {0};
+  test_pg_mpsc_producer_t producers[TEST_QUEUE_PRODUCERS_COUNT] = {0};
+  for (uint64_t i = 0; i < TEST_QUEUE_PRODUCERS_COUNT; i++) {
+    producers[i] = (test_pg_mpsc_producer_t){
+        .queue = &queue, .wakeup = &wakeup, .producer = i};
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, test_pg_mpsc_produce,
+                                &producers[i]));
+  }
+
+  uint64_t last[TEST_QUEUE_PRODUCERS_COUNT] = {0};
+  uint64_t received = 0;
+  while (received < TEST_QUEUE_PRODUCERS_COUNT * TEST_QUEUE_ITEMS_COUNT) {
+    const uint64_t count = pg_mpsc_pop_batch(&queue, items, 64);
+    for (uint64_t i = 0; i < count; i++) {
+      const uint64_t item = (uint64_t)items[i];
+      const uint64_t producer = item >> 32;
+      ASSERT(producer < TEST_QUEUE_PRODUCERS_COUNT);
+      ASSERT_EQ(last[producer] + 1, item & UINT32_MAX);
+      last[producer] += 1;
+    }
+    received += count;
+    if (count > 0)
+      continue;
+
+    pg_wakeup_prepare(&wakeup);
+    if (!pg_mpsc_is_empty(&queue)) {
+      pg_wakeup_cancel(&wakeup);
+      continue;
+    }
+    // A missed wakeup would time out.
+    ASSERT(pg_wakeup_wait(&wakeup, 5000));
+  }
+
+  for (uint64_t i = 0; i < TEST_QUEUE_PRODUCERS_COUNT; i++)
+    pthread_join(threads[i], NULL);
+  pg_wakeup_destroy(&wakeup);
+  pg_mpsc_destroy(&queue);
+  PASS();
+}
+
+TEST test_pg_array_append_many(void) {
+  pg_array_t(uint32_t) array = {0};
+  pg_array_init(array, pg_heap_allocator());
+
+  const uint32_t items[] = {1, 2, 3, 4, 5};
+  pg_array_append_many(array, items, 5);
+  pg_array_append_many(array, items, 2);
+  ASSERT_EQ(7, pg_array_len(array));
+  ASSERT_EQ(5, array[4]);
+  ASSERT_EQ(2, array[6]);
+
+  pg_array_append_uninitialized(array, 100);
+  ASSERT_EQ(107, pg_array_len(array));
+  ASSERT_EQ(0, array[106]);
+  array[106] = 42;
+
+  pg_array_reserve_more(array, 1000);
+  ASSERT(pg_array_available_space(array) >= 1000);
+  ASSERT_EQ(42, array[106]);
+
+  pg_array_free(array);
+  PASS();
+}
+
+TEST test_pg_vm(void) {
+  pg_vm_t vm = {0};
+  ASSERT(pg_vm_init(&vm, 64 * Mi));
+
+  pg_array_t(uint64_t) array = {0};
+  pg_array_init(array, pg_vm_allocator(&vm));
+  const uint64_t *const first = array;
+
+  // Never moves while growing.
+  for (uint64_t i = 0; i < 4 * Mi; i++)
+    pg_array_append(array, i);
+  ASSERT_EQ(first, array);
+  ASSERT_EQ(4 * Mi - 1, array[4 * Mi - 1]);
+  ASSERT(vm.committed < 64 * Mi);
+
+  // Reused memory is zeroed again.
+  pg_array_free(array);
+  pg_array_init_reserve(array, 16, pg_vm_allocator(&vm));
+  ASSERT_EQ(first, array);
+  pg_array_resize(array, 1000);
+  for (uint64_t i = 0; i < 1000; i++)
+    ASSERT_EQ(0, array[i]);
+
+  // Out of reserved space.
+  ASSERT_EQ(NULL, pg_vm_realloc(&vm, PG_ARRAY_HEADER(array), 65 * Mi, 0));
+
+  pg_vm_destroy(&vm);
+
+  // Filled up to the reservation, past which the growth formula goes.
+  ASSERT(pg_vm_init(&vm, 2 * Mi));
+  pg_array_init(array, pg_vm_allocator(&vm));
+  const uint64_t max_len =
+      (vm.reserved - sizeof(pg_array_header_t)) / sizeof(uint64_t);
+  for (uint64_t i = 0; i < max_len; i++)
+    pg_array_append(array, i);
+  ASSERT_EQ(max_len, pg_array_len(array));
+  ASSERT_EQ(max_len, pg_array_capacity(array));
+  ASSERT_EQ(max_len - 1, array[max_len - 1]);
+
+  pg_vm_destroy(&vm);
+  PASS();
+}
+
+TEST test_pg_hash_bytes(void) {
+  // Exact size allocations so that reads past the end are caught.
+  uint64_t hashes[200] = {0};
+  for (uint64_t len = 0; len < 200; len++) {
+    uint8_t *data = pg_alloc(pg_heap_allocator(), len);
+    for (uint64_t i = 0; i < len; i++)
+      data[i] = (uint8_t)(i * 7);
+
+    hashes[len] = pg_hash_bytes(data, len);
+    ASSERT_EQ(hashes[len], pg_hash_bytes(data, len));
+    ASSERT(hashes[len] != pg_hash_bytes_seeded(data, len, 1));
+
+    // Every byte counts.
+    for (uint64_t i = 0; i < len; i++) {
+      data[i] ^= 1;
+      ASSERT(hashes[len] != pg_hash_bytes(data, len));
+      data[i] ^= 1;
+    }
+    pg_free(pg_heap_allocator(), data);
+  }
+
+  // Prefixes of each other.
+  for (uint64_t i = 0; i < 200; i++) {
+    for (uint64_t j = i + 1; j < 200; j++)
+      ASSERT(hashes[i] != hashes[j]);
+  }
+
+  ASSERT_EQ(pg_hash_span(pg_span_make_c("hello")),
+            pg_hash_bytes("hello", 5));
+  PASS();
+}
+
+TEST test_pg_radix_sort(void) {
+  pg_executor_t executor = {0};
+  ASSERT(pg_executor_init(&executor, pg_heap_allocator(), 3));
+
+  // Enough for the parallel sort to use all threads.
+  const uint64_t len = 300 * 1000;
+  uint64_t *const orig = pg_alloc(pg_heap_allocator(), len * sizeof(uint64_t));
+  uint64_t *const keys = pg_alloc(pg_heap_allocator(), len * sizeof(uint64_t));
+  uint64_t *const values =
+      pg_alloc(pg_heap_allocator(), len * sizeof(uint64_t));
+  uint64_t x = 42;
+  for (uint64_t i = 0; i < len; i++) {
+    x = pg_hash_u64(x);
+    // Same high bytes and many duplicates, like addresses.
+    orig[i] = 0x7ff000000000ULL | (x % 5000) << 8;
+  }
+
+  for (uint64_t parallel = 0; parallel < 2; parallel++) {
+    memcpy(keys, orig, len * sizeof(uint64_t));
+    for (uint64_t i = 0; i < len; i++)
+      values[i] = i;
+
+    if (parallel)
+      pg_radix_sort_u64_parallel(&executor, keys, values, len,
+                                 pg_heap_allocator());
+    else
+      pg_radix_sort_u64(keys, values, len, pg_heap_allocator());
+
+    for (uint64_t i = 0; i < len; i++) {
+      ASSERT_EQ(orig[values[i]], keys[i]);
+      if (i == 0)
+        continue;
+      ASSERT(keys[i - 1] <= keys[i]);
+      // Stable.
+      if (keys[i - 1] == keys[i])
+        ASSERT(values[i - 1] < values[i]);
+    }
+  }
+
+  uint32_t small[] = {3, 0xffffffff, 1, 0x10000, 3, 0};
+  pg_radix_sort_u32(small, NULL, sizeof(small) / sizeof(small[0]),
+                    pg_heap_allocator());
+  const uint32_t expected[] = {0, 1, 3, 3, 0x10000, 0xffffffff};
+  ASSERT_MEM_EQ(expected, small, sizeof(small));
+
+  pg_free(pg_heap_allocator(), values);
+  pg_free(pg_heap_allocator(), keys);
+  pg_free(pg_heap_allocator(), orig);
+  pg_executor_destroy(&executor);
+  PASS();
+}
+
+typedef struct {
+  pg_timer_wheel_t wheel;
+  uint64_t fired_count;
+  uint64_t late_count; // Fired at another tick than their deadline.
+} test_timer_ctx_t;
+
+static void test_timer_fire(pg_timer_t *timer) {
+  test_timer_ctx_t *const ctx = timer->ctx;
+  ctx->fired_count += 1;
+  ctx->late_count += ctx->wheel.now != timer->deadline;
+  // Rescheduling from the callback.
+  if (timer->deadline % 7 == 0)
+    pg_timer_wheel_add(&ctx->wheel, timer, ctx->wheel.now + 1000);
+}
+
+TEST test_pg_timer_wheel(void) {
+  test_timer_ctx_t ctx = {0};
+  pg_timer_wheel_init(&ctx.wheel, 1000);
+  ASSERT_EQ(pg_timer_wheel_next_expiry(&ctx.wheel), UINT64_MAX);
+
+  const uint64_t count = 10 * 1000;
+  pg_timer_t *const timers =
+      pg_alloc(pg_heap_allocator(), count * sizeof(pg_timer_t));
+  uint64_t x = 1;
+  for (uint64_t i = 0; i < count; i++) {
+    timers[i] = (pg_timer_t){.fn = test_timer_fire, .ctx = &ctx};
+    x = pg_hash_u64(x);
+    // From the next tick to far in the future, on all levels.
+    const uint64_t delay = i % 3 == 0 ? x % 100 : x >> (x % 64);
+    pg_timer_wheel_add(&ctx.wheel, &timers[i], 1000 + delay);
+  }
+  ASSERT_EQ(ctx.wheel.count, count);
+
+  // Cancelled and rescheduled timers.
+  uint64_t cancelled = 0;
+  for (uint64_t i = 0; i < count; i += 5) {
+    ASSERT(pg_timer_wheel_cancel(&ctx.wheel, &timers[i]));
+    ASSERT_FALSE(pg_timer_wheel_cancel(&ctx.wheel, &timers[i]));
+    cancelled += 1;
+  }
+  for (uint64_t i = 1; i < count; i += 5)
+    pg_timer_wheel_add(&ctx.wheel, &timers[i], timers[i].deadline + 12345);
+  ASSERT_EQ(ctx.wheel.count, count - cancelled);
+
+  // The next expiry is never late.
+  const uint64_t next = pg_timer_wheel_next_expiry(&ctx.wheel);
+  ASSERT(next >= 1);
+  uint64_t earliest = UINT64_MAX;
+  for (uint64_t i = 0; i < count; i++) {
+    if (pg_timer_is_scheduled(&timers[i]))
+      earliest = MIN(earliest, timers[i].deadline);
+  }
+  ASSERT(1000 + next <= earliest);
+
+  // Irregular steps, some large.
+  uint64_t now = 1000;
+  while (ctx.wheel.count > 0) {
+    x = pg_hash_u64(x);
+    const uint64_t step = x % 4 == 0 ? x >> (x % 64) : x % 50;
+    now = now + step < now ? UINT64_MAX - 1 : now + step;
+    pg_timer_wheel_advance(&ctx.wheel, now);
+    if (now == UINT64_MAX - 1)
+      break;
+  }
+  ASSERT_EQ(ctx.late_count, 0);
+  ASSERT_EQ(ctx.wheel.count, 0);
+  ASSERT(ctx.fired_count >= count - cancelled);
+  for (uint64_t i = 0; i < count; i++)
+    ASSERT_FALSE(pg_timer_is_scheduled(&timers[i]));
+
+  pg_free(pg_heap_allocator(), timers);
+  PASS();
+}
+
+// What the parsers did one character at a time.
+static uint64_t test_parse_digits_ref(pg_span_t span, bool hex, bool *valid) {
+  uint64_t res = 0;
+  for (uint64_t i = 0; i < span.len; i++) {
+    const char c = pg_char_to_lower(span.data[i]);
+    uint64_t n = 0;
+    if (pg_char_is_digit(c))
+      n = (uint8_t)c - '0';
+    else if (hex && c >= 'a' && c <= 'f')
+      n = (uint8_t)c - 'a' + 10;
+    else {
+      *valid = false;
+      return 0;
+    }
+    res = res * (hex ? 16 : 10) + n;
+  }
+  *valid = true;
+  return res;
+}
+
+TEST test_pg_span_parse(void) {
+  bool valid = false;
+  ASSERT_EQ(pg_span_parse_u64_decimal(pg_span_make_c(" 18446744073709551615 "),
+                                      &valid),
+            UINT64_MAX);
+  ASSERT(valid);
+  ASSERT_EQ(pg_span_parse_i64_decimal(pg_span_make_c("-9223372036854775807"),
+                                      &valid),
+            -INT64_MAX);
+  ASSERT(valid);
+  ASSERT_EQ(pg_span_parse_u64_decimal(pg_span_make_c("+42"), &valid), 42);
+  ASSERT(valid);
+  pg_span_parse_u64_decimal(pg_span_make_c("-42"), &valid);
+  ASSERT_FALSE(valid);
+  pg_span_parse_u64_decimal(pg_span_make_c("1234567/"), &valid);
+  ASSERT_FALSE(valid);
+  pg_span_parse_u64_decimal(pg_span_make_c("12345678:"), &valid);
+  ASSERT_FALSE(valid);
+  ASSERT_EQ(pg_span_parse_u64_hex(pg_span_make_c("0x7FFee3b1c2d8a9f0"), &valid),
+            0x7ffee3b1c2d8a9f0);
+  ASSERT(valid);
+  ASSERT_EQ(pg_span_parse_i64_hex(pg_span_make_c("-0x10"), &valid), -16);
+  ASSERT(valid);
+  pg_span_parse_u64_hex(pg_span_make_c("0x10g"), &valid);
+  ASSERT_FALSE(valid);
+  pg_span_parse_u64_hex(pg_span_make_c("0x\x11"), &valid);
+  ASSERT_FALSE(valid);
+
+  // Same result as one character at a time, on random near-digits.
+  const char alphabet[] = "0123456789abcdefABCDEFgG/:@`\x10\x80";
+  char buf[32] = {0};
+  uint64_t x = 3;
+  for (uint64_t i = 0; i < 100 * 1000; i++) {
+    x = pg_hash_u64(x);
+    const uint64_t len = x % 25;
+    for (uint64_t j = 0; j < len; j++) {
+      x = pg_hash_u64(x);
+      // Mostly valid digits.
+      buf[j] = alphabet[x % (x % 8 == 0 ? sizeof(alphabet) - 1 : 10)];
+      if (x % 3 == 0)
+        buf[j] = alphabet[x % 22];
+    }
+    const pg_span_t span = {.data = buf, .len = len};
+
+    bool expected_valid = false;
+    uint64_t expected = test_parse_digits_ref(span, false, &expected_valid);
+    uint64_t got = pg_span_parse_u64_decimal(span, &valid);
+    // Trimming makes leading or trailing spaces valid, there are none here.
+    ASSERT_EQ(valid, expected_valid);
+    if (valid)
+      ASSERT_EQ(got, expected);
+
+    expected = test_parse_digits_ref(span, true, &expected_valid);
+    got = pg_span_parse_u64_hex(span, &valid);
+    ASSERT_EQ(valid, expected_valid);
+    if (valid)
+      ASSERT_EQ(got, expected);
+  }
+  PASS();
+}
+
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char **argv) {
@@ -468,10 +1777,34 @@ int main(int argc, char **argv) {
   RUN_SUITE(pg_array);
   RUN_TEST(test_pg_span_split_at_first);
   RUN_TEST(test_pg_span_split_at_last);
+  RUN_TEST(test_pg_memmem);
+  RUN_TEST(test_pg_span_eq);
   RUN_TEST(test_pg_string_url_encode);
   RUN_TEST(test_pg_ring);
+  RUN_TEST(test_pg_ring_mirrored);
   RUN_TEST(test_pg_bitarray);
+  RUN_TEST(test_pg_bitarray_words);
   RUN_TEST(test_pg_pool);
+  RUN_TEST(test_pg_pool_grow);
+  RUN_TEST(test_pg_pool_empty);
+  RUN_TEST(test_pg_pool_cache);
+  RUN_TEST(test_pg_arena);
+  RUN_TEST(test_pg_hashmap);
+  RUN_TEST(test_pg_log_binary_format);
+  RUN_TEST(test_pg_log_rate_limit);
+  RUN_TEST(test_pg_exec);
+  RUN_TEST(test_pg_mmap_file);
+  RUN_TEST(test_pg_builder);
+  RUN_TEST(test_pg_alloc_stats);
+  RUN_TEST(test_pg_executor);
+  RUN_TEST(test_pg_spsc);
+  RUN_TEST(test_pg_mpsc);
+  RUN_TEST(test_pg_array_append_many);
+  RUN_TEST(test_pg_vm);
+  RUN_TEST(test_pg_hash_bytes);
+  RUN_TEST(test_pg_radix_sort);
+  RUN_TEST(test_pg_timer_wheel);
+  RUN_TEST(test_pg_span_parse);
 
   GREATEST_MAIN_END(); /* display results */
 }
@@ -1,12 +1,12 @@
 #pragma once
 
+#include "../pg/pg.h"
+
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#include "../pg/pg.h"
-
 #define BC_BLOCK_LENGTH ((uint32_t)1 << 14)
 
 typedef enum {
@@ -495,12 +495,12 @@ bc_parser_init_metainfo(bc_parser_t *parser, bc_metainfo_t *metainfo,
 }
 
 __attribute__((unused)) static bool
-metainfo_is_last_piece(bc_metainfo_t *metainfo, uint32_t piece) {
+metainfo_is_last_piece(const bc_metainfo_t *metainfo, uint32_t piece) {
   return piece == metainfo->pieces_count - 1;
 }
 
 __attribute__((unused)) static uint32_t
-metainfo_block_count_for_piece(bc_metainfo_t *metainfo, uint32_t piece) {
+metainfo_block_count_for_piece(const bc_metainfo_t *metainfo, uint32_t piece) {
   if (metainfo_is_last_piece(metainfo, piece))
     return metainfo->last_piece_block_count;
   else
@@ -508,7 +508,7 @@ metainfo_block_count_for_piece(bc_metainfo_t *metainfo, uint32_t piece) {
 }
 
 __attribute__((unused)) static uint32_t
-metainfo_block_for_piece_length(bc_metainfo_t *metainfo, uint32_t piece,
+metainfo_block_for_piece_length(const bc_metainfo_t *metainfo, uint32_t piece,
                                 uint32_t block_for_piece) {
   assert(block_for_piece < metainfo->blocks_per_piece);
 
@@ -522,7 +522,7 @@ metainfo_block_for_piece_length(bc_metainfo_t *metainfo, uint32_t piece,
 }
 
 __attribute__((unused)) static uint32_t
-metainfo_piece_length(bc_metainfo_t *metainfo, uint32_t piece) {
+metainfo_piece_length(const bc_metainfo_t *metainfo, uint32_t piece) {
   if (metainfo_is_last_piece(metainfo, piece))
     return metainfo->last_piece_length;
 
@@ -530,8 +530,8 @@ metainfo_piece_length(bc_metainfo_t *metainfo, uint32_t piece) {
 }
 
 __attribute__((unused)) static uint32_t
-metainfo_block_to_block_for_piece(bc_metainfo_t *metainfo, uint32_t piece,
-                                  uint32_t block) {
+metainfo_block_to_block_for_piece(const bc_metainfo_t *metainfo,
+                                  uint32_t piece, uint32_t block) {
   assert(piece < metainfo->pieces_count);
   assert(block < metainfo->blocks_count);
 
@@ -548,8 +548,8 @@ metainfo_block_to_block_for_piece(bc_metainfo_t *metainfo, uint32_t piece,
 }
 
 __attribute__((unused)) static uint32_t
-metainfo_block_for_piece_to_block(bc_metainfo_t *metainfo, uint32_t piece,
-                                  uint32_t block_for_piece) {
+metainfo_block_for_piece_to_block(const bc_metainfo_t *metainfo,
+                                  uint32_t piece, uint32_t block_for_piece) {
   assert(piece < metainfo->pieces_count);
   assert(block_for_piece < metainfo_block_count_for_piece(metainfo, piece));
 
@@ -1,9 +1,10 @@
+#include "../pg/pg.h"
+
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
-#include "../pg/pg.h"
 #include "bencode.h"
 #include "sha1.h"
 
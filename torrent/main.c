@@ -1,3 +1,5 @@
+#include "../pg/pg.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -5,7 +7,6 @@
 #include <string.h>
 #include <sys/_types/_off_t.h>
 
-#include "../pg/pg.h"
 #include "bencode.h"
 #include "peer.h"
 #include "sha1.h"
@@ -16,7 +17,11 @@ int main(int argc, char *argv[]) {
   assert(argc == 2);
 
   // pg_logger_t logger = {.level = PG_LOG_DEBUG};
-  pg_logger_t logger = {.level = PG_LOG_INFO};
+  // Progress is logged for every block received: keep it off the hot path.
+  pg_logger_t logger = {.level = PG_LOG_INFO,
+                        .flags = PG_LOG_FLAGS_BINARY,
+                        .max_per_second = 10};
+  pg_log_background_start();
 
   pg_array_t(uint8_t) torrent_file_data = {0};
   pg_array_init_reserve(torrent_file_data, 0, pg_heap_allocator());
@@ -107,20 +112,33 @@ int main(int argc, char *argv[]) {
   picker_t picker = {0};
   picker_init(pg_heap_allocator(), &logger, &picker, &metainfo);
 
-  peer_error_t peer_err = picker_checksum_all(pg_heap_allocator(), &logger,
-                                              &picker, &metainfo, &download);
+  // Only needed to checksum what is already on disk.
+  pg_executor_t executor = {0};
+  if (!pg_executor_init(&executor, pg_heap_allocator(), 0)) {
+    pg_log_fatal(&logger, errno, "Failed to start threads: err=%s",
+                 strerror(errno));
+  }
+  peer_error_t peer_err =
+      picker_checksum_all(&logger, &executor, &picker, &metainfo, &download);
   if (peer_err.kind != PEK_NONE)
     pg_log_error(&logger, "Failed to checksum file: path=%.*s err=%s",
                  (int)metainfo.name.len, metainfo.name.data, strerror(errno));
+  pg_executor_destroy(&executor);
+
+  storage_t storage = {0};
+  storage_init(&storage, pg_heap_allocator(), &logger, &metainfo, &picker,
+               &download, STORAGE_MAX_DIRTY_BYTES);
 
   pg_pool_t peer_pool = {0};
-  pg_pool_init(&peer_pool, sizeof(peer_t), pg_array_len(peer_addresses_ipv4));
+  pg_pool_init_flags(&peer_pool, sizeof(peer_t),
+                     pg_array_len(peer_addresses_ipv4), PG_POOL_FLAGS_GROW);
 
   for (uint64_t i = 0; i < pg_array_len(peer_addresses_ipv4); i++) {
     const tracker_peer_address_ipv4_t addr = peer_addresses_ipv4[i];
     peer_t *peer = pg_pool_alloc(&peer_pool);
     assert(peer != NULL);
-    peer_init(peer, &logger, &peer_pool, &download, &metainfo, &picker, addr);
+    peer_init(peer, &logger, &peer_pool, &download, &metainfo, &picker,
+              &storage, addr);
     peer_connect(peer, addr);
   }
   pg_array_free(peer_addresses_ipv4);
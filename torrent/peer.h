@@ -17,8 +17,19 @@
 #define PEER_HANDSHAKE_HEADER_LENGTH ((uint64_t)19)
 #define PEER_HANDSHAKE_LENGTH                                                  \
   ((uint64_t)(1 + PEER_HANDSHAKE_HEADER_LENGTH + 8 + 20 + 20))
-#define PEER_MAX_MESSAGE_LENGTH ((uint64_t)1 << 27)
-#define PEER_MAX_IN_FLIGHT_REQUESTS ((uint64_t)5)
+// Requests are pipelined: how many are in flight at once adapts to each peer,
+// within these bounds.
+#define PEER_MIN_IN_FLIGHT_REQUESTS ((uint64_t)5)
+#ifndef PEER_MAX_IN_FLIGHT_BYTES
+#define PEER_MAX_IN_FLIGHT_BYTES ((uint64_t)4 * 1024 * 1024)
+#endif
+#define PEER_MAX_IN_FLIGHT_REQUESTS (PEER_MAX_IN_FLIGHT_BYTES / BC_BLOCK_LENGTH)
+// The rate is measured over at least this long, or one round-trip.
+#define PEER_RATE_WINDOW_NS ((uint64_t)100 * 1000 * 1000)
+// Memory for pieces being downloaded and not yet on disk.
+#ifndef STORAGE_MAX_DIRTY_BYTES
+#define STORAGE_MAX_DIRTY_BYTES ((uint64_t)64 * 1024 * 1024)
+#endif
 
 typedef struct {
   int fd;
@@ -91,13 +102,15 @@ typedef struct {
   uint32_t index, begin, length;
 } peer_message_cancel_t;
 
+// Messages point into the receive buffer and are only valid until they are
+// consumed from it.
 typedef struct {
-  pg_array_t(uint8_t) bitfield;
+  pg_span_t bitfield;
 } peer_message_bitfield_t;
 
 typedef struct {
   uint32_t index, begin;
-  pg_array_t(uint8_t) data;
+  pg_span_t data;
 } peer_message_piece_t;
 
 typedef struct {
@@ -111,23 +124,75 @@ typedef struct {
   PG_PAD(4);
 } peer_message_t;
 
-// TODO: investigate how to reduce size
+typedef enum {
+  PBS_TO_DOWNLOAD,
+  PBS_DOWNLOADING,
+  PBS_DOWNLOADED,
+} picker_block_state_t;
+
+typedef enum {
+  PPS_TO_DOWNLOAD,
+  PPS_DOWNLOADING,
+  PPS_DOWNLOADED,
+} picker_piece_state_t;
+
+typedef struct {
+  uint16_t remaining; // Blocks not downloaded yet.
+  uint16_t in_flight; // Blocks requested and not received yet.
+  uint8_t state;      // `picker_piece_state_t`.
+  PG_PAD(1);
+} picker_piece_t;
+
+// Pieces are picked rarest first: `pieces` is ordered by availability, the
+// number of connected peers having each piece. The pieces with availability
+// `a` are at `[bucket_starts[a], bucket_starts[a + 1])`, so a change of
+// availability is one swap with the edge of the bucket. The last entry of
+// `bucket_starts` is the number of pieces still wanted: downloaded pieces are
+// moved past it and never looked at again.
+//
+// Blocks have 2 bits of state, packed 32 per word in `block_states`. They
+// are only meaningful for pieces in the `PPS_DOWNLOADING` state: the other
+// states apply to every block of the piece, so that marking a whole piece as
+// downloaded or resetting it is O(1).
 typedef struct {
-  pg_bitarray_t blocks_to_download;
-  pg_bitarray_t blocks_downloading;
-  pg_bitarray_t blocks_downloaded;
+  uint64_t *block_states;
+  picker_piece_t *piece_states;
+  uint32_t *availability; // Per piece.
+  uint32_t *pieces;
+  uint32_t *positions; // Per piece, index in `pieces`.
+  pg_array_t(uint32_t) bucket_starts;
+  uint64_t rng;
+  pg_allocator_t allocator;
   pg_logger_t *logger;
   bc_metainfo_t *metainfo;
 } picker_t;
 
 typedef struct {
+  uint32_t block;
+  PG_PAD(4);
+  uint64_t sent_ns;
+} peer_request_t;
+
+// Sizes the request queue of a peer from its bandwidth-delay product.
+typedef struct {
+  uint64_t min_latency_ns; // From request to block, approximates the RTT.
+  uint64_t window_start_ns;
+  uint64_t window_bytes;
+  uint64_t rate; // Bytes per second, smoothed.
+  uint32_t target; // Requests to keep in flight.
+  PG_PAD(4);
+} peer_pipeline_t;
+
+typedef struct storage_t storage_t;
+
+typedef struct {
+  pg_alloc_stats_t memory_stats;
   pg_allocator_t allocator;
   pg_logger_t *logger;
   picker_t *picker;
+  storage_t *storage;
   pg_pool_t *peer_pool;
   pg_pool_t write_ctx_pool;
-  pg_pool_t read_buf_pool;
-  pg_pool_t block_pool;
 
   download_t *download;
   bc_metainfo_t *metainfo;
@@ -138,11 +203,14 @@ typedef struct {
   uv_idle_t idle_handle;
 
   pg_ring_t recv_data;
+  pg_array_t(peer_request_t) in_flight_requests; // Oldest first.
+  peer_pipeline_t pipeline;
   char addr_s[INET6_ADDRSTRLEN + /* :port */ 6];
   bool me_choked, me_interested, them_choked, them_interested, handshaked;
-  uint8_t in_flight_requests;
-
-  PG_PAD(6);
+  bool storage_stalled; // Waiting for room to start a new piece.
+  PG_PAD(2);
+  // Blocks are requested piece by piece, so that pieces complete early.
+  uint32_t picking_piece;
 } peer_t;
 
 typedef struct {
@@ -162,152 +230,607 @@ __attribute__((unused)) static void picker_init(pg_allocator_t allocator,
   assert(metainfo->last_piece_block_count > 0);
   assert(metainfo->last_piece_length > 0);
 
-  pg_bitarray_init(allocator, &picker->blocks_to_download,
-                   metainfo->blocks_count - 1);
-  pg_bitarray_init(allocator, &picker->blocks_downloading,
-                   metainfo->blocks_count - 1);
-  pg_bitarray_init(allocator, &picker->blocks_downloaded,
-                   metainfo->blocks_count - 1);
+  assert(metainfo->blocks_per_piece <= UINT16_MAX);
+
+  picker->block_states = pg_alloc(
+      allocator, (metainfo->blocks_count + 31) / 32 * sizeof(uint64_t));
+  picker->piece_states =
+      pg_alloc(allocator, metainfo->pieces_count * sizeof(picker_piece_t));
 
-  pg_bitarray_set_all(&picker->blocks_to_download);
+  const uint64_t pieces_size = metainfo->pieces_count * sizeof(uint32_t);
+  picker->availability = pg_alloc(allocator, pieces_size);
+  picker->pieces = pg_alloc(allocator, pieces_size);
+  picker->positions = pg_alloc(allocator, pieces_size);
+  for (uint32_t piece = 0; piece < metainfo->pieces_count; piece++) {
+    picker->pieces[piece] = piece;
+    picker->positions[piece] = piece;
+    picker->piece_states[piece].remaining =
+        (uint16_t)metainfo_block_count_for_piece(metainfo, piece);
+  }
+  // All pieces are wanted and nobody has them yet.
+  pg_array_init_reserve(picker->bucket_starts, 64, allocator);
+  pg_array_append(picker->bucket_starts, 0);
+  pg_array_append(picker->bucket_starts, metainfo->pieces_count);
 
+  picker->rng = pg_now_ns() | 1;
+  picker->allocator = allocator;
   picker->logger = logger;
 }
 
-// TODO: randomness, rarity
+// xorshift64*, only for tie-breaking.
+__attribute__((unused)) static uint64_t picker_rand(picker_t *picker) {
+  picker->rng ^= picker->rng >> 12;
+  picker->rng ^= picker->rng << 25;
+  picker->rng ^= picker->rng >> 27;
+  return picker->rng * 2685821657736338717ULL;
+}
+
 __attribute__((unused)) static uint32_t
-picker_pick_block(const picker_t *picker, const pg_bitarray_t *them_have_pieces,
-                  bool *found) {
-  uint64_t i = 0;
-  bool is_set = false;
-  while (pg_bitarray_next(&picker->blocks_to_download, &i, &is_set)) {
-    assert(i > 0);
-    if (!is_set)
-      continue;
+picker_wanted_count(const picker_t *picker) {
+  return picker->bucket_starts[pg_array_len(picker->bucket_starts) - 1];
+}
 
-    const uint32_t block = (uint32_t)i - 1;
-    assert(block < picker->metainfo->blocks_count);
+__attribute__((unused)) static void picker_swap(picker_t *picker, uint32_t i,
+                                                uint32_t j) {
+  const uint32_t a = picker->pieces[i], b = picker->pieces[j];
+  picker->pieces[i] = b;
+  picker->positions[b] = i;
+  picker->pieces[j] = a;
+  picker->positions[a] = j;
+}
+
+// Move `piece` from the bucket `bucket` to the next one, by swapping it with
+// the last piece of its bucket and shrinking the bucket by one.
+__attribute__((unused)) static void
+picker_move_up(picker_t *picker, uint32_t piece, uint32_t bucket) {
+  if (bucket + 2 == pg_array_len(picker->bucket_starts)) {
+    const uint32_t wanted_count = picker_wanted_count(picker);
+    pg_array_append(picker->bucket_starts, wanted_count);
+  }
 
-    const uint32_t piece = block / picker->metainfo->blocks_per_piece;
-    assert(piece < picker->metainfo->pieces_count);
+  const uint32_t last = picker->bucket_starts[bucket + 1] - 1;
+  picker_swap(picker, picker->positions[piece], last);
+  picker->bucket_starts[bucket + 1] = last;
+}
 
-    const bool them_have = pg_bitarray_get(them_have_pieces, piece);
+__attribute__((unused)) static bool picker_is_wanted(const picker_t *picker,
+                                                     uint32_t piece) {
+  return picker->positions[piece] < picker_wanted_count(picker);
+}
 
-    if (!them_have) {
-      pg_log_debug(picker->logger,
-                   "[%s] need block=%u for piece=%u but they "
-                   "don't have it",
-                   __func__, block, piece);
-      continue;
-    }
+__attribute__((unused)) static void
+picker_increment_availability(picker_t *picker, uint32_t piece) {
+  assert(piece < picker->metainfo->pieces_count);
+
+  if (picker_is_wanted(picker, piece))
+    picker_move_up(picker, piece, picker->availability[piece]);
+  picker->availability[piece] += 1;
+}
+
+__attribute__((unused)) static void
+picker_decrement_availability(picker_t *picker, uint32_t piece) {
+  assert(piece < picker->metainfo->pieces_count);
+  assert(picker->availability[piece] > 0);
 
-    pg_log_debug(picker->logger, "[%s] found piece %u", __func__, piece);
-    *found = true;
+  picker->availability[piece] -= 1;
+  if (!picker_is_wanted(picker, piece))
+    return;
+
+  // Swap with the first piece of the bucket and grow the one below.
+  const uint32_t bucket = picker->availability[piece] + 1;
+  const uint32_t first = picker->bucket_starts[bucket];
+  picker_swap(picker, picker->positions[piece], first);
+  picker->bucket_starts[bucket] = first + 1;
+}
 
-    return block;
+// Past the last bucket, one bucket at a time.
+__attribute__((unused)) static void picker_remove_piece(picker_t *picker,
+                                                        uint32_t piece) {
+  if (!picker_is_wanted(picker, piece))
+    return;
+
+  const uint32_t last_bucket =
+      (uint32_t)pg_array_len(picker->bucket_starts) - 2;
+  for (uint32_t bucket = picker->availability[piece]; bucket <= last_bucket;
+       bucket++) {
+    const uint32_t last = picker->bucket_starts[bucket + 1] - 1;
+    picker_swap(picker, picker->positions[piece], last);
+    picker->bucket_starts[bucket + 1] = last;
+  }
+}
+
+// Inverse of `picker_remove_piece`: back into the bucket of its availability.
+__attribute__((unused)) static void picker_add_piece(picker_t *picker,
+                                                     uint32_t piece) {
+  if (picker_is_wanted(picker, piece))
+    return;
+
+  // The availability of pieces not wanted is still tracked, and may be past
+  // the last bucket.
+  const uint32_t wanted_count = picker_wanted_count(picker);
+  while (pg_array_len(picker->bucket_starts) - 2 <
+         picker->availability[piece]) {
+    pg_array_append(picker->bucket_starts, wanted_count);
+  }
+
+  // Into the last bucket, then down one bucket at a time.
+  picker_swap(picker, picker->positions[piece], wanted_count);
+  picker->bucket_starts[pg_array_len(picker->bucket_starts) - 1] =
+      wanted_count + 1;
+
+  const uint32_t last_bucket =
+      (uint32_t)pg_array_len(picker->bucket_starts) - 2;
+  for (uint32_t bucket = last_bucket; bucket > picker->availability[piece];
+       bucket--) {
+    const uint32_t first = picker->bucket_starts[bucket];
+    picker_swap(picker, picker->positions[piece], first);
+    picker->bucket_starts[bucket] = first + 1;
   }
-  return 0;
 }
 
+// From a BITFIELD message or a peer disconnecting.
+__attribute__((unused)) static void
+picker_add_peer_pieces(picker_t *picker, const pg_bitarray_t *them_have) {
+  for (uint64_t i = 0; pg_bitarray_find_next_set(them_have, i, &i); i++)
+    picker_increment_availability(picker, (uint32_t)i);
+}
+
+__attribute__((unused)) static void
+picker_remove_peer_pieces(picker_t *picker, const pg_bitarray_t *them_have) {
+  for (uint64_t i = 0; pg_bitarray_find_next_set(them_have, i, &i); i++)
+    picker_decrement_availability(picker, (uint32_t)i);
+}
+
+__attribute__((unused)) static picker_block_state_t
+picker_block_state(const picker_t *picker, uint32_t block) {
+  assert(block < picker->metainfo->blocks_count);
+
+  const uint32_t piece = block / picker->metainfo->blocks_per_piece;
+  switch (picker->piece_states[piece].state) {
+  case PPS_TO_DOWNLOAD:
+    return PBS_TO_DOWNLOAD;
+  case PPS_DOWNLOADED:
+    return PBS_DOWNLOADED;
+  default:
+    return (picker_block_state_t)((picker->block_states[block / 32] >>
+                                   (block % 32 * 2)) &
+                                  3);
+  }
+}
+
+__attribute__((unused)) static void
+picker_set_block_state(picker_t *picker, uint32_t block,
+                       picker_block_state_t state) {
+  uint64_t *const word = &picker->block_states[block / 32];
+  const uint32_t shift = block % 32 * 2;
+  *word = (*word & ~(3ULL << shift)) | ((uint64_t)state << shift);
+}
+
+// The block states of a piece are only written when it is first requested.
+__attribute__((unused)) static void
+picker_start_piece(picker_t *picker, uint32_t piece) {
+  picker_piece_t *const piece_state = &picker->piece_states[piece];
+  if (piece_state->state != PPS_TO_DOWNLOAD)
+    return;
+
+  const uint32_t first_block = piece * picker->metainfo->blocks_per_piece;
+  for (uint32_t i = 0; i < piece_state->remaining; i++)
+    picker_set_block_state(picker, first_block + i, PBS_TO_DOWNLOAD);
+  piece_state->state = PPS_DOWNLOADING;
+}
+
+// First block of `piece` left to download.
 __attribute__((unused)) static bool
-picker_have_all_blocks_for_piece(const picker_t *picker, uint32_t piece) {
+picker_pick_block_in_piece(const picker_t *picker, uint32_t piece,
+                           uint32_t *block) {
   assert(piece < picker->metainfo->pieces_count);
 
+  const picker_piece_t piece_state = picker->piece_states[piece];
   const uint32_t first_block = piece * picker->metainfo->blocks_per_piece;
-  assert(first_block < picker->metainfo->blocks_count);
+  if (piece_state.state == PPS_TO_DOWNLOAD) {
+    *block = first_block;
+    return true;
+  }
+  if (piece_state.remaining == piece_state.in_flight)
+    return false;
+
+  // Some block is `PBS_TO_DOWNLOAD` i.e. `0b00`: find it a word at a time.
+  const uint32_t end_block =
+      first_block + metainfo_block_count_for_piece(picker->metainfo, piece);
+  for (uint32_t w = first_block / 32; w * 32 < end_block; w++) {
+    const uint64_t word = picker->block_states[w];
+    uint64_t zero_pairs = ~(word | word >> 1) & 0x5555555555555555ULL;
+    if (w == first_block / 32)
+      zero_pairs &= UINT64_MAX << (first_block % 32 * 2);
+
+    if (zero_pairs != 0) {
+      const uint32_t i = w * 32 + (uint32_t)__builtin_ctzll(zero_pairs) / 2;
+      assert(i < end_block);
+      *block = i;
+      return true;
+    }
+  }
+  assert(0 && "unreachable");
+  return false;
+}
 
-  const uint32_t last_block =
-      first_block + metainfo_block_count_for_piece(picker->metainfo, piece) - 1;
-  assert(last_block < picker->metainfo->blocks_count);
+// Rarest piece that they have, starting at a random position within each
+// availability bucket so that peers do not all race for the same pieces.
+// Pieces whose blocks are all requested already are skipped.
+__attribute__((unused)) static uint32_t
+picker_pick_block(picker_t *picker, const pg_bitarray_t *them_have_pieces,
+                  bool *found) {
+  const uint32_t last_bucket =
+      (uint32_t)pg_array_len(picker->bucket_starts) - 2;
 
-  uint64_t i = first_block;
-  bool is_set = false;
-  while (pg_bitarray_next(&picker->blocks_downloaded, &i, &is_set)) {
-    assert(i > 0);
-    const uint32_t block = (uint32_t)i - 1;
-    assert(block < picker->metainfo->blocks_count);
+  for (uint32_t bucket = 1; bucket <= last_bucket; bucket++) {
+    const uint32_t start = picker->bucket_starts[bucket];
+    const uint32_t len = picker->bucket_starts[bucket + 1] - start;
+    if (len == 0)
+      continue;
 
-    if (block > last_block)
-      return true;
-    if (!is_set)
-      return false;
+    const uint32_t offset = (uint32_t)(picker_rand(picker) % len);
+    for (uint32_t i = 0; i < len; i++) {
+      const uint32_t piece = picker->pieces[start + (offset + i) % len];
+      if (!pg_bitarray_get(them_have_pieces, piece))
+        continue;
+
+      uint32_t block = 0;
+      if (picker_pick_block_in_piece(picker, piece, &block)) {
+        pg_log_debug(picker->logger,
+                     "[%s] found piece=%u block=%u availability=%u", __func__,
+                     piece, block, bucket);
+        *found = true;
+        return block;
+      }
+    }
   }
+  return 0;
+}
 
-  return true;
+__attribute__((unused)) static bool
+picker_have_all_blocks_for_piece(const picker_t *picker, uint32_t piece) {
+  assert(piece < picker->metainfo->pieces_count);
+
+  return picker->piece_states[piece].state == PPS_DOWNLOADED;
 }
 
 __attribute__((unused)) static void
 picker_mark_block_as_downloading(picker_t *picker, uint32_t block) {
   assert(block < picker->metainfo->blocks_count);
-  pg_bitarray_set(&picker->blocks_downloading, block);
-  pg_bitarray_unset(&picker->blocks_to_download, block);
+
+  const uint32_t piece = block / picker->metainfo->blocks_per_piece;
+  picker_start_piece(picker, piece);
+  if (picker_block_state(picker, block) != PBS_TO_DOWNLOAD)
+    return;
+
+  picker_set_block_state(picker, block, PBS_DOWNLOADING);
+  picker->piece_states[piece].in_flight += 1;
+}
+
+// The request for it will not be answered e.g. the peer is gone.
+__attribute__((unused)) static void
+picker_mark_block_as_to_download(picker_t *picker, uint32_t block) {
+  assert(block < picker->metainfo->blocks_count);
+
+  if (picker_block_state(picker, block) != PBS_DOWNLOADING)
+    return;
+
+  const uint32_t piece = block / picker->metainfo->blocks_per_piece;
+  picker_set_block_state(picker, block, PBS_TO_DOWNLOAD);
+  assert(picker->piece_states[piece].in_flight > 0);
+  picker->piece_states[piece].in_flight -= 1;
 }
 
+// All blocks of the piece are already on disk e.g. when resuming.
 __attribute__((unused)) static void
-picker_mark_piece_as_to_download(picker_t *picker, uint32_t piece) {
+picker_mark_piece_as_downloaded(picker_t *picker, uint32_t piece) {
   assert(piece < picker->metainfo->pieces_count);
 
-  const uint32_t first_block = piece * picker->metainfo->blocks_per_piece;
-  assert(first_block < picker->metainfo->blocks_count);
+  picker->piece_states[piece] = (picker_piece_t){.state = PPS_DOWNLOADED};
+  picker_remove_piece(picker, piece);
+}
 
-  const uint32_t last_block =
-      first_block + metainfo_block_count_for_piece(picker->metainfo, piece) - 1;
-  assert(last_block < picker->metainfo->blocks_count);
-  assert(first_block <= last_block);
+// After the piece failed its checksum: every block is to be downloaded again.
+__attribute__((unused)) static void picker_reset_piece(picker_t *picker,
+                                                       uint32_t piece) {
+  assert(piece < picker->metainfo->pieces_count);
 
-  for (uint32_t block = first_block; block <= last_block; block++) {
-    pg_bitarray_set(&picker->blocks_downloaded, block);
-    pg_bitarray_unset(&picker->blocks_to_download, block);
-    pg_bitarray_unset(&picker->blocks_downloading, block);
-  }
+  picker->piece_states[piece] = (picker_piece_t){
+      .remaining =
+          (uint16_t)metainfo_block_count_for_piece(picker->metainfo, piece),
+      .state = PPS_TO_DOWNLOAD,
+  };
+  picker_add_piece(picker, piece);
 }
 
 __attribute__((unused)) static void
 picker_mark_block_as_downloaded(picker_t *picker, uint32_t block) {
   assert(block < picker->metainfo->blocks_count);
-  pg_bitarray_set(&picker->blocks_downloaded, block);
-  pg_bitarray_unset(&picker->blocks_downloading, block);
+
+  const uint32_t piece = block / picker->metainfo->blocks_per_piece;
+  picker_start_piece(picker, piece);
+
+  picker_piece_t *const piece_state = &picker->piece_states[piece];
+  const picker_block_state_t state = picker_block_state(picker, block);
+  if (state == PBS_DOWNLOADED)
+    return;
+  if (state == PBS_DOWNLOADING) {
+    assert(piece_state->in_flight > 0);
+    piece_state->in_flight -= 1;
+  }
+  picker_set_block_state(picker, block, PBS_DOWNLOADED);
+
+  assert(piece_state->remaining > 0);
+  piece_state->remaining -= 1;
+  if (piece_state->remaining == 0) {
+    piece_state->state = PPS_DOWNLOADED;
+    picker_remove_piece(picker, piece);
+  }
 }
 
 __attribute__((unused)) static void picker_destroy(picker_t *picker) {
-  pg_bitarray_destroy(&picker->blocks_to_download);
-  pg_bitarray_destroy(&picker->blocks_downloading);
-  pg_bitarray_destroy(&picker->blocks_downloaded);
+  pg_free(picker->allocator, picker->block_states);
+  pg_free(picker->allocator, picker->piece_states);
+  pg_free(picker->allocator, picker->availability);
+  pg_free(picker->allocator, picker->pieces);
+  pg_free(picker->allocator, picker->positions);
+  pg_array_free(picker->bucket_starts);
 }
 
-__attribute__((unused)) static void peer_message_destroy(peer_t *peer,
-                                                         peer_message_t *msg) {
-  switch (msg->kind) {
-  case PMK_NONE:
-  case PMK_HEARTBEAT:
-  case PMK_CHOKE:
-  case PMK_UNCHOKE:
-  case PMK_INTERESTED:
-  case PMK_UNINTERESTED:
-  case PMK_HAVE:
-  case PMK_REQUEST:
-  case PMK_CANCEL:
-    return; // no-op
+// Blocks are gathered in one buffer per piece. A complete piece is
+// checksummed and written with one pwrite(2) on the libuv threadpool, so that
+// the event loop never waits on the disk. Buffers are bounded by
+// `max_dirty_bytes`: past it, peers only get blocks of pieces already started,
+// and stall if there are none until a write completes.
+struct storage_t {
+  uint8_t **buffers;                   // Per piece, NULL when not started.
+  pg_array_t(uint32_t) started_pieces; // Not complete yet.
+  pg_array_t(peer_t *) stalled_peers;
+  uint64_t dirty_bytes, max_dirty_bytes;
+  pg_allocator_t allocator;
+  pg_logger_t *logger;
+  bc_metainfo_t *metainfo;
+  picker_t *picker;
+  download_t *download;
+};
 
-  case PMK_BITFIELD:
-    pg_array_free(msg->v.bitfield.bitfield);
+typedef struct {
+  uv_work_t req;
+  storage_t *storage;
+  uint8_t *data;
+  uint32_t piece;
+  int err;    // From pwrite(2).
+  bool valid; // Passed the checksum.
+  PG_PAD(7);
+} storage_write_t;
+
+__attribute__((unused)) static void peer_on_idle(uv_idle_t *handle);
+
+__attribute__((unused)) static void
+storage_init(storage_t *storage, pg_allocator_t allocator, pg_logger_t *logger,
+             bc_metainfo_t *metainfo, picker_t *picker, download_t *download,
+             uint64_t max_dirty_bytes) {
+  storage->buffers =
+      pg_alloc(allocator, metainfo->pieces_count * sizeof(uint8_t *));
+  pg_array_init_reserve(storage->started_pieces, 16, allocator);
+  pg_array_init_reserve(storage->stalled_peers, 16, allocator);
+  storage->dirty_bytes = 0;
+  storage->max_dirty_bytes = max_dirty_bytes;
+  storage->allocator = allocator;
+  storage->logger = logger;
+  storage->metainfo = metainfo;
+  storage->picker = picker;
+  storage->download = download;
+}
+
+__attribute__((unused)) static void storage_destroy(storage_t *storage) {
+  for (uint32_t piece = 0; piece < storage->metainfo->pieces_count; piece++) {
+    if (storage->buffers[piece] != NULL)
+      pg_free(storage->allocator, storage->buffers[piece]);
+  }
+  pg_free(storage->allocator, storage->buffers);
+  pg_array_free(storage->started_pieces);
+  pg_array_free(storage->stalled_peers);
+}
+
+// One piece is always allowed so that a small budget cannot stop everything.
+__attribute__((unused)) static bool storage_start_piece(storage_t *storage,
+                                                        uint32_t piece) {
+  assert(piece < storage->metainfo->pieces_count);
+
+  if (storage->buffers[piece] != NULL)
+    return true;
+
+  const uint64_t length = metainfo_piece_length(storage->metainfo, piece);
+  if (storage->dirty_bytes > 0 &&
+      storage->dirty_bytes + length > storage->max_dirty_bytes)
+    return false;
+
+  storage->buffers[piece] = pg_alloc(storage->allocator, length);
+  storage->dirty_bytes += length;
+  pg_array_append(storage->started_pieces, piece);
+  return true;
+}
+
+// Typically blocks that a closed peer did not deliver.
+__attribute__((unused)) static bool
+storage_pick_block_in_started_piece(storage_t *storage,
+                                    const pg_bitarray_t *them_have_pieces,
+                                    uint32_t *block) {
+  for (uint64_t i = 0; i < pg_array_len(storage->started_pieces); i++) {
+    const uint32_t piece = storage->started_pieces[i];
+    if (pg_bitarray_get(them_have_pieces, piece) &&
+        picker_pick_block_in_piece(storage->picker, piece, block))
+      return true;
+  }
+  return false;
+}
+
+__attribute__((unused)) static void storage_stall_peer(storage_t *storage,
+                                                       peer_t *peer) {
+  if (peer->storage_stalled)
     return;
-  case PMK_PIECE:
-    pg_pool_free(&peer->block_pool, msg->v.piece.data);
+
+  peer->storage_stalled = true;
+  pg_array_append(storage->stalled_peers, peer);
+}
+
+__attribute__((unused)) static void
+storage_remove_stalled_peer(storage_t *storage, peer_t *peer) {
+  if (!peer->storage_stalled)
+    return;
+
+  const uint64_t len = pg_array_len(storage->stalled_peers);
+  for (uint64_t i = 0; i < len; i++) {
+    if (storage->stalled_peers[i] != peer)
+      continue;
+
+    storage->stalled_peers[i] = storage->stalled_peers[len - 1];
+    pg_array_pop(storage->stalled_peers);
+    break;
+  }
+  peer->storage_stalled = false;
+}
+
+// When a write frees memory, or a closing peer gives back blocks of started
+// pieces.
+__attribute__((unused)) static void
+storage_wake_stalled_peers(storage_t *storage) {
+  for (uint64_t i = 0; i < pg_array_len(storage->stalled_peers); i++) {
+    peer_t *const peer = storage->stalled_peers[i];
+    peer->storage_stalled = false;
+    uv_idle_start(&peer->idle_handle, peer_on_idle);
+  }
+  pg_array_clear(storage->stalled_peers);
+}
+
+__attribute__((unused)) static void storage_put_block(storage_t *storage,
+                                                      uint32_t piece,
+                                                      uint32_t block_for_piece,
+                                                      pg_span_t data) {
+  assert(piece < storage->metainfo->pieces_count);
+  assert(storage->buffers[piece] != NULL);
+
+  const uint64_t offset = (uint64_t)block_for_piece * BC_BLOCK_LENGTH;
+  assert(offset + data.len <=
+         metainfo_piece_length(storage->metainfo, piece));
+
+  memcpy(storage->buffers[piece] + offset, data.data, data.len);
+}
+
+// Runs on the threadpool.
+__attribute__((unused)) static void storage_on_write(uv_work_t *req) {
+  storage_write_t *const write_req = req->data;
+  const bc_metainfo_t *const metainfo = write_req->storage->metainfo;
+  const uint32_t piece = write_req->piece;
+  const uint64_t length = metainfo_piece_length(metainfo, piece);
+
+  uint8_t hash[20] = {0};
+  assert(mbedtls_sha1(write_req->data, length, hash) == 0);
+
+  assert(piece * 20 + 20 <= metainfo->pieces.len);
+  const uint8_t *const expected = (uint8_t *)metainfo->pieces.data + 20 * piece;
+  write_req->valid = memcmp(hash, expected, sizeof(hash)) == 0;
+  if (!write_req->valid)
     return;
+
+  const int fd = write_req->storage->download->fd;
+  const uint64_t offset = (uint64_t)piece * metainfo->piece_length;
+  uint64_t written = 0;
+  while (written < length) {
+    const ssize_t ret = pwrite(fd, write_req->data + written, length - written,
+                               (off_t)(offset + written));
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1) {
+      write_req->err = errno;
+      return;
+    }
+    written += (uint64_t)ret;
+  }
+}
+
+__attribute__((unused)) static void storage_on_write_done(uv_work_t *req,
+                                                          int status) {
+  storage_write_t *const write_req = req->data;
+  storage_t *const storage = write_req->storage;
+  download_t *const download = storage->download;
+  const uint32_t piece = write_req->piece;
+  const uint64_t length = metainfo_piece_length(storage->metainfo, piece);
+
+  if (status != 0 || write_req->err != 0 || !write_req->valid) {
+    pg_log_error(storage->logger,
+                 "Failed to store piece: piece=%u status=%d valid=%d err=%s",
+                 piece, status, write_req->valid, strerror(write_req->err));
+
+    // Downloaded again from scratch.
+    assert(download->downloaded_bytes >= length);
+    download->downloaded_bytes -= length;
+    const uint64_t blocks_count =
+        metainfo_block_count_for_piece(storage->metainfo, piece);
+    assert(download->downloaded_blocks_count >= blocks_count);
+    download->downloaded_blocks_count -= blocks_count;
+    picker_reset_piece(storage->picker, piece);
+  } else {
+    download->downloaded_pieces_count += 1;
+    assert(download->downloaded_pieces_count <=
+           storage->metainfo->pieces_count);
+  }
+
+  assert(storage->buffers[piece] == write_req->data);
+  pg_free(storage->allocator, write_req->data);
+  storage->buffers[piece] = NULL;
+  assert(storage->dirty_bytes >= length);
+  storage->dirty_bytes -= length;
+  pg_free(storage->allocator, write_req);
+
+  storage_wake_stalled_peers(storage);
+}
+
+// The buffer is owned by the write until it completes.
+__attribute__((unused)) static void storage_write_piece(storage_t *storage,
+                                                        uint32_t piece) {
+  assert(storage->buffers[piece] != NULL);
+
+  const uint64_t len = pg_array_len(storage->started_pieces);
+  for (uint64_t i = 0; i < len; i++) {
+    if (storage->started_pieces[i] != piece)
+      continue;
+
+    storage->started_pieces[i] = storage->started_pieces[len - 1];
+    pg_array_pop(storage->started_pieces);
+    break;
+  }
+
+  storage_write_t *const write_req =
+      pg_alloc(storage->allocator, sizeof(storage_write_t));
+  write_req->req.data = write_req;
+  write_req->storage = storage;
+  write_req->data = storage->buffers[piece];
+  write_req->piece = piece;
+
+  int ret = 0;
+  if ((ret = uv_queue_work(uv_default_loop(), &write_req->req,
+                           storage_on_write, storage_on_write_done)) != 0) {
+    pg_log_error(storage->logger, "Failed to uv_queue_work: %d %s", ret,
+                 uv_strerror(ret));
+    storage_on_write_done(&write_req->req, ret);
   }
 }
 
 __attribute__((unused)) static void peer_close(peer_t *peer);
 
+// libuv reads straight into `recv_data`, where messages are parsed in place.
 __attribute__((unused)) static void
 peer_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
   (void)suggested_size;
 
   peer_t *peer = handle->data;
 
-  buf->base = pg_pool_alloc(&peer->read_buf_pool);
-  buf->len = peer->read_buf_pool.chunk_size;
+  const pg_span_t space = pg_ring_write_span(&peer->recv_data);
+  buf->base = space.data;
+  buf->len = space.len;
 }
 
 __attribute__((unused)) static peer_error_t
@@ -322,8 +845,7 @@ peer_check_handshaked(peer_t *peer) {
   const uint8_t handshake_header_expected[] = "\x13"
                                               "BitTorrent protocol";
   uint8_t handshake_got[PEER_HANDSHAKE_LENGTH] = "";
-  for (uint64_t i = 0; i < PEER_HANDSHAKE_LENGTH; i++)
-    handshake_got[i] = pg_ring_pop_front(&peer->recv_data);
+  pg_ring_pop_frontv(&peer->recv_data, handshake_got, PEER_HANDSHAKE_LENGTH);
 
   if (memcmp(handshake_got, handshake_header_expected,
              sizeof(handshake_header_expected) - 1) != 0)
@@ -342,108 +864,93 @@ peer_check_handshaked(peer_t *peer) {
   return (peer_error_t){0};
 }
 
-__attribute__((unused)) static uint32_t peer_read_u32(pg_ring_t *ring) {
-  assert(pg_ring_len(ring) >= sizeof(uint32_t));
-  uint8_t parts[] = {
-      pg_ring_pop_front(ring),
-      pg_ring_pop_front(ring),
-      pg_ring_pop_front(ring),
-      pg_ring_pop_front(ring),
-  };
-  return ntohl(*(uint32_t *)(void *)parts);
+__attribute__((unused)) static uint32_t peer_read_u32(const uint8_t *data) {
+  uint32_t res = 0;
+  memcpy(&res, data, sizeof(res));
+  return ntohl(res);
 }
 
-__attribute__((unused)) static uint32_t peer_peek_read_u32(pg_ring_t *ring) {
-  assert(pg_ring_len(ring) >= sizeof(uint32_t));
-  uint8_t parts[] = {
-      pg_ring_get(ring, 0),
-      pg_ring_get(ring, 1),
-      pg_ring_get(ring, 2),
-      pg_ring_get(ring, 3),
-  };
-  return ntohl(*(uint32_t *)(void *)parts);
+__attribute__((unused)) static uint64_t
+peer_bitfield_length(const bc_metainfo_t *metainfo) {
+  return ((uint64_t)metainfo->pieces_count + 7) / 8;
 }
 
+// Not counting the length prefix. The biggest messages are PIECE, with one
+// block, and BITFIELD for torrents with many pieces.
+__attribute__((unused)) static uint64_t
+peer_max_message_length(const bc_metainfo_t *metainfo) {
+  return MAX(1 + 2 * 4 + (uint64_t)BC_BLOCK_LENGTH,
+             1 + peer_bitfield_length(metainfo));
+}
+
+// Parse the message at the front of `recv_data` without consuming it, since
+// `msg` may point into it: `*msg_len` bytes are to be consumed once the
+// message has been handled.
 __attribute__((unused)) static peer_error_t
-peer_message_parse(peer_t *peer, peer_message_t *msg) {
+peer_message_parse(peer_t *peer, peer_message_t *msg, uint64_t *msg_len) {
   peer_error_t err = peer_check_handshaked(peer);
-  if (err.kind > PEK_NEED_MORE)
+  if (err.kind != PEK_NONE)
     return err;
 
-  if (pg_ring_len(&peer->recv_data) <
-      sizeof(uint32_t)) // Check there is room for the announced_len
+  // Only needed when the ring could not be mirrored.
+  pg_ring_make_contiguous(&peer->recv_data);
+  const pg_span_t recv_data = pg_ring_peek_span(&peer->recv_data);
+  assert(recv_data.len == pg_ring_len(&peer->recv_data));
+  uint8_t *const data = (uint8_t *)recv_data.data;
+
+  if (recv_data.len < 4) // Check there is room for the announced_len
     return (peer_error_t){.kind = PEK_NEED_MORE};
 
-  const uint32_t announced_len = peer_peek_read_u32(&peer->recv_data);
+  const uint32_t announced_len = peer_read_u32(data);
   if (announced_len == 0) {
     // Heartbeat
     msg->kind = PMK_HEARTBEAT;
-
-    pg_ring_consume_front(&peer->recv_data, 4); // Consume the announced_len
+    *msg_len = 4;
     return err;
   }
-  if (announced_len > PEER_MAX_MESSAGE_LENGTH)
+  if (announced_len > peer_max_message_length(peer->metainfo))
     return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
 
-  if (pg_ring_len(&peer->recv_data) <
-      4 + 1) // Check there is room for the announced_len + tag
+  if (recv_data.len < 4 + (uint64_t)announced_len)
     return (peer_error_t){.kind = PEK_NEED_MORE};
+  *msg_len = 4 + (uint64_t)announced_len;
 
-  const uint8_t tag = pg_ring_get(&peer->recv_data, 4);
-  pg_log_debug(
-      peer->logger,
-      "[%s] msg tag=%d announced_len=%u recv_data.len=%llu recv_data.cap=%llu "
-      "recv_data.space=%llu "
-      "recv_data[0..7]=%#x %#x %#x %#x %#x %#x %#x ",
-      peer->addr_s, tag, announced_len, pg_ring_len(&peer->recv_data),
-      pg_ring_cap(&peer->recv_data), pg_ring_space(&peer->recv_data),
-      pg_ring_len(&peer->recv_data) > 0 ? pg_ring_get(&peer->recv_data, 0) : 0,
-      pg_ring_len(&peer->recv_data) > 1 ? pg_ring_get(&peer->recv_data, 1) : 0,
-      pg_ring_len(&peer->recv_data) > 2 ? pg_ring_get(&peer->recv_data, 2) : 0,
-      pg_ring_len(&peer->recv_data) > 3 ? pg_ring_get(&peer->recv_data, 3) : 0,
-      pg_ring_len(&peer->recv_data) > 4 ? pg_ring_get(&peer->recv_data, 4) : 0,
-      pg_ring_len(&peer->recv_data) > 5 ? pg_ring_get(&peer->recv_data, 5) : 0,
-      pg_ring_len(&peer->recv_data) > 6 ? pg_ring_get(&peer->recv_data, 6) : 0);
+  const uint8_t tag = data[4];
+  uint8_t *const payload = data + 4 + 1;
+  const uint64_t payload_len = announced_len - 1;
+  pg_log_debug(peer->logger,
+               "[%s] msg tag=%d announced_len=%u recv_data.len=%llu "
+               "recv_data.cap=%llu",
+               peer->addr_s, tag, announced_len, recv_data.len,
+               pg_ring_cap(&peer->recv_data));
 
   switch (tag) {
   case PT_CHOKE:
+    if (announced_len != 1)
+      return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
     msg->kind = PMK_CHOKE;
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
     return (peer_error_t){0};
   case PT_UNCHOKE:
+    if (announced_len != 1)
+      return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
     msg->kind = PMK_UNCHOKE;
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
-
     return (peer_error_t){0};
   case PT_INTERESTED:
+    if (announced_len != 1)
+      return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
     msg->kind = PMK_INTERESTED;
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
-
     return (peer_error_t){0};
   case PT_UNINTERESTED:
+    if (announced_len != 1)
+      return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
     msg->kind = PMK_UNINTERESTED;
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
-
     return (peer_error_t){0};
   case PT_HAVE: {
     if (announced_len != 5)
       return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
 
-    if (pg_ring_len(&peer->recv_data) < announced_len + 4)
-      return (peer_error_t){.kind = PEK_NEED_MORE};
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
-
-    const uint32_t have = peer_read_u32(&peer->recv_data);
-    if (have > peer->metainfo->pieces_count)
+    const uint32_t have = peer_read_u32(payload);
+    if (have >= peer->metainfo->pieces_count)
       return (peer_error_t){.kind = PEK_INVALID_HAVE};
 
     msg->kind = PMK_HAVE;
@@ -451,47 +958,31 @@ peer_message_parse(peer_t *peer, peer_message_t *msg) {
     return (peer_error_t){0};
   }
   case PT_BITFIELD: {
-    const uint64_t expected_bitfield_len =
-        (uint64_t)(ceil(((double)peer->metainfo->pieces_count - 1) / 8.0));
-    if (announced_len != expected_bitfield_len + /* tag */ 1)
+    if (payload_len != peer_bitfield_length(peer->metainfo))
       return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
 
-    if (pg_ring_len(&peer->recv_data) < announced_len + 4)
-      return (peer_error_t){.kind = PEK_NEED_MORE};
+    // The wire format is MSB-first, `pg_bitarray_t` is LSB-first: convert in
+    // place, the receive buffer is ours.
+    for (uint64_t i = 0; i < payload_len; i++)
+      payload[i] = __builtin_bitreverse8(payload[i]);
 
     msg->kind = PMK_BITFIELD;
-    msg->v.bitfield = (peer_message_bitfield_t){0};
-
-    const uint64_t len =
-        1 + (uint64_t)(ceil(((double)peer->metainfo->pieces_count - 1) / 8.0));
-    pg_array_init_reserve(msg->v.bitfield.bitfield, len, peer->allocator);
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
-
-    for (uint64_t i = 0; i < announced_len - 1; i++) {
-      const uint8_t byte = pg_ring_pop_front(&peer->recv_data);
-      pg_array_append(msg->v.bitfield.bitfield, __builtin_bitreverse8(byte));
-    }
+    msg->v.bitfield = (peer_message_bitfield_t){
+        .bitfield = {.data = (char *)payload, .len = payload_len},
+    };
     pg_log_debug(peer->logger, "[%s] bitfield: last=%#x", peer->addr_s,
-                 (uint8_t)msg->v.bitfield.bitfield[announced_len - 2]);
+                 payload[payload_len - 1]);
     return (peer_error_t){0};
   }
   case PT_REQUEST: {
     if (announced_len != 1 + 3 * 4)
       return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
 
-    if (pg_ring_len(&peer->recv_data) < announced_len + 4)
-      return (peer_error_t){.kind = PEK_NEED_MORE};
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
-
     msg->kind = PMK_REQUEST;
     msg->v.request = (peer_message_request_t){
-        .index = peer_read_u32(&peer->recv_data),
-        .begin = peer_read_u32(&peer->recv_data),
-        .length = peer_read_u32(&peer->recv_data),
+        .index = peer_read_u32(payload),
+        .begin = peer_read_u32(payload + 4),
+        .length = peer_read_u32(payload + 8),
     };
 
     return (peer_error_t){0};
@@ -500,36 +991,27 @@ peer_message_parse(peer_t *peer, peer_message_t *msg) {
     if (announced_len < 1 + 2 * 4 + /* Require at least 1 byte of data */ 1)
       return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
 
-    if (pg_ring_len(&peer->recv_data) < announced_len + 4)
-      return (peer_error_t){.kind = PEK_NEED_MORE};
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
-
     msg->kind = PMK_PIECE;
+    const uint64_t data_len = payload_len - 2 * 4;
     msg->v.piece = (peer_message_piece_t){
-        .index = peer_read_u32(&peer->recv_data),
-        .begin = peer_read_u32(&peer->recv_data),
+        .index = peer_read_u32(payload),
+        .begin = peer_read_u32(payload + 4),
+        .data = {.data = (char *)payload + 2 * 4, .len = data_len},
     };
-    const uint64_t data_len = announced_len - (1 + 2 * 4);
-    // TODO: validate block is in 'downloading'
     if (msg->v.piece.index >= peer->metainfo->pieces_count ||
         msg->v.piece.begin + data_len >
             metainfo_piece_length(peer->metainfo, msg->v.piece.index))
       return (peer_error_t){.kind = PEK_INVALID_PIECE};
 
     const uint32_t block_for_piece = msg->v.piece.begin / BC_BLOCK_LENGTH;
-    if (data_len != metainfo_block_for_piece_length(
+    if (msg->v.piece.begin % BC_BLOCK_LENGTH != 0 ||
+        data_len != metainfo_block_for_piece_length(
                         peer->metainfo, msg->v.piece.index, block_for_piece))
       return (peer_error_t){.kind = PEK_INVALID_PIECE};
 
-    msg->v.piece.data = pg_pool_alloc(&peer->block_pool);
-    for (uint64_t i = 0; i < data_len; i++) {
-      msg->v.piece.data[i] = pg_ring_pop_front(&peer->recv_data);
-    }
     pg_log_debug(peer->logger, "[%s] piece: begin=%u index=%u len=%llu",
                  peer->addr_s, msg->v.piece.begin, msg->v.piece.index,
-                 pg_array_len(msg->v.piece.data));
+                 data_len);
 
     return (peer_error_t){0};
   }
@@ -537,16 +1019,11 @@ peer_message_parse(peer_t *peer, peer_message_t *msg) {
     if (announced_len != 1 + 3 * 4)
       return (peer_error_t){.kind = PEK_INVALID_ANNOUNCED_LENGTH};
 
-    if (pg_ring_len(&peer->recv_data) < announced_len + 4)
-      return (peer_error_t){.kind = PEK_NEED_MORE};
-
-    pg_ring_consume_front(&peer->recv_data,
-                          4 + 1); // consume announced_len + tag
     msg->kind = PMK_CANCEL;
     msg->v.request = (peer_message_request_t){
-        .index = peer_read_u32(&peer->recv_data),
-        .begin = peer_read_u32(&peer->recv_data),
-        .length = peer_read_u32(&peer->recv_data),
+        .index = peer_read_u32(payload),
+        .begin = peer_read_u32(payload + 4),
+        .length = peer_read_u32(payload + 8),
     };
     return (peer_error_t){0};
   }
@@ -587,87 +1064,21 @@ __attribute__((unused)) static const char *peer_message_kind_to_string(int k) {
   }
 }
 
-__attribute__((unused)) static peer_error_t
-download_checksum_piece(pg_logger_t *logger, pg_allocator_t allocator,
-                        download_t *download, bc_metainfo_t *metainfo,
-                        uint32_t piece) {
-  const uint64_t offset = piece * metainfo->piece_length;
-  const uint64_t length = metainfo_piece_length(metainfo, piece);
-
-  if (lseek(download->fd, (off_t)offset, SEEK_SET) == -1) {
-    pg_log_error(logger, "Failed to lseek(2): err=%s", strerror(errno));
-    return (peer_error_t){.kind = PEK_OS};
-  }
-
-  pg_array_t(uint8_t) data = {0};
-  pg_array_init_reserve(data, length, allocator);
-
-  peer_error_t err = {0};
-  // TODO: handle partial reads
-  ssize_t ret = read(download->fd, data, length);
-  if (ret <= 0) {
-    pg_log_error(logger, "Failed to read(2): err=%s", strerror(errno));
-    err = (peer_error_t){.kind = PEK_OS};
-    goto end;
-  }
-  if ((uint64_t)ret != length) {
-    pg_log_error(logger, "Failed to read(2) all: %llu/%llu", (uint64_t)ret,
-                 length);
-    err = (peer_error_t){.kind = PEK_OS};
-    goto end;
-  }
-
-  uint8_t hash[20] = {0};
-  assert(mbedtls_sha1(data, length, hash) == 0);
-
-  assert(piece * 20 + 20 <= metainfo->pieces.len);
-  const uint8_t *const expected = (uint8_t *)metainfo->pieces.data + 20 * piece;
-
-  if (memcmp(hash, expected, sizeof(hash)) != 0) {
-    err = (peer_error_t){.kind = PEK_CHECKSUM_FAILED};
-    goto end;
-  }
-
-end:
-  pg_array_free(data);
-  return err;
-}
-
 __attribute__((unused)) static peer_error_t peer_send_heartbeat(peer_t *peer);
 
-__attribute__((unused)) static peer_error_t
-peer_put_block(peer_t *peer, uint32_t piece, uint32_t block, pg_span_t data) {
+__attribute__((unused)) static void peer_put_block(peer_t *peer, uint32_t piece,
+                                                   uint32_t block_for_piece,
+                                                   uint32_t block,
+                                                   pg_span_t data) {
   assert(piece < peer->metainfo->pieces_count);
   assert(block < peer->metainfo->blocks_count);
 
   pg_log_debug(peer->logger, "[%s] peer_put_block: piece=%u block_for_piece=%u",
-               peer->addr_s, piece, block);
-
-  const uint64_t offset = (uint64_t)block * BC_BLOCK_LENGTH;
-  assert(offset + BC_BLOCK_LENGTH <= peer->metainfo->length);
-
-  if (lseek(peer->download->fd, (off_t)offset, SEEK_SET) == -1) {
-    pg_log_error(peer->logger, "[%s] Failed to lseek(2): err=%s", peer->addr_s,
-                 strerror(errno));
-    return (peer_error_t){.kind = PEK_OS};
-  }
+               peer->addr_s, piece, block_for_piece);
 
-  ssize_t ret = write(peer->download->fd, data.data, data.len);
-  if (ret <= 0) {
-    pg_log_error(peer->logger, "[%s] Failed to write(2): err=%s", peer->addr_s,
-                 strerror(errno));
-    return (peer_error_t){.kind = PEK_OS};
-  }
-  if ((uint64_t)ret != data.len) {
-    // TODO: handle partial writes
-    pg_log_error(peer->logger, "[%s] Failed to write(2) all data: %zd/%llu",
-                 peer->addr_s, ret, data.len);
-    return (peer_error_t){.kind = PEK_OS};
-  }
+  storage_put_block(peer->storage, piece, block_for_piece, data);
 
   picker_mark_block_as_downloaded(peer->picker, block);
-  assert(peer->in_flight_requests > 0);
-  peer->in_flight_requests -= 1;
   peer->download->downloaded_bytes += data.len;
   assert(peer->download->downloaded_bytes <= peer->metainfo->length);
   peer->download->downloaded_blocks_count += 1;
@@ -679,26 +1090,7 @@ peer_put_block(peer_t *peer, uint32_t piece, uint32_t block, pg_span_t data) {
                  "[%s] peer_put_block: have all blocks: piece=%u block=%u",
                  peer->addr_s, piece, block);
 
-    peer_error_t err = download_checksum_piece(
-        peer->logger, peer->allocator, peer->download, peer->metainfo, piece);
-    if (err.kind != PEK_NONE) {
-      pg_log_error(peer->logger,
-                   "[%s] peer_put_block: piece failed checksum: piece=%u "
-                   "block=%u err=%d",
-                   peer->addr_s, piece, block, err.kind);
-      const uint64_t length = metainfo_piece_length(peer->metainfo, piece);
-
-      assert(peer->download->downloaded_bytes >= length);
-      peer->download->downloaded_bytes -= length;
-      const uint64_t blocks_count =
-          metainfo_block_count_for_piece(peer->metainfo, piece);
-      assert(peer->download->downloaded_blocks_count >= blocks_count);
-      peer->download->downloaded_blocks_count -= blocks_count;
-      return err;
-    }
-    peer->download->downloaded_pieces_count += 1;
-    assert(peer->download->downloaded_pieces_count <=
-           peer->metainfo->pieces_count);
+    storage_write_piece(peer->storage, piece);
   }
 
   const uint64_t now = uv_hrtime();
@@ -715,8 +1107,48 @@ peer_put_block(peer_t *peer, uint32_t piece, uint32_t block, pg_span_t data) {
               peer->metainfo->blocks_count,
               (double)peer->download->downloaded_bytes / 1024 / 1024,
               (double)peer->metainfo->length / 1024 / 1024, rate);
+}
 
-  return (peer_error_t){0};
+// Twice the bandwidth-delay product: while the link is not full, the latency
+// stays close to the RTT and the queue doubles every window, like TCP slow
+// start. Once it is full, the rate stops growing and so does the queue.
+__attribute__((unused)) static uint32_t peer_pipeline_target(uint64_t rate,
+                                                             uint64_t rtt_ns) {
+  const double bdp = (double)rate * (double)rtt_ns / 1e9;
+  const double target = ceil(2 * bdp / BC_BLOCK_LENGTH);
+
+  if (target < (double)PEER_MIN_IN_FLIGHT_REQUESTS)
+    return PEER_MIN_IN_FLIGHT_REQUESTS;
+  if (target > (double)PEER_MAX_IN_FLIGHT_REQUESTS)
+    return PEER_MAX_IN_FLIGHT_REQUESTS;
+  return (uint32_t)target;
+}
+
+__attribute__((unused)) static void
+peer_pipeline_on_block(peer_pipeline_t *pipeline, uint64_t now_ns,
+                       uint64_t sent_ns, uint64_t len) {
+  assert(now_ns >= sent_ns);
+
+  const uint64_t latency = now_ns - sent_ns;
+  if (pipeline->min_latency_ns == 0 || latency < pipeline->min_latency_ns)
+    pipeline->min_latency_ns = latency;
+
+  if (pipeline->window_start_ns == 0)
+    pipeline->window_start_ns = sent_ns;
+  pipeline->window_bytes += len;
+
+  const uint64_t elapsed = now_ns - pipeline->window_start_ns;
+  if (elapsed < PEER_RATE_WINDOW_NS || elapsed < pipeline->min_latency_ns)
+    return;
+
+  const uint64_t rate =
+      (uint64_t)((double)pipeline->window_bytes * 1e9 / (double)elapsed);
+  pipeline->rate =
+      pipeline->rate == 0 ? rate : (3 * pipeline->rate + rate) / 4;
+  pipeline->window_start_ns = now_ns;
+  pipeline->window_bytes = 0;
+  pipeline->target =
+      peer_pipeline_target(pipeline->rate, pipeline->min_latency_ns);
 }
 
 __attribute__((unused)) static peer_error_t
@@ -742,17 +1174,22 @@ peer_message_handle(peer_t *peer, peer_message_t *msg, peer_action_t *action) {
     return (peer_error_t){0};
   case PMK_HAVE: {
     const uint32_t have = msg->v.have.have;
-    pg_bitarray_set(&peer->them_have_pieces, have);
+    if (!pg_bitarray_get(&peer->them_have_pieces, have)) {
+      pg_bitarray_set(&peer->them_have_pieces, have);
+      picker_increment_availability(peer->picker, have);
+    }
 
     *action = PEER_ACTION_REQUEST_MORE;
     return (peer_error_t){0};
   }
   case PMK_BITFIELD: {
-    pg_array_t(uint8_t) bitfield = msg->v.bitfield.bitfield;
+    const pg_span_t bitfield = msg->v.bitfield.bitfield;
 
-    // TODO: don't allocate `msg->v.bitfield.bitfield`, simply set
-    // `them_have_pieces` directly
-    pg_bitarray_setv(&peer->them_have_pieces, bitfield, pg_array_len(bitfield));
+    // Replaces what they had: HAVE messages may have come first.
+    picker_remove_peer_pieces(peer->picker, &peer->them_have_pieces);
+    pg_bitarray_setv(&peer->them_have_pieces, (uint8_t *)bitfield.data,
+                     bitfield.len);
+    picker_add_peer_pieces(peer->picker, &peer->them_have_pieces);
 
     *action = PEER_ACTION_REQUEST_MORE;
     return (peer_error_t){0};
@@ -761,11 +1198,6 @@ peer_message_handle(peer_t *peer, peer_message_t *msg, peer_action_t *action) {
     const peer_message_piece_t piece_msg = msg->v.piece;
     const uint32_t piece = piece_msg.index;
 
-    if (peer->in_flight_requests == 0) {
-      pg_log_error(peer->logger, "Received unwanted piece: piece=%u", piece);
-      return (peer_error_t){.kind = PEK_INVALID_PIECE};
-    }
-
     const uint32_t block_for_piece = piece_msg.begin / BC_BLOCK_LENGTH;
     assert(block_for_piece <
            metainfo_block_count_for_piece(peer->metainfo, piece));
@@ -774,18 +1206,32 @@ peer_message_handle(peer_t *peer, peer_message_t *msg, peer_action_t *action) {
         peer->metainfo, piece, block_for_piece);
     assert(block < peer->metainfo->blocks_count);
 
-    const pg_span_t span = (pg_span_t){
-        .data = (char *)piece_msg.data,
-        .len = metainfo_block_for_piece_length(peer->metainfo, piece,
-                                               block_for_piece),
-    };
+    // Blocks mostly come in the order they were requested in.
+    const uint64_t in_flight_len = pg_array_len(peer->in_flight_requests);
+    uint64_t i = 0;
+    while (i < in_flight_len && peer->in_flight_requests[i].block != block)
+      i++;
+    if (i == in_flight_len) {
+      pg_log_error(peer->logger, "Received unwanted piece: piece=%u block=%u",
+                   piece, block);
+      return (peer_error_t){.kind = PEK_INVALID_PIECE};
+    }
+    const peer_request_t request = peer->in_flight_requests[i];
+    memmove(&peer->in_flight_requests[i], &peer->in_flight_requests[i + 1],
+            (in_flight_len - i - 1) * sizeof(peer_request_t));
+    pg_array_pop(peer->in_flight_requests);
+
+    // Copied straight from the receive buffer into the piece buffer.
+    const pg_span_t span = piece_msg.data;
+    peer_pipeline_on_block(&peer->pipeline, uv_hrtime(), request.sent_ns,
+                           span.len);
 
     pg_log_debug(
         peer->logger,
         "[%s] piece: begin=%u piece=%u len=%llu block_for_piece=%u block=%u",
-        peer->addr_s, piece_msg.begin, piece, pg_array_len(piece_msg.data),
-        block_for_piece, block);
-    peer_put_block(peer, piece, block, span);
+        peer->addr_s, piece_msg.begin, piece, span.len, block_for_piece,
+        block);
+    peer_put_block(peer, piece, block_for_piece, block, span);
 
     *action = PEER_ACTION_REQUEST_MORE;
     return (peer_error_t){0};
@@ -804,36 +1250,58 @@ __attribute__((unused)) static peer_error_t peer_send_request(peer_t *peer,
 
 __attribute__((unused)) static peer_error_t
 peer_request_more_blocks(peer_t *peer, peer_action_t *action) {
-  if (peer->in_flight_requests >= PEER_MAX_IN_FLIGHT_REQUESTS ||
+  if (pg_array_len(peer->in_flight_requests) >= peer->pipeline.target ||
       peer->them_choked) {
     pg_log_debug(peer->logger,
-                 "[%s] request_more_blocks stop: in_flight_requests=%hhu "
-                 "them_choked=%d",
-                 peer->addr_s, peer->in_flight_requests, peer->them_choked);
+                 "[%s] request_more_blocks stop: in_flight_requests=%llu "
+                 "target=%u them_choked=%d",
+                 peer->addr_s, pg_array_len(peer->in_flight_requests),
+                 peer->pipeline.target, peer->them_choked);
 
     *action = PEER_ACTION_STOP_REQUESTING;
     return (peer_error_t){0};
   }
 
-  while (peer->in_flight_requests < PEER_MAX_IN_FLIGHT_REQUESTS) {
+  while (pg_array_len(peer->in_flight_requests) < peer->pipeline.target) {
     bool found = false;
-    const uint32_t block =
-        picker_pick_block(peer->picker, &peer->them_have_pieces, &found);
+    uint32_t block = 0;
+    if (peer->picking_piece < peer->metainfo->pieces_count &&
+        picker_pick_block_in_piece(peer->picker, peer->picking_piece, &block))
+      found = true;
+    else
+      block = picker_pick_block(peer->picker, &peer->them_have_pieces, &found);
 
     // Nothing to download anymore
     if (!found) {
       pg_log_debug(peer->logger,
                    "[%s] request_more_blocks no more pieces to download: "
-                   "in_flight_requests=%hhu "
+                   "in_flight_requests=%llu "
                    "them_choked=%d",
-                   peer->addr_s, peer->in_flight_requests, peer->them_choked);
+                   peer->addr_s, pg_array_len(peer->in_flight_requests),
+                   peer->them_choked);
+      *action = PEER_ACTION_STOP_REQUESTING;
+      return (peer_error_t){0};
+    }
+
+    // Too much is waiting to be written to start another piece.
+    if (!storage_start_piece(peer->storage,
+                             block / peer->metainfo->blocks_per_piece) &&
+        !storage_pick_block_in_started_piece(
+            peer->storage, &peer->them_have_pieces, &block)) {
+      pg_log_debug(peer->logger,
+                   "[%s] request_more_blocks stalled: dirty_bytes=%llu",
+                   peer->addr_s, peer->storage->dirty_bytes);
+      storage_stall_peer(peer->storage, peer);
       *action = PEER_ACTION_STOP_REQUESTING;
       return (peer_error_t){0};
     }
 
     picker_mark_block_as_downloading(peer->picker, block);
-    assert(peer->in_flight_requests <= PEER_MAX_IN_FLIGHT_REQUESTS);
-    peer->in_flight_requests += 1;
+    peer->picking_piece = block / peer->metainfo->blocks_per_piece;
+    assert(pg_array_len(peer->in_flight_requests) <
+           PEER_MAX_IN_FLIGHT_REQUESTS);
+    const peer_request_t request = {.block = block, .sent_ns = uv_hrtime()};
+    pg_array_append(peer->in_flight_requests, request);
 
     peer_error_t err = peer_send_request(peer, block);
     if (err.kind != PEK_NONE)
@@ -867,13 +1335,11 @@ peer_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
 
   if (nread > 0) {
     assert(buf != NULL);
-    assert(buf->base != NULL);
-    assert(buf->len > 0);
+    assert(buf->base == pg_ring_write_span(&peer->recv_data).data);
+    assert((uint64_t)nread <= buf->len);
 
-    pg_ring_push_backv(&peer->recv_data, (uint8_t *)buf->base, (uint64_t)nread);
+    pg_ring_commit_write(&peer->recv_data, (uint64_t)nread);
   }
-  if (buf != NULL && buf->base != NULL)
-    pg_pool_free(&peer->read_buf_pool, buf->base);
 
   if (nread <= 0) {
     pg_log_error(peer->logger, "[%s] peer_on_read failed: %s", peer->addr_s,
@@ -885,7 +1351,8 @@ peer_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
   bool idle_started = false;
   while (true) { // Parse as many messages as available in the recv_data
     peer_message_t msg = {0};
-    peer_error_t err = peer_message_parse(peer, &msg);
+    uint64_t msg_len = 0;
+    peer_error_t err = peer_message_parse(peer, &msg, &msg_len);
     if (err.kind == PEK_NEED_MORE)
       break;
     if (err.kind != PEK_NONE) {
@@ -901,12 +1368,13 @@ peer_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
 
     peer_action_t action = PEER_ACTION_NONE;
     err = peer_message_handle(peer, &msg, &action);
-    peer_message_destroy(peer, &msg);
+    pg_ring_consume_front(&peer->recv_data, msg_len);
 
     if (err.kind != PEK_NONE) {
       pg_log_error(peer->logger, "[%s] peer_message_handle failed: %d\n",
                    peer->addr_s, err.kind);
       peer_close(peer);
+      return;
     }
 
     if (action == PEER_ACTION_REQUEST_MORE && !idle_started) {
@@ -924,7 +1392,7 @@ __attribute__((unused)) static void peer_on_write(uv_write_t *req, int status) {
   pg_log_debug(peer->logger, "[%s] peer_on_write status=%d", peer->addr_s,
                status);
 
-  peer->allocator.free(ctx->data);
+  pg_free(peer->allocator, ctx->data);
   pg_pool_free(&peer->write_ctx_pool, ctx);
 
   if (status != 0) {
@@ -948,7 +1416,7 @@ __attribute__((unused)) static peer_error_t peer_send_buf(peer_t *peer,
     pg_log_error(peer->logger, "[%s] uv_write failed: %d", peer->addr_s, ret);
 
     pg_pool_free(&peer->write_ctx_pool, ctx);
-    peer->allocator.free(buf.base);
+    pg_free(peer->allocator, buf.base);
 
     return (peer_error_t){.kind = PEK_UV};
   }
@@ -957,14 +1425,14 @@ __attribute__((unused)) static peer_error_t peer_send_buf(peer_t *peer,
 }
 
 __attribute__((unused)) static peer_error_t peer_send_heartbeat(peer_t *peer) {
-  uv_buf_t buf = uv_buf_init(peer->allocator.realloc(NULL, sizeof(uint32_t), 0),
+  uv_buf_t buf = uv_buf_init(pg_alloc(peer->allocator, sizeof(uint32_t)),
                              sizeof(uint32_t));
   return peer_send_buf(peer, buf);
 }
 
 __attribute__((unused)) static peer_error_t peer_send_handshake(peer_t *peer) {
   uv_buf_t buf =
-      uv_buf_init(peer->allocator.realloc(NULL, PEER_HANDSHAKE_LENGTH, 0),
+      uv_buf_init(pg_alloc(peer->allocator, PEER_HANDSHAKE_LENGTH),
                   PEER_HANDSHAKE_LENGTH);
 
   static const uint8_t handshake_header[] = {
@@ -1032,7 +1500,7 @@ __attribute__((unused)) static peer_error_t peer_send_request(peer_t *peer,
       metainfo_block_for_piece_length(peer->metainfo, piece, block_for_piece);
 
   uv_buf_t buf =
-      uv_buf_init(peer->allocator.realloc(NULL, 4 + 1 + 3 * 4, 0), 0);
+      uv_buf_init(pg_alloc(peer->allocator, 4 + 1 + 3 * 4), 0);
 
   uint8_t *bytes = (uint8_t *)buf.base;
   bytes = peer_write_u32(bytes, (uint64_t *)&buf.len, 1 + 3 * 4);
@@ -1044,8 +1512,9 @@ __attribute__((unused)) static peer_error_t peer_send_request(peer_t *peer,
 
   pg_log_debug(
       peer->logger,
-      "[%s] Sent Request: index=%u begin=%u length=%u in_flight_requests=%u",
-      peer->addr_s, piece, begin, length, peer->in_flight_requests);
+      "[%s] Sent Request: index=%u begin=%u length=%u in_flight_requests=%llu",
+      peer->addr_s, piece, begin, length,
+      pg_array_len(peer->in_flight_requests));
 
   if (peer->download->start_ts == 0ULL)
     peer->download->start_ts = uv_hrtime();
@@ -1053,7 +1522,7 @@ __attribute__((unused)) static peer_error_t peer_send_request(peer_t *peer,
 }
 
 __attribute__((unused)) static peer_error_t peer_send_choke(peer_t *peer) {
-  uv_buf_t buf = uv_buf_init(peer->allocator.realloc(NULL, 4 + 1, 0), 0);
+  uv_buf_t buf = uv_buf_init(pg_alloc(peer->allocator, 4 + 1), 0);
 
   uint8_t *bytes = (uint8_t *)buf.base;
   bytes = peer_write_u32(bytes, (uint64_t *)&buf.len, 1);
@@ -1063,7 +1532,7 @@ __attribute__((unused)) static peer_error_t peer_send_choke(peer_t *peer) {
 }
 
 __attribute__((unused)) static peer_error_t peer_send_interested(peer_t *peer) {
-  uv_buf_t buf = uv_buf_init(peer->allocator.realloc(NULL, 4 + 1, 0), 0);
+  uv_buf_t buf = uv_buf_init(pg_alloc(peer->allocator, 4 + 1), 0);
 
   uint8_t *bytes = (uint8_t *)buf.base;
   bytes = peer_write_u32(bytes, (uint64_t *)&buf.len, 1);
@@ -1121,23 +1590,32 @@ __attribute__((unused)) static void peer_on_connect(uv_connect_t *handle,
 __attribute__((unused)) static void
 peer_init(peer_t *peer, pg_logger_t *logger, pg_pool_t *peer_pool,
           download_t *download, bc_metainfo_t *metainfo, picker_t *picker,
-          tracker_peer_address_ipv4_t address) {
-  peer->allocator = pg_heap_allocator(); // FIXME
+          storage_t *storage, tracker_peer_address_ipv4_t address) {
+  snprintf(peer->addr_s, sizeof(peer->addr_s), "%s:%hu",
+           inet_ntoa(*(struct in_addr *)&address.ip), htons(address.port));
+
+  // Holds the biggest message we accept, plus room for libuv to read in big
+  // chunks.
+  const uint64_t recv_cap = 4 + peer_max_message_length(metainfo) + 64 * 1024;
+
+  // The biggest allocation is the receive buffer when it cannot be mirrored,
+  // the rest is the bitfield and the requests. Pieces are buffered by the
+  // storage.
+  pg_alloc_stats_init(&peer->memory_stats, peer->addr_s, pg_heap_allocator(),
+                      recv_cap + 64 * 1024ULL);
+  peer->allocator = pg_alloc_stats_allocator(&peer->memory_stats);
   peer->picker = picker;
+  peer->storage = storage;
 
-  pg_pool_init(
+  pg_pool_init_flags(
       &peer->write_ctx_pool, sizeof(peer_write_ctx_t),
-      (PEER_MAX_IN_FLIGHT_REQUESTS +
-       /* arbitrary, account for handshake, heartbeats and so on */ 20));
-
-  pg_pool_init(
-      &peer->read_buf_pool,
-      /* real stats suggest most buffers should be 8KiB-16KiB in size */ 17000,
-      30);
+      (PEER_MIN_IN_FLIGHT_REQUESTS +
+       /* arbitrary, account for handshake, heartbeats and so on */ 20),
+      PG_POOL_FLAGS_GROW);
 
-  pg_pool_init(&peer->block_pool, BC_BLOCK_LENGTH,
-               PEER_MAX_IN_FLIGHT_REQUESTS); // TODO: increase when starting to
-                                             // handle Request msg
+  pg_array_init_reserve(peer->in_flight_requests, PEER_MIN_IN_FLIGHT_REQUESTS,
+                        peer->allocator);
+  peer->pipeline = (peer_pipeline_t){.target = PEER_MIN_IN_FLIGHT_REQUESTS};
 
   peer->peer_pool = peer_pool;
   peer->logger = logger;
@@ -1145,14 +1623,11 @@ peer_init(peer_t *peer, pg_logger_t *logger, pg_pool_t *peer_pool,
   peer->metainfo = metainfo;
   pg_bitarray_init(peer->allocator, &peer->them_have_pieces,
                    metainfo->pieces_count - 1);
+  peer->picking_piece = UINT32_MAX;
   peer->connect_req.data = peer;
   peer->connection.data = peer;
   peer->idle_handle.data = peer;
-  pg_ring_init(peer->allocator, &peer->recv_data,
-               /* hold 2 uv_bufs at most at once */ 2 * 17000);
-
-  snprintf(peer->addr_s, sizeof(peer->addr_s), "%s:%hu",
-           inet_ntoa(*(struct in_addr *)&address.ip), htons(address.port));
+  pg_ring_init_mirrored(peer->allocator, &peer->recv_data, recv_cap);
 
   peer->them_choked = true;
   peer->them_interested = false;
@@ -1187,10 +1662,20 @@ peer_connect(peer_t *peer, tracker_peer_address_ipv4_t address) {
 __attribute__((unused)) static void peer_destroy(peer_t *peer) {
   pg_bitarray_destroy(&peer->them_have_pieces);
   pg_ring_destroy(&peer->recv_data);
+  pg_array_free(peer->in_flight_requests);
 
   pg_pool_destroy(&peer->write_ctx_pool);
-  pg_pool_destroy(&peer->read_buf_pool);
-  pg_pool_destroy(&peer->block_pool);
+
+  const pg_alloc_stats_t *const stats = &peer->memory_stats;
+  pg_log_debug(peer->logger,
+               "[%s] Memory: allocs=%llu frees=%llu live=%llu peak=%llu "
+               "budget=%llu",
+               peer->addr_s, stats->allocs_count, stats->frees_count,
+               stats->live_bytes, stats->peak_bytes, stats->budget_bytes);
+  if (pg_alloc_stats_over_budget(stats))
+    pg_log_error(peer->logger, "[%s] Memory over budget: peak=%llu budget=%llu",
+                 peer->addr_s, stats->peak_bytes, stats->budget_bytes);
+  pg_alloc_stats_destroy(&peer->memory_stats);
 
   pg_pool_free(peer->peer_pool, peer);
 }
@@ -1201,7 +1686,14 @@ __attribute__((unused)) static void peer_on_close(uv_handle_t *handle) {
 
   pg_log_debug(peer->logger, "[%s] Closing peer", peer->addr_s);
 
-  // FIXME: mark piece as to download
+  // Let other peers download what was requested from this one.
+  for (uint64_t i = 0; i < pg_array_len(peer->in_flight_requests); i++)
+    picker_mark_block_as_to_download(peer->picker,
+                                     peer->in_flight_requests[i].block);
+  picker_remove_peer_pieces(peer->picker, &peer->them_have_pieces);
+  storage_remove_stalled_peer(peer->storage, peer);
+  // Stalled peers may be able to pick up these blocks.
+  storage_wake_stalled_peers(peer->storage);
 
   uv_idle_stop(&peer->idle_handle);
 
@@ -1225,38 +1717,59 @@ __attribute__((unused)) static void download_init(download_t *download,
   memcpy(download->info_hash, info_hash, 20);
 }
 
+typedef struct {
+  const bc_metainfo_t *metainfo;
+  pg_span_t file;
+  uint8_t *valid; // One per piece.
+} picker_checksum_ctx_t;
+
+__attribute__((unused)) static void
+picker_checksum_pieces(void *ctx, uint64_t begin, uint64_t end) {
+  picker_checksum_ctx_t *const c = ctx;
+  const bc_metainfo_t *const metainfo = c->metainfo;
+
+  for (uint32_t piece = (uint32_t)begin; piece < end; piece++) {
+    const uint64_t length = metainfo_piece_length(metainfo, piece);
+    const uint64_t offset = piece * metainfo->piece_length;
+    assert(offset + length <= c->file.len);
+
+    uint8_t hash[20] = {0};
+    assert(mbedtls_sha1((uint8_t *)c->file.data + offset, length, hash) == 0);
+
+    assert(piece * 20 + 20 <= metainfo->pieces.len);
+    const uint8_t *const expected =
+        (uint8_t *)metainfo->pieces.data + 20 * piece;
+    c->valid[piece] = memcmp(hash, expected, sizeof(hash)) == 0;
+  }
+}
+
+// Pieces are hashed in parallel, the bookkeeping is done after.
 __attribute__((unused)) static peer_error_t
-picker_checksum_all(pg_allocator_t allocator, pg_logger_t *logger,
+picker_checksum_all(pg_logger_t *logger, pg_executor_t *executor,
                     picker_t *picker, bc_metainfo_t *metainfo,
                     download_t *download) {
   pg_log_debug(logger, "Checksumming file");
 
   peer_error_t err = {0};
-  pg_array_t(uint8_t) file_data = {0};
-  pg_array_init_reserve(file_data, 0, allocator);
-
-  if (pg_array_read_file_fd(download->fd, &file_data)) {
+  pg_mapped_file_t file = {0};
+  if (!pg_mmap_file_fd(download->fd, PG_MMAP_FLAGS_SEQUENTIAL, &file)) {
+    pg_log_error(logger, "Failed to read file: err=%s", strerror(errno));
     err = (peer_error_t){.kind = PEK_OS};
     goto end;
   }
 
+  picker_checksum_ctx_t ctx = {
+      .metainfo = metainfo,
+      .file = file.span,
+      .valid = pg_alloc(pg_heap_allocator(), metainfo->pieces_count),
+  };
+  pg_executor_parallel_for(executor, 0, metainfo->pieces_count, 1,
+                           picker_checksum_pieces, &ctx);
+
   for (uint32_t piece = 0; piece < metainfo->pieces_count; piece++) {
     const uint64_t length = metainfo_piece_length(metainfo, piece);
 
-    const uint64_t offset = piece * metainfo->piece_length;
-    uint8_t hash[20] = {0};
-    pg_log_debug(logger,
-                 "%s: checksumming: piece=%u length=%llu "
-                 "offset=%llu file_length=%llu",
-                 __func__, piece, length, offset, pg_array_len(file_data));
-    assert(offset + length <= pg_array_len(file_data));
-    assert(mbedtls_sha1(file_data + offset, length, hash) == 0);
-
-    assert(piece * 20 + 20 <= metainfo->pieces.len);
-    const uint8_t *const expected =
-        (uint8_t *)metainfo->pieces.data + 20 * piece;
-
-    if (memcmp(hash, expected, sizeof(hash)) != 0) {
+    if (!ctx.valid[piece]) {
       pg_log_error(logger,
                    "download_checksum_all: piece failed checksum: piece=%u "
                    " err=%d",
@@ -1266,7 +1779,7 @@ picker_checksum_all(pg_allocator_t allocator, pg_logger_t *logger,
                    "download_checksum_all: piece passed checksum: piece=%u ",
                    piece);
 
-      picker_mark_piece_as_to_download(picker, piece);
+      picker_mark_piece_as_downloaded(picker, piece);
 
       assert(download->downloaded_pieces_count < metainfo->pieces_count);
       download->downloaded_pieces_count += 1;
@@ -1279,11 +1792,12 @@ picker_checksum_all(pg_allocator_t allocator, pg_logger_t *logger,
           metainfo_block_count_for_piece(metainfo, piece);
     }
   }
+  pg_free(pg_heap_allocator(), ctx.valid);
 
   pg_log_info(logger, "%s: have %u/%u pieces", __func__,
               download->downloaded_pieces_count, metainfo->pieces_count);
 
 end:
-  pg_array_free(file_data);
+  pg_munmap_file(&file);
   return err;
 }
@@ -1,3 +1,5 @@
+#include "../pg/pg.h"
+
 #include <unistd.h>
 
 #include "../vendor/greatest/greatest.h"
@@ -40,15 +42,46 @@ static const uint8_t handshake_header[] = {
 
 static pg_logger_t logger = {.level = PG_LOG_FATAL};
 
+static void test_receive_piece(peer_t *peer, uint32_t piece, uint32_t begin,
+                               char c, uint32_t len) {
+  const uint32_t msg_len = 1 + 8 + len;
+  const uint8_t header[] = {
+      (uint8_t)(msg_len >> 24), (uint8_t)(msg_len >> 16),
+      (uint8_t)(msg_len >> 8),  (uint8_t)msg_len,
+      PT_PIECE,                 (uint8_t)(piece >> 24),
+      (uint8_t)(piece >> 16),   (uint8_t)(piece >> 8),
+      (uint8_t)piece,           (uint8_t)(begin >> 24),
+      (uint8_t)(begin >> 16),   (uint8_t)(begin >> 8),
+      (uint8_t)begin,
+  };
+  uv_buf_t buf = {0};
+  peer_alloc((uv_handle_t *)&peer->connection, 1024, &buf);
+  assert(buf.len >= sizeof(header) + len);
+  memcpy(buf.base, header, sizeof(header));
+  memset(buf.base + sizeof(header), c, len);
+
+  uv_stream_t stream = {.data = peer};
+  peer_on_read(&stream, (ssize_t)(sizeof(header) + len), &buf);
+}
+
 TEST test_on_read(void) {
   pg_pool_t peer_pool = {0};
   pg_pool_init(&peer_pool, sizeof(peer_t), 1);
 
+  // Piece 0 is 'y' then 'x', piece 1 fails the checksum.
+  uint8_t pieces[40] = {0};
+  {
+    uint8_t piece_data[2 * BC_BLOCK_LENGTH] = {0};
+    memset(piece_data, 'y', BC_BLOCK_LENGTH);
+    memset(piece_data + BC_BLOCK_LENGTH, 'x', BC_BLOCK_LENGTH);
+    assert(mbedtls_sha1(piece_data, sizeof(piece_data), pieces) == 0);
+  }
+
   bc_metainfo_t metainfo = {
       .announce = pg_span_make_c("http://localhost"),
       .length = 3 * BC_BLOCK_LENGTH + 1,
       .piece_length = 2 * BC_BLOCK_LENGTH,
-      .pieces = pg_span_make_c("0000000000000000000000000000000000000000"),
+      .pieces = {.data = (char *)pieces, .len = sizeof(pieces)},
       .name = pg_span_make_c("foo"),
       .blocks_count = 4,
       .last_piece_length = BC_BLOCK_LENGTH + 1,
@@ -65,9 +98,15 @@ TEST test_on_read(void) {
   picker_t picker = {0};
   picker_init(pg_heap_allocator(), &logger, &picker, &metainfo);
 
+  storage_t storage = {0};
+  storage_init(&storage, pg_heap_allocator(), &logger, &metainfo, &picker,
+               &download, STORAGE_MAX_DIRTY_BYTES);
+
   peer_t *peer = pg_pool_alloc(&peer_pool);
   assert(peer != NULL);
-  peer_init(peer, &logger, &peer_pool, &download, &metainfo, &picker, addr);
+  peer_init(peer, &logger, &peer_pool, &download, &metainfo, &picker,
+            &storage, addr);
+  uv_idle_init(uv_default_loop(), &peer->idle_handle);
 
   {
     uv_buf_t buf1 = {0};
@@ -97,7 +136,7 @@ TEST test_on_read(void) {
     buf1.base[0] = 0;
     buf1.base[1] = 0;
     buf1.base[2] = 0;
-    buf1.base[3] = 5;
+    buf1.base[3] = 1;
     buf1.base[4] = PT_CHOKE;
 
     uv_stream_t stream = {.data = peer};
@@ -118,7 +157,7 @@ TEST test_on_read(void) {
     uv_buf_t buf2 = {0};
     peer_alloc((uv_handle_t *)&peer->connection, 1, &buf2);
     ASSERT(buf2.base != NULL);
-    buf2.base[0] = 5;
+    buf2.base[0] = 1;
     buf2.len = 1;
     peer_on_read(&stream, 1, &buf2);
 
@@ -131,6 +170,101 @@ TEST test_on_read(void) {
 
     ASSERT_EQ(true, peer->them_interested);
   }
+  {
+    uv_buf_t buf = {0};
+    peer_alloc((uv_handle_t *)&peer->connection, 6, &buf);
+    ASSERT(buf.base != NULL);
+    const uint8_t bitfield[] = {0, 0, 0, 2, PT_BITFIELD, 0x80};
+    memcpy(buf.base, bitfield, sizeof(bitfield));
+
+    uv_stream_t stream = {.data = peer};
+    peer_on_read(&stream, sizeof(bitfield), &buf);
+
+    ASSERT_EQ(true, pg_bitarray_get(&peer->them_have_pieces, 0));
+    ASSERT_EQ(false, pg_bitarray_get(&peer->them_have_pieces, 1));
+  }
+  FILE *file = tmpfile();
+  ASSERT(file != NULL);
+  download.fd = fileno(file);
+
+  // The block is copied from the receive buffer, which arrives in two reads.
+  {
+    const peer_request_t request = {.block = 1};
+    pg_array_append(peer->in_flight_requests, request);
+    picker_mark_block_as_downloading(&picker, 1);
+    ASSERT(storage_start_piece(&storage, 0));
+
+    const uint8_t header[] = {
+        0, 0, 0x40, 9, PT_PIECE, /* index */ 0, 0, 0, 0,
+        /* begin */ 0, 0, 0x40, 0,
+    };
+    uv_buf_t buf = {0};
+    peer_alloc((uv_handle_t *)&peer->connection, 1024, &buf);
+    memcpy(buf.base, header, 7);
+    uv_stream_t stream = {.data = peer};
+    peer_on_read(&stream, 7, &buf);
+    ASSERT_EQ_FMT(1ULL, pg_array_len(peer->in_flight_requests), "%llu");
+
+    peer_alloc((uv_handle_t *)&peer->connection, 1024, &buf);
+    ASSERT(buf.len >= sizeof(header) - 7 + BC_BLOCK_LENGTH);
+    memcpy(buf.base, header + 7, sizeof(header) - 7);
+    memset(buf.base + sizeof(header) - 7, 'x', BC_BLOCK_LENGTH);
+    peer_on_read(&stream, sizeof(header) - 7 + BC_BLOCK_LENGTH, &buf);
+
+    ASSERT_EQ_FMT(0ULL, pg_array_len(peer->in_flight_requests), "%llu");
+    ASSERT_EQ_FMT(0ULL, pg_ring_len(&peer->recv_data), "%llu");
+    ASSERT_EQ_FMT(1U, download.downloaded_blocks_count, "%u");
+    ASSERT_EQ('x', storage.buffers[0][BC_BLOCK_LENGTH]);
+  }
+  // The piece is written once complete and valid.
+  {
+    const peer_request_t request = {.block = 0};
+    pg_array_append(peer->in_flight_requests, request);
+    picker_mark_block_as_downloading(&picker, 0);
+
+    test_receive_piece(peer, 0, 0, 'y', BC_BLOCK_LENGTH);
+    ASSERT_EQ_FMT(2U, download.downloaded_blocks_count, "%u");
+    ASSERT_EQ_FMT(0U, download.downloaded_pieces_count, "%u");
+
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ_FMT(1U, download.downloaded_pieces_count, "%u");
+    ASSERT_EQ_FMT(0ULL, storage.dirty_bytes, "%llu");
+    ASSERT_EQ(NULL, storage.buffers[0]);
+
+    char on_disk[2 * BC_BLOCK_LENGTH] = {0};
+    ASSERT_EQ((ssize_t)sizeof(on_disk),
+              pread(download.fd, on_disk, sizeof(on_disk), 0));
+    ASSERT_EQ('y', on_disk[0]);
+    ASSERT_EQ('y', on_disk[BC_BLOCK_LENGTH - 1]);
+    ASSERT_EQ('x', on_disk[BC_BLOCK_LENGTH]);
+    ASSERT_EQ('x', on_disk[2 * BC_BLOCK_LENGTH - 1]);
+  }
+  // A piece failing the checksum is not written and is downloaded again.
+  {
+    pg_bitarray_set(&peer->them_have_pieces, 1);
+    for (uint32_t block = 2; block < 4; block++) {
+      const peer_request_t request = {.block = block};
+      pg_array_append(peer->in_flight_requests, request);
+      picker_mark_block_as_downloading(&picker, block);
+    }
+    ASSERT(storage_start_piece(&storage, 1));
+
+    test_receive_piece(peer, 1, 0, 'z', BC_BLOCK_LENGTH);
+    test_receive_piece(peer, 1, BC_BLOCK_LENGTH, 'z', 1);
+    ASSERT_EQ_FMT(4U, download.downloaded_blocks_count, "%u");
+
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ_FMT(1U, download.downloaded_pieces_count, "%u");
+    ASSERT_EQ_FMT(2U, download.downloaded_blocks_count, "%u");
+    ASSERT_EQ_FMT(0ULL, storage.dirty_bytes, "%llu");
+    ASSERT_EQ_FMT((uint8_t)PPS_TO_DOWNLOAD, picker.piece_states[1].state,
+                  "%u");
+
+    char on_disk = 0;
+    ASSERT_EQ(0, pread(download.fd, &on_disk, 1, 2 * BC_BLOCK_LENGTH));
+  }
+  fclose(file);
+  storage_destroy(&storage);
 
   PASS();
 }
@@ -165,42 +299,259 @@ TEST test_picker(void) {
   {
     bool found = false;
     pg_bitarray_set(&them_have_pieces, 1);
+    picker_add_peer_pieces(&picker, &them_have_pieces);
     ASSERT_EQ_FMT(2U, picker_pick_block(&picker, &them_have_pieces, &found),
                   "%u");
     ASSERT_EQ(true, found);
   }
-  // `them_have_pieces` is only 1s and all blocks are already downloaded
+  // Rarest first: piece 1 is had by two peers, piece 0 by one.
   {
+    pg_bitarray_t other_have_pieces = {0};
+    pg_bitarray_init(pg_heap_allocator(), &other_have_pieces,
+                     pieces_count - 1);
+    pg_bitarray_set_all(&other_have_pieces);
+    picker_add_peer_pieces(&picker, &other_have_pieces);
+    ASSERT_EQ_FMT(1U, picker.availability[0], "%u");
+    ASSERT_EQ_FMT(2U, picker.availability[1], "%u");
+
+    for (int i = 0; i < 16; i++) {
+      bool found = false;
+      ASSERT_EQ_FMT(0U, picker_pick_block(&picker, &other_have_pieces, &found),
+                    "%u");
+      ASSERT_EQ(true, found);
+    }
+
+    // Both at availability 1: either can be picked.
+    picker_remove_peer_pieces(&picker, &them_have_pieces);
+    bool picked[2] = {0};
+    for (int i = 0; i < 64; i++) {
+      bool found = false;
+      const uint32_t block =
+          picker_pick_block(&picker, &other_have_pieces, &found);
+      ASSERT_EQ(true, found);
+      picked[block / metainfo.blocks_per_piece] = true;
+    }
+    ASSERT_EQ(true, picked[0]);
+    ASSERT_EQ(true, picked[1]);
+
+    // A downloaded piece is not picked anymore.
+    picker_mark_piece_as_downloaded(&picker, 0);
+    ASSERT_EQ(true, picker_have_all_blocks_for_piece(&picker, 0));
+    for (int i = 0; i < 16; i++) {
+      bool found = false;
+      ASSERT_EQ_FMT(2U, picker_pick_block(&picker, &other_have_pieces, &found),
+                    "%u");
+      ASSERT_EQ(true, found);
+    }
+
+    // Until it fails its checksum.
+    picker_reset_piece(&picker, 0);
+    ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 0));
+    picked[0] = picked[1] = false;
+    for (int i = 0; i < 64; i++) {
+      bool found = false;
+      const uint32_t block =
+          picker_pick_block(&picker, &other_have_pieces, &found);
+      ASSERT_EQ(true, found);
+      picked[block / metainfo.blocks_per_piece] = true;
+    }
+    ASSERT_EQ(true, picked[0]);
+    ASSERT_EQ(true, picked[1]);
+
+    picker_remove_peer_pieces(&picker, &other_have_pieces);
+    picker_add_peer_pieces(&picker, &them_have_pieces);
+    pg_bitarray_destroy(&other_have_pieces);
+  }
+  // All blocks are already requested.
+  {
+    for (uint32_t block = 0; block < metainfo.blocks_count; block++)
+      picker_mark_block_as_downloading(&picker, block);
+    ASSERT_EQ_FMT(2U, (uint32_t)picker.piece_states[1].in_flight, "%u");
+
     bool found = false;
-    pg_bitarray_unset_all(&picker.blocks_to_download);
     ASSERT_EQ_FMT(0U, picker_pick_block(&picker, &them_have_pieces, &found),
                   "%u");
     ASSERT_EQ(false, found);
   }
 
   {
-    pg_bitarray_unset_all(&picker.blocks_downloaded);
     ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 0));
     ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 1));
 
-    pg_bitarray_set(&picker.blocks_downloaded, 1);
+    picker_mark_block_as_downloaded(&picker, 1);
     ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 0));
     ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 1));
 
-    pg_bitarray_set(&picker.blocks_downloaded, 2);
+    // Received twice.
+    picker_mark_block_as_downloaded(&picker, 1);
+    ASSERT_EQ_FMT(1U, (uint32_t)picker.piece_states[0].remaining, "%u");
+
+    picker_mark_block_as_downloaded(&picker, 2);
     ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 0));
     ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 1));
 
-    pg_bitarray_set(&picker.blocks_downloaded, 3);
+    picker_mark_block_as_downloaded(&picker, 3);
     ASSERT_EQ(false, picker_have_all_blocks_for_piece(&picker, 0));
     ASSERT_EQ(true, picker_have_all_blocks_for_piece(&picker, 1));
 
-    pg_bitarray_set(&picker.blocks_downloaded, 0);
+    picker_mark_block_as_downloaded(&picker, 0);
     ASSERT_EQ(true, picker_have_all_blocks_for_piece(&picker, 0));
     ASSERT_EQ(true, picker_have_all_blocks_for_piece(&picker, 1));
   }
 
+  // A block left to download in the middle of a piece.
+  {
+    picker_reset_piece(&picker, 1);
+    picker_mark_block_as_downloading(&picker, 2);
+    uint32_t block = 0;
+    ASSERT_EQ(true, picker_pick_block_in_piece(&picker, 1, &block));
+    ASSERT_EQ_FMT(3U, block, "%u");
+
+    picker_mark_block_as_downloading(&picker, 3);
+    ASSERT_EQ(false, picker_pick_block_in_piece(&picker, 1, &block));
+  }
+
+  picker_destroy(&picker);
+
+  PASS();
+}
+
+TEST test_peer_pipeline(void) {
+  ASSERT_EQ_FMT((uint32_t)PEER_MIN_IN_FLIGHT_REQUESTS,
+                peer_pipeline_target(0, 0), "%u");
+  // 10 MiB/s with a 100ms RTT: 1 MiB in flight, twice that in requests.
+  ASSERT_EQ_FMT(128U, peer_pipeline_target(10 * 1024 * 1024, 100 * 1000 * 1000),
+                "%u");
+  ASSERT_EQ_FMT((uint32_t)PEER_MAX_IN_FLIGHT_REQUESTS,
+                peer_pipeline_target(1000 * 1000 * 1000, 1000 * 1000 * 1000),
+                "%u");
+
+  // A peer with a 50ms RTT sending a whole queue per round-trip, as long as it
+  // stays under 4 MiB/s: the queue grows until the link is full.
+  const uint64_t rtt = 50 * 1000 * 1000;
+  const uint64_t link_rate = 4 * 1024 * 1024;
+  peer_pipeline_t pipeline = {.target = PEER_MIN_IN_FLIGHT_REQUESTS};
+  uint64_t now = 1;
+  for (int round = 0; round < 64; round++) {
+    const uint64_t bytes = (uint64_t)pipeline.target * BC_BLOCK_LENGTH;
+    const uint64_t transfer = bytes * 1000 * 1000 * 1000 / link_rate;
+    const uint64_t sent = now;
+    now += transfer > rtt ? transfer : rtt;
+    for (uint32_t i = 0; i < pipeline.target; i++)
+      peer_pipeline_on_block(&pipeline, now, sent, BC_BLOCK_LENGTH);
+  }
+  ASSERT_EQ_FMT(rtt, pipeline.min_latency_ns, "%llu");
+  ASSERT(pipeline.rate > link_rate * 9 / 10);
+  ASSERT(pipeline.rate <= link_rate);
+  // Around twice the bandwidth-delay product: 2 * 4 MiB/s * 50ms / 16 KiB.
+  ASSERT(pipeline.target >= 24);
+  ASSERT(pipeline.target <= 26);
+
+  PASS();
+}
+
+// With room for a single piece, peers only get blocks of that piece and
+// stall once none are left.
+TEST test_storage_backpressure(void) {
+  pg_pool_t peer_pool = {0};
+  pg_pool_init(&peer_pool, sizeof(peer_t), 2);
+
+  uint8_t pieces[4 * 20] = {0};
+  {
+    uint8_t piece_data[2 * BC_BLOCK_LENGTH] = {0};
+    memset(piece_data, 'a', sizeof(piece_data));
+    assert(mbedtls_sha1(piece_data, sizeof(piece_data), pieces) == 0);
+    for (uint32_t piece = 1; piece < 4; piece++)
+      memcpy(pieces + 20 * piece, pieces, 20);
+  }
+
+  bc_metainfo_t metainfo = {
+      .announce = pg_span_make_c("http://localhost"),
+      .length = 8 * BC_BLOCK_LENGTH,
+      .piece_length = 2 * BC_BLOCK_LENGTH,
+      .pieces = {.data = (char *)pieces, .len = sizeof(pieces)},
+      .name = pg_span_make_c("foo"),
+      .blocks_count = 8,
+      .last_piece_length = 2 * BC_BLOCK_LENGTH,
+      .last_piece_block_count = 2,
+      .blocks_per_piece = 2,
+      .pieces_count = 4,
+  };
+
+  FILE *file = tmpfile();
+  ASSERT(file != NULL);
+  download_t download = {0};
+  download_init(&download, info_hash, fileno(file));
+
+  picker_t picker = {0};
+  picker_init(pg_heap_allocator(), &logger, &picker, &metainfo);
+
+  storage_t storage = {0};
+  storage_init(&storage, pg_heap_allocator(), &logger, &metainfo, &picker,
+               &download, metainfo.piece_length);
+
+  const tracker_peer_address_ipv4_t addr = {0};
+  peer_t *peers[2] = {0};
+  for (uint64_t i = 0; i < 2; i++) {
+    peer_t *const peer = pg_pool_alloc(&peer_pool);
+    assert(peer != NULL);
+    peer_init(peer, &logger, &peer_pool, &download, &metainfo, &picker,
+              &storage, addr);
+    uv_idle_init(uv_default_loop(), &peer->idle_handle);
+    peer->handshaked = true;
+    peer->them_choked = false;
+    for (uint32_t piece = 0; piece < metainfo.pieces_count; piece++)
+      pg_bitarray_set(&peer->them_have_pieces, piece);
+    picker_add_peer_pieces(&picker, &peer->them_have_pieces);
+    peers[i] = peer;
+  }
+  peer_t *const a = peers[0];
+  peer_t *const b = peers[1];
+
+  // `a` gets both blocks of the only piece there is room for.
+  peer_action_t action = PEER_ACTION_NONE;
+  ASSERT_EQ(PEK_NONE, peer_request_more_blocks(a, &action).kind);
+  ASSERT_EQ(PEER_ACTION_STOP_REQUESTING, action);
+  ASSERT_EQ(true, a->storage_stalled);
+  ASSERT_EQ_FMT(2ULL, pg_array_len(a->in_flight_requests), "%llu");
+  ASSERT_EQ_FMT(metainfo.piece_length, storage.dirty_bytes, "%llu");
+  const uint32_t piece = a->in_flight_requests[0].block / 2;
+
+  ASSERT_EQ(PEK_NONE, peer_request_more_blocks(b, &action).kind);
+  ASSERT_EQ(true, b->storage_stalled);
+  ASSERT_EQ_FMT(0ULL, pg_array_len(b->in_flight_requests), "%llu");
+  ASSERT_EQ_FMT(2ULL, pg_array_len(storage.stalled_peers), "%llu");
+
+  // `b` is woken up and takes over the blocks of `a`.
+  peer_on_close((uv_handle_t *)&a->connection);
+  ASSERT_EQ(false, b->storage_stalled);
+  ASSERT_EQ_FMT(0ULL, pg_array_len(storage.stalled_peers), "%llu");
+
+  uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+  ASSERT_EQ(true, b->storage_stalled);
+  ASSERT_EQ_FMT(2ULL, pg_array_len(b->in_flight_requests), "%llu");
+  ASSERT_EQ_FMT(piece, b->in_flight_requests[0].block / 2, "%u");
+  ASSERT_EQ_FMT(piece, b->in_flight_requests[1].block / 2, "%u");
+
+  // Once the piece is written, `b` starts another one.
+  test_receive_piece(b, piece, 0, 'a', BC_BLOCK_LENGTH);
+  test_receive_piece(b, piece, BC_BLOCK_LENGTH, 'a', BC_BLOCK_LENGTH);
+  ASSERT_EQ_FMT(0ULL, pg_array_len(b->in_flight_requests), "%llu");
+
+  uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+  ASSERT_EQ_FMT(1U, download.downloaded_pieces_count, "%u");
+  ASSERT_EQ(true, b->storage_stalled);
+  ASSERT_EQ_FMT(2ULL, pg_array_len(b->in_flight_requests), "%llu");
+  const uint32_t next_piece = b->in_flight_requests[0].block / 2;
+  ASSERT(next_piece != piece);
+  ASSERT_EQ_FMT(next_piece, b->in_flight_requests[1].block / 2, "%u");
+  ASSERT_EQ_FMT(metainfo.piece_length, storage.dirty_bytes, "%llu");
+
+  peer_on_close((uv_handle_t *)&b->connection);
+  ASSERT_EQ_FMT(0ULL, pg_array_len(storage.stalled_peers), "%llu");
+  storage_destroy(&storage);
   picker_destroy(&picker);
+  fclose(file);
 
   PASS();
 }
@@ -212,6 +563,8 @@ int main(int argc, char **argv) {
 
   RUN_TEST(test_on_read);
   RUN_TEST(test_picker);
+  RUN_TEST(test_peer_pipeline);
+  RUN_TEST(test_storage_backpressure);
 
   GREATEST_MAIN_END(); /* display results */
 }
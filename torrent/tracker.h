@@ -1,9 +1,10 @@
 #pragma once
 
+#include "../pg/pg.h"
+
 #include <curl/curl.h>
 #include <stdint.h>
 
-#include "../pg/pg.h"
 #include "bencode.h"
 
 static uint8_t peer_id[20] = {1,  2,  3,  4,  5,  6,  7,  8,  9,  10,
@@ -124,22 +125,30 @@ __attribute__((unused)) static pg_string_t
 tracker_build_url_from_query(pg_allocator_t allocator, tracker_query_t *q) {
   pg_span_t info_hash_span =
       (pg_span_t){.data = (char *)q->info_hash, .len = sizeof(q->info_hash)};
-  pg_string_t info_hash_url_encoded =
-      pg_span_url_encode(allocator, info_hash_span);
-
   pg_span_t peer_id_span =
       (pg_span_t){.data = (char *)peer_id, .len = sizeof(peer_id)};
-  pg_string_t peer_id_url_encoded = pg_span_url_encode(allocator, peer_id_span);
 
-  pg_string_t res = pg_string_make_reserve(allocator, 5000);
   assert(q->url.len < 4196);
-  snprintf(
-      res, pg_string_cap(res),
-      "%.*s?info_hash=%s&peer_id=%s&port=%hu&uploaded=%llu&downloaded=%llu&"
-      "left=%llu&compact=1",
-      (int)q->url.len, q->url.data, info_hash_url_encoded, peer_id_url_encoded,
-      q->port, q->uploaded, q->downloaded, q->left);
-  return res;
+  char buf[5000];
+  pg_builder_t b = {0};
+  pg_builder_init_buf(&b, buf, sizeof(buf));
+  pg_builder_append_span(&b, q->url);
+  pg_builder_append_cstr(&b, "?info_hash=");
+  pg_builder_append_url_encoded(&b, info_hash_span);
+  pg_builder_append_cstr(&b, "&peer_id=");
+  pg_builder_append_url_encoded(&b, peer_id_span);
+  pg_builder_append_cstr(&b, "&port=");
+  pg_builder_append_u64(&b, q->port);
+  pg_builder_append_cstr(&b, "&uploaded=");
+  pg_builder_append_u64(&b, q->uploaded);
+  pg_builder_append_cstr(&b, "&downloaded=");
+  pg_builder_append_u64(&b, q->downloaded);
+  pg_builder_append_cstr(&b, "&left=");
+  pg_builder_append_u64(&b, q->left);
+  pg_builder_append_cstr(&b, "&compact=1");
+  assert(!b.truncated);
+
+  return pg_string_make_length(allocator, b.data, b.len);
 }
 
 __attribute__((unused)) static uint64_t
@@ -148,17 +157,12 @@ tracker_on_response_chunk(void *ptr, uint64_t size, uint64_t nmemb,
   const uint64_t ptr_len = size * nmemb;
   pg_array_t(char) *response = user_data;
 
-  const uint64_t new_len = pg_array_len(*response) + ptr_len;
-  if (new_len > UINT16_MAX)
+  if (pg_array_len(*response) + ptr_len > UINT16_MAX)
     return 0;
 
-  pg_array_grow(*response, new_len);
-  assert(pg_array_capacity(*response) >= ptr_len);
-
-  memcpy(*response + pg_array_len(*response), ptr, ptr_len);
-  pg_array_resize(*response, new_len);
+  pg_array_append_many(*response, (char *)ptr, ptr_len);
 
-  return new_len;
+  return ptr_len;
 }
 
 __attribute__((unused)) static tracker_error_t tracker_fetch_peers(